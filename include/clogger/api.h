@@ -13,6 +13,8 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <libcork/core.h>
 #include <libcork/ds.h>
@@ -41,23 +43,270 @@ CORK_ATTR_PURE
 const char *
 clog_level_name_fixed_width(enum clog_level level);
 
-extern enum clog_level  clog_minimum_level;
+/* The level used for any channel that doesn't have its own level.  It can't
+ * be assigned to directly; use clog_set_minimum_level to change it, so that
+ * call sites notice. */
+#define clog_minimum_level  ((enum clog_level) _clog_minimum_level)
+extern enum clog_level  _clog_minimum_level;
 
 void
 clog_set_minimum_level(enum clog_level level);
 
+/* Overrides the minimum level for a single channel. */
+void
+clog_set_channel_level(const char *channel, enum clog_level level);
+
+/* Removes all of the per-channel levels. */
+void
+clog_clear_channel_levels(void);
+
+/* Returns the minimum level that applies to channel. */
+enum clog_level
+clog_channel_level(const char *channel);
+
+/* Parses a comma-separated list of levels, like "warning,net=debug".  A bare
+ * level sets the minimum level; "channel=level" sets the level for a single
+ * channel. */
+int
+clog_set_levels(const char *spec);
+
+
+/*-----------------------------------------------------------------------
+ * Call sites
+ */
+
+/* Every log statement has a static descriptor that records where it is and
+ * what it logs.  On platforms with ELF linker sections, the descriptors are
+ * collected into the clog_call_sites section, so that the library can find
+ * every call site in the program at startup, and decide ahead of time whether
+ * each one is enabled.  A log statement then only has to read its
+ * descriptor's enabled byte.
+ *
+ * If a statement's level or channel isn't a compile-time constant (or if the
+ * call site hasn't been registered), the statement has to look up its
+ * channel's level each time it runs. */
+
+enum clog_call_site_state {
+    CLOG_CALL_SITE_DISABLED = 0,
+    CLOG_CALL_SITE_ENABLED = 1,
+    CLOG_CALL_SITE_DYNAMIC = 2
+};
+
+/* Turns an individual call site on or off, regardless of its channel's
+ * minimum level. */
+enum clog_call_site_override {
+    CLOG_CALL_SITE_DEFAULT = 0,
+    CLOG_CALL_SITE_FORCE_ON,
+    CLOG_CALL_SITE_FORCE_OFF
+};
+
+struct clog_call_site {
+    /* A clog_call_site_state; this is all that a log statement reads. */
+    volatile unsigned char enabled;
+    /* A clog_call_site_override */
+    unsigned char override;
+    /* -1 if the level isn't known at compile time */
+    int level;
+    /* NULL if the channel isn't known at compile time */
+    const char* channel;
+    const char* file;
+    unsigned int line;
+    const char* function;
+    /* NULL for cloge_* events, or if the format isn't known at compile
+     * time */
+    const char* format;
+};
+
+void
+clog_call_site_set_override(struct clog_call_site* site,
+                            enum clog_call_site_override override);
+
+/* Returns the first registered call site at the given location, or NULL if
+ * there isn't one. */
+struct clog_call_site*
+clog_call_site_find(const char* file, unsigned int line);
+
+typedef void
+(*clog_call_site_visit_f)(void* user_data, struct clog_call_site* site);
+
+/* Calls visit for every registered call site. */
+void
+clog_call_sites_visit(void* user_data, clog_call_site_visit_f visit);
+
+void
+_clog_call_sites_register(struct clog_call_site* start,
+                          struct clog_call_site* stop);
+
+bool
+_clog_call_site_resolve(struct clog_call_site* site, const char* channel,
+                        enum clog_level level);
+
+CORK_INLINE
+bool
+clog_call_site_enabled(struct clog_call_site* site, const char* channel,
+                       enum clog_level level)
+{
+    unsigned char enabled = site->enabled;
+    if (CORK_LIKELY(enabled != CLOG_CALL_SITE_DYNAMIC)) {
+        return enabled;
+    }
+    return _clog_call_site_resolve(site, channel, level);
+}
+
+#if defined(__GNUC__) && defined(__ELF__)
+/* The linker defines these for each executable and shared library that
+ * contains any call sites.  Every file that includes this header registers
+ * its module's call sites; the library ignores duplicates. */
+extern struct clog_call_site  __start_clog_call_sites[]
+    __attribute__((weak, visibility("hidden")));
+extern struct clog_call_site  __stop_clog_call_sites[]
+    __attribute__((weak, visibility("hidden")));
+
+__attribute__((constructor))
+static void
+_clog_register_module_call_sites(void)
+{
+    _clog_call_sites_register(__start_clog_call_sites, __stop_clog_call_sites);
+}
+
+/* The alignment keeps the compiler from padding the descriptors, so that the
+ * section can be treated as an array.  The descriptors aren't marked "used",
+ * so that the compiler can throw away the descriptor of a statement that it
+ * has compiled away. */
+#define CLOG_CALL_SITE_ATTRS \
+    __attribute__((section("clog_call_sites"), aligned(sizeof(void*))))
+#else
+#define CLOG_CALL_SITE_ATTRS
+#endif
+
+#define _clog_constant_or(value, fallback) \
+    (__builtin_constant_p(value) ? (value) : (fallback))
+
+#define _clog_call_site(level, channel, format)                                \
+    ({                                                                         \
+        static struct clog_call_site __site CLOG_CALL_SITE_ATTRS = {           \
+            CLOG_CALL_SITE_DYNAMIC, CLOG_CALL_SITE_DEFAULT,                    \
+            _clog_constant_or((int) (level), -1),                              \
+            _clog_constant_or((channel), NULL),                                \
+            __FILE__, __LINE__, __func__,                                      \
+            _clog_constant_or((format), NULL)                                  \
+        };                                                                     \
+        &__site;                                                               \
+    })
+
+
+/*-----------------------------------------------------------------------
+ * Per-thread arena
+ */
+
+/* Each thread has an arena that message text and formatted field values are
+ * allocated from.  Allocations are released in bulk by resetting the arena
+ * to a mark that was taken earlier; marks must be reset in the reverse order
+ * that they were taken. */
+
+struct clog_arena_chunk;
+
+struct clog_arena_mark {
+    struct clog_arena_chunk* chunk;
+    size_t used;
+};
+
+struct clog_arena_mark
+clog_arena_get_mark(void);
+
+void
+clog_arena_reset(struct clog_arena_mark mark);
+
+/* The result is aligned for storing pointers and integers. */
+void*
+clog_arena_alloc(size_t size);
+
+/* Renders a NUL-terminated string into the arena.  If size is non-NULL, it's
+ * filled in with the length of the string. */
+const char*
+clog_arena_vprintf(size_t* size, const char* fmt, va_list args);
+
+
+/*-----------------------------------------------------------------------
+ * Thread identity
+ */
+
+/* Each thread's ID and name are rendered into strings the first time that
+ * someone asks for them, and cached for the life of the thread.  A thread
+ * that hasn't been given a name uses the name of its cork_thread, if it has
+ * one, and otherwise its ID. */
+
+#define CLOG_THREAD_NAME_MAX  32
+
+struct clog_thread_info {
+    const char* id;
+    size_t id_size;
+    const char* name;
+    size_t name_size;
+};
+
+const struct clog_thread_info*
+clog_current_thread_info(void);
+
+/* Names the current thread in log messages.  Names longer than
+ * CLOG_THREAD_NAME_MAX bytes are truncated.  Pass NULL to go back to the
+ * default name. */
+void
+clog_set_thread_name(const char* name);
+
 
 /*-----------------------------------------------------------------------
  * Handler interface
  */
 
+/* Typed fields hold a raw value, and are only rendered into a string if
+ * someone asks for one.  Durations are in nanoseconds. */
+enum clog_field_type {
+    CLOG_FIELD_STRING = 0,
+    CLOG_FIELD_INT,
+    CLOG_FIELD_UINT,
+    CLOG_FIELD_DOUBLE,
+    CLOG_FIELD_BOOL,
+    CLOG_FIELD_PTR,
+    CLOG_FIELD_DURATION
+};
+
+union clog_field_raw {
+    int64_t i;
+    uint64_t u;
+    double d;
+    bool b;
+    const void* p;
+};
+
 struct clog_message_field {
     const char* key;
+    /* NULL for a typed field until it's rendered; use
+     * clog_message_field_value to get the value as a string. */
     const char* value;
+    enum clog_field_type type;
+    union clog_field_raw raw;
     void (*done)(struct clog_message_field* field);
+    /* The next field is the one that was added before this one; the previous
+     * field is the one that was added after. */
     struct clog_message_field* next;
+    struct clog_message_field* prev;
 };
 
+/* Renders a typed field's value into the thread's arena. */
+const char*
+_clog_message_field_render(const struct clog_message_field* field);
+
+CORK_INLINE
+const char*
+clog_message_field_value(const struct clog_message_field* field)
+{
+    if (CORK_UNLIKELY(field->value == NULL)) {
+        return _clog_message_field_render(field);
+    }
+    return field->value;
+}
+
 CORK_INLINE
 void
 clog_message_field_done(struct clog_message_field* field)
@@ -67,8 +316,13 @@ clog_message_field_done(struct clog_message_field* field)
     }
 }
 
+/* Fields are kept in a stack: head is the most recently added field, and tail
+ * is the oldest.  Following the next pointers from head visits the fields
+ * newest first; following the prev pointers from tail visits them in the order
+ * that they were added. */
 struct clog_message_fields {
     struct clog_message_field* head;
+    struct clog_message_field* tail;
 };
 
 CORK_INLINE
@@ -76,6 +330,7 @@ void
 clog_message_fields_init(struct clog_message_fields* fields)
 {
     fields->head = NULL;
+    fields->tail = NULL;
 }
 
 CORK_INLINE
@@ -84,6 +339,12 @@ clog_message_fields_push(struct clog_message_fields* fields,
                          struct clog_message_field* field)
 {
     field->next = fields->head;
+    field->prev = NULL;
+    if (fields->head == NULL) {
+        fields->tail = field;
+    } else {
+        fields->head->prev = field;
+    }
     fields->head = field;
 }
 
@@ -94,6 +355,11 @@ clog_message_fields_pop(struct clog_message_fields* fields,
 {
     assert(fields->head == field);
     fields->head = field->next;
+    if (fields->head == NULL) {
+        fields->tail = NULL;
+    } else {
+        fields->head->prev = NULL;
+    }
     clog_message_field_done(field);
 }
 
@@ -113,12 +379,40 @@ clog_message_fields_done(struct clog_message_fields* fields)
 struct clog_message {
     enum clog_level level;
     const char* channel;
+    /* When the message was created, in nanoseconds since the epoch */
+    uint64_t timestamp;
+    /* The thread that logged the message, if it isn't the current thread.
+     * Use clog_message_thread to get the thread's identity. */
+    const struct clog_thread_info* thread;
+    /* The statement that logged the message, which gives its file, line, and
+     * function.  NULL if the message didn't come from a log statement. */
+    const struct clog_call_site* site;
     struct clog_message_fields fields;
-    struct cork_buffer message;
+    /* The rendered message text, which lives in the thread's arena.  NULL
+     * until someone asks for it. */
+    const char* text;
+    size_t text_size;
+    /* Everything allocated from the arena since this mark is freed when the
+     * message is done. */
+    struct clog_arena_mark mark;
     const char* fmt;
     va_list args;
+    /* Whether fmt is a string literal, which won't change (or go away) for as
+     * long as the program runs. */
+    bool static_fmt;
 };
 
+/* The current time, in nanoseconds since the epoch.  On Linux, this is read
+ * from the vDSO, without a system call. */
+CORK_INLINE
+uint64_t
+clog_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
 CORK_INLINE
 void
 clog_message_init(struct clog_message* message, enum clog_level level,
@@ -126,8 +420,25 @@ clog_message_init(struct clog_message* message, enum clog_level level,
 {
     message->level = level;
     message->channel = channel;
+    message->timestamp = clog_now();
+    message->thread = NULL;
+    message->site = NULL;
     clog_message_fields_init(&message->fields);
-    cork_buffer_init(&message->message);
+    message->text = NULL;
+    message->text_size = 0;
+    message->mark = clog_arena_get_mark();
+    message->fmt = NULL;
+    message->static_fmt = false;
+}
+
+CORK_INLINE
+const struct clog_thread_info*
+clog_message_thread(const struct clog_message* message)
+{
+    if (message->thread == NULL) {
+        return clog_current_thread_info();
+    }
+    return message->thread;
 }
 
 CORK_INLINE
@@ -143,12 +454,19 @@ void
 clog_message_done(struct clog_message* message)
 {
     clog_message_fields_done(&message->fields);
-    cork_buffer_done(&message->message);
+    clog_arena_reset(message->mark);
 }
 
 const char*
 clog_message_message(struct clog_message* message);
 
+/* Appends the text of the message to dest.  If no one has asked for the
+ * message text yet, it's rendered directly into dest, rather than being
+ * rendered into the message first and then copied. */
+void
+clog_message_append_message(struct clog_message* message,
+                            struct cork_buffer* dest);
+
 struct clog_handler {
     void (*handle)(struct clog_handler* handler, struct clog_message* message);
     void (*free)(struct clog_handler* handler);
@@ -191,8 +509,39 @@ clog_handler_pop_thread(struct clog_handler *handler);
  * Processing messages
  */
 
+/* Define CLOG_COMPILE_MIN_LEVEL (to CLOG_LEVEL_INFO, say) to remove every log
+ * statement that is less severe than that level, as long as the statement's
+ * level is a compile-time constant.  The statement's arguments and fields are
+ * still type-checked, but the compiler doesn't generate any code for them, and
+ * a removed statement can't be turned back on at runtime.
+ *
+ * None of this depends on the optimizer.  The outermost loop's condition is a
+ * constant false for a removed statement, which the compiler drops along with
+ * the loop body even at -O0.  And a removed statement never gets its own call
+ * site descriptor: __builtin_choose_expr throws away the descriptor's
+ * declaration at compile time, and the statement points at a shared
+ * descriptor that isn't registered instead. */
+#if defined(CLOG_COMPILE_MIN_LEVEL)
+#define _clog_compiled_in(level)  ((level) <= CLOG_COMPILE_MIN_LEVEL)
+
+extern struct clog_call_site  _clog_compiled_out_call_site;
+
+#define _clog_compiled_in_call_site(level, channel, format)                    \
+    __builtin_choose_expr(                                                     \
+            _clog_constant_or(_clog_compiled_in(level), true),                 \
+            _clog_call_site((level), (channel), (format)),                     \
+            &_clog_compiled_out_call_site)
+#else
+#define _clog_compiled_in(level)  true
+#define _clog_compiled_in_call_site(level, channel, format)                    \
+    _clog_call_site((level), (channel), (format))
+#endif
+
 #define clog_log_channel(level, channel, ...)                                  \
-    clog_event_channel((level), (channel)) { clog_set_message(__VA_ARGS__); }
+    _clog_event_channel((level), (channel), _clog_first_arg(__VA_ARGS__, ""))  \
+    { clog_set_message(__VA_ARGS__); }
+
+#define _clog_first_arg(first, ...)  first
 
 #define clog_log(level, ...) \
     clog_log_channel((level), CLOG_CHANNEL, __VA_ARGS__)
@@ -229,22 +578,36 @@ clog_handler_pop_thread(struct clog_handler *handler);
  *
  * and turn it into something equivalent to
  *
- *     if (level <= clog_minimum_level) {
+ *     static struct clog_call_site site = { level, channel, ... };
+ *     if (clog_call_site_enabled(&site, channel, level)) {
  *         struct clog_message msg;
  *         _clog_init_message(&msg, level, channel, fmt, args);
+ *         msg.site = &site;
  *         fields;
  *         _clog_finish_message(&msg);
  *     }
  *
+ * The call site has to be declared with a GNU statement expression, since a
+ * for loop can't declare a static variable.
+ *
  * [1] https://stackoverflow.com/questions/866012/is-there-a-way-to-define-variables-of-two-different-types-in-a-for-loop-initiali */
 /* clang-format off */
 #define clog_event_channel(level, channel)                                     \
-    for (bool __continue = true; __continue; )                                 \
+    _clog_event_channel((level), (channel), NULL)
+
+#define _clog_event_channel(level, channel, format)                            \
+    for (bool __continue = _clog_compiled_in(level);                           \
+         _clog_constant_or(_clog_compiled_in(level), true) && __continue; )    \
     for (enum clog_level __level = (level); __continue; )                      \
-    for (__continue = (__level <= clog_minimum_level); __continue; )           \
     for (const char* __channel = (channel); __continue; )                      \
+    for (struct clog_call_site* __call_site =                                  \
+             _clog_compiled_in_call_site((level), (channel), (format));        \
+         __continue; )                                                         \
+    for (__continue = clog_call_site_enabled(__call_site, __channel, __level); \
+         __continue; )                                                         \
     for (struct clog_message __message; __continue; )                          \
-    for (clog_message_init(&__message, __level, __channel); __continue; )      \
+    for (clog_message_init(&__message, __level, __channel),                    \
+         __message.site = __call_site; __continue; )                           \
     for (CORK_ATTR_UNUSED struct clog_message_fields* __fields =               \
             &__message.fields; __continue;)                                    \
     for (; __continue; __continue = false)                                     \
@@ -256,13 +619,17 @@ clog_handler_pop_thread(struct clog_handler *handler);
         clog_message_add_##field_type##_field(                                 \
                 __fields, &__##field_name##_field, #field_name, __VA_ARGS__);
 
-#define clog_field_value(field_name) __##field_name##_parent->value
+#define clog_field_value(field_name)                                           \
+    clog_message_field_value(__##field_name##_parent)
 
 #define clog_set_message(...)                                                  \
     do {                                                                       \
+        __message.static_fmt = _clog_is_literal(__VA_ARGS__, "");              \
         _clog_process_message(&__message, __VA_ARGS__);                        \
     } while (0)
 
+#define _clog_is_literal(first, ...)  __builtin_constant_p(first)
+
 #define clog_event(level) clog_event_channel((level), CLOG_CHANNEL)
 #define cloge_critical clog_event(CLOG_LEVEL_CRITICAL)
 #define cloge_error clog_event(CLOG_LEVEL_ERROR)
@@ -280,10 +647,13 @@ _clog_process_message(struct clog_message* message, const char* fmt, ...)
 /* clang-format off */
 #define cloge_message_fields                                                   \
     for (bool __continue = true; __continue;)                                  \
+    for (struct clog_arena_mark __mark = clog_arena_get_mark(); __continue;)   \
     for (struct clog_message_fields __field_list; __continue;)                 \
     for (clog_message_fields_init(&__field_list); __continue;)                 \
     for (struct clog_message_fields* __fields = &__field_list; __continue;)    \
-    for (; __continue; __continue = false)
+    for (; __continue;                                                         \
+         __continue = false, clog_message_fields_done(&__field_list),          \
+         clog_arena_reset(__mark))
 /* clang-format on */
 
 
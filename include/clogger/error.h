@@ -16,12 +16,15 @@
 
 #define CLOG_BAD_CONFIG               0xffa63a2f
 #define CLOG_BAD_FORMAT               0x12cd1404
+#define CLOG_BAD_RECORD               0x5b1e7c42
 #define CLOG_BAD_STACK                0x37d461f7
 
 #define clog_bad_config(...) \
     cork_error_set_printf(CLOG_BAD_CONFIG, __VA_ARGS__)
 #define clog_bad_format(...) \
     cork_error_set_printf(CLOG_BAD_FORMAT, __VA_ARGS__)
+#define clog_bad_record(...) \
+    cork_error_set_printf(CLOG_BAD_RECORD, __VA_ARGS__)
 #define clog_bad_stack(...) \
     cork_error_set_printf(CLOG_BAD_STACK, __VA_ARGS__)
 
@@ -34,6 +34,7 @@ clog_message_add_string_field(struct clog_message_fields* fields,
 {
     field->parent.key = key;
     field->parent.value = value;
+    field->parent.type = CLOG_FIELD_STRING;
     field->parent.done = NULL;
     clog_message_fields_push(fields, &field->parent);
     return &field->parent;
@@ -44,16 +45,15 @@ clog_message_add_string_field(struct clog_message_fields* fields,
  * Formatted strings
  */
 
+/* The formatted value is allocated from the thread's arena, and is freed when
+ * the message is done. */
+
 struct clog_printf_field {
     struct clog_message_field parent;
-    struct cork_buffer value;
 };
 
 typedef struct clog_printf_field clog_printf_field_type;
 
-void
-clog_printf_field_done(struct clog_message_field* field);
-
 CORK_INLINE
 CORK_ATTR_PRINTF(4, 5)
 struct clog_message_field*
@@ -62,16 +62,67 @@ clog_message_add_printf_field(struct clog_message_fields* fields,
                               const char* fmt, ...)
 {
     field->parent.key = key;
-    field->parent.done = clog_printf_field_done;
-    cork_buffer_init(&field->value);
+    field->parent.type = CLOG_FIELD_STRING;
+    field->parent.done = NULL;
     va_list args;
     va_start(args, fmt);
-    cork_buffer_vprintf(&field->value, fmt, args);
+    field->parent.value = clog_arena_vprintf(NULL, fmt, args);
     va_end(args);
-    field->parent.value = field->value.buf;
     clog_message_fields_push(fields, &field->parent);
     return &field->parent;
 }
 
 
+/*-----------------------------------------------------------------------
+ * Typed values
+ */
+
+/* These fields hold their raw values, and are only rendered into strings
+ * (into the thread's arena) if a handler asks for one.  Handlers that know
+ * about field types can use the raw value directly. */
+
+#define _clog_define_typed_field(name, TYPE, c_type, member)                   \
+struct clog_##name##_field {                                                   \
+    struct clog_message_field parent;                                          \
+};                                                                             \
+                                                                               \
+typedef struct clog_##name##_field clog_##name##_field_type;                   \
+                                                                               \
+CORK_INLINE                                                                    \
+struct clog_message_field*                                                     \
+clog_message_add_##name##_field(struct clog_message_fields* fields,            \
+                                struct clog_##name##_field* field,             \
+                                const char* key, c_type value)                 \
+{                                                                              \
+    field->parent.key = key;                                                   \
+    field->parent.value = NULL;                                                \
+    field->parent.type = TYPE;                                                 \
+    field->parent.raw.member = value;                                          \
+    field->parent.done = NULL;                                                 \
+    clog_message_fields_push(fields, &field->parent);                          \
+    return &field->parent;                                                     \
+}
+
+/* Large enough for any rendered typed value, plus a NUL terminator */
+#define CLOG_FIELD_MAX_SIZE  32
+
+/* Renders a typed value into dest, which must have room for
+ * CLOG_FIELD_MAX_SIZE bytes, and returns its length.  Doesn't add a NUL
+ * terminator.  For handlers that want to render values straight into their
+ * own output. */
+size_t
+_clog_field_render_raw(char* dest, enum clog_field_type type,
+                       union clog_field_raw raw);
+
+/* clang-format off */
+_clog_define_typed_field(int, CLOG_FIELD_INT, int64_t, i)
+_clog_define_typed_field(uint, CLOG_FIELD_UINT, uint64_t, u)
+_clog_define_typed_field(double, CLOG_FIELD_DOUBLE, double, d)
+_clog_define_typed_field(bool, CLOG_FIELD_BOOL, bool, b)
+_clog_define_typed_field(ptr, CLOG_FIELD_PTR, const void*, p)
+/* In nanoseconds */
+_clog_define_typed_field(duration, CLOG_FIELD_DURATION, int64_t, i)
+/* clang-format on */
+
+
 #endif /* CLOGGER_FIELDS_H */
@@ -17,6 +17,8 @@
 #include <libcork/core.h>
 #include <libcork/ds.h>
 
+#include <clogger/api.h>
+
 struct clog_handler;
 
 /*-----------------------------------------------------------------------
@@ -42,6 +44,352 @@ struct clog_handler *
 clog_stream_handler_new_consumer(struct cork_stream_consumer *consumer,
                                  const char *fmt);
 
+/* Writes directly to a file descriptor.  Messages are collected into batches,
+ * which are written with a single system call when they fill up, when they've
+ * been waiting for a while (100ms), or when a message at CLOG_LEVEL_ERROR or
+ * above arrives.  A background thread writes out batches that have waited too
+ * long, even if nothing else gets logged; call clog_stream_handler_flush if
+ * you need output to appear sooner than that. */
+
+/* Close the file descriptor when the handler is freed */
+#define CLOG_STREAM_CLOSE_FD   0x01
+/* Write each message as soon as it arrives */
+#define CLOG_STREAM_UNBATCHED  0x02
+
+struct clog_handler *
+clog_stream_handler_new_fd(int fd, unsigned int flags, const char *fmt);
+
+/* Writes out any messages that the handler has buffered. */
+int
+clog_stream_handler_flush(struct clog_handler *handler);
+
+/* Only one thread can write to a stream handler at a time.  These counters
+ * show how much the threads that share a handler are contending with each
+ * other.  They're read without taking the handler's lock, so they're only
+ * approximate while other threads are logging. */
+struct clog_stream_handler_stats {
+    /* The number of messages that have been written */
+    size_t  acquisitions;
+    /* The number of times a thread had to spin, waiting for another thread to
+     * finish writing */
+    size_t  spins;
+    /* The number of times a thread had to spin for so long that it went to
+     * sleep instead */
+    size_t  parks;
+    /* The longest that any thread has had to wait, in microseconds */
+    uint64_t  max_wait_usec;
+};
+
+/* handler must be a stream handler. */
+void
+clog_stream_handler_get_stats(struct clog_handler *handler,
+                              struct clog_stream_handler_stats *stats);
+
+
+/*-----------------------------------------------------------------------
+ * Binary record handler
+ */
+
+/* Writes each message as a compact binary record, without rendering its text.
+ * If a message's format string is a string literal, the record holds the
+ * format string's address and the raw values of its arguments; the format
+ * string itself is only written out the first time the handler sees it.  Any
+ * other message is written with its rendered text.  Use a binary decoder (or
+ * the clog-decode program) to turn the records back into text.
+ *
+ * The stream starts with CLOG_BINARY_MAGIC.  Each record is a 32-bit length,
+ * followed by that many bytes, the first of which is the record type.  All
+ * integers are little-endian; strings are a 32-bit length followed by that
+ * many bytes (a length of 0xffffffff means NULL).
+ *
+ *   CLOG_BINARY_FORMAT: u64 id, and then the format string's bytes
+ *   CLOG_BINARY_MESSAGE: u8 level, u64 timestamp (microseconds since the
+ *     epoch), string channel, u32 field count, a string key and value for
+ *     each field (oldest first), and u64 format id.  If the id is 0, it's
+ *     followed by the message's text as a string.  Otherwise, each argument
+ *     follows: integers (including * widths and precisions) as 64 bits,
+ *     floating-point values as 64-bit doubles, pointers as 64-bit integers,
+ *     and %s arguments as strings.
+ *   CLOG_BINARY_TYPED_MESSAGE: the same as CLOG_BINARY_MESSAGE, except that
+ *     each field's key is followed by a u8 clog_field_type.  String fields
+ *     are followed by their value as a string; any other field is followed
+ *     by its raw value as 64 bits.  Only used for messages that have typed
+ *     fields. */
+
+#define CLOG_BINARY_MAGIC  "clogbin1"
+#define CLOG_BINARY_MAGIC_SIZE  (sizeof(CLOG_BINARY_MAGIC) - 1)
+
+#define CLOG_BINARY_FORMAT         0x01
+#define CLOG_BINARY_MESSAGE        0x02
+#define CLOG_BINARY_TYPED_MESSAGE  0x03
+
+struct clog_handler *
+clog_binary_handler_new_consumer(struct cork_stream_consumer *consumer);
+
+/* flags are the same as for clog_stream_handler_new_fd. */
+struct clog_handler *
+clog_binary_handler_new_fd(int fd, unsigned int flags);
+
+int
+clog_binary_handler_flush(struct clog_handler *handler);
+
+/* Turns binary records back into messages, and passes them to a handler.
+ * The decoder doesn't take control of the handler. */
+struct clog_binary_decoder *
+clog_binary_decoder_new(struct clog_handler *handler);
+
+void
+clog_binary_decoder_free(struct clog_binary_decoder *decoder);
+
+/* Decodes every complete record in buf; any partial record at the end is
+ * saved until the next call. */
+int
+clog_binary_decoder_feed(struct clog_binary_decoder *decoder,
+                         const void *buf, size_t size);
+
+/* Returns an error if there's a partial record left over. */
+int
+clog_binary_decoder_finish(struct clog_binary_decoder *decoder);
+
+
+/*-----------------------------------------------------------------------
+ * JSON handler
+ */
+
+/* Writes each message as a JSON object on a line of its own:
+ *
+ *   {"level":"INFO","channel":"main","message":"...","fields":{"key":...}}
+ *
+ * The fields object is left out if the message doesn't have any fields.
+ * String fields are written as JSON strings.  Integer, floating-point, and
+ * boolean fields are written as JSON numbers and booleans; durations are
+ * written as a number of nanoseconds, and pointers as hex strings.  Any bytes
+ * in a string that aren't valid UTF-8 are replaced with U+FFFD. */
+
+struct clog_handler *
+clog_json_handler_new_consumer(struct cork_stream_consumer *consumer);
+
+/* flags are the same as for clog_stream_handler_new_fd. */
+struct clog_handler *
+clog_json_handler_new_fd(int fd, unsigned int flags);
+
+int
+clog_json_handler_flush(struct clog_handler *handler);
+
+
+/*-----------------------------------------------------------------------
+ * Rotating file handler
+ */
+
+/* Writes to a file, switching to a new one when the current file gets too big
+ * or too old.  To rotate, the handler renames path to path.1 (after renaming
+ * path.1 to path.2, and so on), and then starts a new file at path.  Only the
+ * newest few rotated files are kept.  Messages are never split across files.
+ * If path already exists, new messages are added to the end of it.
+ *
+ * If compression is turned on, each rotated file is gzipped on a background
+ * thread, becoming path.1.gz (and so on), so that the thread that triggers a
+ * rotation never waits for the compression.  Compression needs zlib; if
+ * clogger was built without it, clog_rotating_file_handler_set_compress does
+ * nothing, and the compress setting is an error.
+ *
+ * Output is batched in the same way as clog_stream_handler_new_fd.  Age is
+ * only checked when a message arrives, so an idle file won't be rotated
+ * until something is logged to it. */
+
+struct clog_handler *
+clog_rotating_file_handler_new(const char *path, const char *fmt);
+
+/* Settings must be changed before the handler is pushed onto a stack.  A
+ * max_size or max_age of 0 (the default) means that the file never gets too
+ * big or too old.  The handler keeps 5 rotated files by default. */
+
+void
+clog_rotating_file_handler_set_max_size(struct clog_handler *handler,
+                                        size_t max_size);
+
+void
+clog_rotating_file_handler_set_max_age(struct clog_handler *handler,
+                                       unsigned int seconds);
+
+void
+clog_rotating_file_handler_set_keep(struct clog_handler *handler,
+                                    unsigned int keep);
+
+void
+clog_rotating_file_handler_set_compress(struct clog_handler *handler,
+                                        bool compress);
+
+/* Changes several settings at once, from a comma-separated list:
+ *
+ *   size=[bytes]      with an optional K, M, or G suffix
+ *   age=[seconds]     with an optional m, h, or d suffix
+ *   keep=[count]
+ *   compress
+ *
+ * A value that's too big for its setting is an error. */
+int
+clog_rotating_file_handler_configure(struct clog_handler *handler,
+                                     const char *settings);
+
+/* Rotates right away, regardless of the file's size or age. */
+int
+clog_rotating_file_handler_rotate(struct clog_handler *handler);
+
+/* Writes out any buffered messages, and waits for any rotated files to
+ * finish being compressed. */
+int
+clog_rotating_file_handler_flush(struct clog_handler *handler);
+
+
+/*-----------------------------------------------------------------------
+ * Memory-mapped ring handler
+ */
+
+/* Writes each message as a binary record (holding its rendered text) into a
+ * memory-mapped file that's used as a circular buffer.  Threads reserve space
+ * in the ring with a single atomic add, and then copy their record in, so
+ * logging doesn't take any locks or make any system calls.  Once the ring
+ * fills up, new records overwrite the oldest ones.
+ *
+ * The file is shared with the kernel's page cache, so the most recent
+ * messages survive if the process crashes (but not if the machine does).  If
+ * the file already holds a ring of the same size, new records are added after
+ * the existing ones; a ring of a different size starts over.  Any other
+ * non-empty file is left alone, and you get an error.  The file's layout
+ * doesn't depend on the process's word size, but it does use the native byte
+ * order.
+ *
+ * size is the size of the ring, not including the file's header; it must be a
+ * power of two, and should be much larger than any single message. */
+
+#define CLOG_RING_MAGIC  "clogring"
+
+struct clog_handler *
+clog_mmap_ring_handler_new(const char *path, size_t size);
+
+/* Passes each message in a ring file to handler, from oldest to newest.  It's
+ * safe to read a ring that another process is writing to, though messages
+ * that are still being written will be skipped. */
+int
+clog_mmap_ring_read(const char *path, struct clog_handler *handler);
+
+
+/*-----------------------------------------------------------------------
+ * Rate-limiting handler
+ */
+
+/* Passes messages along to the next handler, but only up to per_second
+ * messages per second (with bursts of up to burst messages) from each call
+ * site.  Call sites are told apart by their channel and their format string;
+ * statements whose format isn't a string literal share a limit with the rest
+ * of their channel.  Checking the limit never takes a lock, and a message
+ * that's dropped is never rendered.
+ *
+ * Every so often, the handler sends a warning to the next handler for each
+ * call site that has had messages dropped since the last summary, with the
+ * count in a "suppressed" field, and the format string (if known) in a
+ * "format" field.  Summaries are only sent when a message arrives, or when
+ * you call clog_rate_limit_handler_report. */
+
+#define CLOG_RATE_LIMIT_DEFAULT_SUMMARY_INTERVAL  10
+
+struct clog_handler *
+clog_rate_limit_handler_new(unsigned int per_second, unsigned int burst);
+
+/* In seconds; the default is CLOG_RATE_LIMIT_DEFAULT_SUMMARY_INTERVAL. */
+void
+clog_rate_limit_handler_set_summary_interval(struct clog_handler *handler,
+                                             unsigned int seconds);
+
+/* Sends a summary right away for any call sites with dropped messages. */
+void
+clog_rate_limit_handler_report(struct clog_handler *handler);
+
+/* Returns the total number of messages that have been dropped. */
+size_t
+clog_rate_limit_handler_suppressed(const struct clog_handler *handler);
+
+
+/*-----------------------------------------------------------------------
+ * Sampling handler
+ */
+
+/* Passes a sample of messages along to the next handler, adding a
+ * "sample_rate" field to each one that it keeps, which tells you how many
+ * messages each kept one stands for. */
+
+/* Keeps exactly one out of every n messages.  Each thread counts its own
+ * messages, keeping its first one and every nth one after that, so threads
+ * don't contend with each other. */
+struct clog_handler *
+clog_sampling_handler_new_every(unsigned int n);
+
+/* Keeps each message with the given probability.  Each thread uses its own
+ * random number generator, so threads don't contend with each other. */
+struct clog_handler *
+clog_sampling_handler_new_random(double probability);
+
+/* Keeps one out of every n values of the key field, based on a hash of the
+ * value, so that either all or none of the messages with a particular value
+ * are kept.  (Use a request ID, for instance, to keep complete traces for a
+ * sample of requests.)  Messages that don't have the field are kept with a
+ * probability of 1/n. */
+struct clog_handler *
+clog_sampling_handler_new_field(const char *key, unsigned int n);
+
+/* Only messages at this level or less severe are sampled; more severe
+ * messages are always kept, and don't get a sample_rate field.  The default
+ * is CLOG_LEVEL_CRITICAL, which samples every message. */
+void
+clog_sampling_handler_set_level(struct clog_handler *handler,
+                                enum clog_level level);
+
+
+/*-----------------------------------------------------------------------
+ * Asynchronous handler
+ */
+
+/* Passes messages along to another handler on a dedicated background thread.
+ * Each message is serialized into a preallocated queue, so the thread that
+ * produced it can return right away.  The async handler takes control of
+ * inner, and will free it when the async handler is freed.  Freeing the async
+ * handler waits for every queued message to be processed.  If the background
+ * thread can't be started, we return NULL, and the caller still owns inner. */
+
+enum clog_async_overflow {
+    /* Wait until the background thread makes room in the queue */
+    CLOG_ASYNC_BLOCK,
+    /* Drop the message that we're trying to add */
+    CLOG_ASYNC_DROP_NEWEST,
+    /* Drop the oldest message in the queue to make room */
+    CLOG_ASYNC_DROP_OLDEST
+};
+
+struct clog_async_handler *
+clog_async_handler_new(struct clog_handler *inner, size_t capacity);
+
+void
+clog_async_handler_free(struct clog_async_handler *handler);
+
+/* The default is CLOG_ASYNC_BLOCK. */
+void
+clog_async_handler_set_overflow(struct clog_async_handler *handler,
+                                enum clog_async_overflow overflow);
+
+/* Returns the number of messages that have been dropped because the queue was
+ * full. */
+size_t
+clog_async_handler_dropped(const struct clog_async_handler *handler);
+
+/* Waits until every message that has been queued so far has been passed along
+ * to the inner handler.  Must not be called from the inner handler. */
+void
+clog_async_handler_flush(struct clog_async_handler *handler);
+
+struct clog_handler *
+clog_async_handler_handler(struct clog_async_handler *handler);
+
 
 /*-----------------------------------------------------------------------
  * Channel name filter
@@ -18,18 +18,44 @@
 void
 clog_set_default_format(const char *fmt);
 
-/* Output will be sent to stderr.
+/* Output will be sent to stderr, unless CLOG_FILE is set.
  *
  * Environment variables:
  *
  * CLOG={CRITICAL|ERROR|WARNING|NOTICE|INFO|DEBUG|TRACE)
  *   sets the minimum log level
  *
+ * CLOG=[level],[channel]=[level],...
+ *   sets the minimum log level, and overrides it for particular channels
+ *
  * CLOG_FORMAT=[format string]
  *   the format string to use
  *
+ * CLOG_FILE=[path]
+ *   write to this file instead of stderr
+ *
+ * CLOG_ROTATE=[settings]
+ *   when to rotate CLOG_FILE, as a comma-separated list of size=[bytes],
+ *   age=[seconds], keep=[count], and compress; see
+ *   clog_rotating_file_handler_configure
+ *
+ * CLOG_BINARY=1
+ *   write binary records to stderr instead of text (CLOG_FORMAT is ignored);
+ *   use clog-decode to turn them back into text
+ *
+ * CLOG_JSON=1
+ *   write a JSON object per line to stderr instead of text (CLOG_FORMAT is
+ *   ignored)
+ *
  * CLOG_CHANNELS=[comma-separated list]
  *   channel names not in the list will be ignored
+ *
+ * CLOG_ASYNC=[queue size]
+ *   write output from a background thread, queueing up to this many
+ *   messages
+ *
+ * CLOG_ASYNC_OVERFLOW={BLOCK|DROP-NEWEST|DROP-OLDEST}
+ *   what to do when the CLOG_ASYNC queue is full (default BLOCK)
  */
 
 int
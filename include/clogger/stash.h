@@ -22,10 +22,45 @@ clog_stash_new(void);
 void
 clog_stash_free(struct clog_stash* stash);
 
+/* Each of these queries takes a NULL-terminated list of key/value pairs, and
+ * matches the stashed events that have all of those fields.  (The message
+ * itself is stored in the "__message" field.)  Events are numbered in the
+ * order that they were stashed, starting from 0. */
+
 CORK_ATTR_SENTINEL
 bool
 clog_stash_contains_event(const struct clog_stash* stash, ...);
 
+CORK_ATTR_SENTINEL
+size_t
+clog_stash_count_events(const struct clog_stash* stash, ...);
+
+/* These return false if no event matches, leaving *index alone. */
+
+CORK_ATTR_SENTINEL
+bool
+clog_stash_find_first_event(const struct clog_stash* stash, size_t* index,
+                            ...);
+
+CORK_ATTR_SENTINEL
+bool
+clog_stash_find_last_event(const struct clog_stash* stash, size_t* index, ...);
+
+/* Takes a list of queries, each terminated by NULL, with an extra NULL at the
+ * end.  Returns whether there are events matching each query, in that order
+ * (but not necessarily next to each other). */
+CORK_ATTR_SENTINEL
+bool
+clog_stash_contains_sequence(const struct clog_stash* stash, ...);
+
+size_t
+clog_stash_event_count(const struct clog_stash* stash);
+
+/* Returns NULL if the event doesn't exist or doesn't have this field. */
+const char*
+clog_stash_event_get(const struct clog_stash* stash, size_t index,
+                     const char* key);
+
 struct clog_handler*
 clog_stashing_handler_new(struct clog_stash* stash);
 
@@ -0,0 +1,116 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include "clogger.h"
+
+
+/* Turns the records written by a binary handler back into text, using the
+ * same format strings as any other stream handler.
+ *
+ *   clog-decode [-f format] [file...]
+ *
+ * Reads from stdin if no files are given. */
+
+#define READ_SIZE  65536
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: clog-decode [-f format] [file...]\n");
+    exit(EXIT_FAILURE);
+}
+
+static int
+decode_fd(struct clog_binary_decoder *decoder, int fd, const char *filename)
+{
+    char  buf[READ_SIZE];
+    ssize_t  bytes_read;
+    while ((bytes_read = read(fd, buf, sizeof(buf))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cork_system_error_set_explicit(errno);
+            cork_error_prefix("%s: ", filename);
+            return -1;
+        }
+        rii_check(clog_binary_decoder_feed(decoder, buf, bytes_read));
+    }
+    return clog_binary_decoder_finish(decoder);
+}
+
+static int
+decode_file(struct clog_handler *handler, int fd, const char *filename)
+{
+    int  rc;
+    struct clog_binary_decoder  *decoder = clog_binary_decoder_new(handler);
+    rc = decode_fd(decoder, fd, filename);
+    clog_binary_decoder_free(decoder);
+    return rc;
+}
+
+int
+main(int argc, const char **argv)
+{
+    const char  *fmt = CLOG_DEFAULT_FORMAT;
+    struct clog_handler  *handler;
+    int  i = 1;
+    int  rc = 0;
+
+    if (i + 1 < argc && strcmp(argv[i], "-f") == 0) {
+        fmt = argv[i + 1];
+        i += 2;
+    } else if (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+        usage();
+    }
+
+    handler = clog_stream_handler_new_fp(stdout, false, fmt);
+    if (handler == NULL) {
+        fprintf(stderr, "%s\n", cork_error_message());
+        exit(EXIT_FAILURE);
+    }
+
+    if (i == argc) {
+        rc = decode_file(handler, STDIN_FILENO, "<stdin>");
+    }
+
+    for (; rc == 0 && i < argc; i++) {
+        int  fd;
+        if (strcmp(argv[i], "-") == 0) {
+            rc = decode_file(handler, STDIN_FILENO, "<stdin>");
+            continue;
+        }
+        fd = open(argv[i], O_RDONLY);
+        if (fd < 0) {
+            cork_system_error_set_explicit(errno);
+            cork_error_prefix("%s: ", argv[i]);
+            rc = -1;
+            break;
+        }
+        rc = decode_file(handler, fd, argv[i]);
+        close(fd);
+    }
+
+    clog_handler_free(handler);
+    if (rc != 0) {
+        fprintf(stderr, "%s\n", cork_error_message());
+        exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+}
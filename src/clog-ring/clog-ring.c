@@ -0,0 +1,63 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+
+#include "clogger.h"
+
+
+/* Prints out the messages in a ring file written by an mmap ring handler,
+ * from oldest to newest.
+ *
+ *   clog-ring [-f format] file... */
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: clog-ring [-f format] file...\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, const char **argv)
+{
+    const char  *fmt = CLOG_DEFAULT_FORMAT;
+    struct clog_handler  *handler;
+    int  i = 1;
+    int  rc = 0;
+
+    if (i + 1 < argc && strcmp(argv[i], "-f") == 0) {
+        fmt = argv[i + 1];
+        i += 2;
+    }
+    if (i == argc || argv[i][0] == '-') {
+        usage();
+    }
+
+    handler = clog_stream_handler_new_fp(stdout, false, fmt);
+    if (handler == NULL) {
+        fprintf(stderr, "%s\n", cork_error_message());
+        exit(EXIT_FAILURE);
+    }
+
+    for (; rc == 0 && i < argc; i++) {
+        rc = clog_mmap_ring_read(argv[i], handler);
+    }
+
+    clog_handler_free(handler);
+    if (rc != 0) {
+        fprintf(stderr, "%s\n", cork_error_message());
+        exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+
+
+/*-----------------------------------------------------------------------
+ * Per-thread arena
+ */
+
+/* Each thread has a list of chunks.  Allocations are carved off of the end
+ * of the current chunk; when it fills up, we move on to the next chunk in the
+ * list, creating a new one if needed.  Resetting to a mark never frees any
+ * chunks, so once a thread has built up enough of them, logging a message
+ * doesn't need to allocate anything.  The chunks are freed when the thread
+ * exits. */
+
+#define CLOG_ARENA_CHUNK_SIZE  4096
+#define CLOG_ARENA_ALIGNMENT  sizeof(void*)
+
+struct clog_arena_chunk {
+    struct clog_arena_chunk* next;
+    size_t size;
+    size_t used;
+    /* Aligned well enough for anything that clog_arena_alloc hands out */
+    char data[];
+};
+
+struct clog_arena {
+    struct clog_arena_chunk* first;
+    struct clog_arena_chunk* current;
+};
+
+cork_tls(struct clog_arena*, thread_arena);
+
+static pthread_once_t thread_arena_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_arena_key;
+
+static void
+clog_arena_free(void* varena)
+{
+    struct clog_arena* arena = varena;
+    struct clog_arena_chunk* chunk;
+    struct clog_arena_chunk* next;
+    for (chunk = arena->first; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        cork_free(chunk, sizeof(struct clog_arena_chunk) + chunk->size);
+    }
+    cork_delete(struct clog_arena, arena);
+}
+
+static void
+clog_arena_create_key(void)
+{
+    pthread_key_create(&thread_arena_key, clog_arena_free);
+}
+
+static struct clog_arena*
+clog_arena_get(void)
+{
+    struct clog_arena** arena_ptr = thread_arena_get();
+    struct clog_arena* arena = *arena_ptr;
+    if (CORK_UNLIKELY(arena == NULL)) {
+        arena = cork_new(struct clog_arena);
+        arena->first = NULL;
+        arena->current = NULL;
+        pthread_once(&thread_arena_key_once, clog_arena_create_key);
+        pthread_setspecific(thread_arena_key, arena);
+        *arena_ptr = arena;
+    }
+    return arena;
+}
+
+/* Makes the chunk after the current one current, making sure that it has
+ * room for at least size bytes. */
+static struct clog_arena_chunk*
+clog_arena_next_chunk(struct clog_arena* arena, size_t size)
+{
+    struct clog_arena_chunk* next;
+    struct clog_arena_chunk* chunk;
+    size_t chunk_size;
+
+    next = (arena->current == NULL) ? arena->first : arena->current->next;
+    if (next != NULL && next->size >= size) {
+        next->used = 0;
+        arena->current = next;
+        return next;
+    }
+
+    chunk_size = (size > CLOG_ARENA_CHUNK_SIZE) ? size : CLOG_ARENA_CHUNK_SIZE;
+    chunk = cork_malloc(sizeof(struct clog_arena_chunk) + chunk_size);
+    chunk->next = next;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    if (arena->current == NULL) {
+        arena->first = chunk;
+    } else {
+        arena->current->next = chunk;
+    }
+    arena->current = chunk;
+    return chunk;
+}
+
+struct clog_arena_mark
+clog_arena_get_mark(void)
+{
+    struct clog_arena* arena = clog_arena_get();
+    struct clog_arena_mark mark;
+    mark.chunk = arena->current;
+    mark.used = (arena->current == NULL) ? 0 : arena->current->used;
+    return mark;
+}
+
+void
+clog_arena_reset(struct clog_arena_mark mark)
+{
+    struct clog_arena* arena = *thread_arena_get();
+    /* There's nothing to free if we haven't allocated anything since we got
+     * the mark. */
+    if (arena == NULL) {
+        return;
+    }
+    arena->current = mark.chunk;
+    if (mark.chunk != NULL) {
+        mark.chunk->used = mark.used;
+    }
+}
+
+void*
+clog_arena_alloc(size_t size)
+{
+    struct clog_arena* arena = clog_arena_get();
+    struct clog_arena_chunk* chunk = arena->current;
+    size_t start = 0;
+    if (chunk != NULL) {
+        start = (chunk->used + CLOG_ARENA_ALIGNMENT - 1) &
+                ~((size_t) CLOG_ARENA_ALIGNMENT - 1);
+    }
+    if (CORK_UNLIKELY(chunk == NULL || start > chunk->size ||
+                      chunk->size - start < size)) {
+        chunk = clog_arena_next_chunk(arena, size);
+        start = 0;
+    }
+    chunk->used = start + size;
+    return chunk->data + start;
+}
+
+const char*
+clog_arena_vprintf(size_t* size_out, const char* fmt, va_list args)
+{
+    struct clog_arena* arena = clog_arena_get();
+    struct clog_arena_chunk* chunk = arena->current;
+    size_t available = (chunk == NULL) ? 0 : chunk->size - chunk->used;
+    char* result = (chunk == NULL) ? NULL : chunk->data + chunk->used;
+    va_list args1;
+    int size;
+
+    /* Try to render into whatever's left of the current chunk first. */
+    va_copy(args1, args);
+    size = vsnprintf(result, available, fmt, args1);
+    va_end(args1);
+    if (CORK_UNLIKELY(size < 0)) {
+        /* The format couldn't be rendered (for instance, a %ls argument that
+         * isn't valid in the current locale).  There's nothing sensible to
+         * show, so render an empty string instead. */
+        goto empty;
+    }
+
+    if ((size_t) size >= available) {
+        chunk = clog_arena_next_chunk(arena, (size_t) size + 1);
+        result = chunk->data;
+        va_copy(args1, args);
+        size = vsnprintf(result, (size_t) size + 1, fmt, args1);
+        va_end(args1);
+        if (CORK_UNLIKELY(size < 0)) {
+            goto empty;
+        }
+    }
+
+    chunk->used += (size_t) size + 1;
+    if (size_out != NULL) {
+        *size_out = size;
+    }
+    return result;
+
+empty:
+    if (size_out != NULL) {
+        *size_out = 0;
+    }
+    return "";
+}
@@ -0,0 +1,548 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Message queue
+ */
+
+/* The queue is a bounded array of slots, using the sequence-number scheme from
+ * Dmitry Vyukov's bounded MPMC queue.  Each slot's sequence number tells us
+ * which "lap" around the ring it belongs to:
+ *
+ *   - sequence == pos: the slot is empty, and a producer can claim it for
+ *     position pos.
+ *
+ *   - sequence == pos + 1: the slot has been filled in for position pos, and
+ *     can be claimed by a consumer.
+ *
+ * Producers and consumers claim positions by CAS-ing the enqueue and dequeue
+ * counters, so no one ever takes a lock on the fast path.  There's only one
+ * consumer thread, but producers also need to be able to claim the oldest
+ * slot when the overflow policy is CLOG_ASYNC_DROP_OLDEST.
+ *
+ * Each slot owns a buffer that the producer serializes its message into.  The
+ * consumer swaps that buffer with a spare one of its own before releasing the
+ * slot, so a slow inner handler doesn't keep a slot tied up.  The buffers are
+ * reused, so once they've grown to fit the largest messages that we see,
+ * enqueuing a message doesn't allocate anything. */
+
+struct async_slot {
+    volatile size_t sequence;
+    struct cork_buffer record;
+};
+
+#define ASYNC_INITIAL_RECORD_SIZE 256
+
+/* How long the consumer thread and any blocked producers wait before checking
+ * the queue again, in case they missed a wakeup. */
+#define ASYNC_WAIT_USEC 10000
+
+struct clog_async_handler {
+    struct clog_handler parent;
+    struct clog_handler* inner;
+    enum clog_async_overflow overflow;
+
+    struct async_slot* slots;
+    size_t capacity;
+    volatile size_t enqueue_pos;
+    volatile size_t dequeue_pos;
+    volatile size_t dropped;
+
+    /* The position up through which the consumer thread has finished passing
+     * messages along to the inner handler.  Only written by the consumer. */
+    volatile size_t completed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t has_data;
+    pthread_cond_t has_space;
+    pthread_cond_t idle;
+    volatile int consumer_sleeping;
+    volatile int producers_waiting;
+    volatile int flushers_waiting;
+    volatile bool stopping;
+
+    struct cork_thread* consumer;
+    volatile cork_thread_id consumer_id;
+    /* Only used by the consumer thread */
+    struct cork_buffer record;
+    cork_array(struct clog_message_field) fields;
+};
+
+static bool
+async_sequence_before(size_t a, size_t b)
+{
+    return (intptr_t) (a - b) < 0;
+}
+
+static void
+async_wait(struct clog_async_handler* self, pthread_cond_t* cond)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += ASYNC_WAIT_USEC * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, &self->mutex, &deadline);
+}
+
+static void
+async_signal(struct clog_async_handler* self, pthread_cond_t* cond)
+{
+    pthread_mutex_lock(&self->mutex);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&self->mutex);
+}
+
+/* Claims the oldest filled-in slot, returning NULL if the queue is empty. */
+static struct async_slot*
+async_queue_take(struct clog_async_handler* self, size_t* pos_out)
+{
+    size_t pos = self->dequeue_pos;
+    while (true) {
+        struct async_slot* slot = &self->slots[pos & (self->capacity - 1)];
+        size_t sequence = slot->sequence;
+        if (sequence == pos + 1) {
+            size_t actual = cork_size_cas(&self->dequeue_pos, pos, pos + 1);
+            if (actual == pos) {
+                *pos_out = pos;
+                return slot;
+            }
+            pos = actual;
+        } else if (async_sequence_before(sequence, pos + 1)) {
+            return NULL;
+        } else {
+            pos = self->dequeue_pos;
+        }
+    }
+}
+
+/* Hands a slot that we've taken back to the producers. */
+static void
+async_queue_release(struct clog_async_handler* self, struct async_slot* slot)
+{
+    /* pos + 1 => pos + capacity */
+    cork_size_atomic_add(&slot->sequence, self->capacity - 1);
+    if (self->producers_waiting > 0) {
+        async_signal(self, &self->has_space);
+    }
+}
+
+static bool
+async_queue_is_full(struct clog_async_handler* self)
+{
+    size_t pos = self->enqueue_pos;
+    struct async_slot* slot = &self->slots[pos & (self->capacity - 1)];
+    return async_sequence_before(slot->sequence, pos);
+}
+
+static bool
+async_queue_is_empty(struct clog_async_handler* self)
+{
+    size_t pos = self->dequeue_pos;
+    struct async_slot* slot = &self->slots[pos & (self->capacity - 1)];
+    return slot->sequence != pos + 1;
+}
+
+/* Called when a producer finds the queue full.  Returns whether the producer
+ * should try again. */
+static bool
+async_queue_overflow(struct clog_async_handler* self)
+{
+    struct async_slot* slot;
+    size_t pos;
+
+    /* If the inner handler generates log messages of its own, and they come
+     * back to us, the consumer thread must never wait on itself. */
+    if (self->overflow == CLOG_ASYNC_DROP_NEWEST ||
+        (self->overflow == CLOG_ASYNC_BLOCK &&
+         cork_current_thread_get_id() == self->consumer_id)) {
+        cork_size_atomic_add(&self->dropped, 1);
+        return false;
+    }
+
+    if (self->overflow == CLOG_ASYNC_DROP_OLDEST) {
+        slot = async_queue_take(self, &pos);
+        cork_size_atomic_add(&self->dropped, 1);
+        if (slot == NULL) {
+            /* Every slot that hasn't been released is still being filled in
+             * or handled, so there's nothing older that we can throw away.
+             * Drop this message instead of spinning until there is. */
+            return false;
+        }
+        async_queue_release(self, slot);
+        return true;
+    }
+
+    /* CLOG_ASYNC_BLOCK.  Check again after announcing that we're waiting, so
+     * that we can't miss the consumer making room. */
+    pthread_mutex_lock(&self->mutex);
+    cork_int_atomic_add(&self->producers_waiting, 1);
+    if (async_queue_is_full(self)) {
+        async_wait(self, &self->has_space);
+    }
+    cork_int_atomic_add(&self->producers_waiting, -1);
+    pthread_mutex_unlock(&self->mutex);
+    return true;
+}
+
+/* Claims an empty slot, returning NULL if the message should be dropped. */
+static struct async_slot*
+async_queue_claim(struct clog_async_handler* self)
+{
+    size_t pos = self->enqueue_pos;
+    while (true) {
+        struct async_slot* slot = &self->slots[pos & (self->capacity - 1)];
+        size_t sequence = slot->sequence;
+        if (sequence == pos) {
+            size_t actual = cork_size_cas(&self->enqueue_pos, pos, pos + 1);
+            if (actual == pos) {
+                return slot;
+            }
+            pos = actual;
+        } else if (async_sequence_before(sequence, pos)) {
+            if (!async_queue_overflow(self)) {
+                return NULL;
+            }
+            pos = self->enqueue_pos;
+        } else {
+            pos = self->enqueue_pos;
+        }
+    }
+}
+
+static void
+async_queue_publish(struct clog_async_handler* self, struct async_slot* slot)
+{
+    /* pos => pos + 1 */
+    cork_size_atomic_add(&slot->sequence, 1);
+    if (self->consumer_sleeping) {
+        async_signal(self, &self->has_data);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Serialized messages
+ */
+
+/* Each record starts with this header, followed by the channel name, the
+ * logging thread's ID and name, the message text, and then each field (in
+ * the order they were added).  Each field is its key, a byte holding its
+ * type, and then either its value (for string fields) or its raw value.
+ * Each string is NUL-terminated. */
+struct async_record_header {
+    enum clog_level level;
+    uint64_t timestamp;
+    /* Call site descriptors are static, so we can pass along the pointer. */
+    const struct clog_call_site* site;
+    size_t field_count;
+};
+
+static void
+async_record_encode(struct cork_buffer* dest, struct clog_message* message)
+{
+    struct async_record_header header;
+    const struct clog_thread_info* thread = clog_message_thread(message);
+    struct clog_message_field* field;
+
+    header.level = message->level;
+    header.timestamp = message->timestamp;
+    header.site = message->site;
+    header.field_count = 0;
+    cork_buffer_set(dest, &header, sizeof(header));
+    cork_buffer_append(dest, message->channel, strlen(message->channel) + 1);
+    cork_buffer_append(dest, thread->id, thread->id_size + 1);
+    cork_buffer_append(dest, thread->name, thread->name_size + 1);
+    clog_message_append_message(message, dest);
+    cork_buffer_append(dest, "", 1);
+    for (field = message->fields.tail; field != NULL; field = field->prev) {
+        uint8_t type = field->type;
+        cork_buffer_append(dest, field->key, strlen(field->key) + 1);
+        cork_buffer_append(dest, &type, 1);
+        if (field->type == CLOG_FIELD_STRING) {
+            cork_buffer_append(dest, field->value, strlen(field->value) + 1);
+        } else {
+            cork_buffer_append(dest, &field->raw, sizeof(field->raw));
+        }
+        header.field_count++;
+    }
+    memcpy(dest->buf, &header, sizeof(header));
+}
+
+static void
+async_record_handle(struct clog_async_handler* self,
+                    const struct cork_buffer* record)
+{
+    struct async_record_header header;
+    struct clog_message message;
+    struct clog_thread_info thread;
+    const char* curr = (const char*) record->buf + sizeof(header);
+    const char* channel;
+    const char* text;
+    size_t text_size;
+    size_t i;
+
+    memcpy(&header, record->buf, sizeof(header));
+    channel = curr;
+    curr += strlen(curr) + 1;
+    thread.id = curr;
+    thread.id_size = strlen(curr);
+    curr += thread.id_size + 1;
+    thread.name = curr;
+    thread.name_size = strlen(curr);
+    curr += thread.name_size + 1;
+    text = curr;
+    text_size = strlen(text);
+    curr += text_size + 1;
+
+    clog_message_init(&message, header.level, channel);
+    message.timestamp = header.timestamp;
+    message.thread = &thread;
+    message.site = header.site;
+    /* The text is already rendered, so point straight at our copy of it. */
+    message.text = text;
+    message.text_size = text_size;
+
+    cork_array_clear(&self->fields);
+    cork_array_ensure_size(&self->fields, header.field_count);
+    for (i = 0; i < header.field_count; i++) {
+        struct clog_message_field* field = cork_array_append_get(&self->fields);
+        field->key = curr;
+        curr += strlen(curr) + 1;
+        field->type = (uint8_t) *curr++;
+        if (field->type == CLOG_FIELD_STRING) {
+            field->value = curr;
+            curr += strlen(curr) + 1;
+        } else {
+            /* Typed fields are rendered later, if anyone needs them. */
+            field->value = NULL;
+            memcpy(&field->raw, curr, sizeof(field->raw));
+            curr += sizeof(field->raw);
+        }
+        field->done = NULL;
+        clog_message_fields_push(&message.fields, field);
+    }
+
+    clog_handler_handle(self->inner, &message);
+    clog_message_done(&message);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Consumer thread
+ */
+
+static int
+async_consumer_run(void* vself)
+{
+    struct clog_async_handler* self = vself;
+    self->consumer_id = cork_current_thread_get_id();
+
+    while (true) {
+        struct async_slot* slot;
+        size_t pos;
+
+        slot = async_queue_take(self, &pos);
+        if (slot != NULL) {
+            struct cork_buffer record = slot->record;
+            slot->record = self->record;
+            self->record = record;
+            async_queue_release(self, slot);
+            async_record_handle(self, &self->record);
+            self->completed = pos + 1;
+            continue;
+        }
+
+        /* The queue is empty, so everything that's been claimed so far has
+         * either been handled or dropped. */
+        self->completed = self->dequeue_pos;
+        pthread_mutex_lock(&self->mutex);
+        if (self->flushers_waiting > 0) {
+            pthread_cond_broadcast(&self->idle);
+        }
+        if (self->stopping) {
+            pthread_mutex_unlock(&self->mutex);
+            return 0;
+        }
+        cork_int_cas(&self->consumer_sleeping, 0, 1);
+        if (async_queue_is_empty(self)) {
+            async_wait(self, &self->has_data);
+        }
+        cork_int_cas(&self->consumer_sleeping, 1, 0);
+        pthread_mutex_unlock(&self->mutex);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Async handler
+ */
+
+static void
+clog_async_handler__handle(struct clog_handler* handler,
+                           struct clog_message* message)
+{
+    struct clog_async_handler* self =
+            cork_container_of(handler, struct clog_async_handler, parent);
+    struct async_slot* slot = async_queue_claim(self);
+    if (slot != NULL) {
+        async_record_encode(&slot->record, message);
+        async_queue_publish(self, slot);
+    }
+
+    if (handler->next != NULL) {
+        clog_handler_handle(handler->next, message);
+    }
+}
+
+static void
+clog_async_handler_done(struct clog_async_handler* self)
+{
+    size_t i;
+    if (self->inner != NULL) {
+        clog_handler_free(self->inner);
+    }
+    for (i = 0; i < self->capacity; i++) {
+        cork_buffer_done(&self->slots[i].record);
+    }
+    cork_free(self->slots, self->capacity * sizeof(struct async_slot));
+    cork_buffer_done(&self->record);
+    cork_array_done(&self->fields);
+    pthread_cond_destroy(&self->idle);
+    pthread_cond_destroy(&self->has_space);
+    pthread_cond_destroy(&self->has_data);
+    pthread_mutex_destroy(&self->mutex);
+    cork_delete(struct clog_async_handler, self);
+}
+
+static void
+clog_async_handler__free(struct clog_handler* handler)
+{
+    struct clog_async_handler* self =
+            cork_container_of(handler, struct clog_async_handler, parent);
+
+    /* The consumer thread drains the queue before it finishes. */
+    pthread_mutex_lock(&self->mutex);
+    self->stopping = true;
+    pthread_cond_broadcast(&self->has_data);
+    pthread_mutex_unlock(&self->mutex);
+    cork_thread_join(self->consumer);
+    clog_async_handler_done(self);
+}
+
+struct clog_async_handler*
+clog_async_handler_new(struct clog_handler* inner, size_t capacity)
+{
+    struct clog_async_handler* self = cork_new(struct clog_async_handler);
+    size_t i;
+
+    self->parent.handle = clog_async_handler__handle;
+    self->parent.free = clog_async_handler__free;
+    self->parent.next = NULL;
+    self->inner = inner;
+    self->overflow = CLOG_ASYNC_BLOCK;
+
+    /* Round the capacity up to a power of two so that we can mask positions
+     * instead of dividing. */
+    for (self->capacity = 2; self->capacity < capacity;
+         self->capacity *= 2) {
+    }
+    self->slots = cork_malloc(self->capacity * sizeof(struct async_slot));
+    for (i = 0; i < self->capacity; i++) {
+        self->slots[i].sequence = i;
+        cork_buffer_init(&self->slots[i].record);
+        cork_buffer_ensure_size(&self->slots[i].record,
+                                ASYNC_INITIAL_RECORD_SIZE);
+    }
+    self->enqueue_pos = 0;
+    self->dequeue_pos = 0;
+    self->dropped = 0;
+    self->completed = 0;
+
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->has_data, NULL);
+    pthread_cond_init(&self->has_space, NULL);
+    pthread_cond_init(&self->idle, NULL);
+    self->consumer_sleeping = 0;
+    self->producers_waiting = 0;
+    self->flushers_waiting = 0;
+    self->stopping = false;
+
+    cork_buffer_init(&self->record);
+    cork_buffer_ensure_size(&self->record, ASYNC_INITIAL_RECORD_SIZE);
+    cork_array_init(&self->fields);
+    self->consumer_id = CORK_THREAD_NONE;
+    self->consumer = cork_thread_new("clog-async", self, NULL,
+                                     async_consumer_run);
+    if (CORK_UNLIKELY(cork_thread_start(self->consumer) != 0)) {
+        /* There's no consumer thread to wait for, and the caller still owns
+         * the inner handler. */
+        cork_thread_free(self->consumer);
+        self->inner = NULL;
+        clog_async_handler_done(self);
+        return NULL;
+    }
+    return self;
+}
+
+void
+clog_async_handler_set_overflow(struct clog_async_handler* self,
+                                enum clog_async_overflow overflow)
+{
+    self->overflow = overflow;
+}
+
+size_t
+clog_async_handler_dropped(const struct clog_async_handler* self)
+{
+    return self->dropped;
+}
+
+void
+clog_async_handler_flush(struct clog_async_handler* self)
+{
+    size_t target = self->enqueue_pos;
+    pthread_mutex_lock(&self->mutex);
+    self->flushers_waiting++;
+    while (async_sequence_before(self->completed, target)) {
+        pthread_cond_broadcast(&self->has_data);
+        async_wait(self, &self->idle);
+    }
+    self->flushers_waiting--;
+    pthread_mutex_unlock(&self->mutex);
+}
+
+void
+clog_async_handler_free(struct clog_async_handler* self)
+{
+    clog_async_handler__free(&self->parent);
+}
+
+struct clog_handler*
+clog_async_handler_handler(struct clog_async_handler* self)
+{
+    return &self->parent;
+}
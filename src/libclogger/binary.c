@@ -0,0 +1,1119 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "clogger/api.h"
+#include "clogger/error.h"
+#include "clogger/handlers.h"
+#include "internal.h"
+
+
+/*-----------------------------------------------------------------------
+ * Conversion specs
+ */
+
+/* The kinds of printf arguments that we know how to copy into a record.  Each
+ * of the integer kinds is stored as 64 bits, but we have to remember which C
+ * type it was, to pull it out of the va_list, and to hand it back to printf
+ * when decoding. */
+enum clog_binary_arg {
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_INTMAX,
+    ARG_SIZE,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_LONG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER
+};
+
+struct clog_binary_spec {
+    /* The length of the conversion spec, including the % */
+    size_t size;
+    /* false for %% */
+    bool has_arg;
+    enum clog_binary_arg arg;
+    bool star_width;
+    bool star_precision;
+    /* -1 if there isn't a literal precision */
+    int precision;
+};
+
+static const char*
+skip_digits(const char* curr)
+{
+    while (*curr >= '0' && *curr <= '9') {
+        curr++;
+    }
+    return curr;
+}
+
+/* Parses the conversion spec that starts at fmt (which must point at a %).
+ * Returns false if it's a conversion that we can't copy into a record: %n,
+ * %m, wide characters, and positional arguments. */
+static bool
+clog_binary_parse_spec(const char* fmt, struct clog_binary_spec* spec)
+{
+    enum { LEN_NONE, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_BIG_L } length;
+    const char* curr = fmt + 1;
+    const char* start;
+
+    spec->has_arg = true;
+    spec->star_width = false;
+    spec->star_precision = false;
+    spec->precision = -1;
+
+    if (*curr == '%') {
+        spec->size = 2;
+        spec->has_arg = false;
+        return true;
+    }
+
+    while (*curr != '\0' && strchr("-+ #0'", *curr) != NULL) {
+        curr++;
+    }
+
+    if (*curr == '*') {
+        spec->star_width = true;
+        curr++;
+    } else {
+        curr = skip_digits(curr);
+    }
+    if (*curr == '$' || (spec->star_width && *curr >= '0' && *curr <= '9')) {
+        return false;
+    }
+
+    if (*curr == '.') {
+        curr++;
+        if (*curr == '*') {
+            spec->star_precision = true;
+            curr++;
+            if (*curr >= '0' && *curr <= '9') {
+                return false;
+            }
+        } else {
+            start = curr;
+            curr = skip_digits(curr);
+            spec->precision = 0;
+            while (start < curr) {
+                spec->precision = spec->precision * 10 + (*start++ - '0');
+            }
+        }
+    }
+
+    length = LEN_NONE;
+    switch (*curr) {
+        case 'h':
+            curr += (curr[1] == 'h') ? 2 : 1;
+            break;
+        case 'l':
+            if (curr[1] == 'l') {
+                length = LEN_LL;
+                curr += 2;
+            } else {
+                length = LEN_L;
+                curr++;
+            }
+            break;
+        case 'q':
+            length = LEN_LL;
+            curr++;
+            break;
+        case 'j':
+            length = LEN_J;
+            curr++;
+            break;
+        case 'z':
+        case 'Z':
+            length = LEN_Z;
+            curr++;
+            break;
+        case 't':
+            length = LEN_T;
+            curr++;
+            break;
+        case 'L':
+            length = LEN_BIG_L;
+            curr++;
+            break;
+        default:
+            break;
+    }
+
+    switch (*curr) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            switch (length) {
+                case LEN_NONE:  spec->arg = ARG_INT; break;
+                case LEN_L:     spec->arg = ARG_LONG; break;
+                case LEN_LL:    spec->arg = ARG_LLONG; break;
+                case LEN_J:     spec->arg = ARG_INTMAX; break;
+                case LEN_Z:     spec->arg = ARG_SIZE; break;
+                case LEN_T:     spec->arg = ARG_PTRDIFF; break;
+                default:        return false;
+            }
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+        case 'a': case 'A':
+            spec->arg = (length == LEN_BIG_L) ? ARG_LONG_DOUBLE : ARG_DOUBLE;
+            break;
+        case 'c':
+            if (length != LEN_NONE) {
+                return false;
+            }
+            spec->arg = ARG_INT;
+            break;
+        case 's':
+            if (length != LEN_NONE) {
+                return false;
+            }
+            spec->arg = ARG_STRING;
+            break;
+        case 'p':
+            spec->arg = ARG_POINTER;
+            break;
+        default:
+            return false;
+    }
+
+    spec->size = curr + 1 - fmt;
+    return true;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Parsed formats
+ */
+
+/* The list of arguments that a format string takes, parsed once when the
+ * handler first sees the format string. */
+
+struct clog_binary_format_arg {
+    enum clog_binary_arg arg;
+    /* For ARG_STRING, the precision, which limits how much of the string we
+     * copy.  -1 if there isn't one; -2 if it's the previous (star)
+     * argument. */
+    int precision;
+};
+
+struct clog_binary_format {
+    /* false if the format uses a conversion that we can't copy into a
+     * record, in which case we always write the rendered text instead */
+    bool deferred;
+    size_t arg_count;
+    struct clog_binary_format_arg args[];
+};
+
+static size_t
+clog_binary_format_size(size_t arg_count)
+{
+    return sizeof(struct clog_binary_format) +
+           arg_count * sizeof(struct clog_binary_format_arg);
+}
+
+static void
+clog_binary_format_free(void* vformat)
+{
+    struct clog_binary_format* format = vformat;
+    cork_free(format, clog_binary_format_size(format->arg_count));
+}
+
+static struct clog_binary_format*
+clog_binary_format_new(const char* fmt)
+{
+    struct clog_binary_format* format;
+    struct clog_binary_spec spec;
+    const char* curr;
+    size_t arg_count = 0;
+    bool deferred = true;
+
+    /* Count the arguments first, so that we can allocate the format in one
+     * piece. */
+    for (curr = strchr(fmt, '%'); curr != NULL;
+         curr = strchr(curr + spec.size, '%')) {
+        if (!clog_binary_parse_spec(curr, &spec)) {
+            deferred = false;
+            arg_count = 0;
+            break;
+        }
+        arg_count += spec.star_width + spec.star_precision + spec.has_arg;
+    }
+
+    format = cork_malloc(clog_binary_format_size(arg_count));
+    format->deferred = deferred;
+    format->arg_count = arg_count;
+    if (!deferred) {
+        return format;
+    }
+
+    arg_count = 0;
+    for (curr = strchr(fmt, '%'); curr != NULL;
+         curr = strchr(curr + spec.size, '%')) {
+        clog_binary_parse_spec(curr, &spec);
+        if (spec.star_width) {
+            format->args[arg_count].arg = ARG_INT;
+            format->args[arg_count++].precision = -1;
+        }
+        if (spec.star_precision) {
+            format->args[arg_count].arg = ARG_INT;
+            format->args[arg_count++].precision = -1;
+        }
+        if (spec.has_arg) {
+            format->args[arg_count].arg = spec.arg;
+            format->args[arg_count++].precision =
+                spec.star_precision ? -2 : spec.precision;
+        }
+    }
+    return format;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Encoding
+ */
+
+#define CLOG_BINARY_NULL_STRING  UINT32_MAX
+
+static void
+put_u8(struct cork_buffer* buf, uint8_t value)
+{
+    cork_buffer_append(buf, &value, 1);
+}
+
+static void
+put_u32(struct cork_buffer* buf, uint32_t value)
+{
+    uint8_t bytes[4];
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+    cork_buffer_append(buf, bytes, sizeof(bytes));
+}
+
+static void
+put_u64(struct cork_buffer* buf, uint64_t value)
+{
+    uint8_t bytes[8];
+    size_t i;
+    for (i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = value >> (8 * i);
+    }
+    cork_buffer_append(buf, bytes, sizeof(bytes));
+}
+
+static void
+put_string(struct cork_buffer* buf, const char* str, size_t size)
+{
+    if (str == NULL) {
+        put_u32(buf, CLOG_BINARY_NULL_STRING);
+        return;
+    }
+    put_u32(buf, size);
+    cork_buffer_append(buf, str, size);
+}
+
+static void
+put_double(struct cork_buffer* buf, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_u64(buf, bits);
+}
+
+static void
+clog_binary_encode_args(struct cork_buffer* buf,
+                        const struct clog_binary_format* format, va_list args)
+{
+    int last_int = 0;
+    size_t i;
+
+    for (i = 0; i < format->arg_count; i++) {
+        const struct clog_binary_format_arg* arg = &format->args[i];
+        switch (arg->arg) {
+            case ARG_INT:
+                last_int = va_arg(args, int);
+                put_u64(buf, (int64_t) last_int);
+                break;
+            case ARG_LONG:
+                put_u64(buf, (int64_t) va_arg(args, long));
+                break;
+            case ARG_LLONG:
+                put_u64(buf, (int64_t) va_arg(args, long long));
+                break;
+            case ARG_INTMAX:
+                put_u64(buf, (int64_t) va_arg(args, intmax_t));
+                break;
+            case ARG_SIZE:
+                put_u64(buf, (uint64_t) va_arg(args, size_t));
+                break;
+            case ARG_PTRDIFF:
+                put_u64(buf, (int64_t) va_arg(args, ptrdiff_t));
+                break;
+            case ARG_DOUBLE:
+                put_double(buf, va_arg(args, double));
+                break;
+            case ARG_LONG_DOUBLE:
+                put_double(buf, (double) va_arg(args, long double));
+                break;
+            case ARG_POINTER:
+                put_u64(buf, (uintptr_t) va_arg(args, void*));
+                break;
+            case ARG_STRING: {
+                /* With a precision, the string doesn't have to be
+                 * NUL-terminated. */
+                const char* str = va_arg(args, const char*);
+                int precision =
+                    (arg->precision == -2) ? last_int : arg->precision;
+                size_t size = 0;
+                if (str != NULL) {
+                    size = (precision < 0) ? strlen(str)
+                                           : strnlen(str, precision);
+                }
+                put_string(buf, str, size);
+                break;
+            }
+            default:
+                cork_unreachable();
+        }
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Binary handler
+ */
+
+struct clog_binary_handler {
+    struct clog_handler parent;
+    struct cork_stream_consumer* consumer;
+    /* Writes out anything that the consumer has buffered up.  NULL if the
+     * consumer doesn't buffer anything itself. */
+    clog_consumer_flush_f flush;
+    pthread_mutex_t mutex;
+    /* Maps format strings (by address) to clog_binary_format instances.  A
+     * format string is written to the stream when it's added to this
+     * table. */
+    struct cork_hash_table* formats;
+    struct cork_buffer buf;
+    bool first_chunk;
+};
+
+/* Must be called while holding the handler's mutex.  Returns the parsed
+ * format for the message, or NULL if we have to write its text. */
+static struct clog_binary_format*
+clog_binary_handler_get_format(struct clog_binary_handler* self,
+                               struct clog_message* message)
+{
+    struct clog_binary_format* format;
+    struct cork_buffer* buf = &self->buf;
+    size_t fmt_size;
+
+    /* Only string literals are guaranteed to still have the same content the
+     * next time we see the same address. */
+    if (message->text != NULL || message->fmt == NULL ||
+        !message->static_fmt) {
+        return NULL;
+    }
+
+    format = cork_hash_table_get(self->formats, message->fmt);
+    if (CORK_UNLIKELY(format == NULL)) {
+        format = clog_binary_format_new(message->fmt);
+        cork_hash_table_put(self->formats, (void*) message->fmt, format,
+                            NULL, NULL, NULL);
+        if (format->deferred) {
+            fmt_size = strlen(message->fmt);
+            put_u32(buf, 1 + 8 + fmt_size);
+            put_u8(buf, CLOG_BINARY_FORMAT);
+            put_u64(buf, (uintptr_t) message->fmt);
+            cork_buffer_append(buf, message->fmt, fmt_size);
+        }
+    }
+    return format->deferred ? format : NULL;
+}
+
+/* Typed values are written as their raw 64 bits, without rendering them. */
+static void
+clog_binary_encode_field_value(struct cork_buffer* buf,
+                               const struct clog_message_field* field)
+{
+    switch (field->type) {
+        case CLOG_FIELD_STRING:
+            put_string(buf, field->value, strlen(field->value));
+            break;
+        case CLOG_FIELD_INT:
+        case CLOG_FIELD_DURATION:
+            put_u64(buf, field->raw.i);
+            break;
+        case CLOG_FIELD_UINT:
+            put_u64(buf, field->raw.u);
+            break;
+        case CLOG_FIELD_DOUBLE:
+            put_double(buf, field->raw.d);
+            break;
+        case CLOG_FIELD_BOOL:
+            put_u64(buf, field->raw.b);
+            break;
+        case CLOG_FIELD_PTR:
+            put_u64(buf, (uintptr_t) field->raw.p);
+            break;
+        default:
+            cork_unreachable();
+    }
+}
+
+/* If format is NULL, the record holds the message's rendered text. */
+static void
+clog_binary_encode_message(struct cork_buffer* buf,
+                           struct clog_message* message,
+                           struct clog_binary_format* format)
+{
+    struct clog_message_field* field;
+    size_t field_count = 0;
+    bool typed = false;
+    size_t start;
+    uint32_t size;
+    size_t i;
+
+    for (field = message->fields.head; field != NULL; field = field->next) {
+        field_count++;
+        typed = typed || field->type != CLOG_FIELD_STRING;
+    }
+
+    /* Fill in the record size once we know it.  Messages without any typed
+     * fields use the original record type, so that older decoders can still
+     * read them. */
+    start = buf->size;
+    put_u32(buf, 0);
+    put_u8(buf, typed ? CLOG_BINARY_TYPED_MESSAGE : CLOG_BINARY_MESSAGE);
+    put_u8(buf, message->level);
+    put_u64(buf, message->timestamp / 1000);
+    put_string(buf, message->channel, strlen(message->channel));
+
+    put_u32(buf, field_count);
+    for (field = message->fields.tail; field != NULL; field = field->prev) {
+        put_string(buf, field->key, strlen(field->key));
+        if (typed) {
+            put_u8(buf, field->type);
+        }
+        clog_binary_encode_field_value(buf, field);
+    }
+
+    if (format == NULL) {
+        const char* text = clog_message_message(message);
+        put_u64(buf, 0);
+        put_string(buf, text, message->text_size);
+    } else {
+        va_list args;
+        put_u64(buf, (uintptr_t) message->fmt);
+        va_copy(args, message->args);
+        clog_binary_encode_args(buf, format, args);
+        va_end(args);
+    }
+
+    size = buf->size - start - 4;
+    for (i = 0; i < 4; i++) {
+        ((uint8_t*) buf->buf)[start + i] = size >> (8 * i);
+    }
+}
+
+void
+_clog_binary_encode_text(struct cork_buffer* buf, struct clog_message* message)
+{
+    clog_binary_encode_message(buf, message, NULL);
+}
+
+static void
+clog_binary_handler_handle(struct clog_handler* handler,
+                           struct clog_message* message)
+{
+    struct clog_binary_handler* self =
+            cork_container_of(handler, struct clog_binary_handler, parent);
+    struct clog_binary_format* format;
+
+    pthread_mutex_lock(&self->mutex);
+    cork_buffer_clear(&self->buf);
+    if (self->first_chunk) {
+        cork_buffer_append(&self->buf, CLOG_BINARY_MAGIC,
+                           CLOG_BINARY_MAGIC_SIZE);
+    }
+    /* This writes out a format record first if needed. */
+    format = clog_binary_handler_get_format(self, message);
+    clog_binary_encode_message(&self->buf, message, format);
+    _clog_consumer_write_message(self->consumer, self->flush, self->buf.buf,
+                                 self->buf.size, self->first_chunk,
+                                 message->level);
+    self->first_chunk = false;
+    pthread_mutex_unlock(&self->mutex);
+
+    if (handler->next != NULL) {
+        clog_handler_handle(handler->next, message);
+    }
+}
+
+static void
+clog_binary_handler_free(struct clog_handler* handler)
+{
+    struct clog_binary_handler* self =
+            cork_container_of(handler, struct clog_binary_handler, parent);
+    cork_stream_consumer_free(self->consumer);
+    cork_hash_table_free(self->formats);
+    cork_buffer_done(&self->buf);
+    pthread_mutex_destroy(&self->mutex);
+    cork_delete(struct clog_binary_handler, self);
+}
+
+struct clog_handler*
+clog_binary_handler_new_consumer(struct cork_stream_consumer* consumer)
+{
+    struct clog_binary_handler* self = cork_new(struct clog_binary_handler);
+    self->parent.handle = clog_binary_handler_handle;
+    self->parent.free = clog_binary_handler_free;
+    self->parent.next = NULL;
+    self->consumer = consumer;
+    self->flush = NULL;
+    pthread_mutex_init(&self->mutex, NULL);
+    self->formats = cork_pointer_hash_table_new(0, 0);
+    cork_hash_table_set_free_value(self->formats, clog_binary_format_free);
+    cork_buffer_init(&self->buf);
+    self->first_chunk = true;
+    return &self->parent;
+}
+
+struct clog_handler*
+clog_binary_handler_new_fd(int fd, unsigned int flags)
+{
+    struct clog_handler* handler =
+        clog_binary_handler_new_consumer(_clog_fd_consumer_new(fd, flags));
+    struct clog_binary_handler* self =
+            cork_container_of(handler, struct clog_binary_handler, parent);
+    self->flush = _clog_fd_consumer_flush;
+    return handler;
+}
+
+int
+clog_binary_handler_flush(struct clog_handler* handler)
+{
+    struct clog_binary_handler* self =
+            cork_container_of(handler, struct clog_binary_handler, parent);
+    int rc = 0;
+    if (self->flush != NULL) {
+        pthread_mutex_lock(&self->mutex);
+        rc = self->flush(self->consumer);
+        pthread_mutex_unlock(&self->mutex);
+    }
+    return rc;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Decoding
+ */
+
+struct clog_binary_reader {
+    const uint8_t* curr;
+    size_t left;
+};
+
+static int
+get_bytes(struct clog_binary_reader* reader, const void** dest, size_t size)
+{
+    if (CORK_UNLIKELY(reader->left < size)) {
+        clog_bad_record("Truncated binary log record");
+        return -1;
+    }
+    *dest = reader->curr;
+    reader->curr += size;
+    reader->left -= size;
+    return 0;
+}
+
+static int
+get_u8(struct clog_binary_reader* reader, uint8_t* dest)
+{
+    const uint8_t* bytes;
+    rii_check(get_bytes(reader, (const void**) &bytes, 1));
+    *dest = bytes[0];
+    return 0;
+}
+
+static int
+get_u32(struct clog_binary_reader* reader, uint32_t* dest)
+{
+    const uint8_t* bytes;
+    rii_check(get_bytes(reader, (const void**) &bytes, 4));
+    *dest = (uint32_t) bytes[0] | ((uint32_t) bytes[1] << 8) |
+            ((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+    return 0;
+}
+
+static int
+get_u64(struct clog_binary_reader* reader, uint64_t* dest)
+{
+    const uint8_t* bytes;
+    size_t i;
+    rii_check(get_bytes(reader, (const void**) &bytes, 8));
+    *dest = 0;
+    for (i = 0; i < 8; i++) {
+        *dest |= (uint64_t) bytes[i] << (8 * i);
+    }
+    return 0;
+}
+
+/* Copies a string into dest (with a NUL terminator), and returns its offset
+ * in dest, or SIZE_MAX if it's NULL. */
+static int
+get_string(struct clog_binary_reader* reader, struct cork_buffer* dest,
+           size_t* offset)
+{
+    const void* bytes;
+    uint32_t size;
+    rii_check(get_u32(reader, &size));
+    if (size == CLOG_BINARY_NULL_STRING) {
+        *offset = SIZE_MAX;
+        return 0;
+    }
+    rii_check(get_bytes(reader, &bytes, size));
+    *offset = dest->size;
+    cork_buffer_append(dest, bytes, size);
+    cork_buffer_append(dest, "", 1);
+    return 0;
+}
+
+struct clog_binary_decoder {
+    struct clog_handler* handler;
+    /* Maps format ids to the format strings' offsets (plus one) in
+     * format_strings */
+    struct cork_hash_table* formats;
+    struct cork_buffer format_strings;
+    /* Any partial record from the end of the last chunk we were fed */
+    struct cork_buffer pending;
+    bool seen_magic;
+    /* Scratch space for decoding messages */
+    struct cork_buffer strings;
+    struct cork_buffer text;
+    struct cork_buffer spec;
+    struct cork_buffer arg;
+    /* The offsets of each field's key and value in strings */
+    cork_array(size_t) field_offsets;
+    cork_array(struct clog_message_field) fields;
+};
+
+/* Renders one conversion, with the arguments that it consumes taken from the
+ * record.  Any * width or precision is replaced with its value. */
+static int
+clog_binary_decoder_render_spec(struct clog_binary_decoder* self,
+                                struct clog_binary_reader* reader,
+                                const char* fmt,
+                                const struct clog_binary_spec* spec)
+{
+    struct cork_buffer* text = &self->text;
+    const char* curr;
+    uint64_t value;
+    size_t offset;
+
+    cork_buffer_clear(&self->spec);
+    for (curr = fmt; curr < fmt + spec->size; curr++) {
+        if (*curr != '*') {
+            cork_buffer_append(&self->spec, curr, 1);
+            continue;
+        }
+        rii_check(get_u64(reader, &value));
+        if (curr[-1] == '.' && (int) value < 0) {
+            /* A negative precision is the same as not having one. */
+            cork_buffer_truncate(&self->spec, self->spec.size - 1);
+        } else {
+            cork_buffer_append_printf(&self->spec, "%d", (int) value);
+        }
+    }
+
+    if (!spec->has_arg) {
+        cork_buffer_append(text, "%", 1);
+        return 0;
+    }
+
+    if (spec->arg == ARG_STRING) {
+        const char* str;
+        cork_buffer_clear(&self->arg);
+        rii_check(get_string(reader, &self->arg, &offset));
+        str = (offset == SIZE_MAX) ? NULL : (char*) self->arg.buf + offset;
+        cork_buffer_append_printf(text, self->spec.buf, str);
+        return 0;
+    }
+
+    rii_check(get_u64(reader, &value));
+    switch (spec->arg) {
+        case ARG_INT:
+            cork_buffer_append_printf(text, self->spec.buf, (int) value);
+            break;
+        case ARG_LONG:
+            cork_buffer_append_printf(text, self->spec.buf, (long) value);
+            break;
+        case ARG_LLONG:
+            cork_buffer_append_printf(text, self->spec.buf, (long long) value);
+            break;
+        case ARG_INTMAX:
+            cork_buffer_append_printf(text, self->spec.buf, (intmax_t) value);
+            break;
+        case ARG_SIZE:
+            cork_buffer_append_printf(text, self->spec.buf, (size_t) value);
+            break;
+        case ARG_PTRDIFF:
+            cork_buffer_append_printf(text, self->spec.buf, (ptrdiff_t) value);
+            break;
+        case ARG_DOUBLE:
+        case ARG_LONG_DOUBLE: {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            if (spec->arg == ARG_DOUBLE) {
+                cork_buffer_append_printf(text, self->spec.buf, d);
+            } else {
+                cork_buffer_append_printf(text, self->spec.buf,
+                                          (long double) d);
+            }
+            break;
+        }
+        case ARG_POINTER:
+            cork_buffer_append_printf(text, self->spec.buf,
+                                      (void*) (uintptr_t) value);
+            break;
+        default:
+            cork_unreachable();
+    }
+    return 0;
+}
+
+static int
+clog_binary_decoder_render(struct clog_binary_decoder* self,
+                           struct clog_binary_reader* reader, const char* fmt)
+{
+    struct clog_binary_spec spec;
+    const char* curr = fmt;
+    const char* percent;
+
+    cork_buffer_clear(&self->text);
+    while ((percent = strchr(curr, '%')) != NULL) {
+        cork_buffer_append(&self->text, curr, percent - curr);
+        if (!clog_binary_parse_spec(percent, &spec)) {
+            clog_bad_record("Unsupported conversion in format %s", fmt);
+            return -1;
+        }
+        rii_check(clog_binary_decoder_render_spec
+                  (self, reader, percent, &spec));
+        curr = percent + spec.size;
+    }
+    cork_buffer_append_string(&self->text, curr);
+    return 0;
+}
+
+static int
+clog_binary_decoder_format(struct clog_binary_decoder* self,
+                           struct clog_binary_reader* reader)
+{
+    uint64_t id;
+    size_t offset = self->format_strings.size;
+    rii_check(get_u64(reader, &id));
+    if (id == 0) {
+        clog_bad_record("Invalid binary log format id");
+        return -1;
+    }
+    cork_buffer_append(&self->format_strings, reader->curr, reader->left);
+    cork_buffer_append(&self->format_strings, "", 1);
+    cork_hash_table_put(self->formats, (void*) (uintptr_t) id,
+                        (void*) (offset + 1), NULL, NULL, NULL);
+    return 0;
+}
+
+/* Reads a field's value.  A string value is copied into strings, and its
+ * offset is returned in offset; for a typed value, offset is SIZE_MAX. */
+static int
+clog_binary_decoder_field_value(struct clog_binary_decoder* self,
+                                struct clog_binary_reader* reader,
+                                bool typed, struct clog_message_field* field,
+                                size_t* offset)
+{
+    uint8_t type = CLOG_FIELD_STRING;
+    uint64_t bits;
+
+    if (typed) {
+        rii_check(get_u8(reader, &type));
+    }
+    field->type = type;
+    if (type == CLOG_FIELD_STRING) {
+        rii_check(get_string(reader, &self->strings, offset));
+        if (*offset == SIZE_MAX) {
+            clog_bad_record("Missing field in binary log record");
+            return -1;
+        }
+        return 0;
+    }
+
+    *offset = SIZE_MAX;
+    rii_check(get_u64(reader, &bits));
+    switch (type) {
+        case CLOG_FIELD_INT:
+        case CLOG_FIELD_DURATION:
+            field->raw.i = (int64_t) bits;
+            break;
+        case CLOG_FIELD_UINT:
+            field->raw.u = bits;
+            break;
+        case CLOG_FIELD_DOUBLE:
+            memcpy(&field->raw.d, &bits, sizeof(bits));
+            break;
+        case CLOG_FIELD_BOOL:
+            field->raw.b = (bits != 0);
+            break;
+        case CLOG_FIELD_PTR:
+            field->raw.p = (const void*) (uintptr_t) bits;
+            break;
+        default:
+            clog_bad_record("Unknown binary log field type %u",
+                            (unsigned int) type);
+            return -1;
+    }
+    return 0;
+}
+
+/* Binary logs don't record which thread logged each message, so we make sure
+ * that decoded messages don't claim to come from the decoding thread. */
+static const struct clog_thread_info  clog_binary_unknown_thread = {
+    "", 0, "", 0
+};
+
+static int
+clog_binary_decoder_message(struct clog_binary_decoder* self,
+                            struct clog_binary_reader* reader, bool typed)
+{
+    struct clog_message message;
+    uint8_t level;
+    uint64_t timestamp;
+    uint32_t field_count;
+    uint64_t id;
+    size_t channel;
+    size_t offset;
+    size_t i;
+
+    cork_buffer_clear(&self->strings);
+    rii_check(get_u8(reader, &level));
+    if (level > CLOG_LEVEL_TRACE) {
+        clog_bad_record("Invalid log level %u", (unsigned int) level);
+        return -1;
+    }
+    rii_check(get_u64(reader, &timestamp));
+    rii_check(get_string(reader, &self->strings, &channel));
+    if (channel == SIZE_MAX) {
+        clog_bad_record("Missing channel in binary log record");
+        return -1;
+    }
+
+    /* The keys and values are stored as offsets into strings until we've
+     * read them all, since the buffer might move. */
+    rii_check(get_u32(reader, &field_count));
+    cork_array_clear(&self->field_offsets);
+    cork_array_clear(&self->fields);
+    for (i = 0; i < field_count; i++) {
+        struct clog_message_field* field =
+            cork_array_append_get(&self->fields);
+        rii_check(get_string(reader, &self->strings, &offset));
+        if (offset == SIZE_MAX) {
+            clog_bad_record("Missing field in binary log record");
+            return -1;
+        }
+        cork_array_append(&self->field_offsets, offset);
+        rii_check(clog_binary_decoder_field_value
+                  (self, reader, typed, field, &offset));
+        cork_array_append(&self->field_offsets, offset);
+    }
+
+    rii_check(get_u64(reader, &id));
+    cork_buffer_clear(&self->text);
+    if (id == 0) {
+        rii_check(get_string(reader, &self->text, &offset));
+        if (offset == SIZE_MAX) {
+            clog_bad_record("Missing text in binary log record");
+            return -1;
+        }
+    } else {
+        uintptr_t format = (uintptr_t) cork_hash_table_get
+            (self->formats, (void*) (uintptr_t) id);
+        if (format == 0) {
+            clog_bad_record("Unknown binary log format id %" PRIu64, id);
+            return -1;
+        }
+        rii_check(clog_binary_decoder_render
+                  (self, reader,
+                   (char*) self->format_strings.buf + format - 1));
+        cork_buffer_append(&self->text, "", 1);
+    }
+
+    clog_message_init(&message, level,
+                      (char*) self->strings.buf + channel);
+    message.timestamp = timestamp * 1000;
+    message.thread = &clog_binary_unknown_thread;
+    message.text = self->text.buf;
+    message.text_size = self->text.size - 1;
+    for (i = 0; i < field_count; i++) {
+        struct clog_message_field* field = &cork_array_at(&self->fields, i);
+        field->key = (char*) self->strings.buf +
+                     cork_array_at(&self->field_offsets, 2 * i);
+        offset = cork_array_at(&self->field_offsets, 2 * i + 1);
+        field->value = (offset == SIZE_MAX) ? NULL :
+                       (char*) self->strings.buf + offset;
+        field->done = NULL;
+    }
+    for (i = 0; i < field_count; i++) {
+        clog_message_fields_push(&message.fields,
+                                 &cork_array_at(&self->fields, i));
+    }
+    clog_handler_handle(self->handler, &message);
+    clog_message_done(&message);
+    return 0;
+}
+
+static int
+clog_binary_decoder_record(struct clog_binary_decoder* self,
+                           const uint8_t* buf, size_t size)
+{
+    struct clog_binary_reader reader;
+    uint8_t type;
+    reader.curr = buf;
+    reader.left = size;
+    rii_check(get_u8(&reader, &type));
+    switch (type) {
+        case CLOG_BINARY_FORMAT:
+            return clog_binary_decoder_format(self, &reader);
+        case CLOG_BINARY_MESSAGE:
+            return clog_binary_decoder_message(self, &reader, false);
+        case CLOG_BINARY_TYPED_MESSAGE:
+            return clog_binary_decoder_message(self, &reader, true);
+        default:
+            clog_bad_record("Unknown binary log record type %u",
+                            (unsigned int) type);
+            return -1;
+    }
+}
+
+/* Decodes every complete record in buf, and returns how many bytes we
+ * used. */
+static int
+clog_binary_decoder_records(struct clog_binary_decoder* self,
+                            const uint8_t* buf, size_t size, size_t* used)
+{
+    struct clog_binary_reader reader;
+    uint32_t record_size;
+
+    reader.curr = buf;
+    reader.left = size;
+    if (!self->seen_magic) {
+        if (size < CLOG_BINARY_MAGIC_SIZE) {
+            *used = 0;
+            return 0;
+        }
+        if (memcmp(buf, CLOG_BINARY_MAGIC, CLOG_BINARY_MAGIC_SIZE) != 0) {
+            clog_bad_record("Not a binary log stream");
+            return -1;
+        }
+        self->seen_magic = true;
+        reader.curr += CLOG_BINARY_MAGIC_SIZE;
+        reader.left -= CLOG_BINARY_MAGIC_SIZE;
+    }
+
+    while (reader.left >= 4) {
+        const uint8_t* record = reader.curr;
+        get_u32(&reader, &record_size);
+        if (reader.left < record_size) {
+            reader.curr = record;
+            reader.left += 4;
+            break;
+        }
+        rii_check(clog_binary_decoder_record(self, reader.curr, record_size));
+        reader.curr += record_size;
+        reader.left -= record_size;
+    }
+
+    *used = size - reader.left;
+    return 0;
+}
+
+int
+clog_binary_decoder_feed(struct clog_binary_decoder* self, const void* buf,
+                         size_t size)
+{
+    size_t used;
+
+    if (self->pending.size == 0) {
+        rii_check(clog_binary_decoder_records(self, buf, size, &used));
+        cork_buffer_set(&self->pending, (const uint8_t*) buf + used,
+                        size - used);
+        return 0;
+    }
+
+    cork_buffer_append(&self->pending, buf, size);
+    rii_check(clog_binary_decoder_records
+              (self, self->pending.buf, self->pending.size, &used));
+    memmove(self->pending.buf, (uint8_t*) self->pending.buf + used,
+            self->pending.size - used);
+    cork_buffer_truncate(&self->pending, self->pending.size - used);
+    return 0;
+}
+
+int
+clog_binary_decoder_finish(struct clog_binary_decoder* self)
+{
+    if (self->pending.size > 0) {
+        clog_bad_record("Truncated binary log record");
+        return -1;
+    }
+    return 0;
+}
+
+struct clog_binary_decoder*
+clog_binary_decoder_new(struct clog_handler* handler)
+{
+    struct clog_binary_decoder* self = cork_new(struct clog_binary_decoder);
+    self->handler = handler;
+    self->formats = cork_pointer_hash_table_new(0, 0);
+    cork_buffer_init(&self->format_strings);
+    cork_buffer_init(&self->pending);
+    self->seen_magic = false;
+    cork_buffer_init(&self->strings);
+    cork_buffer_init(&self->text);
+    cork_buffer_init(&self->spec);
+    cork_buffer_init(&self->arg);
+    cork_array_init(&self->field_offsets);
+    cork_array_init(&self->fields);
+    return self;
+}
+
+void
+clog_binary_decoder_free(struct clog_binary_decoder* self)
+{
+    cork_hash_table_free(self->formats);
+    cork_buffer_done(&self->format_strings);
+    cork_buffer_done(&self->pending);
+    cork_buffer_done(&self->strings);
+    cork_buffer_done(&self->text);
+    cork_buffer_done(&self->spec);
+    cork_buffer_done(&self->arg);
+    cork_array_done(&self->field_offsets);
+    cork_array_done(&self->fields);
+    cork_delete(struct clog_binary_decoder, self);
+}
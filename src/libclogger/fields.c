@@ -7,26 +7,609 @@
  * ----------------------------------------------------------------------
  */
 
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
 #include <libcork/core.h>
 #include <libcork/ds.h>
 
 #include "clogger/api.h"
 #include "clogger/fields.h"
 
+
+/*-----------------------------------------------------------------------
+ * Rendering typed values
+ */
+
+static const char  digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* Writes value's digits so that they end just before end, two digits at a
+ * time, and returns where they start. */
+static char*
+clog_render_digits(char* end, uint64_t value)
+{
+    while (value >= 100) {
+        unsigned int pair = (value % 100) * 2;
+        value /= 100;
+        *--end = digit_pairs[pair + 1];
+        *--end = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        unsigned int pair = value * 2;
+        *--end = digit_pairs[pair + 1];
+        *--end = digit_pairs[pair];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
+static size_t
+clog_render_uint(char* dest, uint64_t value)
+{
+    char buf[CLOG_FIELD_MAX_SIZE];
+    char* end = buf + sizeof(buf);
+    char* start = clog_render_digits(end, value);
+    memcpy(dest, start, end - start);
+    return end - start;
+}
+
+static size_t
+clog_render_int(char* dest, int64_t value)
+{
+    if (value < 0) {
+        *dest = '-';
+        /* Careful not to overflow when negating INT64_MIN */
+        return 1 + clog_render_uint(dest + 1, -(uint64_t) value);
+    }
+    return clog_render_uint(dest, value);
+}
+
+/* The shortest representation that reads back as exactly the same double,
+ * using Florian Loitsch's Grisu2 algorithm ("Printing Floating-Point Numbers
+ * Quickly and Accurately with Integers", PLDI 2010).  Grisu2 works entirely in
+ * 64-bit integer arithmetic, so it's much faster than printf, and doesn't
+ * depend on the current locale.  Its output always round-trips, and is the
+ * shortest possible for all but a tiny fraction of values.
+ *
+ * The result looks like printf's %g: fixed notation for values with a decimal
+ * exponent from -4 to 14, and scientific notation for anything else. */
+
+/* A floating-point value with a 64-bit significand: f * 2^e */
+struct clog_diy_fp {
+    uint64_t f;
+    int e;
+};
+
+#define CLOG_DP_SIGNIFICAND_SIZE  52
+#define CLOG_DP_EXPONENT_BIAS     (0x3ff + CLOG_DP_SIGNIFICAND_SIZE)
+#define CLOG_DP_MIN_EXPONENT      (-CLOG_DP_EXPONENT_BIAS)
+#define CLOG_DP_EXPONENT_MASK     UINT64_C(0x7ff0000000000000)
+#define CLOG_DP_SIGNIFICAND_MASK  UINT64_C(0x000fffffffffffff)
+#define CLOG_DP_HIDDEN_BIT        UINT64_C(0x0010000000000000)
+
+/* 10^k for k = -348, -340, ..., 340, normalized so that the top bit of f is
+ * set. */
+static const struct clog_diy_fp  cached_powers[] = {
+    { UINT64_C(0xfa8fd5a0081c0288), -1220 },
+    { UINT64_C(0xbaaee17fa23ebf76), -1193 },
+    { UINT64_C(0x8b16fb203055ac76), -1166 },
+    { UINT64_C(0xcf42894a5dce35ea), -1140 },
+    { UINT64_C(0x9a6bb0aa55653b2d), -1113 },
+    { UINT64_C(0xe61acf033d1a45df), -1087 },
+    { UINT64_C(0xab70fe17c79ac6ca), -1060 },
+    { UINT64_C(0xff77b1fcbebcdc4f), -1034 },
+    { UINT64_C(0xbe5691ef416bd60c), -1007 },
+    { UINT64_C(0x8dd01fad907ffc3c), -980 },
+    { UINT64_C(0xd3515c2831559a83), -954 },
+    { UINT64_C(0x9d71ac8fada6c9b5), -927 },
+    { UINT64_C(0xea9c227723ee8bcb), -901 },
+    { UINT64_C(0xaecc49914078536d), -874 },
+    { UINT64_C(0x823c12795db6ce57), -847 },
+    { UINT64_C(0xc21094364dfb5637), -821 },
+    { UINT64_C(0x9096ea6f3848984f), -794 },
+    { UINT64_C(0xd77485cb25823ac7), -768 },
+    { UINT64_C(0xa086cfcd97bf97f4), -741 },
+    { UINT64_C(0xef340a98172aace5), -715 },
+    { UINT64_C(0xb23867fb2a35b28e), -688 },
+    { UINT64_C(0x84c8d4dfd2c63f3b), -661 },
+    { UINT64_C(0xc5dd44271ad3cdba), -635 },
+    { UINT64_C(0x936b9fcebb25c996), -608 },
+    { UINT64_C(0xdbac6c247d62a584), -582 },
+    { UINT64_C(0xa3ab66580d5fdaf6), -555 },
+    { UINT64_C(0xf3e2f893dec3f126), -529 },
+    { UINT64_C(0xb5b5ada8aaff80b8), -502 },
+    { UINT64_C(0x87625f056c7c4a8b), -475 },
+    { UINT64_C(0xc9bcff6034c13053), -449 },
+    { UINT64_C(0x964e858c91ba2655), -422 },
+    { UINT64_C(0xdff9772470297ebd), -396 },
+    { UINT64_C(0xa6dfbd9fb8e5b88f), -369 },
+    { UINT64_C(0xf8a95fcf88747d94), -343 },
+    { UINT64_C(0xb94470938fa89bcf), -316 },
+    { UINT64_C(0x8a08f0f8bf0f156b), -289 },
+    { UINT64_C(0xcdb02555653131b6), -263 },
+    { UINT64_C(0x993fe2c6d07b7fac), -236 },
+    { UINT64_C(0xe45c10c42a2b3b06), -210 },
+    { UINT64_C(0xaa242499697392d3), -183 },
+    { UINT64_C(0xfd87b5f28300ca0e), -157 },
+    { UINT64_C(0xbce5086492111aeb), -130 },
+    { UINT64_C(0x8cbccc096f5088cc), -103 },
+    { UINT64_C(0xd1b71758e219652c), -77 },
+    { UINT64_C(0x9c40000000000000), -50 },
+    { UINT64_C(0xe8d4a51000000000), -24 },
+    { UINT64_C(0xad78ebc5ac620000), 3 },
+    { UINT64_C(0x813f3978f8940984), 30 },
+    { UINT64_C(0xc097ce7bc90715b3), 56 },
+    { UINT64_C(0x8f7e32ce7bea5c70), 83 },
+    { UINT64_C(0xd5d238a4abe98068), 109 },
+    { UINT64_C(0x9f4f2726179a2245), 136 },
+    { UINT64_C(0xed63a231d4c4fb27), 162 },
+    { UINT64_C(0xb0de65388cc8ada8), 189 },
+    { UINT64_C(0x83c7088e1aab65db), 216 },
+    { UINT64_C(0xc45d1df942711d9a), 242 },
+    { UINT64_C(0x924d692ca61be758), 269 },
+    { UINT64_C(0xda01ee641a708dea), 295 },
+    { UINT64_C(0xa26da3999aef774a), 322 },
+    { UINT64_C(0xf209787bb47d6b85), 348 },
+    { UINT64_C(0xb454e4a179dd1877), 375 },
+    { UINT64_C(0x865b86925b9bc5c2), 402 },
+    { UINT64_C(0xc83553c5c8965d3d), 428 },
+    { UINT64_C(0x952ab45cfa97a0b3), 455 },
+    { UINT64_C(0xde469fbd99a05fe3), 481 },
+    { UINT64_C(0xa59bc234db398c25), 508 },
+    { UINT64_C(0xf6c69a72a3989f5c), 534 },
+    { UINT64_C(0xb7dcbf5354e9bece), 561 },
+    { UINT64_C(0x88fcf317f22241e2), 588 },
+    { UINT64_C(0xcc20ce9bd35c78a5), 614 },
+    { UINT64_C(0x98165af37b2153df), 641 },
+    { UINT64_C(0xe2a0b5dc971f303a), 667 },
+    { UINT64_C(0xa8d9d1535ce3b396), 694 },
+    { UINT64_C(0xfb9b7cd9a4a7443c), 720 },
+    { UINT64_C(0xbb764c4ca7a44410), 747 },
+    { UINT64_C(0x8bab8eefb6409c1a), 774 },
+    { UINT64_C(0xd01fef10a657842c), 800 },
+    { UINT64_C(0x9b10a4e5e9913129), 827 },
+    { UINT64_C(0xe7109bfba19c0c9d), 853 },
+    { UINT64_C(0xac2820d9623bf429), 880 },
+    { UINT64_C(0x80444b5e7aa7cf85), 907 },
+    { UINT64_C(0xbf21e44003acdd2d), 933 },
+    { UINT64_C(0x8e679c2f5e44ff8f), 960 },
+    { UINT64_C(0xd433179d9c8cb841), 986 },
+    { UINT64_C(0x9e19db92b4e31ba9), 1013 },
+    { UINT64_C(0xeb96bf6ebadf77d9), 1039 },
+    { UINT64_C(0xaf87023b9bf0ee6b), 1066 }
+};
+
+static const uint64_t  powers_of_ten[] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+    UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+    UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000),
+    UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000),
+    UINT64_C(100000000000000), UINT64_C(1000000000000000),
+    UINT64_C(10000000000000000), UINT64_C(100000000000000000),
+    UINT64_C(1000000000000000000), UINT64_C(10000000000000000000)
+};
+
+static struct clog_diy_fp
+clog_diy_fp_from_double(double value)
+{
+    struct clog_diy_fp result;
+    uint64_t bits;
+    int biased_e;
+    memcpy(&bits, &value, sizeof(bits));
+    biased_e = (bits & CLOG_DP_EXPONENT_MASK) >> CLOG_DP_SIGNIFICAND_SIZE;
+    if (biased_e != 0) {
+        result.f = (bits & CLOG_DP_SIGNIFICAND_MASK) + CLOG_DP_HIDDEN_BIT;
+        result.e = biased_e - CLOG_DP_EXPONENT_BIAS;
+    } else {
+        /* Subnormal */
+        result.f = bits & CLOG_DP_SIGNIFICAND_MASK;
+        result.e = CLOG_DP_MIN_EXPONENT + 1;
+    }
+    return result;
+}
+
+/* The upper 64 bits of the 128-bit product, rounded. */
+static struct clog_diy_fp
+clog_diy_fp_multiply(struct clog_diy_fp x, struct clog_diy_fp y)
+{
+    struct clog_diy_fp result;
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & 0xffffffff;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & 0xffffffff;
+    uint64_t ac = a * c;
+    uint64_t bc = b * c;
+    uint64_t ad = a * d;
+    uint64_t bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+    tmp += UINT64_C(1) << 31;
+    result.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    result.e = x.e + y.e + 64;
+    return result;
+}
+
+static struct clog_diy_fp
+clog_diy_fp_normalize(struct clog_diy_fp x, uint64_t top_bit)
+{
+    while ((x.f & top_bit) == 0) {
+        x.f <<= 1;
+        x.e--;
+    }
+    while ((x.f & (UINT64_C(1) << 63)) == 0) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* The boundaries of the interval of values that round to v, normalized to
+ * the same exponent. */
+static void
+clog_diy_fp_boundaries(struct clog_diy_fp v, struct clog_diy_fp* minus,
+                       struct clog_diy_fp* plus)
+{
+    struct clog_diy_fp pl = { (v.f << 1) + 1, v.e - 1 };
+    struct clog_diy_fp mi;
+    pl = clog_diy_fp_normalize(pl, CLOG_DP_HIDDEN_BIT << 1);
+    if (v.f == CLOG_DP_HIDDEN_BIT) {
+        /* The next smaller value is closer, since its exponent is smaller. */
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    } else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *minus = mi;
+    *plus = pl;
+}
+
+/* Returns a cached power of ten c = 10^-k such that e + c.e + 64 is between
+ * -60 and -32, which keeps the scaled values' integer parts in 32 bits. */
+static struct clog_diy_fp
+clog_cached_power(int e, int* k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int) dk;
+    unsigned int index;
+    if (ik != dk) {
+        ik++;
+    }
+    index = (ik >> 3) + 1;
+    *k = -(-348 + (int) (index << 3));
+    return cached_powers[index];
+}
+
+static unsigned int
+clog_count_digits(uint32_t n)
+{
+    unsigned int count = 1;
+    while (n >= 10) {
+        n /= 10;
+        count++;
+    }
+    return count;
+}
+
+/* Moves the last digit towards the real value, as long as we stay inside the
+ * rounding interval. */
+static void
+clog_grisu_round(char* buf, int size, uint64_t delta, uint64_t rest,
+                 uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[size - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static void
+clog_grisu_digits(struct clog_diy_fp w, struct clog_diy_fp mp, uint64_t delta,
+                  char* buf, int* size, int* k)
+{
+    struct clog_diy_fp one = { UINT64_C(1) << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = mp.f >> -one.e;
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = clog_count_digits(p1);
+    *size = 0;
+
+    /* The digits of the integer part */
+    while (kappa > 0) {
+        uint32_t digit = p1 / powers_of_ten[kappa - 1];
+        uint64_t rest;
+        p1 %= powers_of_ten[kappa - 1];
+        if (digit != 0 || *size != 0) {
+            buf[(*size)++] = '0' + digit;
+        }
+        kappa--;
+        rest = ((uint64_t) p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            clog_grisu_round(buf, *size, delta, rest,
+                             powers_of_ten[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    /* The digits of the fractional part */
+    while (true) {
+        char digit;
+        p2 *= 10;
+        delta *= 10;
+        digit = p2 >> -one.e;
+        if (digit != 0 || *size != 0) {
+            buf[(*size)++] = '0' + digit;
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            clog_grisu_round(buf, *size, delta, p2, one.f,
+                             (-kappa < 20) ? wp_w * powers_of_ten[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+/* Fills in buf with the value's significant digits, and returns how many
+ * there are; the value is those digits times 10^k.  value must be positive
+ * and finite. */
+static int
+clog_grisu2(double value, char* buf, int* k)
+{
+    struct clog_diy_fp v = clog_diy_fp_from_double(value);
+    struct clog_diy_fp w_m;
+    struct clog_diy_fp w_p;
+    struct clog_diy_fp c_mk;
+    struct clog_diy_fp w;
+    int size;
+
+    clog_diy_fp_boundaries(v, &w_m, &w_p);
+    c_mk = clog_cached_power(w_p.e, k);
+    w = clog_diy_fp_multiply(clog_diy_fp_normalize(v, CLOG_DP_HIDDEN_BIT),
+                             c_mk);
+    w_p = clog_diy_fp_multiply(w_p, c_mk);
+    w_m = clog_diy_fp_multiply(w_m, c_mk);
+    w_m.f++;
+    w_p.f--;
+    clog_grisu_digits(w, w_p, w_p.f - w_m.f, buf, &size, k);
+    return size;
+}
+
+static size_t
+clog_render_double(char* dest, double value)
+{
+    char digits[20];
+    char* curr = dest;
+    int size;
+    int k;
+    int exponent;
+
+    if (isnan(value)) {
+        memcpy(dest, "nan", 3);
+        return 3;
+    }
+    if (signbit(value)) {
+        *curr++ = '-';
+        value = -value;
+    }
+    if (isinf(value)) {
+        memcpy(curr, "inf", 3);
+        return curr + 3 - dest;
+    }
+    if (value == 0) {
+        *curr++ = '0';
+        return curr - dest;
+    }
+
+    size = clog_grisu2(value, digits, &k);
+    /* The value is d.ddd * 10^exponent */
+    exponent = size + k - 1;
+
+    if (exponent >= -4 && exponent < 15) {
+        if (k >= 0) {
+            /* An integer */
+            memcpy(curr, digits, size);
+            memset(curr + size, '0', k);
+            curr += size + k;
+        } else if (exponent >= 0) {
+            memcpy(curr, digits, exponent + 1);
+            curr[exponent + 1] = '.';
+            memcpy(curr + exponent + 2, digits + exponent + 1,
+                   size - exponent - 1);
+            curr += size + 1;
+        } else {
+            *curr++ = '0';
+            *curr++ = '.';
+            memset(curr, '0', -exponent - 1);
+            curr += -exponent - 1;
+            memcpy(curr, digits, size);
+            curr += size;
+        }
+        return curr - dest;
+    }
+
+    *curr++ = digits[0];
+    if (size > 1) {
+        *curr++ = '.';
+        memcpy(curr, digits + 1, size - 1);
+        curr += size - 1;
+    }
+    *curr++ = 'e';
+    if (exponent < 0) {
+        *curr++ = '-';
+        exponent = -exponent;
+    } else {
+        *curr++ = '+';
+    }
+    /* Like printf, use at least two digits for the exponent. */
+    if (exponent < 10) {
+        *curr++ = '0';
+    }
+    curr += clog_render_uint(curr, exponent);
+    return curr - dest;
+}
+
+static size_t
+clog_render_ptr(char* dest, const void* value)
+{
+    static const char  hex_digits[] = "0123456789abcdef";
+    uintptr_t bits = (uintptr_t) value;
+    char buf[CLOG_FIELD_MAX_SIZE];
+    char* end = buf + sizeof(buf);
+    char* start = end;
+    do {
+        *--start = hex_digits[bits & 0xf];
+        bits >>= 4;
+    } while (bits != 0);
+    *--start = 'x';
+    *--start = '0';
+    memcpy(dest, start, end - start);
+    return end - start;
+}
+
+/* Durations use the largest unit that the value is at least one of, with as
+ * many decimal places as needed to be exact: "250ns", "1.5ms", "3s". */
+static size_t
+clog_render_duration(char* dest, int64_t value)
+{
+    static const struct {
+        const char* unit;
+        uint64_t scale;
+        unsigned int places;
+    } units[] = {
+        { "s", 1000000000, 9 },
+        { "ms", 1000000, 6 },
+        { "us", 1000, 3 },
+        { "ns", 1, 0 }
+    };
+    uint64_t magnitude;
+    char* curr = dest;
+    size_t i;
+
+    if (value < 0) {
+        *curr++ = '-';
+        magnitude = -(uint64_t) value;
+    } else {
+        magnitude = value;
+    }
+
+    for (i = 0; units[i].scale > 1 && magnitude < units[i].scale; i++) {
+    }
+    curr += clog_render_uint(curr, magnitude / units[i].scale);
+    if (units[i].places > 0 && magnitude % units[i].scale != 0) {
+        uint64_t fraction = magnitude % units[i].scale;
+        unsigned int places = units[i].places;
+        /* Drop any trailing zeroes. */
+        while (fraction % 10 == 0) {
+            fraction /= 10;
+            places--;
+        }
+        *curr++ = '.';
+        memset(curr, '0', places);
+        clog_render_digits(curr + places, fraction);
+        curr += places;
+    }
+    strcpy(curr, units[i].unit);
+    return curr - dest + strlen(units[i].unit);
+}
+
+size_t
+_clog_field_render_raw(char* dest, enum clog_field_type type,
+                       union clog_field_raw raw)
+{
+    switch (type) {
+        case CLOG_FIELD_INT:
+            return clog_render_int(dest, raw.i);
+        case CLOG_FIELD_UINT:
+            return clog_render_uint(dest, raw.u);
+        case CLOG_FIELD_DOUBLE:
+            return clog_render_double(dest, raw.d);
+        case CLOG_FIELD_BOOL:
+            memcpy(dest, raw.b ? "true" : "false", raw.b ? 4 : 5);
+            return raw.b ? 4 : 5;
+        case CLOG_FIELD_PTR:
+            return clog_render_ptr(dest, raw.p);
+        case CLOG_FIELD_DURATION:
+            return clog_render_duration(dest, raw.i);
+        default:
+            /* String fields always have a value. */
+            cork_unreachable();
+    }
+}
+
+const char*
+_clog_message_field_render(const struct clog_message_field* field)
+{
+    struct clog_message_field* mfield = (struct clog_message_field*) field;
+    char* dest = clog_arena_alloc(CLOG_FIELD_MAX_SIZE);
+    size_t size = _clog_field_render_raw(dest, field->type, field->raw);
+    dest[size] = '\0';
+
+    /* Cache the rendered value, so that we only render it once per
+     * message. */
+    mfield->value = dest;
+    return dest;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Inline declarations
+ */
+
 struct clog_message_field*
 clog_message_add_string_field(struct clog_message_fields* fields,
                               struct clog_string_field* field, const char* key,
                               const char* value);
 
-void
-clog_printf_field_done(struct clog_message_field* vfield)
-{
-    struct clog_printf_field* field =
-            cork_container_of(vfield, struct clog_printf_field, parent);
-    cork_buffer_done(&field->value);
-}
-
 struct clog_message_field*
 clog_message_add_printf_field(struct clog_message_fields* fields,
                               struct clog_printf_field* field, const char* key,
                               const char* fmt, ...);
+
+struct clog_message_field*
+clog_message_add_int_field(struct clog_message_fields* fields,
+                           struct clog_int_field* field, const char* key,
+                           int64_t value);
+
+struct clog_message_field*
+clog_message_add_uint_field(struct clog_message_fields* fields,
+                            struct clog_uint_field* field, const char* key,
+                            uint64_t value);
+
+struct clog_message_field*
+clog_message_add_double_field(struct clog_message_fields* fields,
+                              struct clog_double_field* field, const char* key,
+                              double value);
+
+struct clog_message_field*
+clog_message_add_bool_field(struct clog_message_fields* fields,
+                            struct clog_bool_field* field, const char* key,
+                            bool value);
+
+struct clog_message_field*
+clog_message_add_ptr_field(struct clog_message_fields* fields,
+                           struct clog_ptr_field* field, const char* key,
+                           const void* value);
+
+struct clog_message_field*
+clog_message_add_duration_field(struct clog_message_fields* fields,
+                                struct clog_duration_field* field,
+                                const char* key, int64_t value);
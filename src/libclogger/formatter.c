@@ -8,480 +8,458 @@
  */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #include <libcork/core.h>
 #include <libcork/ds.h>
 #include <libcork/helpers/errors.h>
+#include <libcork/threads.h>
 
 #include "clogger/api.h"
 #include "clogger/error.h"
+#include "clogger/fields.h"
 #include "clogger/formatter.h"
 
 
 /*-----------------------------------------------------------------------
- * Segment interface
+ * Compiled programs
  */
 
-struct segment {
-    void (*start)(struct segment* segment);
-    void (*message)(struct segment* segment, struct clog_message* message);
-    void (*append)(struct segment* segment, struct cork_buffer* dest);
-    void (*free)(struct segment* segment);
+/* We compile each format string into a flat array of opcodes, which
+ * clog_formatter_format_message runs in a single loop.  Any literal text
+ * (including the names of the fields that we reference) lives in a separate
+ * literal pool, which opcodes refer to by offset.
+ *
+ * The #{} family of conversions each compile into an OP_VAR or OP_MULTI
+ * opcode, followed by the opcodes for the annotation spec.  The annotation
+ * spec is executed once for each matching field; body_size tells the
+ * interpreter how many of the following opcodes belong to it.
+ *
+ * Every opcode writes its output directly into the destination buffer; there
+ * aren't any per-opcode scratch buffers. */
+
+enum opcode {
+    /* Top-level opcodes */
+    OP_RAW,
+    OP_LEVEL,
+    OP_LEVEL_FIXED,
+    OP_CHANNEL,
+    OP_MESSAGE,
+    OP_TIME_ISO,
+    OP_TIME_EPOCH_MS,
+    OP_TIME_OFFSET,
+    OP_THREAD_ID,
+    OP_THREAD_NAME,
+    OP_SOURCE,
+    OP_SOURCE_FILE,
+    OP_SOURCE_LINE,
+    OP_SOURCE_FUNCTION,
+    OP_VAR,
+    OP_MULTI,
+    /* Annotation spec opcodes (OP_RAW is also allowed) */
+    OP_KEY,
+    OP_VALUE
 };
 
-typedef cork_array(struct segment*) segment_array;
-
-
-/*-----------------------------------------------------------------------
- * Annotation segment interface
- */
-
-struct annotation_segment {
-    void (*annotation)(struct annotation_segment* segment,
-                       struct cork_buffer* dest, const char* key,
-                       const char* value);
-    void (*free)(struct annotation_segment* segment);
+struct op {
+    enum opcode code;
+    /* OP_RAW: the literal text to output.  OP_VAR: the (NUL-terminated) name
+     * of the field to look for. */
+    size_t literal;
+    size_t literal_size;
+    /* OP_VAR, OP_MULTI: the number of annotation spec opcodes that follow */
+    size_t body_size;
+    /* OP_VAR: the field name's slot in the formatter's field name index */
+    size_t slot;
 };
 
-typedef cork_array(struct annotation_segment*) annotation_segment_array;
+typedef cork_array(struct op) op_array;
 
 
 /*-----------------------------------------------------------------------
- * Formatter type
+ * Field name index
  */
 
-struct clog_formatter {
-    segment_array segments;
-};
-
+/* Each distinct field name that's referenced by a #{} or #!{} conversion is
+ * assigned a slot.  Before running a program, we walk the message's fields
+ * once, using a small open-addressed hash table to find the slot (if any) that
+ * each field belongs to.  Each OP_VAR opcode can then find its field directly,
+ * instead of comparing its name against every field in the message. */
 
-/*-----------------------------------------------------------------------
- * Raw segment
- */
-
-struct raw_segment {
-    struct segment parent;
-    struct cork_buffer content;
+struct var_name {
+    cork_hash hash;
+    size_t literal;
 };
 
-static void
-raw_segment_start(struct segment* vself)
-{
-}
+typedef cork_array(struct var_name) var_name_array;
 
-static void
-raw_segment_message(struct segment* vself, struct clog_message* message)
-{
-}
-
-static void
-raw_segment_append(struct segment* vself, struct cork_buffer* dest)
-{
-    struct raw_segment* self =
-            cork_container_of(vself, struct raw_segment, parent);
-    cork_buffer_append(dest, self->content.buf, self->content.size);
-}
-
-static void
-raw_segment_free(struct segment* vself)
-{
-    struct raw_segment* self =
-            cork_container_of(vself, struct raw_segment, parent);
-    cork_buffer_done(&self->content);
-    cork_delete(struct raw_segment, self);
-}
+struct var_match {
+    /* The most recently added field with this name */
+    struct clog_message_field* field;
+    /* Whether there are any older fields with the same name */
+    bool more;
+};
 
-static void
-raw_segment_new(struct clog_formatter* fmt, const char* content, size_t size)
-{
-    struct raw_segment* self = cork_new(struct raw_segment);
-    self->parent.start = raw_segment_start;
-    self->parent.message = raw_segment_message;
-    self->parent.append = raw_segment_append;
-    self->parent.free = raw_segment_free;
-    cork_buffer_init(&self->content);
-    cork_buffer_set(&self->content, content, size);
-    /*printf("RAW \"%.*s\"\n", (int) size, content);*/
-    cork_array_append(&fmt->segments, &self->parent);
-}
+/* Most format strings only reference a handful of fields, so we can usually
+ * keep the per-message matches on the stack. */
+#define VAR_MATCHES_INLINE_COUNT 16
 
 
 /*-----------------------------------------------------------------------
- * Message part
+ * Timestamps
  */
 
-enum msg_part {
-    MSG_LEVEL,
-    MSG_LEVEL_FIXED,
-    MSG_CHANNEL,
-    MSG_MESSAGE
-};
+/* Each message's timestamp is captured when the message is created.  Turning
+ * the seconds into a calendar date is the expensive part, and consecutive
+ * messages from a thread almost always fall in the same second.  So each
+ * thread caches the rendered date and time for the last second that it saw,
+ * and only has to render the sub-second digits for each message. */
+
+/* "YYYY-MM-DDTHH:MM:SS" */
+#define CLOG_TIME_PREFIX_SIZE  19
 
-struct msg_segment {
-    struct segment parent;
-    enum msg_part part;
-    struct cork_buffer value;
+struct clog_time_cache {
+    bool valid;
+    uint64_t second;
+    char prefix[CLOG_TIME_PREFIX_SIZE + 1];
 };
 
+cork_tls(struct clog_time_cache, time_cache);
+
+/* %t{offset} is relative to when the library was loaded. */
+static uint64_t  clog_start_time;
+
+__attribute__((constructor))
 static void
-msg_segment_start(struct segment* vself)
+clog_start_time_init(void)
 {
+    clog_start_time = clog_now();
 }
 
+/* Renders value as exactly width digits, with leading zeroes. */
 static void
-msg_segment_message(struct segment* vself, struct clog_message* message)
-{
-    struct msg_segment* self =
-            cork_container_of(vself, struct msg_segment, parent);
-    switch (self->part) {
-        case MSG_LEVEL:
-            cork_buffer_set_string(&self->value,
-                                   clog_level_name(message->level));
-            break;
-
-        case MSG_LEVEL_FIXED:
-            cork_buffer_set_string(
-                    &self->value, clog_level_name_fixed_width(message->level));
-            break;
-
-        case MSG_CHANNEL:
-            cork_buffer_set_string(&self->value, message->channel);
-            break;
-
-        case MSG_MESSAGE: {
-            cork_buffer_set_string(&self->value, clog_message_message(message));
-            break;
-        }
-
-        default:
-            cork_unreachable();
+append_fixed_digits(struct cork_buffer* dest, uint64_t value,
+                    unsigned int width)
+{
+    char digits[CLOG_FIELD_MAX_SIZE];
+    unsigned int i;
+    for (i = width; i > 0; i--) {
+        digits[i - 1] = '0' + value % 10;
+        value /= 10;
     }
+    cork_buffer_append(dest, digits, width);
 }
 
 static void
-msg_segment_append(struct segment* vself, struct cork_buffer* dest)
+append_uint(struct cork_buffer* dest, uint64_t value)
 {
-    struct msg_segment* self =
-            cork_container_of(vself, struct msg_segment, parent);
-    cork_buffer_append(dest, self->value.buf, self->value.size);
+    char digits[CLOG_FIELD_MAX_SIZE];
+    union clog_field_raw raw;
+    size_t size;
+    raw.u = value;
+    size = _clog_field_render_raw(digits, CLOG_FIELD_UINT, raw);
+    cork_buffer_append(dest, digits, size);
 }
 
+/* ISO 8601, in UTC, with milliseconds: 2020-01-02T03:04:05.678Z */
 static void
-msg_segment_free(struct segment* vself)
-{
-    struct msg_segment* self =
-            cork_container_of(vself, struct msg_segment, parent);
-    cork_buffer_done(&self->value);
-    cork_delete(struct msg_segment, self);
+append_time_iso(struct cork_buffer* dest, uint64_t timestamp)
+{
+    struct clog_time_cache* cache = time_cache_get();
+    uint64_t second = timestamp / 1000000000;
+
+    if (CORK_UNLIKELY(!cache->valid || cache->second != second)) {
+        time_t t = second;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(cache->prefix, sizeof(cache->prefix), "%Y-%m-%dT%H:%M:%S",
+                 &tm);
+        cache->second = second;
+        cache->valid = true;
+    }
+
+    cork_buffer_append(dest, cache->prefix, CLOG_TIME_PREFIX_SIZE);
+    cork_buffer_append(dest, ".", 1);
+    append_fixed_digits(dest, (timestamp / 1000000) % 1000, 3);
+    cork_buffer_append(dest, "Z", 1);
 }
 
+/* Seconds since the library was loaded, with microseconds: 12.345678 */
 static void
-msg_segment_new(struct clog_formatter* fmt, enum msg_part part)
+append_time_offset(struct cork_buffer* dest, uint64_t timestamp)
 {
-    struct msg_segment* self = cork_new(struct msg_segment);
-    self->parent.start = msg_segment_start;
-    self->parent.message = msg_segment_message;
-    self->parent.append = msg_segment_append;
-    self->parent.free = msg_segment_free;
-    self->part = part;
-    cork_buffer_init(&self->value);
-#if 0
-    printf("MSG %s\n",
-           part == MSG_LEVEL? "level":
-           part == MSG_LEVEL_FIXED? "fixed level":
-           part == MSG_CHANNEL? "channel":
-           part == MSG_MESSAGE? "message": "UNKNOWN");
-#endif
-    cork_array_append(&fmt->segments, &self->parent);
+    uint64_t offset;
+    if (timestamp < clog_start_time) {
+        /* The clock was set backwards. */
+        cork_buffer_append(dest, "-", 1);
+        offset = (clog_start_time - timestamp) / 1000;
+    } else {
+        offset = (timestamp - clog_start_time) / 1000;
+    }
+    append_uint(dest, offset / 1000000);
+    cork_buffer_append(dest, ".", 1);
+    append_fixed_digits(dest, offset % 1000000, 6);
 }
 
 
 /*-----------------------------------------------------------------------
- * Raw segment
+ * Source locations
  */
 
-struct raw_annotation_segment {
-    struct annotation_segment parent;
-    struct cork_buffer content;
-};
-
-static void
-raw_annotation_segment_annotation(struct annotation_segment* vself,
-                                  struct cork_buffer* dest, const char* key,
-                                  const char* value)
-{
-    struct raw_annotation_segment* self =
-            cork_container_of(vself, struct raw_annotation_segment, parent);
-    cork_buffer_append(dest, self->content.buf, self->content.size);
-}
-
-static void
-raw_annotation_segment_free(struct annotation_segment* vself)
-{
-    struct raw_annotation_segment* self =
-            cork_container_of(vself, struct raw_annotation_segment, parent);
-    cork_buffer_done(&self->content);
-    cork_delete(struct raw_annotation_segment, self);
-}
+/* Each message points at its statement's static call site descriptor, so the
+ * file, line, and function are only looked at if a format string asks for
+ * them.  Messages that didn't come from a log statement don't have a source
+ * location, and render as nothing. */
 
+/* file.c:123 */
 static void
-raw_annotation_segment_new(annotation_segment_array* arr, const char* content,
-                           size_t size)
+append_source(struct cork_buffer* dest, const struct clog_call_site* site)
 {
-    struct raw_annotation_segment* self =
-            cork_new(struct raw_annotation_segment);
-    self->parent.annotation = raw_annotation_segment_annotation;
-    self->parent.free = raw_annotation_segment_free;
-    cork_buffer_init(&self->content);
-    cork_buffer_set(&self->content, content, size);
-    /*printf("  RAW \"%.*s\"\n", (int) size, content);*/
-    cork_array_append(arr, &self->parent);
+    if (site == NULL) {
+        return;
+    }
+    cork_buffer_append_string(dest, site->file);
+    cork_buffer_append(dest, ":", 1);
+    append_uint(dest, site->line);
 }
 
 
 /*-----------------------------------------------------------------------
- * Annotation key sub-segment
+ * Formatter type
  */
 
-static void
-key_segment_annotation(struct annotation_segment* self,
-                       struct cork_buffer* dest, const char* key,
-                       const char* value)
-{
-    cork_buffer_append_string(dest, key);
-}
-
-static void
-key_segment_free(struct annotation_segment* self)
-{
-    cork_delete(struct annotation_segment, self);
-}
-
-static void
-key_segment_new(annotation_segment_array *arr)
-{
-    struct annotation_segment* self = cork_new(struct annotation_segment);
-    self->annotation = key_segment_annotation;
-    self->free = key_segment_free;
-    /*printf("  KEY\n");*/
-    cork_array_append(arr, self);
-}
+struct clog_formatter {
+    op_array program;
+    struct cork_buffer literals;
+    var_name_array var_names;
+    /* Maps field names to slots.  Each entry is a slot number plus one; zero
+     * marks an empty entry.  The size is always a power of two. */
+    size_t* var_index;
+    size_t var_index_size;
+    /* Only used while compiling: the index of the first opcode that a new raw
+     * span is allowed to be merged into. */
+    size_t merge_start;
+};
 
 
 /*-----------------------------------------------------------------------
- * Annotation value sub-segment
+ * Compiling opcodes
  */
 
-static void
-value_segment_annotation(struct annotation_segment* self,
-                         struct cork_buffer* dest, const char* key,
-                         const char* value)
+static size_t
+op_new(struct clog_formatter* fmt, enum opcode code)
 {
-    cork_buffer_append_string(dest, value);
+    struct op* op = cork_array_append_get(&fmt->program);
+    op->code = code;
+    op->literal = 0;
+    op->literal_size = 0;
+    op->body_size = 0;
+    op->slot = 0;
+    return cork_array_size(&fmt->program) - 1;
 }
 
-static void
-value_segment_free(struct annotation_segment* self)
+static size_t
+op_new_literal(struct clog_formatter* fmt, enum opcode code,
+               const char* content, size_t size)
 {
-    cork_delete(struct annotation_segment, self);
+    size_t index = op_new(fmt, code);
+    struct op* op = &cork_array_at(&fmt->program, index);
+    op->literal = fmt->literals.size;
+    op->literal_size = size;
+    cork_buffer_append(&fmt->literals, content, size);
+    /* Include a NUL terminator in the pool so that field names can be passed
+     * directly to strcmp. */
+    cork_buffer_append(&fmt->literals, "", 1);
+    return index;
 }
 
 static void
-value_segment_new(annotation_segment_array* arr)
-{
-    struct annotation_segment* self = cork_new(struct annotation_segment);
-    self->annotation = value_segment_annotation;
-    self->free = value_segment_free;
-    /*printf("  VALUE\n");*/
-    cork_array_append(arr, self);
-}
-
-
-/*-----------------------------------------------------------------------
- * Variable reference
- */
-
-struct var_segment {
-    struct segment parent;
-    const char* name;
-    const char* default_value;
-    struct cork_buffer value;
-    annotation_segment_array segments;
-    bool value_given;
-};
+op_raw_new(struct clog_formatter* fmt, const char* content, size_t size)
+{
+    struct op* prev;
+    size_t count = cork_array_size(&fmt->program);
+
+    /* Merge adjacent raw spans (for instance, from "##" or "%%") into a single
+     * opcode.  We can only do this if the previous span is the last thing in
+     * the literal pool, since we're going to extend it in place. */
+    if (count > fmt->merge_start) {
+        prev = &cork_array_at(&fmt->program, count - 1);
+        if (prev->code == OP_RAW &&
+            prev->literal + prev->literal_size + 1 == fmt->literals.size) {
+            cork_buffer_truncate(&fmt->literals, fmt->literals.size - 1);
+            cork_buffer_append(&fmt->literals, content, size);
+            cork_buffer_append(&fmt->literals, "", 1);
+            prev->literal_size += size;
+            return;
+        }
+    }
 
-static void
-var_segment_start(struct segment* vself)
-{
-    struct var_segment* self =
-            cork_container_of(vself, struct var_segment, parent);
-    self->value_given = false;
-    cork_buffer_clear(&self->value);
+    op_new_literal(fmt, OP_RAW, content, size);
 }
 
-static void
-var_segment_message(struct segment* vself, struct clog_message* message)
+static size_t
+op_var_new(struct clog_formatter* fmt, const char* name, size_t size)
 {
-    struct var_segment* self =
-            cork_container_of(vself, struct var_segment, parent);
-    struct clog_message_field* field;
-    for (field = message->fields.head; field != NULL; field = field->next) {
-        if (strcmp(field->key, self->name) == 0) {
-            size_t i;
-            self->value_given = true;
-            for (i = 0; i < cork_array_size(&self->segments); i++) {
-                struct annotation_segment* segment =
-                        cork_array_at(&self->segments, i);
-                segment->annotation(segment, &self->value, field->key,
-                                    field->value);
-            }
+    size_t index = op_new_literal(fmt, OP_VAR, name, size);
+    struct op* op = &cork_array_at(&fmt->program, index);
+    const char* literals = fmt->literals.buf;
+    const char* op_name = literals + op->literal;
+    struct var_name* var_name;
+    size_t i;
+
+    /* Reuse the slot of any earlier reference to the same field. */
+    for (i = 0; i < cork_array_size(&fmt->var_names); i++) {
+        var_name = &cork_array_at(&fmt->var_names, i);
+        if (strcmp(literals + var_name->literal, op_name) == 0) {
+            op->slot = i;
+            return index;
         }
     }
+
+    op->slot = cork_array_size(&fmt->var_names);
+    var_name = cork_array_append_get(&fmt->var_names);
+    var_name->hash = cork_hash_buffer(0, name, size);
+    var_name->literal = op->literal;
+    return index;
 }
 
+/* Fills in the body_size of an OP_VAR or OP_MULTI opcode once we've finished
+ * compiling its annotation spec. */
 static void
-var_segment_append(struct segment* vself, struct cork_buffer* dest)
+op_finish_body(struct clog_formatter* fmt, size_t index)
 {
-    struct var_segment* self =
-            cork_container_of(vself, struct var_segment, parent);
-    if (self->value_given) {
-        cork_buffer_append(dest, self->value.buf, self->value.size);
-    } else {
-        cork_buffer_append_string(dest, self->default_value);
-    }
+    struct op* op = &cork_array_at(&fmt->program, index);
+    op->body_size = cork_array_size(&fmt->program) - index - 1;
+    /* Don't let any later raw spans get merged into the annotation spec. */
+    fmt->merge_start = cork_array_size(&fmt->program);
 }
 
 static void
-var_segment_free(struct segment* vself)
+var_index_build(struct clog_formatter* fmt)
 {
+    size_t count = cork_array_size(&fmt->var_names);
+    size_t size;
     size_t i;
-    struct var_segment* self =
-            cork_container_of(vself, struct var_segment, parent);
-
-    cork_strfree(self->name);
-    cork_strfree(self->default_value);
-    cork_buffer_done(&self->value);
-    for (i = 0; i < cork_array_size(&self->segments); i++) {
-        struct annotation_segment* segment = cork_array_at(&self->segments, i);
-        segment->free(segment);
+
+    if (count == 0) {
+        return;
     }
-    cork_array_done(&self->segments);
-    cork_delete(struct var_segment, self);
-}
 
-static struct var_segment*
-var_segment_new(struct clog_formatter* fmt, const char* default_value,
-                size_t default_size, const char* name, size_t name_size)
-{
-    struct var_segment* self = cork_new(struct var_segment);
-    self->parent.start = var_segment_start;
-    self->parent.message = var_segment_message;
-    self->parent.append = var_segment_append;
-    self->parent.free = var_segment_free;
-    cork_array_init(&self->segments);
-    cork_buffer_init(&self->value);
-    cork_buffer_set(&self->value, name, name_size);
-    self->name = cork_strdup(self->value.buf);
-    cork_buffer_set(&self->value, default_value, default_size);
-    self->default_value = cork_strdup(self->value.buf);
-#if 0
-    printf("VAR \"%s\" \"%s\"\n", self->name, self->default_value);
-#endif
-    cork_array_append(&fmt->segments, &self->parent);
-    return self;
+    /* Keep the table at most half full. */
+    for (size = 8; size < count * 2; size *= 2) {
+    }
+    fmt->var_index = cork_calloc(size, sizeof(size_t));
+    fmt->var_index_size = size;
+
+    for (i = 0; i < count; i++) {
+        struct var_name* var_name = &cork_array_at(&fmt->var_names, i);
+        size_t j = var_name->hash & (size - 1);
+        while (fmt->var_index[j] != 0) {
+            j = (j + 1) & (size - 1);
+        }
+        fmt->var_index[j] = i + 1;
+    }
 }
 
 
 /*-----------------------------------------------------------------------
- * Multiple variable reference
+ * Running opcodes
  */
 
-struct multi_segment {
-    struct segment parent;
-    const char* default_value;
-    struct cork_buffer value;
-    annotation_segment_array segments;
-    bool value_given;
-};
-
 static void
-multi_segment_start(struct segment* vself)
+var_matches_fill(struct clog_formatter* self, struct var_match* matches,
+                 struct clog_message* message)
 {
-    struct multi_segment* self =
-            cork_container_of(vself, struct multi_segment, parent);
-    self->value_given = false;
-    cork_buffer_clear(&self->value);
-}
-
-static void
-multi_segment_message(struct segment* vself, struct clog_message* message)
-{
-    struct multi_segment* self =
-            cork_container_of(vself, struct multi_segment, parent);
-    self->value_given = true;
-    struct clog_message_field* head = message->fields.head;
-    struct clog_message_field* last;
+    const char* literals = self->literals.buf;
+    size_t mask = self->var_index_size - 1;
     struct clog_message_field* field;
-    for (last = NULL; last != head; last = field) {
-        for (field = head; field->next != last; field = field->next) {}
+
+    memset(matches, 0, cork_array_size(&self->var_names) * sizeof(*matches));
+    for (field = message->fields.head; field != NULL; field = field->next) {
+        cork_hash hash = cork_hash_buffer(0, field->key, strlen(field->key));
         size_t i;
-        for (i = 0; i < cork_array_size(&self->segments); i++) {
-            struct annotation_segment* segment =
-                    cork_array_at(&self->segments, i);
-            segment->annotation(segment, &self->value, field->key,
-                                field->value);
+        size_t entry;
+        for (i = hash & mask; (entry = self->var_index[i]) != 0;
+             i = (i + 1) & mask) {
+            struct var_name* var_name =
+                    &cork_array_at(&self->var_names, entry - 1);
+            if (var_name->hash == hash &&
+                strcmp(field->key, literals + var_name->literal) == 0) {
+                struct var_match* match = &matches[entry - 1];
+                if (match->field == NULL) {
+                    match->field = field;
+                } else {
+                    match->more = true;
+                }
+                break;
+            }
         }
     }
 }
 
 static void
-multi_segment_append(struct segment* vself, struct cork_buffer* dest)
-{
-    struct multi_segment* self =
-            cork_container_of(vself, struct multi_segment, parent);
-    if (self->value_given) {
-        cork_buffer_append(dest, self->value.buf, self->value.size);
-    } else {
-        cork_buffer_append_string(dest, self->default_value);
+run_annotation(const struct op* op, const struct op* end, const char* literals,
+               struct cork_buffer* dest,
+               const struct clog_message_field* field)
+{
+    for (; op < end; op++) {
+        switch (op->code) {
+            case OP_RAW:
+                cork_buffer_append(dest, literals + op->literal,
+                                   op->literal_size);
+                break;
+
+            case OP_KEY:
+                cork_buffer_append_string(dest, field->key);
+                break;
+
+            case OP_VALUE:
+                cork_buffer_append_string(dest,
+                                          clog_message_field_value(field));
+                break;
+
+            default:
+                cork_unreachable();
+        }
     }
 }
 
 static void
-multi_segment_free(struct segment* vself)
-{
-    size_t i;
-    struct multi_segment* self =
-            cork_container_of(vself, struct multi_segment, parent);
-
-    cork_strfree(self->default_value);
-    cork_buffer_done(&self->value);
-    for (i = 0; i < cork_array_size(&self->segments); i++) {
-        struct annotation_segment* segment = cork_array_at(&self->segments, i);
-        segment->free(segment);
+run_var(const struct op* op, const char* literals, struct cork_buffer* dest,
+        const struct var_match* match)
+{
+    const struct op* body = op + 1;
+    const struct op* body_end = body + op->body_size;
+    const char* name = literals + op->literal;
+    struct clog_message_field* field = match->field;
+    if (field == NULL) {
+        return;
+    }
+
+    run_annotation(body, body_end, literals, dest, field);
+    if (CORK_UNLIKELY(match->more)) {
+        /* Fall back on a linear scan for any duplicates. */
+        for (field = field->next; field != NULL; field = field->next) {
+            if (strcmp(field->key, name) == 0) {
+                run_annotation(body, body_end, literals, dest, field);
+            }
+        }
     }
-    cork_array_done(&self->segments);
-    cork_delete(struct multi_segment, self);
 }
 
-static struct multi_segment*
-multi_segment_new(struct clog_formatter* fmt, const char* default_value,
-                  size_t default_size)
+static void
+run_multi(const struct op* op, const char* literals, struct cork_buffer* dest,
+          struct clog_message* message)
 {
-    struct multi_segment* self = cork_new(struct multi_segment);
-    self->parent.start = multi_segment_start;
-    self->parent.message = multi_segment_message;
-    self->parent.append = multi_segment_append;
-    self->parent.free = multi_segment_free;
-    cork_array_init(&self->segments);
-    cork_buffer_init(&self->value);
-    cork_buffer_set(&self->value, default_value, default_size);
-    self->default_value = cork_strdup(self->value.buf);
-#if 0
-    printf("MLT \"%s\"\n", self->default_value);
-#endif
-    cork_array_append(&fmt->segments, &self->parent);
-    return self;
+    const struct op* body = op + 1;
+    const struct op* body_end = body + op->body_size;
+    struct clog_message_field* field;
+    /* Output the fields in the order that they were added. */
+    for (field = message->fields.tail; field != NULL; field = field->prev) {
+        run_annotation(body, body_end, literals, dest, field);
+    }
 }
 
 
@@ -490,7 +468,7 @@ multi_segment_new(struct clog_formatter* fmt, const char* default_value,
  */
 
 static const char*
-annotation_spec_parse(annotation_segment_array* arr, const char* fmt)
+annotation_spec_parse(struct clog_formatter* self, const char* fmt)
 {
     const char* curr = fmt;
 
@@ -503,13 +481,13 @@ annotation_spec_parse(annotation_segment_array* arr, const char* fmt)
             return NULL;
         } else if (curr[0] == '%') {
             if (curr[1] == '%') {
-                raw_annotation_segment_new(arr, "%", 1);
+                op_raw_new(self, "%", 1);
                 curr += 2;
             } else if (curr[1] == 'k') {
-                key_segment_new(arr);
+                op_new(self, OP_KEY);
                 curr += 2;
             } else if (curr[1] == 'v') {
-                value_segment_new(arr);
+                op_new(self, OP_VALUE);
                 curr += 2;
             } else {
                 /* Unknown "%" conversion */
@@ -523,7 +501,7 @@ annotation_spec_parse(annotation_segment_array* arr, const char* fmt)
             while (s_end[0] != '\0' && s_end[0] != '%' && s_end[0] != '}') {
                 s_end++;
             }
-            raw_annotation_segment_new(arr, curr, s_end - curr);
+            op_raw_new(self, curr, s_end - curr);
             curr = s_end;
         }
     }
@@ -531,6 +509,99 @@ annotation_spec_parse(annotation_segment_array* arr, const char* fmt)
     return curr + 1;
 }
 
+/* Parses the optional {style} after a conversion.  style is set to NULL if
+ * there isn't one.  Returns a pointer just past the conversion. */
+static const char*
+style_parse(const char* curr, const char* what, const char** style,
+            size_t* size)
+{
+    const char* s_end;
+
+    if (curr[0] != '{') {
+        *style = NULL;
+        *size = 0;
+        return curr;
+    }
+
+    curr++;
+    for (s_end = curr; s_end[0] != '}'; s_end++) {
+        if (s_end[0] == '\0') {
+            clog_bad_format("Unterminated %s style", what);
+            return NULL;
+        }
+    }
+
+    *style = curr;
+    *size = s_end - curr;
+    return s_end + 1;
+}
+
+static bool
+style_is(const char* style, size_t size, const char* expected)
+{
+    return size == strlen(expected) && memcmp(style, expected, size) == 0;
+}
+
+static const char*
+time_spec_parse(struct clog_formatter* self, const char* curr)
+{
+    const char* style;
+    size_t size;
+
+    rpp_check(curr = style_parse(curr, "timestamp", &style, &size));
+    if (style == NULL || style_is(style, size, "iso")) {
+        op_new(self, OP_TIME_ISO);
+    } else if (style_is(style, size, "ms")) {
+        op_new(self, OP_TIME_EPOCH_MS);
+    } else if (style_is(style, size, "offset")) {
+        op_new(self, OP_TIME_OFFSET);
+    } else {
+        clog_bad_format("Unknown timestamp style %.*s", (int) size, style);
+        return NULL;
+    }
+    return curr;
+}
+
+static const char*
+thread_spec_parse(struct clog_formatter* self, const char* curr)
+{
+    const char* style;
+    size_t size;
+
+    rpp_check(curr = style_parse(curr, "thread", &style, &size));
+    if (style == NULL || style_is(style, size, "name")) {
+        op_new(self, OP_THREAD_NAME);
+    } else if (style_is(style, size, "id")) {
+        op_new(self, OP_THREAD_ID);
+    } else {
+        clog_bad_format("Unknown thread style %.*s", (int) size, style);
+        return NULL;
+    }
+    return curr;
+}
+
+static const char*
+source_spec_parse(struct clog_formatter* self, const char* curr)
+{
+    const char* style;
+    size_t size;
+
+    rpp_check(curr = style_parse(curr, "source", &style, &size));
+    if (style == NULL) {
+        op_new(self, OP_SOURCE);
+    } else if (style_is(style, size, "file")) {
+        op_new(self, OP_SOURCE_FILE);
+    } else if (style_is(style, size, "line")) {
+        op_new(self, OP_SOURCE_LINE);
+    } else if (style_is(style, size, "func")) {
+        op_new(self, OP_SOURCE_FUNCTION);
+    } else {
+        clog_bad_format("Unknown source style %.*s", (int) size, style);
+        return NULL;
+    }
+    return curr;
+}
+
 static int
 format_string_parse(struct clog_formatter* self, const char* fmt)
 {
@@ -541,7 +612,7 @@ format_string_parse(struct clog_formatter* self, const char* fmt)
 
         if (curr[0] == '#') {
             if (curr[1] == '{') {
-                struct var_segment* segment;
+                size_t var;
                 /* We've got a variable reference.  Look for the closing "}" */
                 const char* v_end = curr + 2;
                 while (v_end[0] != '}') {
@@ -552,13 +623,13 @@ format_string_parse(struct clog_formatter* self, const char* fmt)
                     }
                     v_end++;
                 }
-                segment = var_segment_new(self, "", 0, curr + 2,
-                                          v_end - curr - 2);
-                value_segment_new(&segment->segments);
+                var = op_var_new(self, curr + 2, v_end - curr - 2);
+                op_new(self, OP_VALUE);
+                op_finish_body(self, var);
                 curr = v_end + 1;
             } else if (curr[1] == '!') {
                 if (curr[2] == '{') {
-                    struct var_segment* segment;
+                    size_t var;
 
                     /* Another variable reference.  Look for the closing "}" */
                     const char* v_end = curr + 3;
@@ -577,33 +648,32 @@ format_string_parse(struct clog_formatter* self, const char* fmt)
                         return -1;
                     }
 
-                    /* Create the variable segment */
-                    segment = var_segment_new(self, "", 0, curr + 3,
-                                              v_end - curr - 3);
+                    /* Create the variable opcode */
+                    var = op_var_new(self, curr + 3, v_end - curr - 3);
 
                     /* Parse the annotation spec */
-                    rip_check(curr = annotation_spec_parse(&segment->segments,
-                                                           v_end + 2));
+                    rip_check(curr = annotation_spec_parse(self, v_end + 2));
+                    op_finish_body(self, var);
                 } else {
                     clog_bad_format("Expected { in #! conversion");
                     return -1;
                 }
             } else if (curr[1] == '*') {
                 if (curr[2] == '{') {
-                    struct multi_segment* segment;
+                    size_t multi;
 
-                    /* Create the multi-variable segment */
-                    segment = multi_segment_new(self, "", 0);
+                    /* Create the multi-variable opcode */
+                    multi = op_new(self, OP_MULTI);
 
                     /* Parse the annotation spec */
-                    rip_check(curr = annotation_spec_parse(&segment->segments,
-                                                           curr + 3));
+                    rip_check(curr = annotation_spec_parse(self, curr + 3));
+                    op_finish_body(self, multi);
                 } else {
                     clog_bad_format("Expected { in #! conversion");
                     return -1;
                 }
             } else if (curr[1] == '#') {
-                raw_segment_new(self, "#", 1);
+                op_raw_new(self, "#", 1);
                 curr += 2;
             } else {
                 /* Unknown "#" conversion */
@@ -612,20 +682,26 @@ format_string_parse(struct clog_formatter* self, const char* fmt)
             }
         } else if (curr[0] == '%') {
             if (curr[1] == '%') {
-                raw_segment_new(self, "%", 1);
+                op_raw_new(self, "%", 1);
                 curr += 2;
             } else if (curr[1] == 'l') {
-                msg_segment_new(self, MSG_LEVEL);
+                op_new(self, OP_LEVEL);
                 curr += 2;
             } else if (curr[1] == 'L') {
-                msg_segment_new(self, MSG_LEVEL_FIXED);
+                op_new(self, OP_LEVEL_FIXED);
                 curr += 2;
             } else if (curr[1] == 'c') {
-                msg_segment_new(self, MSG_CHANNEL);
+                op_new(self, OP_CHANNEL);
                 curr += 2;
             } else if (curr[1] == 'm') {
-                msg_segment_new(self, MSG_MESSAGE);
+                op_new(self, OP_MESSAGE);
                 curr += 2;
+            } else if (curr[1] == 't') {
+                rip_check(curr = time_spec_parse(self, curr + 2));
+            } else if (curr[1] == 'T') {
+                rip_check(curr = thread_spec_parse(self, curr + 2));
+            } else if (curr[1] == 's') {
+                rip_check(curr = source_spec_parse(self, curr + 2));
             } else {
                 /* Unknown "%" conversion */
                 clog_bad_format("Unknown conversion %%%c", curr[1]);
@@ -638,7 +714,7 @@ format_string_parse(struct clog_formatter* self, const char* fmt)
             while (s_end[0] != '\0' && s_end[0] != '#' && s_end[0] != '%') {
                 s_end++;
             }
-            raw_segment_new(self, curr, s_end - curr);
+            op_raw_new(self, curr, s_end - curr);
             curr = s_end;
         }
     }
@@ -654,12 +730,12 @@ format_string_parse(struct clog_formatter* self, const char* fmt)
 void
 clog_formatter_free(struct clog_formatter* self)
 {
-    size_t i;
-    for (i = 0; i < cork_array_size(&self->segments); i++) {
-        struct segment* segment = cork_array_at(&self->segments, i);
-        segment->free(segment);
+    cork_array_done(&self->program);
+    cork_buffer_done(&self->literals);
+    cork_array_done(&self->var_names);
+    if (self->var_index != NULL) {
+        cork_free(self->var_index, self->var_index_size * sizeof(size_t));
     }
-    cork_array_done(&self->segments);
     cork_delete(struct clog_formatter, self);
 }
 
@@ -667,8 +743,14 @@ struct clog_formatter*
 clog_formatter_new(const char* fmt)
 {
     struct clog_formatter* self = cork_new(struct clog_formatter);
-    cork_array_init(&self->segments);
+    cork_array_init(&self->program);
+    cork_buffer_init(&self->literals);
+    cork_array_init(&self->var_names);
+    self->var_index = NULL;
+    self->var_index_size = 0;
+    self->merge_start = 0;
     ei_check(format_string_parse(self, fmt));
+    var_index_build(self);
     return self;
 
 error:
@@ -681,12 +763,107 @@ clog_formatter_format_message(struct clog_formatter* self,
                               struct cork_buffer* dest,
                               struct clog_message* message)
 {
-    size_t i;
+    const struct op* op = cork_array_elements(&self->program);
+    const struct op* end = op + cork_array_size(&self->program);
+    const char* literals = self->literals.buf;
+    size_t var_count = cork_array_size(&self->var_names);
+    struct var_match inline_matches[VAR_MATCHES_INLINE_COUNT];
+    struct var_match* matches = inline_matches;
+    const struct clog_thread_info* thread;
+
+    if (var_count > 0) {
+        if (CORK_UNLIKELY(var_count > VAR_MATCHES_INLINE_COUNT)) {
+            matches = cork_calloc(var_count, sizeof(struct var_match));
+        }
+        var_matches_fill(self, matches, message);
+    }
+
     cork_buffer_clear(dest);
-    for (i = 0; i < cork_array_size(&self->segments); i++) {
-        struct segment* segment = cork_array_at(&self->segments, i);
-        segment->start(segment);
-        segment->message(segment, message);
-        segment->append(segment, dest);
+    for (; op < end; op++) {
+        switch (op->code) {
+            case OP_RAW:
+                cork_buffer_append(dest, literals + op->literal,
+                                   op->literal_size);
+                break;
+
+            case OP_LEVEL:
+                cork_buffer_append_string(dest,
+                                          clog_level_name(message->level));
+                break;
+
+            case OP_LEVEL_FIXED:
+                cork_buffer_append_string(
+                        dest, clog_level_name_fixed_width(message->level));
+                break;
+
+            case OP_CHANNEL:
+                cork_buffer_append_string(dest, message->channel);
+                break;
+
+            case OP_MESSAGE:
+                clog_message_append_message(message, dest);
+                break;
+
+            case OP_TIME_ISO:
+                append_time_iso(dest, message->timestamp);
+                break;
+
+            case OP_TIME_EPOCH_MS:
+                append_uint(dest, message->timestamp / 1000000);
+                break;
+
+            case OP_TIME_OFFSET:
+                append_time_offset(dest, message->timestamp);
+                break;
+
+            case OP_THREAD_ID:
+                thread = clog_message_thread(message);
+                cork_buffer_append(dest, thread->id, thread->id_size);
+                break;
+
+            case OP_THREAD_NAME:
+                thread = clog_message_thread(message);
+                cork_buffer_append(dest, thread->name, thread->name_size);
+                break;
+
+            case OP_SOURCE:
+                append_source(dest, message->site);
+                break;
+
+            case OP_SOURCE_FILE:
+                if (message->site != NULL) {
+                    cork_buffer_append_string(dest, message->site->file);
+                }
+                break;
+
+            case OP_SOURCE_LINE:
+                if (message->site != NULL) {
+                    append_uint(dest, message->site->line);
+                }
+                break;
+
+            case OP_SOURCE_FUNCTION:
+                if (message->site != NULL) {
+                    cork_buffer_append_string(dest, message->site->function);
+                }
+                break;
+
+            case OP_VAR:
+                run_var(op, literals, dest, &matches[op->slot]);
+                op += op->body_size;
+                break;
+
+            case OP_MULTI:
+                run_multi(op, literals, dest, message);
+                op += op->body_size;
+                break;
+
+            default:
+                cork_unreachable();
+        }
+    }
+
+    if (matches != inline_matches) {
+        cork_free(matches, var_count * sizeof(struct var_match));
     }
 }
@@ -0,0 +1,127 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef LIBCLOGGER_INTERNAL_H
+#define LIBCLOGGER_INTERNAL_H
+
+/* Helpers that the handlers share with each other.  None of this is installed
+ * or part of the public API. */
+
+#include <pthread.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/handlers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Per-thread output buffers
+ */
+
+/* The per-thread buffer that the stream handler formats messages into.
+ * Returns NULL if the buffer is already in use, which happens when writing a
+ * message causes another message to be logged from the same thread. */
+struct cork_buffer *
+_clog_thread_buf_claim(void);
+
+void
+_clog_thread_buf_release(struct cork_buffer *buf);
+
+typedef void
+(*clog_thread_buf_write_f)(void *user_data, struct cork_buffer *buf,
+                           struct clog_message *message);
+
+/* Calls write with an empty buffer to render message into: the per-thread
+ * buffer if it's free, or a temporary one if it isn't. */
+void
+_clog_thread_buf_write(void *user_data, struct clog_message *message,
+                       clog_thread_buf_write_f write);
+
+
+/*-----------------------------------------------------------------------
+ * Adaptive lock
+ */
+
+/* The lock that handlers hold while writing to their consumers.  A thread
+ * that finds the lock taken spins for a while, since most messages are
+ * written quickly.  If the lock still isn't free, the thread parks on a
+ * condition variable instead of burning a core while the owner is stuck in a
+ * slow write.
+ *
+ * The lock can be claimed again by the thread that holds it, which happens
+ * when a consumer logs a message that ends up back at the same handler. */
+
+struct clog_stream_lock {
+    volatile cork_thread_id active_thread;
+    volatile int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    /* A running average of how many spins it takes to claim the lock. */
+    volatile unsigned int spin_estimate;
+    /* These are only updated while holding the lock. */
+    struct clog_stream_handler_stats stats;
+};
+
+void
+_clog_stream_lock_init(struct clog_stream_lock *lock);
+
+void
+_clog_stream_lock_done(struct clog_stream_lock *lock);
+
+/* Returns true if we've just claimed the lock; false if we already had it,
+ * in which case the caller must not release it. */
+bool
+_clog_stream_lock_claim(struct clog_stream_lock *lock);
+
+void
+_clog_stream_lock_release(struct clog_stream_lock *lock);
+
+
+/*-----------------------------------------------------------------------
+ * File descriptor output
+ */
+
+/* The batching file descriptor consumer that clog_stream_handler_new_fd uses,
+ * for other handlers that write to file descriptors.  flags are the same as
+ * for clog_stream_handler_new_fd. */
+struct cork_stream_consumer *
+_clog_fd_consumer_new(int fd, unsigned int flags);
+
+int
+_clog_fd_consumer_flush(struct cork_stream_consumer *consumer);
+
+typedef int
+(*clog_consumer_flush_f)(struct cork_stream_consumer *consumer);
+
+/* Passes one message's output to a handler's consumer.  flush is how the
+ * handler writes out whatever its consumer has buffered, or NULL if the
+ * consumer doesn't buffer anything.  Messages at CLOG_LEVEL_ERROR or above
+ * are flushed right away, so that serious problems don't sit in a batch. */
+int
+_clog_consumer_write_message(struct cork_stream_consumer *consumer,
+                             clog_consumer_flush_f flush,
+                             const void *buf, size_t size, bool is_first,
+                             enum clog_level level);
+
+
+/*-----------------------------------------------------------------------
+ * Binary records
+ */
+
+/* Appends a CLOG_BINARY_MESSAGE record holding message's rendered text, for
+ * other handlers that store binary records. */
+void
+_clog_binary_encode_text(struct cork_buffer *buf,
+                         struct clog_message *message);
+
+
+#endif /* LIBCLOGGER_INTERNAL_H */
@@ -0,0 +1,379 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+#include "internal.h"
+
+
+/*-----------------------------------------------------------------------
+ * String escaping
+ */
+
+/* Only quotes, backslashes, and control characters have to be escaped, and
+ * most strings don't have any of them.  So we look for the next byte that
+ * needs escaping, and copy everything before it in a single append.  With
+ * SSE2 or AVX2, we can check 16 or 32 bytes at a time.
+ *
+ * JSON has to be valid UTF-8, but messages can hold anything, so we also stop
+ * at bytes outside of ASCII.  Valid UTF-8 sequences are copied through as-is,
+ * and anything else is replaced with U+FFFD. */
+
+/* Non-zero for each byte that has to be escaped.  For the ones that have a
+ * short escape, this is the character that follows the backslash. */
+static const char  json_escapes[256] = {
+    /* 0x00 - 0x1f */
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    /* 0x20 - 0x5f */
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0
+    /* Everything else is zero */
+};
+
+/* Returns how many bytes at the start of str are ASCII and don't need
+ * escaping. */
+static size_t
+clog_json_clean_prefix(const char* str, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) str;
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    for (; i + 32 <= size; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (bytes + i));
+        /* A byte is a control character if max(byte, 0x1f) == 0x1f. */
+        __m256i dirty = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                            _mm256_cmpeq_epi8(chunk, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+        /* Bytes outside of ASCII have their top bit set. */
+        unsigned int mask = _mm256_movemask_epi8(dirty) |
+                            _mm256_movemask_epi8(chunk);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (bytes + i));
+        /* A byte is a control character if max(byte, 0x1f) == 0x1f. */
+        __m128i dirty = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                         _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        /* Bytes outside of ASCII have their top bit set. */
+        unsigned int mask = _mm_movemask_epi8(dirty) |
+                            _mm_movemask_epi8(chunk);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    /* Whatever's left over (or everything, without SIMD) */
+    for (; i < size; i++) {
+        if (bytes[i] >= 0x80 || json_escapes[bytes[i]] != 0) {
+            return i;
+        }
+    }
+    return size;
+}
+
+/* Returns how many bytes of the UTF-8 sequence at the start of bytes to
+ * consume; the first byte must be outside of ASCII.  If the sequence isn't
+ * valid, this is the longest prefix that could have started a valid one, which
+ * should be replaced with a single U+FFFD. */
+static size_t
+clog_json_utf8_sequence(const uint8_t* bytes, size_t size, bool* valid)
+{
+    uint8_t lead = bytes[0];
+    /* The range of the first continuation byte, which is narrower for some
+     * lead bytes to rule out overlong encodings, surrogates, and values
+     * above U+10FFFF. */
+    uint8_t lower = 0x80;
+    uint8_t upper = 0xbf;
+    size_t length;
+    size_t i;
+
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        length = 2;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        length = 3;
+        if (lead == 0xe0) {
+            lower = 0xa0;
+        } else if (lead == 0xed) {
+            upper = 0x9f;
+        }
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        length = 4;
+        if (lead == 0xf0) {
+            lower = 0x90;
+        } else if (lead == 0xf4) {
+            upper = 0x8f;
+        }
+    } else {
+        *valid = false;
+        return 1;
+    }
+
+    for (i = 1; i < length; i++) {
+        if (i == size || bytes[i] < lower || bytes[i] > upper) {
+            *valid = false;
+            return i;
+        }
+        lower = 0x80;
+        upper = 0xbf;
+    }
+    *valid = true;
+    return length;
+}
+
+static void
+clog_json_append_string(struct cork_buffer* dest, const char* str,
+                        size_t size)
+{
+    static const char  hex_digits[] = "0123456789abcdef";
+    size_t i = 0;
+
+    cork_buffer_append(dest, "\"", 1);
+    while (i < size) {
+        size_t clean = clog_json_clean_prefix(str + i, size - i);
+        char escape[6];
+        uint8_t ch;
+
+        cork_buffer_append(dest, str + i, clean);
+        i += clean;
+        if (i == size) {
+            break;
+        }
+
+        ch = str[i];
+        if (ch >= 0x80) {
+            bool valid;
+            size_t length = clog_json_utf8_sequence
+                ((const uint8_t*) str + i, size - i, &valid);
+            if (valid) {
+                cork_buffer_append(dest, str + i, length);
+            } else {
+                cork_buffer_append(dest, "\xef\xbf\xbd", 3);
+            }
+            i += length;
+            continue;
+        }
+
+        i++;
+        escape[0] = '\\';
+        escape[1] = json_escapes[ch];
+        if (escape[1] == 'u') {
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = hex_digits[ch >> 4];
+            escape[5] = hex_digits[ch & 0xf];
+            cork_buffer_append(dest, escape, 6);
+        } else {
+            cork_buffer_append(dest, escape, 2);
+        }
+    }
+    cork_buffer_append(dest, "\"", 1);
+}
+
+/* Typed values are written as JSON numbers and booleans where possible.
+ * Durations are written as an integer number of nanoseconds.  JSON can't
+ * represent infinities or NaNs, so those are written as null. */
+static void
+clog_json_append_field_value(struct cork_buffer* dest,
+                             const struct clog_message_field* field)
+{
+    char buf[CLOG_FIELD_MAX_SIZE];
+    size_t size;
+
+    switch (field->type) {
+        case CLOG_FIELD_STRING:
+            clog_json_append_string(dest, field->value, strlen(field->value));
+            return;
+        case CLOG_FIELD_DOUBLE:
+            if (!isfinite(field->raw.d)) {
+                cork_buffer_append(dest, "null", 4);
+                return;
+            }
+            size = _clog_field_render_raw(buf, field->type, field->raw);
+            break;
+        case CLOG_FIELD_DURATION:
+            size = _clog_field_render_raw(buf, CLOG_FIELD_INT, field->raw);
+            break;
+        case CLOG_FIELD_PTR:
+            size = _clog_field_render_raw(buf, field->type, field->raw);
+            clog_json_append_string(dest, buf, size);
+            return;
+        default:
+            size = _clog_field_render_raw(buf, field->type, field->raw);
+            break;
+    }
+    cork_buffer_append(dest, buf, size);
+}
+
+static void
+clog_json_encode_message(struct cork_buffer* dest,
+                         struct clog_message* message)
+{
+    const struct clog_message_field* field;
+    const char* level = clog_level_name(message->level);
+    const char* text = clog_message_message(message);
+
+    cork_buffer_append(dest, "{\"level\":", 9);
+    clog_json_append_string(dest, level, strlen(level));
+    cork_buffer_append(dest, ",\"channel\":", 11);
+    clog_json_append_string(dest, message->channel, strlen(message->channel));
+    cork_buffer_append(dest, ",\"message\":", 11);
+    clog_json_append_string(dest, text, message->text_size);
+
+    /* Fields go in their own object, in the order they were added, so that
+     * they can't clash with the keys above. */
+    if (message->fields.tail != NULL) {
+        cork_buffer_append(dest, ",\"fields\":{", 11);
+        for (field = message->fields.tail; field != NULL;
+             field = field->prev) {
+            clog_json_append_string(dest, field->key, strlen(field->key));
+            cork_buffer_append(dest, ":", 1);
+            clog_json_append_field_value(dest, field);
+            if (field->prev != NULL) {
+                cork_buffer_append(dest, ",", 1);
+            }
+        }
+        cork_buffer_append(dest, "}", 1);
+    }
+    cork_buffer_append(dest, "}\n", 2);
+}
+
+
+/*-----------------------------------------------------------------------
+ * JSON handler
+ */
+
+struct clog_json_handler {
+    struct clog_handler parent;
+    struct cork_stream_consumer* consumer;
+    /* Writes out anything that the consumer has buffered up.  NULL if the
+     * consumer doesn't buffer anything itself. */
+    clog_consumer_flush_f flush;
+    struct clog_stream_lock lock;
+    bool first_chunk;
+};
+
+static void
+clog_json_handler_write(void* user_data, struct cork_buffer* buf,
+                        struct clog_message* message)
+{
+    struct clog_json_handler* self = user_data;
+    bool claimed;
+
+    clog_json_encode_message(buf, message);
+    /* If the consumer logs something to this same handler, we'll already
+     * hold the lock, and must leave it held for our caller. */
+    claimed = _clog_stream_lock_claim(&self->lock);
+    _clog_consumer_write_message(self->consumer, self->flush, buf->buf,
+                                 buf->size, self->first_chunk, message->level);
+    self->first_chunk = false;
+    if (claimed) {
+        _clog_stream_lock_release(&self->lock);
+    }
+}
+
+static void
+clog_json_handler_handle(struct clog_handler* handler,
+                         struct clog_message* message)
+{
+    struct clog_json_handler* self =
+            cork_container_of(handler, struct clog_json_handler, parent);
+    /* Encode into the same per-thread buffer that the stream handler uses,
+     * so that we only hold the lock while writing. */
+    _clog_thread_buf_write(self, message, clog_json_handler_write);
+    if (handler->next != NULL) {
+        clog_handler_handle(handler->next, message);
+    }
+}
+
+static void
+clog_json_handler_free(struct clog_handler* handler)
+{
+    struct clog_json_handler* self =
+            cork_container_of(handler, struct clog_json_handler, parent);
+    cork_stream_consumer_free(self->consumer);
+    _clog_stream_lock_done(&self->lock);
+    cork_delete(struct clog_json_handler, self);
+}
+
+struct clog_handler*
+clog_json_handler_new_consumer(struct cork_stream_consumer* consumer)
+{
+    struct clog_json_handler* self = cork_new(struct clog_json_handler);
+    self->parent.handle = clog_json_handler_handle;
+    self->parent.free = clog_json_handler_free;
+    self->parent.next = NULL;
+    self->consumer = consumer;
+    self->flush = NULL;
+    _clog_stream_lock_init(&self->lock);
+    self->first_chunk = true;
+    return &self->parent;
+}
+
+struct clog_handler*
+clog_json_handler_new_fd(int fd, unsigned int flags)
+{
+    struct clog_handler* handler =
+        clog_json_handler_new_consumer(_clog_fd_consumer_new(fd, flags));
+    struct clog_json_handler* self =
+            cork_container_of(handler, struct clog_json_handler, parent);
+    self->flush = _clog_fd_consumer_flush;
+    return handler;
+}
+
+int
+clog_json_handler_flush(struct clog_handler* handler)
+{
+    struct clog_json_handler* self =
+            cork_container_of(handler, struct clog_json_handler, parent);
+    bool claimed;
+    int rc = 0;
+
+    if (self->flush == NULL) {
+        return 0;
+    }
+    claimed = _clog_stream_lock_claim(&self->lock);
+    rc = self->flush(self->consumer);
+    if (claimed) {
+        _clog_stream_lock_release(&self->lock);
+    }
+    return rc;
+}
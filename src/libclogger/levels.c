@@ -8,7 +8,18 @@
  * ----------------------------------------------------------------------
  */
 
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
 #include "clogger/api.h"
+#include "clogger/error.h"
 
 
 const char *
@@ -60,3 +71,407 @@ clog_level_name_fixed_width(enum clog_level level)
             return "unknown ";
     }
 }
+
+
+/*-----------------------------------------------------------------------
+ * Minimum levels
+ */
+
+/* Call sites whose channel isn't known at compile time look up their
+ * channel's level every time they run, so lookups don't take any locks.
+ *
+ * Each channel that has ever had its own level gets an entry, which is never
+ * freed; clearing a channel's level just marks its entry as unset.  The
+ * entries are found with an open-addressed hash table.  Writers only ever
+ * fill in an empty slot, or replace the whole table with a larger copy, so a
+ * reader always sees a consistent table.  A replaced table is kept around,
+ * since a reader might still be using it; all of them put together are no
+ * bigger than the current one.
+ *
+ * Writers hold channel_levels_mutex, which also protects the list of
+ * registered call sites. */
+
+#define CLOG_CHANNEL_LEVEL_UNSET  (-1)
+#define CLOG_CHANNEL_TABLE_MIN_SIZE  16
+
+struct clog_channel_level {
+    char* channel;
+    cork_hash hash;
+    /* A clog_level, or CLOG_CHANNEL_LEVEL_UNSET */
+    int level;
+};
+
+struct clog_channel_table {
+    size_t mask;
+    size_t count;
+    struct clog_channel_table* replaced;
+    struct clog_channel_level* slots[];
+};
+
+/* The call sites from one executable or shared library. */
+struct clog_call_site_module {
+    struct clog_call_site* start;
+    struct clog_call_site* stop;
+    struct clog_call_site_module* next;
+};
+
+enum clog_level _clog_minimum_level = CLOG_LEVEL_WARNING;
+
+static pthread_mutex_t channel_levels_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct clog_channel_table* channel_table = NULL;
+/* Modules are never removed, so this list can be walked without holding the
+ * mutex. */
+static struct clog_call_site_module* volatile call_site_modules = NULL;
+
+static struct clog_channel_level*
+clog_channel_level_find(struct clog_channel_table* table, const char* channel,
+                        cork_hash hash)
+{
+    struct clog_channel_level* entry;
+    size_t i;
+    if (table == NULL) {
+        return NULL;
+    }
+    /* The table is never more than half full, so there's always an empty
+     * slot to stop at. */
+    for (i = hash & table->mask;
+         (entry = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE)) != NULL;
+         i = (i + 1) & table->mask) {
+        if (entry->hash == hash && strcmp(entry->channel, channel) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static enum clog_level
+clog_channel_level_get(const char* channel)
+{
+    struct clog_channel_table* table =
+        __atomic_load_n(&channel_table, __ATOMIC_ACQUIRE);
+    cork_hash hash = cork_hash_buffer(0, channel, strlen(channel));
+    struct clog_channel_level* entry =
+        clog_channel_level_find(table, channel, hash);
+    if (entry != NULL) {
+        int level = __atomic_load_n(&entry->level, __ATOMIC_RELAXED);
+        if (level != CLOG_CHANNEL_LEVEL_UNSET) {
+            return level;
+        }
+    }
+    return __atomic_load_n(&_clog_minimum_level, __ATOMIC_RELAXED);
+}
+
+static void
+clog_channel_table_put(struct clog_channel_table* table,
+                       struct clog_channel_level* entry)
+{
+    size_t i = entry->hash & table->mask;
+    while (table->slots[i] != NULL) {
+        i = (i + 1) & table->mask;
+    }
+    /* Readers that find the entry must see it fully initialized. */
+    __atomic_store_n(&table->slots[i], entry, __ATOMIC_RELEASE);
+    table->count++;
+}
+
+/* Must be called while holding channel_levels_mutex. */
+static struct clog_channel_level*
+clog_channel_level_add(const char* channel, cork_hash hash)
+{
+    struct clog_channel_table* table = channel_table;
+    struct clog_channel_level* entry;
+    size_t channel_size;
+
+    if (table == NULL || (table->count + 1) * 2 > table->mask + 1) {
+        size_t size = (table == NULL) ?
+            CLOG_CHANNEL_TABLE_MIN_SIZE : (table->mask + 1) * 2;
+        size_t i;
+        struct clog_channel_table* bigger =
+            cork_calloc(1, sizeof(struct clog_channel_table) +
+                           size * sizeof(struct clog_channel_level*));
+        bigger->mask = size - 1;
+        bigger->replaced = table;
+        if (table != NULL) {
+            for (i = 0; i <= table->mask; i++) {
+                if (table->slots[i] != NULL) {
+                    clog_channel_table_put(bigger, table->slots[i]);
+                }
+            }
+        }
+        __atomic_store_n(&channel_table, bigger, __ATOMIC_RELEASE);
+        table = bigger;
+    }
+
+    entry = cork_new(struct clog_channel_level);
+    channel_size = strlen(channel) + 1;
+    entry->channel = cork_malloc(channel_size);
+    memcpy(entry->channel, channel, channel_size);
+    entry->hash = hash;
+    entry->level = CLOG_CHANNEL_LEVEL_UNSET;
+    clog_channel_table_put(table, entry);
+    return entry;
+}
+
+/* Must be called while holding channel_levels_mutex. */
+static void
+clog_call_site_update(struct clog_call_site* site)
+{
+    switch (site->override) {
+        case CLOG_CALL_SITE_FORCE_ON:
+            site->enabled = CLOG_CALL_SITE_ENABLED;
+            return;
+        case CLOG_CALL_SITE_FORCE_OFF:
+            site->enabled = CLOG_CALL_SITE_DISABLED;
+            return;
+        default:
+            break;
+    }
+
+    if (site->level < 0 || site->channel == NULL) {
+        site->enabled = CLOG_CALL_SITE_DYNAMIC;
+    } else if (site->level <= (int) clog_channel_level_get(site->channel)) {
+        site->enabled = CLOG_CALL_SITE_ENABLED;
+    } else {
+        site->enabled = CLOG_CALL_SITE_DISABLED;
+    }
+}
+
+/* Must be called while holding channel_levels_mutex. */
+static void
+clog_call_sites_update(void)
+{
+    struct clog_call_site_module* module;
+    struct clog_call_site* site;
+    for (module = call_site_modules; module != NULL; module = module->next) {
+        for (site = module->start; site < module->stop; site++) {
+            clog_call_site_update(site);
+        }
+    }
+}
+
+void
+clog_set_minimum_level(enum clog_level level)
+{
+    pthread_mutex_lock(&channel_levels_mutex);
+    __atomic_store_n(&_clog_minimum_level, level, __ATOMIC_RELAXED);
+    clog_call_sites_update();
+    pthread_mutex_unlock(&channel_levels_mutex);
+}
+
+void
+clog_set_channel_level(const char* channel, enum clog_level level)
+{
+    cork_hash hash = cork_hash_buffer(0, channel, strlen(channel));
+    struct clog_channel_level* entry;
+    pthread_mutex_lock(&channel_levels_mutex);
+    entry = clog_channel_level_find(channel_table, channel, hash);
+    if (entry == NULL) {
+        entry = clog_channel_level_add(channel, hash);
+    }
+    __atomic_store_n(&entry->level, (int) level, __ATOMIC_RELAXED);
+    clog_call_sites_update();
+    pthread_mutex_unlock(&channel_levels_mutex);
+}
+
+void
+clog_clear_channel_levels(void)
+{
+    size_t i;
+    pthread_mutex_lock(&channel_levels_mutex);
+    if (channel_table != NULL) {
+        for (i = 0; i <= channel_table->mask; i++) {
+            struct clog_channel_level* entry = channel_table->slots[i];
+            if (entry != NULL) {
+                __atomic_store_n(&entry->level, CLOG_CHANNEL_LEVEL_UNSET,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+    }
+    clog_call_sites_update();
+    pthread_mutex_unlock(&channel_levels_mutex);
+}
+
+enum clog_level
+clog_channel_level(const char* channel)
+{
+    return clog_channel_level_get(channel);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Call sites
+ */
+
+/* Every statement that CLOG_COMPILE_MIN_LEVEL removes points at this
+ * descriptor.  It isn't in any module's call site section, so it's never
+ * registered, and stays disabled. */
+struct clog_call_site  _clog_compiled_out_call_site = {
+    CLOG_CALL_SITE_DISABLED, CLOG_CALL_SITE_DEFAULT, -1, NULL, "", 0, "", NULL
+};
+
+void
+_clog_call_sites_register(struct clog_call_site* start,
+                          struct clog_call_site* stop)
+{
+    struct clog_call_site_module* module;
+    struct clog_call_site* site;
+
+    if (start == stop) {
+        return;
+    }
+
+    pthread_mutex_lock(&channel_levels_mutex);
+    for (module = call_site_modules; module != NULL; module = module->next) {
+        if (module->start == start) {
+            pthread_mutex_unlock(&channel_levels_mutex);
+            return;
+        }
+    }
+
+    /* This might run before main, when the program hasn't had a chance to
+     * install a custom allocator yet, and the module is never unregistered;
+     * so we use the system allocator here. */
+    module = malloc(sizeof(struct clog_call_site_module));
+    assert(module != NULL);
+    module->start = start;
+    module->stop = stop;
+    for (site = start; site < stop; site++) {
+        clog_call_site_update(site);
+    }
+    /* The compare-and-swap acts as a barrier, so that readers that aren't
+     * holding the mutex see a fully initialized module. */
+    module->next = call_site_modules;
+    (void) cork_ptr_cas(&call_site_modules, module->next, module);
+    pthread_mutex_unlock(&channel_levels_mutex);
+}
+
+void
+clog_call_site_set_override(struct clog_call_site* site,
+                            enum clog_call_site_override override)
+{
+    pthread_mutex_lock(&channel_levels_mutex);
+    site->override = override;
+    clog_call_site_update(site);
+    pthread_mutex_unlock(&channel_levels_mutex);
+}
+
+struct clog_call_site*
+clog_call_site_find(const char* file, unsigned int line)
+{
+    struct clog_call_site_module* module;
+    struct clog_call_site* site;
+    for (module = call_site_modules; module != NULL; module = module->next) {
+        for (site = module->start; site < module->stop; site++) {
+            if (site->line == line && strcmp(site->file, file) == 0) {
+                return site;
+            }
+        }
+    }
+    return NULL;
+}
+
+void
+clog_call_sites_visit(void* user_data, clog_call_site_visit_f visit)
+{
+    struct clog_call_site_module* module;
+    struct clog_call_site* site;
+    for (module = call_site_modules; module != NULL; module = module->next) {
+        for (site = module->start; site < module->stop; site++) {
+            visit(user_data, site);
+        }
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Dynamic call sites
+ */
+
+/* A call site whose level or channel isn't a compile-time constant can't be
+ * resolved ahead of time, so it looks up its channel's level each time it
+ * runs.  That lookup doesn't take any locks. */
+
+bool
+_clog_call_site_resolve(struct clog_call_site* site, const char* channel,
+                        enum clog_level level)
+{
+    switch (site->override) {
+        case CLOG_CALL_SITE_FORCE_ON:
+            return true;
+        case CLOG_CALL_SITE_FORCE_OFF:
+            return false;
+        default:
+            return level <= clog_channel_level_get(channel);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Parsing levels
+ */
+
+static int
+clog_parse_level(const char* str, size_t size, enum clog_level* level)
+{
+#define test_level(what) \
+    if (size == sizeof(#what) - 1 && strncasecmp(str, #what, size) == 0) { \
+        *level = CLOG_LEVEL_##what; \
+        return 0; \
+    }
+
+    test_level(NONE);
+    test_level(CRITICAL);
+    test_level(ERROR);
+    test_level(WARNING);
+    test_level(NOTICE);
+    test_level(INFO);
+    test_level(DEBUG);
+    test_level(TRACE);
+#undef test_level
+
+    clog_bad_config("Unknown CLOG level %.*s", (int) size, str);
+    return -1;
+}
+
+int
+clog_set_levels(const char* spec)
+{
+    struct cork_buffer channel = CORK_BUFFER_INIT();
+    const char* curr = spec;
+
+    while (true) {
+        const char* end = strchr(curr, ',');
+        const char* equals;
+        enum clog_level level;
+        if (end == NULL) {
+            end = curr + strlen(curr);
+        }
+
+        equals = memchr(curr, '=', end - curr);
+        if (equals == NULL) {
+            ei_check(clog_parse_level(curr, end - curr, &level));
+            clog_set_minimum_level(level);
+        } else {
+            if (equals == curr) {
+                clog_bad_config("Missing channel name in CLOG level %.*s",
+                                (int) (end - curr), curr);
+                goto error;
+            }
+            ei_check(clog_parse_level(equals + 1, end - equals - 1, &level));
+            cork_buffer_set(&channel, curr, equals - curr);
+            clog_set_channel_level(channel.buf, level);
+        }
+
+        if (*end == '\0') {
+            break;
+        }
+        curr = end + 1;
+    }
+
+    cork_buffer_done(&channel);
+    return 0;
+
+error:
+    cork_buffer_done(&channel);
+    return -1;
+}
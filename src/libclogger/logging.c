@@ -7,7 +7,9 @@
  * ----------------------------------------------------------------------
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <libcork/core.h>
 #include <libcork/os.h>
@@ -20,7 +22,8 @@
 
 
 static const char  *default_format = CLOG_DEFAULT_FORMAT;
-static struct clog_handler  *stderr_handler = NULL;
+static struct clog_handler  *output_handler = NULL;
+static struct clog_async_handler  *async_handler = NULL;
 static struct clog_handler  *filter_handler = NULL;
 
 void
@@ -38,42 +41,127 @@ clog_teardown_logging(void)
         clog_handler_free(filter_handler);
     }
 
-    clog_handler_pop_process(stderr_handler);
-    clog_handler_free(stderr_handler);
+    if (async_handler != NULL) {
+        /* This waits for any queued messages to be written out. */
+        clog_handler_pop_process(clog_async_handler_handler(async_handler));
+        clog_async_handler_free(async_handler);
+        async_handler = NULL;
+        return;
+    }
+
+    clog_handler_pop_process(output_handler);
+    clog_handler_free(output_handler);
 }
 
-int
-clog_setup_logging(void)
+static int
+clog_setup_async(const char *capacity_str)
 {
     const char  *value;
-    const char  *fmt;
+    char  *end;
+    unsigned long  capacity = strtoul(capacity_str, &end, 10);
+    enum clog_async_overflow  overflow = CLOG_ASYNC_BLOCK;
 
-#define test_level(what) \
-    if (strcasecmp(value, #what) == 0) { \
-        clog_set_minimum_level(CLOG_LEVEL_##what); \
+    if (*capacity_str == '\0' || *end != '\0' || capacity == 0) {
+        clog_bad_config("Invalid CLOG_ASYNC queue size %s", capacity_str);
+        return -1;
     }
 
-    value = cork_env_get(NULL, "CLOG");
+    value = cork_env_get(NULL, "CLOG_ASYNC_OVERFLOW");
     if (value != NULL) {
-        test_level(NONE)
-        else test_level(CRITICAL)
-        else test_level(ERROR)
-        else test_level(WARNING)
-        else test_level(NOTICE)
-        else test_level(INFO)
-        else test_level(DEBUG)
-        else test_level(TRACE)
-        else {
-            clog_bad_config("Unknown CLOG level %s", value);
+        if (strcasecmp(value, "block") == 0) {
+            overflow = CLOG_ASYNC_BLOCK;
+        } else if (strcasecmp(value, "drop-newest") == 0) {
+            overflow = CLOG_ASYNC_DROP_NEWEST;
+        } else if (strcasecmp(value, "drop-oldest") == 0) {
+            overflow = CLOG_ASYNC_DROP_OLDEST;
+        } else {
+            clog_bad_config("Unknown CLOG_ASYNC_OVERFLOW policy %s", value);
             return -1;
         }
     }
 
+    rip_check(async_handler = clog_async_handler_new(output_handler, capacity));
+    clog_async_handler_set_overflow(async_handler, overflow);
+    return 0;
+}
+
+static bool
+clog_binary_requested(void)
+{
+    const char  *value = cork_env_get(NULL, "CLOG_BINARY");
+    return value != NULL && strcmp(value, "") != 0 && strcmp(value, "0") != 0;
+}
+
+static bool
+clog_json_requested(void)
+{
+    const char  *value = cork_env_get(NULL, "CLOG_JSON");
+    return value != NULL && strcmp(value, "") != 0 && strcmp(value, "0") != 0;
+}
+
+static int
+clog_setup_file(const char *path, const char *fmt)
+{
+    const char  *settings;
+
+    if (clog_binary_requested()) {
+        clog_bad_config("CLOG_BINARY can't be used with CLOG_FILE");
+        return -1;
+    }
+    if (clog_json_requested()) {
+        clog_bad_config("CLOG_JSON can't be used with CLOG_FILE");
+        return -1;
+    }
+
+    rip_check(output_handler = clog_rotating_file_handler_new(path, fmt));
+    settings = cork_env_get(NULL, "CLOG_ROTATE");
+    if (settings != NULL &&
+        clog_rotating_file_handler_configure(output_handler, settings) != 0) {
+        clog_handler_free(output_handler);
+        return -1;
+    }
+    return 0;
+}
+
+int
+clog_setup_logging(void)
+{
+    const char  *value;
+    const char  *fmt;
+
+    value = cork_env_get(NULL, "CLOG");
+    if (value != NULL) {
+        rii_check(clog_set_levels(value));
+    }
+
     value = cork_env_get(NULL, "CLOG_FORMAT");
     fmt = (value == NULL)? default_format: value;
 
-    rip_check(stderr_handler = clog_stderr_handler_new(fmt));
-    clog_handler_push_process(stderr_handler);
+    value = cork_env_get(NULL, "CLOG_FILE");
+    if (value != NULL) {
+        rii_check(clog_setup_file(value, fmt));
+    } else if (clog_binary_requested() && clog_json_requested()) {
+        clog_bad_config("CLOG_BINARY can't be used with CLOG_JSON");
+        return -1;
+    } else if (clog_binary_requested()) {
+        rip_check(output_handler =
+                  clog_binary_handler_new_fd(STDERR_FILENO, 0));
+    } else if (clog_json_requested()) {
+        rip_check(output_handler = clog_json_handler_new_fd(STDERR_FILENO, 0));
+    } else {
+        rip_check(output_handler = clog_stderr_handler_new(fmt));
+    }
+
+    value = cork_env_get(NULL, "CLOG_ASYNC");
+    if (value != NULL) {
+        if (clog_setup_async(value) != 0) {
+            clog_handler_free(output_handler);
+            return -1;
+        }
+        clog_handler_push_process(clog_async_handler_handler(async_handler));
+    } else {
+        clog_handler_push_process(output_handler);
+    }
 
     value = cork_env_get(NULL, "CLOG_CHANNELS");
     if (value != NULL) {
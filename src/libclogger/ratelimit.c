@@ -0,0 +1,339 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Buckets
+ */
+
+/* Each (channel, format string) pair gets its own token bucket.  We use the
+ * "generic cell rate algorithm" form of a token bucket, which only needs a
+ * single word of state: the time at which the bucket would be full again if
+ * no more messages arrived.  Each message that we let through pushes that
+ * time back by one interval; if it's more than a burst's worth of intervals
+ * in the future, the bucket is empty and we drop the message.  That means
+ * that checking a bucket is a single CAS, and never needs a lock.
+ *
+ * Buckets live in a fixed-size open-addressing table.  We only look at the
+ * message's channel name and format string pointer, so that a dropped message
+ * is never rendered.  Channels are hashed and compared by their contents,
+ * since channel names are often built at runtime, and the same channel can
+ * then show up at many different addresses.  Format strings are only used if
+ * they're string literals, since other formats might have different contents
+ * the next time we see the same address; messages whose format isn't a
+ * literal share a bucket with the rest of their channel.  If the table fills
+ * up, any new pairs share a single overflow bucket. */
+
+#define CLOG_RATE_BUCKET_COUNT  256
+
+enum clog_rate_bucket_state {
+    CLOG_RATE_BUCKET_EMPTY = 0,
+    CLOG_RATE_BUCKET_CLAIMING,
+    CLOG_RATE_BUCKET_READY
+};
+
+struct clog_rate_bucket {
+    volatile unsigned int state;
+    /* Our own copy of the channel name */
+    const char* channel;
+    const char* fmt;
+    /* In microseconds */
+    volatile uint64_t full_at;
+    volatile size_t suppressed;
+};
+
+struct clog_rate_limit_handler {
+    struct clog_handler parent;
+    /* In microseconds */
+    uint64_t interval;
+    uint64_t tolerance;
+    uint64_t summary_interval;
+    volatile uint64_t next_summary;
+    volatile size_t suppressed;
+    struct clog_rate_bucket overflow;
+    struct clog_rate_bucket buckets[CLOG_RATE_BUCKET_COUNT];
+};
+
+static uint64_t
+clog_rate_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static size_t
+clog_rate_hash(const char* channel, const char* fmt)
+{
+    uintptr_t hash = (uintptr_t) cork_hash_buffer(0, channel, strlen(channel));
+    hash = hash * 31 + (uintptr_t) fmt;
+    /* Pointers are aligned, so mix the high bits into the low ones. */
+    hash ^= hash >> 17;
+    hash *= 0x9e3779b1;
+    hash ^= hash >> 15;
+    return hash % CLOG_RATE_BUCKET_COUNT;
+}
+
+static bool
+clog_rate_bucket_matches(const struct clog_rate_bucket* bucket,
+                         const char* channel, const char* fmt)
+{
+    return bucket->fmt == fmt && strcmp(bucket->channel, channel) == 0;
+}
+
+static struct clog_rate_bucket*
+clog_rate_limit_find_bucket(struct clog_rate_limit_handler* self,
+                            const char* channel, const char* fmt)
+{
+    size_t start = clog_rate_hash(channel, fmt);
+    size_t i;
+
+    for (i = 0; i < CLOG_RATE_BUCKET_COUNT; i++) {
+        struct clog_rate_bucket* bucket =
+            &self->buckets[(start + i) % CLOG_RATE_BUCKET_COUNT];
+        /* Pairs with the release below, so that if we see that a bucket is
+         * ready, we also see its key. */
+        unsigned int state = __atomic_load_n(&bucket->state, __ATOMIC_ACQUIRE);
+
+        if (state == CLOG_RATE_BUCKET_EMPTY) {
+            state = cork_uint_cas(&bucket->state, CLOG_RATE_BUCKET_EMPTY,
+                                  CLOG_RATE_BUCKET_CLAIMING);
+            if (state == CLOG_RATE_BUCKET_EMPTY) {
+                bucket->channel = cork_strdup(channel);
+                bucket->fmt = fmt;
+                __atomic_store_n(&bucket->state, CLOG_RATE_BUCKET_READY,
+                                 __ATOMIC_RELEASE);
+                return bucket;
+            }
+        }
+
+        /* Someone else is claiming this bucket; they'll be done in a
+         * moment. */
+        while (state == CLOG_RATE_BUCKET_CLAIMING) {
+            cork_pause();
+            state = __atomic_load_n(&bucket->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (clog_rate_bucket_matches(bucket, channel, fmt)) {
+            return bucket;
+        }
+    }
+
+    return &self->overflow;
+}
+
+/* Returns whether there's a token for a message arriving at now. */
+static bool
+clog_rate_bucket_take(struct clog_rate_limit_handler* self,
+                      struct clog_rate_bucket* bucket, uint64_t now)
+{
+    uint64_t full_at = bucket->full_at;
+    while (true) {
+        uint64_t start = (full_at > now) ? full_at : now;
+        uint64_t actual;
+        if (start - now > self->tolerance) {
+            return false;
+        }
+        actual = __sync_val_compare_and_swap
+            (&bucket->full_at, full_at, start + self->interval);
+        if (actual == full_at) {
+            return true;
+        }
+        full_at = actual;
+    }
+}
+
+static size_t
+clog_rate_bucket_take_suppressed(struct clog_rate_bucket* bucket)
+{
+    size_t count = bucket->suppressed;
+    while (count > 0) {
+        size_t actual = cork_size_cas(&bucket->suppressed, count, 0);
+        if (actual == count) {
+            break;
+        }
+        count = actual;
+    }
+    return count;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Summaries
+ */
+
+static void
+clog_rate_limit_report_bucket(struct clog_rate_limit_handler* self,
+                              struct clog_rate_bucket* bucket)
+{
+    struct clog_message message;
+    struct clog_string_field suppressed_field;
+    struct clog_string_field format_field;
+    char suppressed[32];
+    char text[128];
+    size_t count = clog_rate_bucket_take_suppressed(bucket);
+
+    if (count == 0) {
+        return;
+    }
+    if (self->parent.next == NULL) {
+        return;
+    }
+
+    snprintf(suppressed, sizeof(suppressed), "%zu", count);
+    snprintf(text, sizeof(text), "Rate limit suppressed %zu message%s",
+             count, (count == 1) ? "" : "s");
+    clog_message_init(&message, CLOG_LEVEL_WARNING,
+                      (bucket->channel == NULL) ? "clogger" : bucket->channel);
+    message.text = text;
+    message.text_size = strlen(text);
+    clog_message_add_string_field
+        (&message.fields, &suppressed_field, "suppressed", suppressed);
+    if (bucket->fmt != NULL) {
+        clog_message_add_string_field
+            (&message.fields, &format_field, "format", bucket->fmt);
+    }
+    clog_handler_handle(self->parent.next, &message);
+    clog_message_done(&message);
+}
+
+static void
+clog_rate_limit_report(struct clog_rate_limit_handler* self)
+{
+    size_t i;
+    for (i = 0; i < CLOG_RATE_BUCKET_COUNT; i++) {
+        struct clog_rate_bucket* bucket = &self->buckets[i];
+        if (__atomic_load_n(&bucket->state, __ATOMIC_ACQUIRE) ==
+            CLOG_RATE_BUCKET_READY) {
+            clog_rate_limit_report_bucket(self, bucket);
+        }
+    }
+    clog_rate_limit_report_bucket(self, &self->overflow);
+}
+
+/* Only one thread gets to send each summary. */
+static void
+clog_rate_limit_maybe_report(struct clog_rate_limit_handler* self,
+                             uint64_t now)
+{
+    uint64_t next_summary = self->next_summary;
+    if (CORK_LIKELY(now < next_summary)) {
+        return;
+    }
+    if (__sync_val_compare_and_swap(&self->next_summary, next_summary,
+                                    now + self->summary_interval) ==
+        next_summary) {
+        clog_rate_limit_report(self);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Rate-limiting handler
+ */
+
+static void
+clog_rate_limit_handler_handle(struct clog_handler* handler,
+                               struct clog_message* message)
+{
+    struct clog_rate_limit_handler* self =
+            cork_container_of(handler, struct clog_rate_limit_handler, parent);
+    const char* fmt =
+        (message->text == NULL && message->static_fmt) ? message->fmt : NULL;
+    struct clog_rate_bucket* bucket =
+        clog_rate_limit_find_bucket(self, message->channel, fmt);
+    uint64_t now = clog_rate_now();
+
+    if (CORK_LIKELY(clog_rate_bucket_take(self, bucket, now))) {
+        clog_rate_limit_maybe_report(self, now);
+        if (handler->next != NULL) {
+            clog_handler_handle(handler->next, message);
+        }
+    } else {
+        cork_size_atomic_add(&bucket->suppressed, 1);
+        cork_size_atomic_add(&self->suppressed, 1);
+        clog_rate_limit_maybe_report(self, now);
+    }
+}
+
+static void
+clog_rate_limit_handler_free(struct clog_handler* handler)
+{
+    struct clog_rate_limit_handler* self =
+            cork_container_of(handler, struct clog_rate_limit_handler, parent);
+    size_t i;
+    for (i = 0; i < CLOG_RATE_BUCKET_COUNT; i++) {
+        if (self->buckets[i].channel != NULL) {
+            cork_strfree(self->buckets[i].channel);
+        }
+    }
+    cork_delete(struct clog_rate_limit_handler, self);
+}
+
+struct clog_handler*
+clog_rate_limit_handler_new(unsigned int per_second, unsigned int burst)
+{
+    struct clog_rate_limit_handler* self;
+    assert(per_second > 0);
+    assert(burst > 0);
+    self = cork_new(struct clog_rate_limit_handler);
+    memset(self, 0, sizeof(struct clog_rate_limit_handler));
+    self->parent.handle = clog_rate_limit_handler_handle;
+    self->parent.free = clog_rate_limit_handler_free;
+    self->interval = 1000000 / per_second;
+    if (self->interval == 0) {
+        self->interval = 1;
+    }
+    self->tolerance = self->interval * (burst - 1);
+    self->summary_interval =
+        (uint64_t) CLOG_RATE_LIMIT_DEFAULT_SUMMARY_INTERVAL * 1000000;
+    self->next_summary = clog_rate_now() + self->summary_interval;
+    self->suppressed = 0;
+    self->overflow.state = CLOG_RATE_BUCKET_READY;
+    return &self->parent;
+}
+
+void
+clog_rate_limit_handler_set_summary_interval(struct clog_handler* handler,
+                                             unsigned int seconds)
+{
+    struct clog_rate_limit_handler* self =
+            cork_container_of(handler, struct clog_rate_limit_handler, parent);
+    self->summary_interval = (uint64_t) seconds * 1000000;
+    self->next_summary = clog_rate_now() + self->summary_interval;
+}
+
+void
+clog_rate_limit_handler_report(struct clog_handler* handler)
+{
+    struct clog_rate_limit_handler* self =
+            cork_container_of(handler, struct clog_rate_limit_handler, parent);
+    clog_rate_limit_report(self);
+}
+
+size_t
+clog_rate_limit_handler_suppressed(const struct clog_handler* handler)
+{
+    const struct clog_rate_limit_handler* self = cork_container_of
+        (handler, struct clog_rate_limit_handler, parent);
+    return self->suppressed;
+}
@@ -0,0 +1,366 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "clogger/api.h"
+#include "clogger/error.h"
+#include "clogger/handlers.h"
+#include "internal.h"
+
+
+/*-----------------------------------------------------------------------
+ * Ring files
+ */
+
+/* A ring file starts with a fixed-size header, followed by the ring itself.
+ * Positions in the ring are "logical" offsets that only ever increase; a
+ * record at logical position pos lives at (pos & mask) in the ring, wrapping
+ * around to the start if it runs off the end.
+ *
+ * Each record is aligned to CLOG_RING_ALIGNMENT, and starts with a slot that
+ * holds ~pos once the record has been completely written.  (We use ~pos so
+ * that a zero-filled ring doesn't look like it has a record at position 0.)
+ * The rest of the record is a binary message record.  A reader only trusts a
+ * record if its slot matches the record's position, which also weeds out
+ * stale records left over from earlier trips around the ring, and any record
+ * that a crashed thread didn't finish writing.
+ *
+ * Positions (in the header and in each slot) are always 64 bits, so that the
+ * file's layout doesn't depend on the word size of the process that wrote
+ * it. */
+
+#define CLOG_RING_HEADER_SIZE  64
+#define CLOG_RING_ALIGNMENT  8
+#define CLOG_RING_SLOT_SIZE  CLOG_RING_ALIGNMENT
+
+struct clog_ring_header {
+    char magic[8];
+    uint64_t header_size;
+    uint64_t data_size;
+    /* The logical position of the next record to be reserved */
+    volatile uint64_t head;
+};
+
+#define clog_ring_align(size) \
+    (((size) + CLOG_RING_ALIGNMENT - 1) & ~((size_t) CLOG_RING_ALIGNMENT - 1))
+
+static void
+clog_ring_copy_in(char* data, size_t mask, uint64_t pos,
+                  const void* src, size_t size)
+{
+    size_t offset = pos & mask;
+    size_t first = mask + 1 - offset;
+    if (first >= size) {
+        memcpy(data + offset, src, size);
+    } else {
+        memcpy(data + offset, src, first);
+        memcpy(data, (const char*) src + first, size - first);
+    }
+}
+
+static void
+clog_ring_copy_out(const char* data, size_t mask, uint64_t pos,
+                   void* dest, size_t size)
+{
+    size_t offset = pos & mask;
+    size_t first = mask + 1 - offset;
+    if (first >= size) {
+        memcpy(dest, data + offset, size);
+    } else {
+        memcpy(dest, data + offset, first);
+        memcpy((char*) dest + first, data, size - first);
+    }
+}
+
+static bool
+clog_ring_header_valid(const struct clog_ring_header* header, size_t size)
+{
+    return memcmp(header->magic, CLOG_RING_MAGIC, sizeof(header->magic)) == 0
+        && header->header_size == CLOG_RING_HEADER_SIZE
+        && header->data_size == size;
+}
+
+static bool
+clog_ring_size_valid(size_t size)
+{
+    return size >= CLOG_RING_ALIGNMENT && (size & (size - 1)) == 0;
+}
+
+/* Returns whether an existing file holds a ring, of any size. */
+static bool
+clog_ring_file_valid(int fd, off_t file_size)
+{
+    struct clog_ring_header header;
+    if (file_size < CLOG_RING_HEADER_SIZE ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return false;
+    }
+    return memcmp(header.magic, CLOG_RING_MAGIC, sizeof(header.magic)) == 0
+        && header.header_size == CLOG_RING_HEADER_SIZE;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Ring handler
+ */
+
+struct clog_mmap_ring_handler {
+    struct clog_handler parent;
+    struct clog_ring_header* header;
+    char* data;
+    size_t mask;
+    size_t map_size;
+};
+
+static void
+clog_mmap_ring_handler_write(void* user_data, struct cork_buffer* buf,
+                             struct clog_message* message)
+{
+    struct clog_mmap_ring_handler* self = user_data;
+    size_t record_size;
+    uint64_t pos;
+    volatile uint64_t* slot;
+
+    _clog_binary_encode_text(buf, message);
+    record_size = clog_ring_align(CLOG_RING_SLOT_SIZE + buf->size);
+    if (CORK_UNLIKELY(record_size > self->mask + 1)) {
+        /* This message would overwrite itself. */
+        return;
+    }
+
+    pos = __sync_fetch_and_add(&self->header->head, record_size);
+    clog_ring_copy_in(self->data, self->mask, pos + CLOG_RING_SLOT_SIZE,
+                      buf->buf, buf->size);
+
+    /* The CAS is a full barrier, so anyone who sees the slot's new value will
+     * also see the rest of the record. */
+    slot = (volatile uint64_t*) (self->data + (pos & self->mask));
+    (void) __sync_val_compare_and_swap(slot, *slot, ~pos);
+}
+
+static void
+clog_mmap_ring_handler_handle(struct clog_handler* handler,
+                              struct clog_message* message)
+{
+    struct clog_mmap_ring_handler* self =
+            cork_container_of(handler, struct clog_mmap_ring_handler, parent);
+    _clog_thread_buf_write(self, message, clog_mmap_ring_handler_write);
+    if (handler->next != NULL) {
+        clog_handler_handle(handler->next, message);
+    }
+}
+
+static void
+clog_mmap_ring_handler_free(struct clog_handler* handler)
+{
+    struct clog_mmap_ring_handler* self =
+            cork_container_of(handler, struct clog_mmap_ring_handler, parent);
+    munmap(self->header, self->map_size);
+    cork_delete(struct clog_mmap_ring_handler, self);
+}
+
+struct clog_handler*
+clog_mmap_ring_handler_new(const char* path, size_t size)
+{
+    struct clog_mmap_ring_handler* self;
+    struct clog_ring_header* header;
+    size_t map_size = CLOG_RING_HEADER_SIZE + size;
+    struct stat info;
+    void* map;
+    int fd;
+
+    if (!clog_ring_size_valid(size)) {
+        clog_bad_config("Ring size %zu isn't a power of two", size);
+        return NULL;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        cork_system_error_set();
+        return NULL;
+    }
+    if (fstat(fd, &info) == -1) {
+        cork_system_error_set();
+        close(fd);
+        return NULL;
+    }
+    /* Don't clobber some other file that happens to be at path. */
+    if (info.st_size != 0 && !clog_ring_file_valid(fd, info.st_size)) {
+        close(fd);
+        clog_bad_config("%s already exists, and isn't a ring file", path);
+        return NULL;
+    }
+    if ((size_t) info.st_size != map_size && ftruncate(fd, map_size) == -1) {
+        cork_system_error_set();
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cork_system_error_set();
+        return NULL;
+    }
+
+    /* Keep any records that are already in the file, as long as it's a ring
+     * of the same size.  A ring of some other size starts over. */
+    header = map;
+    if (!clog_ring_header_valid(header, size)) {
+        memset(map, 0, map_size);
+        header->header_size = CLOG_RING_HEADER_SIZE;
+        header->data_size = size;
+        memcpy(header->magic, CLOG_RING_MAGIC, sizeof(header->magic));
+    }
+
+    self = cork_new(struct clog_mmap_ring_handler);
+    self->parent.handle = clog_mmap_ring_handler_handle;
+    self->parent.free = clog_mmap_ring_handler_free;
+    self->parent.next = NULL;
+    self->header = header;
+    self->data = (char*) map + CLOG_RING_HEADER_SIZE;
+    self->mask = size - 1;
+    self->map_size = map_size;
+    return &self->parent;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Reading ring files
+ */
+
+/* Passes every complete record in the ring snapshot to the decoder.  A
+ * record whose slot matches its position can still fail to decode: a writer
+ * that was lapped by a faster one might have had its body overwritten, or
+ * the "slot" might really be a payload word inside some other record that
+ * happens to equal ~pos.  We treat those like any other torn record, and
+ * keep looking, so that one bad record can't hide the rest of the ring. */
+static void
+clog_ring_decode(struct clog_binary_decoder* decoder, const char* data,
+                 size_t mask, uint64_t start, uint64_t end)
+{
+    struct cork_buffer record = CORK_BUFFER_INIT();
+    uint64_t pos = start;
+
+    while (end - pos >= CLOG_RING_SLOT_SIZE + 4) {
+        uint64_t tag;
+        uint8_t size_bytes[4];
+        size_t record_size;
+
+        clog_ring_copy_out(data, mask, pos, &tag, sizeof(tag));
+        if (tag == ~pos) {
+            clog_ring_copy_out(data, mask, pos + CLOG_RING_SLOT_SIZE,
+                               size_bytes, 4);
+            record_size = (size_t) size_bytes[0] |
+                          ((size_t) size_bytes[1] << 8) |
+                          ((size_t) size_bytes[2] << 16) |
+                          ((size_t) size_bytes[3] << 24);
+            record_size += 4;
+            if (clog_ring_align(CLOG_RING_SLOT_SIZE + record_size) <=
+                end - pos) {
+                cork_buffer_ensure_size(&record, record_size);
+                clog_ring_copy_out(data, mask, pos + CLOG_RING_SLOT_SIZE,
+                                   record.buf, record_size);
+                if (clog_binary_decoder_feed
+                        (decoder, record.buf, record_size) == 0) {
+                    pos += clog_ring_align(CLOG_RING_SLOT_SIZE + record_size);
+                    continue;
+                }
+                cork_error_clear();
+            }
+        }
+        /* There isn't a complete record here; it's either the middle of a
+         * record that we started reading partway through, one that's still
+         * being written, or one that was torn.  Look for the next one. */
+        pos += CLOG_RING_ALIGNMENT;
+    }
+
+    cork_buffer_done(&record);
+}
+
+int
+clog_mmap_ring_read(const char* path, struct clog_handler* handler)
+{
+    struct clog_binary_decoder* decoder;
+    const struct clog_ring_header* header;
+    struct cork_buffer snapshot = CORK_BUFFER_INIT();
+    struct stat info;
+    size_t size;
+    uint64_t start;
+    uint64_t end;
+    uint64_t head;
+    void* map;
+    int fd;
+    int rc;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        cork_system_error_set();
+        return -1;
+    }
+    if (fstat(fd, &info) == -1) {
+        cork_system_error_set();
+        close(fd);
+        return -1;
+    }
+    if ((size_t) info.st_size < CLOG_RING_HEADER_SIZE) {
+        close(fd);
+        clog_bad_record("%s isn't a ring file", path);
+        return -1;
+    }
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cork_system_error_set();
+        return -1;
+    }
+
+    header = map;
+    size = info.st_size - CLOG_RING_HEADER_SIZE;
+    if (!clog_ring_size_valid(size) || !clog_ring_header_valid(header, size)) {
+        munmap(map, info.st_size);
+        clog_bad_record("%s isn't a ring file", path);
+        return -1;
+    }
+
+    /* Copy the ring so that writers can't change it while we decode it.  Any
+     * record that was overwritten while we were copying is before the final
+     * value of head, less the size of the ring. */
+    end = header->head;
+    __sync_synchronize();
+    cork_buffer_ensure_size(&snapshot, size);
+    memcpy(snapshot.buf, (const char*) map + CLOG_RING_HEADER_SIZE, size);
+    __sync_synchronize();
+    head = header->head;
+    start = (head > size) ? head - size : 0;
+    munmap(map, info.st_size);
+
+    decoder = clog_binary_decoder_new(handler);
+    rc = clog_binary_decoder_feed
+        (decoder, CLOG_BINARY_MAGIC, CLOG_BINARY_MAGIC_SIZE);
+    if (rc == 0 && start < end) {
+        clog_ring_decode(decoder, snapshot.buf, size - 1, start, end);
+    }
+    if (rc == 0) {
+        rc = clog_binary_decoder_finish(decoder);
+    }
+    clog_binary_decoder_free(decoder);
+    cork_buffer_done(&snapshot);
+    return rc;
+}
@@ -0,0 +1,558 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(CLOG_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/threads.h>
+#include <libcork/helpers/errors.h>
+
+#include "clogger/api.h"
+#include "clogger/error.h"
+#include "clogger/formatter.h"
+#include "clogger/handlers.h"
+#include "internal.h"
+
+
+/*-----------------------------------------------------------------------
+ * Rotating file handler
+ */
+
+#define CLOG_ROTATE_DEFAULT_KEEP  5
+#define CLOG_ROTATE_READ_SIZE  65536
+
+/* A rotated file that's waiting to be compressed */
+struct clog_rotate_pending {
+    const char* path;
+    struct clog_rotate_pending* next;
+};
+
+struct clog_rotating_file_handler {
+    struct clog_handler parent;
+    struct clog_formatter* fmt;
+    const char* path;
+    size_t max_size;
+    unsigned int max_age;
+    unsigned int keep;
+    bool compress;
+
+    /* Protects the current file */
+    pthread_mutex_t mutex;
+    /* NULL if we couldn't open the current file */
+    struct cork_stream_consumer* consumer;
+    size_t size;
+    time_t opened;
+    unsigned int rotation_count;
+
+    /* Background compression.  Once compression is turned on, only the
+     * compressor thread renames rotated files, so that it can't race with the
+     * thread that's logging. */
+    pthread_mutex_t compress_mutex;
+    pthread_cond_t has_work;
+    pthread_cond_t idle;
+    struct cork_thread* compressor;
+    struct clog_rotate_pending* head;
+    struct clog_rotate_pending* tail;
+    /* Includes the file that's being compressed right now */
+    size_t pending_count;
+    bool stopping;
+};
+
+static int
+clog_rotate_open(struct clog_rotating_file_handler* self)
+{
+    struct stat info;
+    int fd = open(self->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        cork_system_error_set();
+        cork_error_prefix("%s: ", self->path);
+        return -1;
+    }
+    if (fstat(fd, &info) == -1) {
+        cork_system_error_set();
+        close(fd);
+        return -1;
+    }
+    self->consumer = _clog_fd_consumer_new(fd, CLOG_STREAM_CLOSE_FD);
+    self->size = info.st_size;
+    self->opened = time(NULL);
+    return 0;
+}
+
+/* Makes src the newest rotated file (path.1, plus suffix), bumping each older
+ * one along and removing any that we don't need to keep. */
+static void
+clog_rotate_shift(struct clog_rotating_file_handler* self, const char* src,
+                  const char* suffix)
+{
+    struct cork_buffer from = CORK_BUFFER_INIT();
+    struct cork_buffer to = CORK_BUFFER_INIT();
+    unsigned int i;
+
+    if (self->keep == 0) {
+        unlink(src);
+        return;
+    }
+
+    cork_buffer_printf(&to, "%s.%u%s", self->path, self->keep, suffix);
+    unlink(to.buf);
+    for (i = self->keep - 1; i > 0; i--) {
+        cork_buffer_printf(&from, "%s.%u%s", self->path, i, suffix);
+        rename(from.buf, to.buf);
+        cork_buffer_copy(&to, &from);
+    }
+    rename(src, to.buf);
+    cork_buffer_done(&from);
+    cork_buffer_done(&to);
+}
+
+#if defined(CLOG_HAVE_ZLIB)
+static int
+clog_rotate_compress(const char* src, const char* dest)
+{
+    char buf[CLOG_ROTATE_READ_SIZE];
+    ssize_t bytes_read;
+    gzFile gz;
+    int fd;
+
+    fd = open(src, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    gz = gzopen(dest, "wb");
+    if (gz == NULL) {
+        close(fd);
+        return -1;
+    }
+    while ((bytes_read = read(fd, buf, sizeof(buf))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (gzwrite(gz, buf, bytes_read) != bytes_read) {
+            bytes_read = -1;
+            break;
+        }
+    }
+    close(fd);
+    if (gzclose(gz) != Z_OK || bytes_read != 0) {
+        unlink(dest);
+        return -1;
+    }
+    return 0;
+}
+#else
+/* Compression can't be turned on without zlib. */
+static int
+clog_rotate_compress(const char* src, const char* dest)
+{
+    return -1;
+}
+#endif
+
+static int
+clog_rotate_compressor_run(void* vself)
+{
+    struct clog_rotating_file_handler* self = vself;
+    struct cork_buffer dest = CORK_BUFFER_INIT();
+
+    pthread_mutex_lock(&self->compress_mutex);
+    while (true) {
+        struct clog_rotate_pending* pending = self->head;
+        if (pending == NULL) {
+            pthread_cond_broadcast(&self->idle);
+            if (self->stopping) {
+                break;
+            }
+            pthread_cond_wait(&self->has_work, &self->compress_mutex);
+            continue;
+        }
+
+        self->head = pending->next;
+        if (self->head == NULL) {
+            self->tail = NULL;
+        }
+        pthread_mutex_unlock(&self->compress_mutex);
+
+        cork_buffer_printf(&dest, "%s.gz", pending->path);
+        if (clog_rotate_compress(pending->path, dest.buf) == 0) {
+            unlink(pending->path);
+            clog_rotate_shift(self, dest.buf, ".gz");
+        } else {
+            /* Better to keep the file uncompressed than to lose it. */
+            clog_rotate_shift(self, pending->path, "");
+        }
+        cork_strfree(pending->path);
+        cork_delete(struct clog_rotate_pending, pending);
+
+        pthread_mutex_lock(&self->compress_mutex);
+        self->pending_count--;
+    }
+    pthread_mutex_unlock(&self->compress_mutex);
+    cork_buffer_done(&dest);
+    return 0;
+}
+
+static void
+clog_rotate_enqueue(struct clog_rotating_file_handler* self, const char* path)
+{
+    struct clog_rotate_pending* pending = cork_new(struct clog_rotate_pending);
+    pending->path = cork_strdup(path);
+    pending->next = NULL;
+
+    pthread_mutex_lock(&self->compress_mutex);
+    if (self->compressor == NULL) {
+        self->compressor = cork_thread_new
+            ("clog-compress", self, NULL, clog_rotate_compressor_run);
+        cork_thread_start(self->compressor);
+    }
+    if (self->tail == NULL) {
+        self->head = pending;
+    } else {
+        self->tail->next = pending;
+    }
+    self->tail = pending;
+    self->pending_count++;
+    pthread_cond_signal(&self->has_work);
+    pthread_mutex_unlock(&self->compress_mutex);
+}
+
+/* Must be called while holding the handler's mutex. */
+static int
+clog_rotate_locked(struct clog_rotating_file_handler* self)
+{
+    if (self->consumer != NULL) {
+        cork_stream_consumer_free(self->consumer);
+        self->consumer = NULL;
+    }
+
+    /* Renaming the file takes it out of the way all at once; nothing else
+     * will be written to it, since we hold the lock. */
+    if (self->compress) {
+        struct cork_buffer pending = CORK_BUFFER_INIT();
+        cork_buffer_printf(&pending, "%s.rotated-%ld-%u", self->path,
+                           (long) getpid(), self->rotation_count++);
+        if (rename(self->path, pending.buf) == 0) {
+            clog_rotate_enqueue(self, pending.buf);
+        }
+        cork_buffer_done(&pending);
+    } else {
+        clog_rotate_shift(self, self->path, "");
+    }
+
+    return clog_rotate_open(self);
+}
+
+static bool
+clog_rotate_needed(struct clog_rotating_file_handler* self, size_t size)
+{
+    if (self->size == 0) {
+        return false;
+    }
+    if (self->max_size != 0 && self->size + size > self->max_size) {
+        return true;
+    }
+    return self->max_age != 0 &&
+        (unsigned long) (time(NULL) - self->opened) >= self->max_age;
+}
+
+static void
+clog_rotating_file_handler_write(void* user_data, struct cork_buffer* buf,
+                                 struct clog_message* message)
+{
+    struct clog_rotating_file_handler* self = user_data;
+    clog_formatter_format_message(self->fmt, buf, message);
+    cork_buffer_append(buf, "\n", 1);
+
+    pthread_mutex_lock(&self->mutex);
+    if (clog_rotate_needed(self, buf->size)) {
+        /* If we can't open the new file, we drop messages until the next
+         * rotation. */
+        clog_rotate_locked(self);
+    }
+    if (self->consumer != NULL) {
+        _clog_consumer_write_message(self->consumer, _clog_fd_consumer_flush,
+                                     buf->buf, buf->size, false,
+                                     message->level);
+        self->size += buf->size;
+    }
+    pthread_mutex_unlock(&self->mutex);
+}
+
+static void
+clog_rotating_file_handler_handle(struct clog_handler* handler,
+                                  struct clog_message* message)
+{
+    struct clog_rotating_file_handler* self = cork_container_of
+        (handler, struct clog_rotating_file_handler, parent);
+    _clog_thread_buf_write(self, message, clog_rotating_file_handler_write);
+    if (handler->next != NULL) {
+        clog_handler_handle(handler->next, message);
+    }
+}
+
+static void
+clog_rotating_file_handler_free(struct clog_handler* handler)
+{
+    struct clog_rotating_file_handler* self = cork_container_of
+        (handler, struct clog_rotating_file_handler, parent);
+
+    if (self->consumer != NULL) {
+        cork_stream_consumer_free(self->consumer);
+    }
+
+    /* The compressor thread finishes everything in its queue first. */
+    if (self->compressor != NULL) {
+        pthread_mutex_lock(&self->compress_mutex);
+        self->stopping = true;
+        pthread_cond_signal(&self->has_work);
+        pthread_mutex_unlock(&self->compress_mutex);
+        cork_thread_join(self->compressor);
+    }
+
+    if (self->fmt != NULL) {
+        clog_formatter_free(self->fmt);
+    }
+    cork_strfree(self->path);
+    pthread_cond_destroy(&self->idle);
+    pthread_cond_destroy(&self->has_work);
+    pthread_mutex_destroy(&self->compress_mutex);
+    pthread_mutex_destroy(&self->mutex);
+    cork_delete(struct clog_rotating_file_handler, self);
+}
+
+struct clog_handler*
+clog_rotating_file_handler_new(const char* path, const char* fmt)
+{
+    struct clog_rotating_file_handler* self =
+        cork_new(struct clog_rotating_file_handler);
+    self->parent.handle = clog_rotating_file_handler_handle;
+    self->parent.free = clog_rotating_file_handler_free;
+    self->parent.next = NULL;
+    self->path = cork_strdup(path);
+    self->max_size = 0;
+    self->max_age = 0;
+    self->keep = CLOG_ROTATE_DEFAULT_KEEP;
+    self->compress = false;
+    pthread_mutex_init(&self->mutex, NULL);
+    self->consumer = NULL;
+    self->rotation_count = 0;
+    pthread_mutex_init(&self->compress_mutex, NULL);
+    pthread_cond_init(&self->has_work, NULL);
+    pthread_cond_init(&self->idle, NULL);
+    self->compressor = NULL;
+    self->head = NULL;
+    self->tail = NULL;
+    self->pending_count = 0;
+    self->stopping = false;
+    ep_check(self->fmt = clog_formatter_new(fmt));
+    ei_check(clog_rotate_open(self));
+    return &self->parent;
+
+error:
+    clog_rotating_file_handler_free(&self->parent);
+    return NULL;
+}
+
+#define rotating_file_handler(handler) \
+    cork_container_of((handler), struct clog_rotating_file_handler, parent)
+
+void
+clog_rotating_file_handler_set_max_size(struct clog_handler* handler,
+                                        size_t max_size)
+{
+    rotating_file_handler(handler)->max_size = max_size;
+}
+
+void
+clog_rotating_file_handler_set_max_age(struct clog_handler* handler,
+                                       unsigned int seconds)
+{
+    rotating_file_handler(handler)->max_age = seconds;
+}
+
+void
+clog_rotating_file_handler_set_keep(struct clog_handler* handler,
+                                    unsigned int keep)
+{
+    rotating_file_handler(handler)->keep = keep;
+}
+
+void
+clog_rotating_file_handler_set_compress(struct clog_handler* handler,
+                                        bool compress)
+{
+#if defined(CLOG_HAVE_ZLIB)
+    rotating_file_handler(handler)->compress = compress;
+#endif
+}
+
+int
+clog_rotating_file_handler_rotate(struct clog_handler* handler)
+{
+    struct clog_rotating_file_handler* self = rotating_file_handler(handler);
+    int rc;
+    pthread_mutex_lock(&self->mutex);
+    rc = clog_rotate_locked(self);
+    pthread_mutex_unlock(&self->mutex);
+    return rc;
+}
+
+int
+clog_rotating_file_handler_flush(struct clog_handler* handler)
+{
+    struct clog_rotating_file_handler* self = rotating_file_handler(handler);
+    int rc = 0;
+
+    pthread_mutex_lock(&self->mutex);
+    if (self->consumer != NULL) {
+        rc = _clog_fd_consumer_flush(self->consumer);
+    }
+    pthread_mutex_unlock(&self->mutex);
+
+    pthread_mutex_lock(&self->compress_mutex);
+    while (self->pending_count > 0) {
+        pthread_cond_wait(&self->idle, &self->compress_mutex);
+    }
+    pthread_mutex_unlock(&self->compress_mutex);
+    return rc;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Rotation settings
+ */
+
+/* Rejects anything that's bigger than max once its unit is applied. */
+static int
+clog_rotate_parse_number(const char* value, const char* units,
+                         const unsigned long* multipliers,
+                         unsigned long max, unsigned long* dest)
+{
+    char* end;
+    const char* unit;
+    unsigned long result;
+
+    errno = 0;
+    result = strtoul(value, &end, 10);
+    if (end == value || *value == '-' || errno == ERANGE) {
+        return -1;
+    }
+    if (*end != '\0') {
+        unsigned long multiplier;
+        if (end[1] != '\0' || (unit = strchr(units, *end)) == NULL) {
+            return -1;
+        }
+        multiplier = multipliers[unit - units];
+        if (result > ULONG_MAX / multiplier) {
+            return -1;
+        }
+        result *= multiplier;
+    }
+    if (result > max) {
+        return -1;
+    }
+    *dest = result;
+    return 0;
+}
+
+static const unsigned long size_multipliers[] = {
+    1024, 1024, 1024 * 1024, 1024 * 1024, 1024 * 1024 * 1024,
+    1024 * 1024 * 1024
+};
+
+static const unsigned long age_multipliers[] = {
+    1, 60, 60 * 60, 24 * 60 * 60
+};
+
+int
+clog_rotating_file_handler_configure(struct clog_handler* handler,
+                                     const char* settings)
+{
+    struct clog_rotating_file_handler* self = rotating_file_handler(handler);
+    struct cork_buffer buf = CORK_BUFFER_INIT();
+    char* setting;
+    char* next;
+    unsigned long number;
+
+    cork_buffer_set_string(&buf, settings);
+    for (setting = buf.buf; setting != NULL; setting = next) {
+        char* value;
+        next = strchr(setting, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (*setting == '\0') {
+            continue;
+        }
+
+        if (strcmp(setting, "compress") == 0) {
+#if defined(CLOG_HAVE_ZLIB)
+            self->compress = true;
+            continue;
+#else
+            cork_buffer_done(&buf);
+            clog_bad_config("Can't compress rotated files without zlib");
+            return -1;
+#endif
+        }
+
+        value = strchr(setting, '=');
+        if (value == NULL) {
+            goto bad_setting;
+        }
+        *value++ = '\0';
+        if (strcmp(setting, "size") == 0) {
+            if (clog_rotate_parse_number(value, "kKmMgG", size_multipliers,
+                                         SIZE_MAX, &number) != 0) {
+                goto bad_setting;
+            }
+            self->max_size = number;
+        } else if (strcmp(setting, "age") == 0) {
+            if (clog_rotate_parse_number(value, "smhd", age_multipliers,
+                                         UINT_MAX, &number) != 0) {
+                goto bad_setting;
+            }
+            self->max_age = number;
+        } else if (strcmp(setting, "keep") == 0) {
+            if (clog_rotate_parse_number(value, "", NULL, UINT_MAX,
+                                         &number) != 0) {
+                goto bad_setting;
+            }
+            self->keep = number;
+        } else {
+            goto bad_setting;
+        }
+    }
+
+    cork_buffer_done(&buf);
+    return 0;
+
+bad_setting:
+    cork_buffer_done(&buf);
+    clog_bad_config("Invalid rotation settings %s", settings);
+    return -1;
+}
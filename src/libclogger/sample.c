@@ -0,0 +1,257 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Random numbers
+ */
+
+/* Each thread has its own xorshift64* generator, so that sampling never
+ * touches any shared state.  It's seeded from the thread's ID and the clock
+ * the first time the thread needs it. */
+
+cork_tls(uint64_t, sample_rng);
+
+static uint64_t
+clog_sample_random(void)
+{
+    uint64_t* state = sample_rng_get();
+    uint64_t x = *state;
+    if (CORK_UNLIKELY(x == 0)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        x = ((uint64_t) cork_current_thread_get_id() << 32) ^
+            ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec);
+        x = (x == 0) ? 1 : x;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+/* Each thread also keeps its own counts for the 1-in-n handlers, so that they
+ * don't all bump the same cache line.  Each handler gets its own slot in this
+ * array.  If a process creates more 1-in-n handlers than there are slots,
+ * some of them share a count; they still keep about 1 in n messages between
+ * them, just not as evenly. */
+
+#define CLOG_SAMPLE_COUNTERS  64
+
+struct clog_sample_counters {
+    size_t counts[CLOG_SAMPLE_COUNTERS];
+};
+
+cork_tls(struct clog_sample_counters, sample_counters);
+
+static volatile size_t  next_counter = 0;
+
+/* FNV-1a */
+static uint64_t
+clog_sample_hash(const char* str)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sampling handler
+ */
+
+enum clog_sampling_mode {
+    CLOG_SAMPLE_EVERY,
+    CLOG_SAMPLE_RANDOM,
+    CLOG_SAMPLE_FIELD
+};
+
+struct clog_sampling_handler {
+    struct clog_handler parent;
+    enum clog_sampling_mode mode;
+    /* Messages more severe than this aren't sampled. */
+    enum clog_level level;
+    /* For CLOG_SAMPLE_EVERY and CLOG_SAMPLE_FIELD */
+    size_t n;
+    /* For CLOG_SAMPLE_EVERY: where this handler's count lives in each
+     * thread's sample_counters */
+    size_t counter;
+    /* A message is kept if a random number is less than this.  Used for
+     * CLOG_SAMPLE_RANDOM, and for messages that don't have the field that
+     * CLOG_SAMPLE_FIELD is looking for. */
+    uint64_t threshold;
+    bool keep_all;
+    const char* key;
+    /* The value of the sample_rate field that we add to kept messages */
+    char rate[32];
+};
+
+static const char*
+clog_sampling_find_field(struct clog_message* message, const char* key)
+{
+    struct clog_message_field* field;
+    for (field = message->fields.head; field != NULL; field = field->next) {
+        if (strcmp(field->key, key) == 0) {
+            return clog_message_field_value(field);
+        }
+    }
+    return NULL;
+}
+
+static bool
+clog_sampling_keep_random(struct clog_sampling_handler* self)
+{
+    return self->keep_all || clog_sample_random() < self->threshold;
+}
+
+static bool
+clog_sampling_keep(struct clog_sampling_handler* self,
+                   struct clog_message* message)
+{
+    const char* value;
+    size_t count;
+    switch (self->mode) {
+        case CLOG_SAMPLE_EVERY:
+            count = sample_counters_get()->counts[self->counter]++;
+            return count % self->n == 0;
+
+        case CLOG_SAMPLE_RANDOM:
+            return clog_sampling_keep_random(self);
+
+        case CLOG_SAMPLE_FIELD:
+            value = clog_sampling_find_field(message, self->key);
+            if (value == NULL) {
+                return clog_sampling_keep_random(self);
+            }
+            return clog_sample_hash(value) % self->n == 0;
+
+        default:
+            return true;
+    }
+}
+
+static void
+clog_sampling_handler_handle(struct clog_handler* handler,
+                             struct clog_message* message)
+{
+    struct clog_sampling_handler* self =
+            cork_container_of(handler, struct clog_sampling_handler, parent);
+    struct clog_string_field rate_field;
+
+    if (handler->next == NULL) {
+        return;
+    }
+    if (message->level < self->level) {
+        clog_handler_handle(handler->next, message);
+        return;
+    }
+    if (!clog_sampling_keep(self, message)) {
+        return;
+    }
+
+    clog_message_add_string_field
+        (&message->fields, &rate_field, "sample_rate", self->rate);
+    clog_handler_handle(handler->next, message);
+    clog_message_pop_field(message, &rate_field.parent);
+}
+
+static void
+clog_sampling_handler_free(struct clog_handler* handler)
+{
+    struct clog_sampling_handler* self =
+            cork_container_of(handler, struct clog_sampling_handler, parent);
+    if (self->key != NULL) {
+        cork_strfree(self->key);
+    }
+    cork_delete(struct clog_sampling_handler, self);
+}
+
+static struct clog_sampling_handler*
+clog_sampling_handler_new(enum clog_sampling_mode mode, size_t n,
+                          double probability)
+{
+    struct clog_sampling_handler* self =
+            cork_new(struct clog_sampling_handler);
+    self->parent.handle = clog_sampling_handler_handle;
+    self->parent.free = clog_sampling_handler_free;
+    self->mode = mode;
+    self->level = CLOG_LEVEL_CRITICAL;
+    self->n = (n == 0) ? 1 : n;
+    self->counter =
+        (cork_size_atomic_add(&next_counter, 1) - 1) % CLOG_SAMPLE_COUNTERS;
+    self->key = NULL;
+    if (probability >= 1.0) {
+        self->keep_all = true;
+        self->threshold = UINT64_MAX;
+    } else if (probability <= 0.0) {
+        self->keep_all = false;
+        self->threshold = 0;
+    } else {
+        /* Scale to 2^64, being careful about rounding up. */
+        double threshold = probability * 18446744073709551616.0;
+        self->keep_all = false;
+        self->threshold = (threshold >= 18446744073709551615.0) ?
+            UINT64_MAX : (uint64_t) threshold;
+    }
+    return self;
+}
+
+struct clog_handler*
+clog_sampling_handler_new_every(unsigned int n)
+{
+    struct clog_sampling_handler* self =
+        clog_sampling_handler_new(CLOG_SAMPLE_EVERY, n, 1.0);
+    snprintf(self->rate, sizeof(self->rate), "%zu", self->n);
+    return &self->parent;
+}
+
+struct clog_handler*
+clog_sampling_handler_new_random(double probability)
+{
+    struct clog_sampling_handler* self =
+        clog_sampling_handler_new(CLOG_SAMPLE_RANDOM, 1, probability);
+    snprintf(self->rate, sizeof(self->rate), "%g",
+             (probability > 0.0) ? 1.0 / probability : 0.0);
+    return &self->parent;
+}
+
+struct clog_handler*
+clog_sampling_handler_new_field(const char* key, unsigned int n)
+{
+    struct clog_sampling_handler* self =
+        clog_sampling_handler_new(CLOG_SAMPLE_FIELD, n, 1.0 / (n ? n : 1));
+    self->key = cork_strdup(key);
+    snprintf(self->rate, sizeof(self->rate), "%zu", self->n);
+    return &self->parent;
+}
+
+void
+clog_sampling_handler_set_level(struct clog_handler* handler,
+                                enum clog_level level)
+{
+    struct clog_sampling_handler* self =
+            cork_container_of(handler, struct clog_sampling_handler, parent);
+    self->level = level;
+}
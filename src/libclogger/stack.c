@@ -18,8 +18,6 @@
 #include "clogger/error.h"
 
 
-enum clog_level clog_minimum_level = CLOG_LEVEL_WARNING;
-
 static bool can_push_process_handlers = true;
 static struct clog_handler* process_stack = NULL;
 cork_tls(struct clog_handler*, thread_stack);
@@ -95,10 +93,27 @@ clog_get_stack(void)
 const char*
 clog_message_message(struct clog_message* message)
 {
-    if (message->message.buf == NULL) {
-        cork_buffer_vprintf(&message->message, message->fmt, message->args);
+    if (message->text == NULL) {
+        message->text = clog_arena_vprintf(&message->text_size, message->fmt,
+                                           message->args);
+    }
+    return message->text;
+}
+
+void
+clog_message_append_message(struct clog_message* message,
+                            struct cork_buffer* dest)
+{
+    if (message->text == NULL) {
+        /* Use a copy of the arguments so that the message can still be
+         * rendered again later on. */
+        va_list args;
+        va_copy(args, message->args);
+        cork_buffer_append_vprintf(dest, message->fmt, args);
+        va_end(args);
+    } else {
+        cork_buffer_append(dest, message->text, message->text_size);
     }
-    return message->message.buf;
 }
 
 void
@@ -117,17 +132,17 @@ _clog_process_message(struct clog_message* message, const char* fmt, ...)
 }
 
 
-void
-clog_set_minimum_level(enum clog_level level)
-{
-    clog_minimum_level = level;
-}
-
-
 /*-----------------------------------------------------------------------
  * Inline declarations
  */
 
+bool
+clog_call_site_enabled(struct clog_call_site* site, const char* channel,
+                       enum clog_level level);
+
+const char*
+clog_message_field_value(const struct clog_message_field* field);
+
 void
 clog_message_field_done(struct clog_message_field* field);
 
@@ -145,10 +160,16 @@ clog_message_fields_pop(struct clog_message_fields* fields,
 void
 clog_message_fields_done(struct clog_message_fields* fields);
 
+uint64_t
+clog_now(void);
+
 void
 clog_message_init(struct clog_message* message, enum clog_level level,
                   const char* channel);
 
+const struct clog_thread_info*
+clog_message_thread(const struct clog_message* message);
+
 void
 clog_message_pop_field(struct clog_message* message,
                        struct clog_message_field* field);
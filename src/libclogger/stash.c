@@ -7,160 +7,865 @@
  * ----------------------------------------------------------------------
  */
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
 
+#include <libcork/core.h>
 #include <libcork/ds.h>
 #include <libcork/helpers/errors.h>
+#include <libcork/threads.h>
 
 #include "clogger/api.h"
 #include "clogger/stash.h"
 
+/* Each stashed event is a single block, carved out of one of the stash's
+ * chunks: an array of fields, followed by the bytes of each field's value.
+ * Events are only freed when the stash is.
+ *
+ * Each thread that logs into a stash gets its own segment, with its own
+ * chunks and its own copies of keys, so that logging threads never have to
+ * wait for each other.  Each event gets a sequence number from a counter
+ * that's shared by the whole stash, and is then published by appending it to
+ * its segment's list of events.
+ *
+ * Queries merge any newly published events into the stash's main list, in
+ * sequence order, stopping early if some thread has claimed a sequence number
+ * but not yet published its event.  That means that a query always sees
+ * every event up to some point in the sequence, and none after it.  While
+ * merging, we replace each event's keys with the stash's interned copy, and
+ * add the event's index to a posting list for each of its key=value pairs.
+ * Event indexes only ever grow, so each posting list is sorted, and a query
+ * intersects the posting lists of the pairs that it asks about instead of
+ * looking at every event. */
+
+#define CLOG_STASH_CHUNK_SIZE  65536
+#define CLOG_STASH_ALIGNMENT  sizeof(void*)
+
+#define CLOG_STASH_MESSAGE_KEY  "__message"
+
+#define CLOG_STASH_NO_EVENT  SIZE_MAX
+
+struct clog_stashed_field {
+    const char* key;
+    const char* value;
+};
+
 struct clog_stashed_event {
-    struct cork_hash_table* fields;
+    size_t seq;
+    /* The next event in the same segment */
+    struct clog_stashed_event* next;
+    size_t field_count;
+    struct clog_stashed_field fields[];
+};
+
+/* The indexes of the events that have a particular key=value pair, in
+ * order. */
+struct clog_stash_postings {
+    size_t count;
+    size_t capacity;
+    size_t* ids;
+};
+
+struct clog_stash_key {
+    const char* name;
+    /* Maps each value of this key to its clog_stash_postings */
+    struct cork_hash_table* values;
+};
+
+/* A field of the event that we're in the middle of stashing */
+struct clog_stash_pending_field {
+    const char* key;
+    const char* value;
+};
+
+struct clog_stash_chunk {
+    struct clog_stash_chunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct clog_stash_segment {
+    struct clog_stash_segment* next;
+    cork_thread_id owner;
+    /* These are only touched by the owning thread. */
+    struct clog_stash_chunk* chunks;
+    /* Maps each key to this segment's copy of it */
+    struct cork_hash_table* keys;
+    cork_array(struct clog_stash_pending_field) fields;
+    struct clog_stashed_event* tail;
+    /* Events are published by linking them onto the list, and then
+     * incrementing this. */
+    volatile size_t published;
+    struct clog_stashed_event* head;
+    /* The last event that we've merged, and how many we have.  Only touched
+     * while holding the stash's query lock. */
+    struct clog_stashed_event* last_merged;
+    size_t merged;
+};
+
+struct clog_stash {
+    size_t id;
+    volatile size_t next_seq;
+    /* Protects the list of segments */
+    pthread_mutex_t segments_lock;
+    struct clog_stash_segment* segments;
+
+    /* Everything else is protected by the query lock. */
+    pthread_mutex_t query_lock;
+    cork_array(struct clog_stashed_event*) events;
+    /* Maps each key to its clog_stash_key */
+    struct cork_hash_table* keys;
+    /* Holds the interned keys and the posting lists */
+    struct clog_stash_chunk* chunks;
 };
 
+static volatile size_t next_stash_id = 0;
+
+static void*
+clog_stash_alloc(struct clog_stash_chunk** chunks, size_t size)
+{
+    struct clog_stash_chunk* chunk = *chunks;
+    size = (size + CLOG_STASH_ALIGNMENT - 1) &
+           ~((size_t) CLOG_STASH_ALIGNMENT - 1);
+    if (CORK_UNLIKELY(chunk == NULL || chunk->size - chunk->used < size)) {
+        size_t chunk_size = (size > CLOG_STASH_CHUNK_SIZE) ?
+            size : CLOG_STASH_CHUNK_SIZE;
+        chunk = cork_malloc(sizeof(struct clog_stash_chunk) + chunk_size);
+        chunk->next = *chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        *chunks = chunk;
+    }
+    chunk->used += size;
+    return chunk->data + chunk->used - size;
+}
+
+static void
+clog_stash_free_chunks(struct clog_stash_chunk* chunks)
+{
+    struct clog_stash_chunk* chunk;
+    struct clog_stash_chunk* next;
+    for (chunk = chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        cork_free(chunk, sizeof(struct clog_stash_chunk) + chunk->size);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Keys and posting lists
+ */
+
 static void
-cork_strfree_callback(void* vstr)
+clog_stash_key_free(void* vkey)
+{
+    struct clog_stash_key* key = vkey;
+    cork_hash_table_free(key->values);
+}
+
+/* Returns NULL if no stashed event has ever used this key. */
+static const struct clog_stash_key*
+clog_stash_find_key(const struct clog_stash* stash, const char* name)
+{
+    return cork_hash_table_get(stash->keys, name);
+}
+
+static struct clog_stash_key*
+clog_stash_intern_key(struct clog_stash* stash, const char* name)
 {
-    const char* str = (const char*) vstr;
-    cork_strfree(str);
+    struct clog_stash_key* key = cork_hash_table_get(stash->keys, name);
+    if (CORK_UNLIKELY(key == NULL)) {
+        size_t size = strlen(name) + 1;
+        char* copy = clog_stash_alloc(&stash->chunks, size);
+        memcpy(copy, name, size);
+        key = clog_stash_alloc(&stash->chunks, sizeof(struct clog_stash_key));
+        key->name = copy;
+        key->values = cork_string_hash_table_new(0, 0);
+        cork_hash_table_put(stash->keys, copy, key, NULL, NULL, NULL);
+    }
+    return key;
 }
 
-static struct clog_stashed_event*
-clog_stashed_event_new(void)
+/* Returns NULL if no stashed event has ever had this key=value pair. */
+static const struct clog_stash_postings*
+clog_stash_find_postings(const struct clog_stash* stash, const char* name,
+                         const char* value)
 {
-    struct clog_stashed_event* event = cork_new(struct clog_stashed_event);
-    event->fields = cork_string_hash_table_new(0, 0);
-    cork_hash_table_set_free_key(event->fields, cork_strfree_callback);
-    cork_hash_table_set_free_value(event->fields, cork_strfree_callback);
-    return event;
+    const struct clog_stash_key* key = clog_stash_find_key(stash, name);
+    if (key == NULL) {
+        return NULL;
+    }
+    return cork_hash_table_get(key->values, value);
 }
 
+/* value must be the event's own copy, since the index keeps a pointer to
+ * it. */
 static void
-clog_stashed_event_free(struct clog_stashed_event* event)
+clog_stash_add_posting(struct clog_stash* stash, struct clog_stash_key* key,
+                       const char* value, size_t id)
+{
+    struct clog_stash_postings* postings;
+    struct cork_hash_table_entry* entry;
+    bool is_new;
+
+    entry = cork_hash_table_get_or_create(key->values, (void*) value, &is_new);
+    if (is_new) {
+        /* Most values only appear once, so start with room for one event
+         * index, right after the list itself. */
+        postings = clog_stash_alloc
+            (&stash->chunks,
+             sizeof(struct clog_stash_postings) + sizeof(size_t));
+        postings->count = 0;
+        postings->capacity = 1;
+        postings->ids = (size_t*) (postings + 1);
+        entry->value = postings;
+    } else {
+        postings = entry->value;
+    }
+
+    if (CORK_UNLIKELY(postings->count == postings->capacity)) {
+        /* The old array stays in its chunk until the stash is freed; since we
+         * double each time, that wastes at most as much as we're using. */
+        size_t* ids = clog_stash_alloc
+            (&stash->chunks, 2 * postings->capacity * sizeof(size_t));
+        memcpy(ids, postings->ids, postings->count * sizeof(size_t));
+        postings->ids = ids;
+        postings->capacity *= 2;
+    }
+    postings->ids[postings->count++] = id;
+}
+
+/* Returns the index of the first entry in postings that's >= id. */
+static size_t
+clog_stash_postings_lower_bound(const struct clog_stash_postings* postings,
+                                size_t id)
 {
-    cork_hash_table_free(event->fields);
-    cork_delete(struct clog_stashed_event, event);
+    size_t lo = 0;
+    size_t hi = postings->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (postings->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
 static bool
-clog_stashed_event_matches(const struct clog_stashed_event* event, va_list args)
+clog_stash_postings_contains(const struct clog_stash_postings* postings,
+                             size_t id)
 {
-    const char* key;
-    const char* expected;
+    size_t i = clog_stash_postings_lower_bound(postings, id);
+    return i < postings->count && postings->ids[i] == id;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Queries
+ */
+
+/* A query is the set of posting lists for the key=value pairs that an event
+ * must have.  If the stash has never seen one of the pairs, nothing can
+ * match.  A query with no pairs matches every event. */
+struct clog_stash_query {
+    cork_array(const struct clog_stash_postings*) postings;
+    /* The shortest posting list, which we walk through while checking the
+     * others; NULL if the query has no pairs. */
+    const struct clog_stash_postings* shortest;
+    bool empty;
+};
+
+static void
+clog_stash_query_init(struct clog_stash_query* query)
+{
+    cork_array_init(&query->postings);
+    query->shortest = NULL;
+    query->empty = false;
+}
+
+static void
+clog_stash_query_done(struct clog_stash_query* query)
+{
+    cork_array_done(&query->postings);
+}
+
+static void
+clog_stash_query_add(struct clog_stash_query* query,
+                     const struct clog_stash* stash, const char* name,
+                     const char* value)
+{
+    const struct clog_stash_postings* postings =
+        clog_stash_find_postings(stash, name, value);
+    if (postings == NULL) {
+        query->empty = true;
+        return;
+    }
+    cork_array_append(&query->postings, postings);
+    if (query->shortest == NULL || postings->count < query->shortest->count) {
+        query->shortest = postings;
+    }
+}
 
+/* Reads key/value pairs from args until a NULL key.  Returns false if a key
+ * is missing its value. */
+static bool
+clog_stash_query_add_args(struct clog_stash_query* query,
+                          const struct clog_stash* stash, va_list* args)
+{
     while (true) {
-        key = va_arg(args, const char*);
+        const char* key = va_arg(*args, const char*);
+        const char* expected;
         if (key == NULL) {
             return true;
         }
 
-        expected = va_arg(args, const char*);
+        expected = va_arg(*args, const char*);
         if (expected == NULL) {
             // False because the caller didn't provide the right number of
             // parameters.
             return false;
         }
-
-        const char *actual = cork_hash_table_get(event->fields, key);
-        if (actual == NULL || strcmp(expected, actual) != 0) {
-            return false;
-        }
+        clog_stash_query_add(query, stash, key, expected);
     }
 }
 
 static bool
-clog_stashed_event_matches_message_fields(
-        const struct clog_stashed_event* event,
-        struct clog_message_fields* fields)
+clog_stash_query_matches(const struct clog_stash_query* query, size_t id)
 {
-    struct clog_message_field* field;
-    for (field = fields->head; field != NULL; field = field->next) {
-        const char* key = field->key;
-        const char* expected = field->value;
-        const char *actual = cork_hash_table_get(event->fields, key);
-        if (actual == NULL || strcmp(expected, actual) != 0) {
+    size_t i;
+    for (i = 0; i < cork_array_size(&query->postings); i++) {
+        const struct clog_stash_postings* postings =
+            cork_array_at(&query->postings, i);
+        if (postings != query->shortest &&
+            !clog_stash_postings_contains(postings, id)) {
             return false;
         }
     }
     return true;
 }
 
+/* Returns the index of the first matching event that's >= from, or
+ * CLOG_STASH_NO_EVENT. */
+static size_t
+clog_stash_query_next(const struct clog_stash_query* query,
+                      const struct clog_stash* stash, size_t from)
+{
+    size_t i;
+    if (query->empty) {
+        return CLOG_STASH_NO_EVENT;
+    }
+    if (query->shortest == NULL) {
+        return (from < cork_array_size(&stash->events)) ?
+            from : CLOG_STASH_NO_EVENT;
+    }
+    for (i = clog_stash_postings_lower_bound(query->shortest, from);
+         i < query->shortest->count; i++) {
+        size_t id = query->shortest->ids[i];
+        if (clog_stash_query_matches(query, id)) {
+            return id;
+        }
+    }
+    return CLOG_STASH_NO_EVENT;
+}
+
+/* Returns the index of the last matching event, or CLOG_STASH_NO_EVENT. */
+static size_t
+clog_stash_query_last(const struct clog_stash_query* query,
+                      const struct clog_stash* stash)
+{
+    size_t i;
+    if (query->empty) {
+        return CLOG_STASH_NO_EVENT;
+    }
+    if (query->shortest == NULL) {
+        return (cork_array_size(&stash->events) > 0) ?
+            cork_array_size(&stash->events) - 1 : CLOG_STASH_NO_EVENT;
+    }
+    for (i = query->shortest->count; i > 0; i--) {
+        size_t id = query->shortest->ids[i - 1];
+        if (clog_stash_query_matches(query, id)) {
+            return id;
+        }
+    }
+    return CLOG_STASH_NO_EVENT;
+}
+
+static size_t
+clog_stash_query_count(const struct clog_stash_query* query,
+                       const struct clog_stash* stash)
+{
+    size_t count = 0;
+    size_t i;
+    if (query->empty) {
+        return 0;
+    }
+    if (query->shortest == NULL) {
+        return cork_array_size(&stash->events);
+    }
+    for (i = 0; i < query->shortest->count; i++) {
+        if (clog_stash_query_matches(query, query->shortest->ids[i])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Segments
+ */
+
+struct clog_stash_thread_cache {
+    size_t stash_id;
+    struct clog_stash_segment* segment;
+};
+
+/* The segment that the current thread most recently logged into, so that we
+ * don't have to look at the stash's segment list for every message. */
+cork_tls(struct clog_stash_thread_cache, thread_cache);
+
+static struct clog_stash_segment*
+clog_stash_segment_new(cork_thread_id owner)
+{
+    struct clog_stash_segment* segment = cork_new(struct clog_stash_segment);
+    segment->next = NULL;
+    segment->owner = owner;
+    segment->chunks = NULL;
+    segment->keys = cork_string_hash_table_new(0, 0);
+    cork_array_init(&segment->fields);
+    segment->head = NULL;
+    segment->tail = NULL;
+    segment->published = 0;
+    segment->last_merged = NULL;
+    segment->merged = 0;
+    return segment;
+}
+
 static void
-clog_stashed_event_add(struct clog_stashed_event* event, const char* key,
-                       const char* value)
+clog_stash_segment_free(struct clog_stash_segment* segment)
 {
-    const char* key_copy = cork_strdup(key);
-    const char* value_copy = cork_strdup(value);
-    bool is_new;
-    void* old_key;
-    void* old_value;
-    cork_hash_table_put(event->fields, (void*) key_copy, (void*) value_copy,
-                        &is_new, &old_key, &old_value);
-    if (!is_new) {
-        cork_strfree((const char*) old_key);
-        cork_strfree((const char*) old_value);
+    cork_hash_table_free(segment->keys);
+    clog_stash_free_chunks(segment->chunks);
+    cork_array_done(&segment->fields);
+    cork_delete(struct clog_stash_segment, segment);
+}
+
+/* Returns the current thread's segment, creating it if needed. */
+static struct clog_stash_segment*
+clog_stash_get_segment(struct clog_stash* stash)
+{
+    struct clog_stash_thread_cache* cache = thread_cache_get();
+    struct clog_stash_segment* segment;
+    cork_thread_id tid;
+
+    if (CORK_LIKELY(cache->stash_id == stash->id)) {
+        return cache->segment;
+    }
+
+    tid = cork_current_thread_get_id();
+    pthread_mutex_lock(&stash->segments_lock);
+    for (segment = stash->segments; segment != NULL; segment = segment->next) {
+        if (segment->owner == tid) {
+            break;
+        }
+    }
+    if (segment == NULL) {
+        segment = clog_stash_segment_new(tid);
+        segment->next = stash->segments;
+        stash->segments = segment;
+    }
+    pthread_mutex_unlock(&stash->segments_lock);
+
+    cache->stash_id = stash->id;
+    cache->segment = segment;
+    return segment;
+}
+
+static const char*
+clog_stash_segment_intern_key(struct clog_stash_segment* segment,
+                              const char* key)
+{
+    const char* interned = cork_hash_table_get(segment->keys, key);
+    if (CORK_UNLIKELY(interned == NULL)) {
+        size_t size = strlen(key) + 1;
+        char* copy = clog_stash_alloc(&segment->chunks, size);
+        memcpy(copy, key, size);
+        cork_hash_table_put(segment->keys, copy, copy, NULL, NULL, NULL);
+        interned = copy;
     }
+    return interned;
 }
 
 static void
-clog_stashed_event_free_callback(void* ud, void* vevent)
+clog_stash_segment_add_field(struct clog_stash_segment* segment,
+                             const char* key, const char* value)
 {
-    struct clog_stashed_event** event = vevent;
-    clog_stashed_event_free(*event);
+    const char* interned = clog_stash_segment_intern_key(segment, key);
+    struct clog_stash_pending_field* field;
+    size_t i;
+
+    /* If a key appears more than once, the last value that we're given
+     * wins. */
+    for (i = 0; i < cork_array_size(&segment->fields); i++) {
+        field = &cork_array_at(&segment->fields, i);
+        if (field->key == interned) {
+            field->value = value;
+            return;
+        }
+    }
+    field = cork_array_append_get(&segment->fields);
+    field->key = interned;
+    field->value = value;
 }
 
-struct clog_stash {
-    cork_array(struct clog_stashed_event*) events;
-};
+static void
+clog_stash_add_event(struct clog_stash* stash, struct clog_message* message)
+{
+    struct clog_stash_segment* segment = clog_stash_get_segment(stash);
+    struct clog_stashed_event* event;
+    struct clog_message_field* field;
+    size_t field_count;
+    size_t values_size = 0;
+    char* values;
+    size_t i;
+
+    cork_array_clear(&segment->fields);
+    for (field = message->fields.head; field != NULL; field = field->next) {
+        clog_stash_segment_add_field(segment, field->key,
+                                     clog_message_field_value(field));
+    }
+    clog_stash_segment_add_field(segment, CLOG_STASH_MESSAGE_KEY,
+                                 clog_message_message(message));
+
+    field_count = cork_array_size(&segment->fields);
+    for (i = 0; i < field_count; i++) {
+        values_size += strlen(cork_array_at(&segment->fields, i).value) + 1;
+    }
+
+    event = clog_stash_alloc
+        (&segment->chunks,
+         sizeof(struct clog_stashed_event) +
+         field_count * sizeof(struct clog_stashed_field) + values_size);
+    event->next = NULL;
+    event->field_count = field_count;
+    values = (char*) &event->fields[field_count];
+    for (i = 0; i < field_count; i++) {
+        const struct clog_stash_pending_field* src =
+            &cork_array_at(&segment->fields, i);
+        size_t size = strlen(src->value) + 1;
+        memcpy(values, src->value, size);
+        event->fields[i].key = src->key;
+        event->fields[i].value = values;
+        values += size;
+    }
+
+    /* Claim the sequence number as late as we can, so that queries don't
+     * have to wait long for us to publish the event. */
+    event->seq = cork_size_atomic_add(&stash->next_seq, 1) - 1;
+    if (segment->tail == NULL) {
+        segment->head = event;
+    } else {
+        segment->tail->next = event;
+    }
+    segment->tail = event;
+    /* This is a full barrier, so the event is visible before the count. */
+    cork_size_atomic_add(&segment->published, 1);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Stashes
+ */
+
+/* Must be called while holding the query lock. */
+static void
+clog_stash_merge_event(struct clog_stash* stash,
+                       struct clog_stashed_event* event)
+{
+    size_t id = cork_array_size(&stash->events);
+    size_t i;
+    for (i = 0; i < event->field_count; i++) {
+        struct clog_stash_key* key =
+            clog_stash_intern_key(stash, event->fields[i].key);
+        event->fields[i].key = key->name;
+        clog_stash_add_posting(stash, key, event->fields[i].value, id);
+    }
+    cork_array_append(&stash->events, event);
+}
+
+/* Must be called while holding the query lock. */
+static void
+clog_stash_merge(struct clog_stash* stash)
+{
+    struct clog_stash_segment* segments;
+    struct clog_stash_segment* segment;
+
+    /* Any segment created after this can only contain events with later
+     * sequence numbers than the ones we can see now, so we'll stop before
+     * we'd need them. */
+    pthread_mutex_lock(&stash->segments_lock);
+    segments = stash->segments;
+    pthread_mutex_unlock(&stash->segments_lock);
+
+    while (true) {
+        size_t expected = cork_array_size(&stash->events);
+        struct clog_stashed_event* event = NULL;
+        for (segment = segments; segment != NULL; segment = segment->next) {
+            /* Adding 0 gives us a full barrier, so that we see the event
+             * that the count covers. */
+            size_t published = cork_size_atomic_add(&segment->published, 0);
+            if (segment->merged < published) {
+                event = (segment->last_merged == NULL) ?
+                    segment->head : segment->last_merged->next;
+                if (event->seq == expected) {
+                    break;
+                }
+            }
+        }
+        if (segment == NULL) {
+            /* Either we've merged everything, or the next event hasn't been
+             * published yet. */
+            return;
+        }
+        clog_stash_merge_event(stash, event);
+        segment->last_merged = event;
+        segment->merged++;
+    }
+}
+
+/* Merges any newly published events and claims the query lock.  Queries
+ * don't change what's in the stash, which is why they take a const pointer,
+ * even though they might have to update its indexes. */
+static struct clog_stash*
+clog_stash_lock(const struct clog_stash* cstash)
+{
+    struct clog_stash* stash = (struct clog_stash*) cstash;
+    pthread_mutex_lock(&stash->query_lock);
+    clog_stash_merge(stash);
+    return stash;
+}
+
+static void
+clog_stash_unlock(struct clog_stash* stash)
+{
+    pthread_mutex_unlock(&stash->query_lock);
+}
 
 struct clog_stash*
 clog_stash_new(void)
 {
     struct clog_stash* stash = cork_new(struct clog_stash);
+    stash->id = cork_size_atomic_add(&next_stash_id, 1);
+    stash->next_seq = 0;
+    pthread_mutex_init(&stash->segments_lock, NULL);
+    stash->segments = NULL;
+    pthread_mutex_init(&stash->query_lock, NULL);
     cork_array_init(&stash->events);
-    cork_array_set_remove(&stash->events, clog_stashed_event_free_callback);
-    cork_array_set_done(&stash->events, clog_stashed_event_free_callback);
+    stash->keys = cork_string_hash_table_new(0, 0);
+    cork_hash_table_set_free_value(stash->keys, clog_stash_key_free);
+    stash->chunks = NULL;
     return stash;
 }
 
 void
 clog_stash_free(struct clog_stash* stash)
 {
+    struct clog_stash_segment* segment;
+    struct clog_stash_segment* next;
+    for (segment = stash->segments; segment != NULL; segment = next) {
+        next = segment->next;
+        clog_stash_segment_free(segment);
+    }
+    /* Free the indexes first, since their keys live in the chunks. */
+    cork_hash_table_free(stash->keys);
+    clog_stash_free_chunks(stash->chunks);
     cork_array_done(&stash->events);
+    pthread_mutex_destroy(&stash->segments_lock);
+    pthread_mutex_destroy(&stash->query_lock);
     cork_delete(struct clog_stash, stash);
 }
 
+size_t
+clog_stash_event_count(const struct clog_stash* cstash)
+{
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    size_t result = cork_array_size(&stash->events);
+    clog_stash_unlock(stash);
+    return result;
+}
+
+const char*
+clog_stash_event_get(const struct clog_stash* cstash, size_t index,
+                     const char* key)
+{
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    const struct clog_stash_key* interned = clog_stash_find_key(stash, key);
+    const struct clog_stashed_event* event;
+    const char* result = NULL;
+    size_t i;
+
+    if (interned != NULL && index < cork_array_size(&stash->events)) {
+        event = cork_array_at(&stash->events, index);
+        for (i = 0; i < event->field_count; i++) {
+            if (event->fields[i].key == interned->name) {
+                result = event->fields[i].value;
+                break;
+            }
+        }
+    }
+    clog_stash_unlock(stash);
+    return result;
+}
+
 bool
-clog_stash_contains_event(const struct clog_stash* stash, ...)
-{
-    for (size_t i = 0; i < cork_array_size(&stash->events); i++) {
-        va_list args;
-        va_start(args, stash);
-        bool matches = clog_stashed_event_matches(
-                cork_array_at(&stash->events, i), args);
-        va_end(args);
-        if (matches) {
-            return true;
+clog_stash_contains_event(const struct clog_stash* cstash, ...)
+{
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    struct clog_stash_query query;
+    bool result;
+    va_list args;
+
+    clog_stash_query_init(&query);
+    va_start(args, cstash);
+    result = clog_stash_query_add_args(&query, stash, &args);
+    va_end(args);
+    if (result) {
+        result = clog_stash_query_next(&query, stash, 0) != CLOG_STASH_NO_EVENT;
+    }
+    clog_stash_query_done(&query);
+    clog_stash_unlock(stash);
+    return result;
+}
+
+size_t
+clog_stash_count_events(const struct clog_stash* cstash, ...)
+{
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    struct clog_stash_query query;
+    size_t result = 0;
+    va_list args;
+
+    clog_stash_query_init(&query);
+    va_start(args, cstash);
+    if (clog_stash_query_add_args(&query, stash, &args)) {
+        result = clog_stash_query_count(&query, stash);
+    }
+    va_end(args);
+    clog_stash_query_done(&query);
+    clog_stash_unlock(stash);
+    return result;
+}
+
+bool
+clog_stash_find_first_event(const struct clog_stash* cstash, size_t* index,
+                            ...)
+{
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    struct clog_stash_query query;
+    size_t id = CLOG_STASH_NO_EVENT;
+    va_list args;
+
+    clog_stash_query_init(&query);
+    va_start(args, index);
+    if (clog_stash_query_add_args(&query, stash, &args)) {
+        id = clog_stash_query_next(&query, stash, 0);
+    }
+    va_end(args);
+    clog_stash_query_done(&query);
+    clog_stash_unlock(stash);
+    if (id == CLOG_STASH_NO_EVENT) {
+        return false;
+    }
+    *index = id;
+    return true;
+}
+
+bool
+clog_stash_find_last_event(const struct clog_stash* cstash, size_t* index,
+                           ...)
+{
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    struct clog_stash_query query;
+    size_t id = CLOG_STASH_NO_EVENT;
+    va_list args;
+
+    clog_stash_query_init(&query);
+    va_start(args, index);
+    if (clog_stash_query_add_args(&query, stash, &args)) {
+        id = clog_stash_query_last(&query, stash);
+    }
+    va_end(args);
+    clog_stash_query_done(&query);
+    clog_stash_unlock(stash);
+    if (id == CLOG_STASH_NO_EVENT) {
+        return false;
+    }
+    *index = id;
+    return true;
+}
+
+bool
+clog_stash_contains_sequence(const struct clog_stash* cstash, ...)
+{
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    struct clog_stash_query query;
+    size_t next = 0;
+    bool result = true;
+    va_list args;
+
+    /* Each pattern ends with a NULL key, and an empty pattern ends the
+     * sequence.  Matching each pattern against the earliest event that it
+     * can is enough to tell whether any ordering of events would work. */
+    va_start(args, cstash);
+    while (true) {
+        size_t id;
+        clog_stash_query_init(&query);
+        if (!clog_stash_query_add_args(&query, stash, &args)) {
+            clog_stash_query_done(&query);
+            result = false;
+            break;
         }
+        if (!query.empty && query.shortest == NULL) {
+            clog_stash_query_done(&query);
+            break;
+        }
+        id = clog_stash_query_next(&query, stash, next);
+        clog_stash_query_done(&query);
+        if (id == CLOG_STASH_NO_EVENT) {
+            result = false;
+            break;
+        }
+        next = id + 1;
     }
-    return false;
+    va_end(args);
+    clog_stash_unlock(stash);
+    return result;
 }
 
 bool
-clog_stash_contains_message_fields(const struct clog_stash* stash,
+clog_stash_contains_message_fields(const struct clog_stash* cstash,
                                    struct clog_message_fields* fields)
 {
-    for (size_t i = 0; i < cork_array_size(&stash->events); i++) {
-        bool matches = clog_stashed_event_matches_message_fields(
-                cork_array_at(&stash->events, i), fields);
-        if (matches) {
-            clog_message_fields_done(fields);
-            return true;
-        }
+    struct clog_stash* stash = clog_stash_lock(cstash);
+    struct clog_stash_query query;
+    struct clog_message_field* field;
+    bool result;
+
+    clog_stash_query_init(&query);
+    for (field = fields->head; field != NULL; field = field->next) {
+        clog_stash_query_add(&query, stash, field->key,
+                             clog_message_field_value(field));
     }
+    result = clog_stash_query_next(&query, stash, 0) != CLOG_STASH_NO_EVENT;
+    clog_stash_query_done(&query);
+    clog_stash_unlock(stash);
     clog_message_fields_done(fields);
-    return false;
+    return result;
 }
 
 struct clog_stashing_handler {
@@ -174,13 +879,7 @@ clog_stashing_handler_handle(struct clog_handler* handler,
 {
     struct clog_stashing_handler* self =
             cork_container_of(handler, struct clog_stashing_handler, parent);
-    struct clog_stashed_event* event = clog_stashed_event_new();
-    struct clog_message_field* field;
-    for (field = message->fields.head; field != NULL; field = field->next) {
-        clog_stashed_event_add(event, field->key, field->value);
-    }
-    clog_stashed_event_add(event, "__message", clog_message_message(message));
-    cork_array_append(&self->stash->events, event);
+    clog_stash_add_event(self->stash, message);
     if (handler->next != NULL) {
         clog_handler_handle(handler->next, message);
     }
@@ -8,8 +8,14 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include <libcork/core.h>
 #include <libcork/ds.h>
@@ -19,48 +25,125 @@
 #include "clogger/api.h"
 #include "clogger/formatter.h"
 #include "clogger/handlers.h"
-
-
-struct clog_stream_handler {
-    struct clog_handler parent;
-    struct cork_stream_consumer* consumer;
-    volatile cork_thread_id active_thread;
-    struct cork_buffer buf;
-    struct clog_formatter* fmt;
-    bool first_chunk;
-};
+#include "internal.h"
 
 
 /*-----------------------------------------------------------------------
- * Simple spin-lock
+ * Adaptive lock
  */
 
-/* Returns true if we've just claimed the lock; false if we already had it. */
+/* How long we spin adapts to how long it has recently taken for the lock to
+ * become free, in the same way as glibc's adaptive mutexes. */
+
+#define CLOG_STREAM_MIN_SPINS  16
+#define CLOG_STREAM_MAX_SPINS  4096
+
+void
+_clog_stream_lock_init(struct clog_stream_lock* lock)
+{
+    lock->active_thread = CORK_THREAD_NONE;
+    lock->waiters = 0;
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_cond_init(&lock->released, NULL);
+    lock->spin_estimate = CLOG_STREAM_MIN_SPINS;
+    memset(&lock->stats, 0, sizeof(lock->stats));
+}
+
+void
+_clog_stream_lock_done(struct clog_stream_lock* lock)
+{
+    pthread_cond_destroy(&lock->released);
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static uint64_t
+clog_stream_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 static bool
-clog_stream_handler_claim(struct clog_stream_handler* self)
+clog_stream_lock_try(struct clog_stream_lock* lock, cork_thread_id tid)
+{
+    return lock->active_thread == CORK_THREAD_NONE &&
+           cork_uint_cas(&lock->active_thread, CORK_THREAD_NONE, tid) ==
+                   CORK_THREAD_NONE;
+}
+
+bool
+_clog_stream_lock_claim(struct clog_stream_lock* lock)
 {
     cork_thread_id tid = cork_current_thread_get_id();
-    if (self->active_thread == tid) {
+    unsigned int max_spins;
+    unsigned int spins;
+    uint64_t start;
+    uint64_t wait;
+    bool parked = false;
+
+    if (lock->active_thread == tid) {
         return false;
     }
 
-    while (cork_uint_cas(&self->active_thread, CORK_THREAD_NONE, tid) !=
-           CORK_THREAD_NONE) {
-        /* Someone else holds the lock.  Spin until it looks like it might be
-         * free. */
-        while (self->active_thread != CORK_THREAD_NONE) {
-            cork_pause();
+    if (CORK_LIKELY(clog_stream_lock_try(lock, tid))) {
+        lock->stats.acquisitions++;
+        return true;
+    }
+
+    /* Someone else holds the lock.  Spin until it looks like it might be
+     * free, but not for much longer than it's taken recently. */
+    start = clog_stream_now();
+    max_spins = lock->spin_estimate * 2 + CLOG_STREAM_MIN_SPINS;
+    if (max_spins > CLOG_STREAM_MAX_SPINS) {
+        max_spins = CLOG_STREAM_MAX_SPINS;
+    }
+    for (spins = 0; spins < max_spins; spins++) {
+        cork_pause();
+        if (clog_stream_lock_try(lock, tid)) {
+            break;
         }
     }
 
+    if (spins == max_spins) {
+        /* Park until the owner releases the lock.  We register as a waiter
+         * before trying again, so that the owner can't miss us. */
+        parked = true;
+        pthread_mutex_lock(&lock->mutex);
+        cork_int_atomic_add(&lock->waiters, 1);
+        while (!clog_stream_lock_try(lock, tid)) {
+            pthread_cond_wait(&lock->released, &lock->mutex);
+        }
+        cork_int_atomic_add(&lock->waiters, -1);
+        pthread_mutex_unlock(&lock->mutex);
+    }
+
+    /* We have the lock now, so it's safe to update everything else. */
+    lock->spin_estimate += ((int) spins - (int) lock->spin_estimate) / 8;
+    wait = clog_stream_now() - start;
+    lock->stats.acquisitions++;
+    lock->stats.spins++;
+    if (parked) {
+        lock->stats.parks++;
+    }
+    if (wait > lock->stats.max_wait_usec) {
+        lock->stats.max_wait_usec = wait;
+    }
     return true;
 }
 
-static void
-clog_stream_handler_release(struct clog_stream_handler* self)
+void
+_clog_stream_lock_release(struct clog_stream_lock* lock)
 {
-    /* Assume that we already have the lock */
-    self->active_thread = CORK_THREAD_NONE;
+    /* Assume that we already have the lock.  The CAS is a full barrier, so
+     * any thread that registers as a waiter after we check below will see
+     * that the lock is free. */
+    cork_uint_cas(&lock->active_thread, lock->active_thread, CORK_THREAD_NONE);
+    if (lock->waiters > 0) {
+        pthread_mutex_lock(&lock->mutex);
+        pthread_cond_signal(&lock->released);
+        pthread_mutex_unlock(&lock->mutex);
+    }
 }
 
 
@@ -68,21 +151,119 @@ clog_stream_handler_release(struct clog_stream_handler* self)
  * Stream handler
  */
 
+/* Each thread formats messages into its own buffer, so that formatting can
+ * happen in parallel, and we only need to hold the lock while writing the
+ * result to the stream.  The buffers are freed when their threads exit. */
+
+struct stream_thread_buf {
+    struct cork_buffer buf;
+    /* Set while the buffer is in use, in case writing a message causes
+     * another message to be logged from the same thread. */
+    bool in_use;
+};
+
+cork_tls(struct stream_thread_buf*, thread_buf);
+
+static pthread_once_t thread_buf_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_buf_key;
+
+static void
+stream_thread_buf_free(void* vbuf)
+{
+    struct stream_thread_buf* tbuf = vbuf;
+    cork_buffer_done(&tbuf->buf);
+    cork_delete(struct stream_thread_buf, tbuf);
+}
+
+static void
+stream_thread_buf_create_key(void)
+{
+    pthread_key_create(&thread_buf_key, stream_thread_buf_free);
+}
+
+struct cork_buffer*
+_clog_thread_buf_claim(void)
+{
+    struct stream_thread_buf** tbuf_ptr = thread_buf_get();
+    struct stream_thread_buf* tbuf = *tbuf_ptr;
+    if (CORK_UNLIKELY(tbuf == NULL)) {
+        tbuf = cork_new(struct stream_thread_buf);
+        cork_buffer_init(&tbuf->buf);
+        tbuf->in_use = false;
+        pthread_once(&thread_buf_key_once, stream_thread_buf_create_key);
+        pthread_setspecific(thread_buf_key, tbuf);
+        *tbuf_ptr = tbuf;
+    }
+    if (CORK_UNLIKELY(tbuf->in_use)) {
+        return NULL;
+    }
+    tbuf->in_use = true;
+    return &tbuf->buf;
+}
+
+void
+_clog_thread_buf_release(struct cork_buffer* buf)
+{
+    struct stream_thread_buf* tbuf =
+            cork_container_of(buf, struct stream_thread_buf, buf);
+    tbuf->in_use = false;
+}
+
+void
+_clog_thread_buf_write(void* user_data, struct clog_message* message,
+                       clog_thread_buf_write_f write)
+{
+    struct cork_buffer* tbuf = _clog_thread_buf_claim();
+    if (CORK_LIKELY(tbuf != NULL)) {
+        cork_buffer_clear(tbuf);
+        write(user_data, tbuf, message);
+        _clog_thread_buf_release(tbuf);
+    } else {
+        struct cork_buffer buf = CORK_BUFFER_INIT();
+        write(user_data, &buf, message);
+        cork_buffer_done(&buf);
+    }
+}
+
+struct clog_stream_handler {
+    struct clog_handler parent;
+    struct cork_stream_consumer* consumer;
+    /* Writes out anything that the consumer has buffered up.  NULL if the
+     * consumer doesn't buffer anything itself. */
+    clog_consumer_flush_f flush;
+    struct clog_stream_lock lock;
+    struct clog_formatter* fmt;
+    bool first_chunk;
+};
+
+static void
+clog_stream_handler_write(void* user_data, struct cork_buffer* buf,
+                          struct clog_message* message)
+{
+    struct clog_stream_handler* self = user_data;
+    bool claimed;
+
+    clog_formatter_format_message(self->fmt, buf, message);
+    cork_buffer_append(buf, "\n", 1);
+
+    /* If the consumer logs something to this same handler, we'll already
+     * hold the lock, and must leave it held for our caller. */
+    claimed = _clog_stream_lock_claim(&self->lock);
+    _clog_consumer_write_message(self->consumer, self->flush, buf->buf,
+                                 buf->size, self->first_chunk, message->level);
+    self->first_chunk = false;
+    if (claimed) {
+        _clog_stream_lock_release(&self->lock);
+    }
+}
+
 static void
 clog_stream_handler_handle(struct clog_handler* handler,
                            struct clog_message* message)
 {
     struct clog_stream_handler* self =
             cork_container_of(handler, struct clog_stream_handler, parent);
-
-    clog_stream_handler_claim(self);
-    clog_formatter_format_message(self->fmt, &self->buf, message);
-    cork_buffer_append(&self->buf, "\n", 1);
-    cork_stream_consumer_data(self->consumer, self->buf.buf, self->buf.size,
-                              self->first_chunk);
-    self->first_chunk = false;
-    clog_stream_handler_release(self);
-
+    _clog_thread_buf_write(self, message, clog_stream_handler_write);
     if (handler->next != NULL) {
         clog_handler_handle(handler->next, message);
     }
@@ -149,6 +330,358 @@ stream_consumer_new(FILE* fp, bool should_close)
 }
 
 
+/*-----------------------------------------------------------------------
+ * Stream consumer for file descriptors
+ */
+
+/* Collects records into a chunk, and writes the whole chunk to the file
+ * descriptor at once.  The chunk is written out when it fills up, when the
+ * oldest record in the chunk has been waiting for too long, or when the
+ * handler asks us to flush. */
+
+#define CLOG_STREAM_BATCH_SIZE  (64 * 1024)
+#define CLOG_STREAM_BATCH_USEC  100000
+
+struct fd_consumer {
+    struct cork_stream_consumer parent;
+    int fd;
+    unsigned int flags;
+    /* Protects chunk and chunk_start, since the flusher thread can write out
+     * the chunk while the handler isn't holding its own lock. */
+    pthread_mutex_t mutex;
+    struct cork_buffer chunk;
+    /* When the oldest record in chunk arrived */
+    uint64_t chunk_start;
+    /* The rest are protected by fd_flusher_mutex. */
+    bool queued;
+    uint64_t flush_at;
+    struct fd_consumer* next_queued;
+};
+
+static int
+fd_consumer_writev(struct fd_consumer* self, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t written = writev(self->fd, iov, iovcnt);
+        if (CORK_UNLIKELY(written < 0)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cork_system_error_set();
+            return -1;
+        }
+
+        /* Skip past whatever was written, in case it was a short write. */
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static int
+fd_consumer_flush_locked(struct fd_consumer* self)
+{
+    struct iovec iov;
+    int rc;
+
+    if (self->chunk.size == 0) {
+        return 0;
+    }
+    iov.iov_base = self->chunk.buf;
+    iov.iov_len = self->chunk.size;
+    rc = fd_consumer_writev(self, &iov, 1);
+    cork_buffer_clear(&self->chunk);
+    return rc;
+}
+
+int
+_clog_fd_consumer_flush(struct cork_stream_consumer* vself)
+{
+    struct fd_consumer* self =
+            cork_container_of(vself, struct fd_consumer, parent);
+    int rc;
+    if (self->flags & CLOG_STREAM_UNBATCHED) {
+        return 0;
+    }
+    pthread_mutex_lock(&self->mutex);
+    rc = fd_consumer_flush_locked(self);
+    pthread_mutex_unlock(&self->mutex);
+    return rc;
+}
+
+
+/* A background thread makes sure that no chunk waits longer than
+ * CLOG_STREAM_BATCH_USEC, even if nothing else is logged after it.  When a
+ * record starts a new chunk, its consumer joins the end of the flusher's
+ * queue; chunks are started in time order, so the head of the queue is always
+ * the next one that's due.  The thread only runs while there are batching
+ * consumers, and only wakes up when a chunk is due.
+ *
+ * The flusher holds fd_flusher_mutex while writing out a chunk, so that a
+ * consumer can't be freed out from under it. */
+
+static pthread_mutex_t fd_flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fd_flusher_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t fd_flusher_cond;
+static struct fd_consumer* fd_flusher_head = NULL;
+static struct fd_consumer* fd_flusher_tail = NULL;
+static size_t fd_flusher_consumers = 0;
+static bool fd_flusher_running = false;
+
+static void
+fd_flusher_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fd_flusher_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* fd_flusher_mutex must be held. */
+static void
+fd_flusher_push(struct fd_consumer* self, uint64_t chunk_start)
+{
+    self->queued = true;
+    self->flush_at = chunk_start + CLOG_STREAM_BATCH_USEC;
+    self->next_queued = NULL;
+    if (fd_flusher_tail == NULL) {
+        fd_flusher_head = self;
+        pthread_cond_signal(&fd_flusher_cond);
+    } else {
+        fd_flusher_tail->next_queued = self;
+    }
+    fd_flusher_tail = self;
+}
+
+/* fd_flusher_mutex must be held. */
+static void
+fd_flusher_remove(struct fd_consumer* self)
+{
+    struct fd_consumer** curr;
+    struct fd_consumer* prev = NULL;
+    for (curr = &fd_flusher_head; *curr != NULL;
+         prev = *curr, curr = &(*curr)->next_queued) {
+        if (*curr == self) {
+            *curr = self->next_queued;
+            if (fd_flusher_tail == self) {
+                fd_flusher_tail = prev;
+            }
+            break;
+        }
+    }
+    self->queued = false;
+}
+
+static void
+fd_flusher_enqueue(struct fd_consumer* self, uint64_t chunk_start)
+{
+    pthread_mutex_lock(&fd_flusher_mutex);
+    if (!self->queued) {
+        fd_flusher_push(self, chunk_start);
+    }
+    pthread_mutex_unlock(&fd_flusher_mutex);
+}
+
+/* fd_flusher_mutex must be held.  Writes out self's chunk if it's due.  If a
+ * newer chunk has been started since self was queued, self goes back in the
+ * queue to wait for that one. */
+static void
+fd_flusher_flush(struct fd_consumer* self)
+{
+    uint64_t now = clog_stream_now();
+    pthread_mutex_lock(&self->mutex);
+    if (self->chunk.size > 0) {
+        if (now - self->chunk_start >= CLOG_STREAM_BATCH_USEC) {
+            if (fd_consumer_flush_locked(self) != 0) {
+                /* There's no one to report the error to. */
+                cork_error_clear();
+            }
+        } else {
+            fd_flusher_push(self, self->chunk_start);
+        }
+    }
+    pthread_mutex_unlock(&self->mutex);
+}
+
+static void*
+fd_flusher_run(void* unused)
+{
+    pthread_mutex_lock(&fd_flusher_mutex);
+    while (fd_flusher_consumers > 0) {
+        struct fd_consumer* self = fd_flusher_head;
+        if (self == NULL) {
+            pthread_cond_wait(&fd_flusher_cond, &fd_flusher_mutex);
+        } else if (clog_stream_now() < self->flush_at) {
+            struct timespec deadline;
+            deadline.tv_sec = self->flush_at / 1000000;
+            deadline.tv_nsec = (self->flush_at % 1000000) * 1000;
+            pthread_cond_timedwait
+                (&fd_flusher_cond, &fd_flusher_mutex, &deadline);
+        } else {
+            fd_flusher_head = self->next_queued;
+            if (fd_flusher_head == NULL) {
+                fd_flusher_tail = NULL;
+            }
+            self->queued = false;
+            fd_flusher_flush(self);
+        }
+    }
+    fd_flusher_running = false;
+    pthread_mutex_unlock(&fd_flusher_mutex);
+    return NULL;
+}
+
+static void
+fd_flusher_add_consumer(void)
+{
+    pthread_once(&fd_flusher_once, fd_flusher_init);
+    pthread_mutex_lock(&fd_flusher_mutex);
+    fd_flusher_consumers++;
+    if (!fd_flusher_running) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        /* If we can't start the thread, chunks are still written out when
+         * they fill up, or when a later record finds that they're too old. */
+        fd_flusher_running =
+            (pthread_create(&thread, &attr, fd_flusher_run, NULL) == 0);
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&fd_flusher_mutex);
+}
+
+static void
+fd_flusher_remove_consumer(struct fd_consumer* self)
+{
+    pthread_mutex_lock(&fd_flusher_mutex);
+    if (self->queued) {
+        fd_flusher_remove(self);
+    }
+    if (--fd_flusher_consumers == 0) {
+        /* Let the thread see that it can exit. */
+        pthread_cond_signal(&fd_flusher_cond);
+    }
+    pthread_mutex_unlock(&fd_flusher_mutex);
+}
+
+
+static int
+fd_consumer_data(struct cork_stream_consumer* vself, const void* buf,
+                 size_t size, bool is_first)
+{
+    struct fd_consumer* self =
+            cork_container_of(vself, struct fd_consumer, parent);
+    struct iovec iov[2];
+    uint64_t now;
+    bool started;
+    int rc = 0;
+
+    if (self->flags & CLOG_STREAM_UNBATCHED) {
+        iov[0].iov_base = (void*) buf;
+        iov[0].iov_len = size;
+        return fd_consumer_writev(self, iov, 1);
+    }
+
+    pthread_mutex_lock(&self->mutex);
+    now = clog_stream_now();
+    started = (self->chunk.size == 0);
+    if (started) {
+        self->chunk_start = now;
+    }
+
+    if (self->chunk.size + size > CLOG_STREAM_BATCH_SIZE) {
+        /* Send the chunk and this record together, without copying the
+         * record into the chunk first. */
+        iov[0].iov_base = self->chunk.buf;
+        iov[0].iov_len = self->chunk.size;
+        iov[1].iov_base = (void*) buf;
+        iov[1].iov_len = size;
+        rc = fd_consumer_writev(self, iov, 2);
+        cork_buffer_clear(&self->chunk);
+    } else {
+        cork_buffer_append(&self->chunk, buf, size);
+        if (now - self->chunk_start >= CLOG_STREAM_BATCH_USEC) {
+            rc = fd_consumer_flush_locked(self);
+        }
+    }
+    started = started && self->chunk.size > 0;
+    pthread_mutex_unlock(&self->mutex);
+
+    if (started) {
+        fd_flusher_enqueue(self, now);
+    }
+    return rc;
+}
+
+static int
+fd_consumer_eof(struct cork_stream_consumer* vself)
+{
+    return _clog_fd_consumer_flush(vself);
+}
+
+static void
+fd_consumer_free(struct cork_stream_consumer* vself)
+{
+    struct fd_consumer* self =
+            cork_container_of(vself, struct fd_consumer, parent);
+    if (!(self->flags & CLOG_STREAM_UNBATCHED)) {
+        fd_flusher_remove_consumer(self);
+        fd_consumer_flush_locked(self);
+    }
+    if (self->flags & CLOG_STREAM_CLOSE_FD) {
+        close(self->fd);
+    }
+    pthread_mutex_destroy(&self->mutex);
+    cork_buffer_done(&self->chunk);
+    cork_delete(struct fd_consumer, self);
+}
+
+struct cork_stream_consumer*
+_clog_fd_consumer_new(int fd, unsigned int flags)
+{
+    struct fd_consumer* self = cork_new(struct fd_consumer);
+    self->parent.data = fd_consumer_data;
+    self->parent.eof = fd_consumer_eof;
+    self->parent.free = fd_consumer_free;
+    self->fd = fd;
+    self->flags = flags;
+    pthread_mutex_init(&self->mutex, NULL);
+    cork_buffer_init(&self->chunk);
+    self->chunk_start = 0;
+    self->queued = false;
+    self->flush_at = 0;
+    self->next_queued = NULL;
+    if (!(flags & CLOG_STREAM_UNBATCHED)) {
+        cork_buffer_ensure_size(&self->chunk, CLOG_STREAM_BATCH_SIZE);
+        fd_flusher_add_consumer();
+    }
+    return &self->parent;
+}
+
+int
+_clog_consumer_write_message(struct cork_stream_consumer* consumer,
+                             clog_consumer_flush_f flush,
+                             const void* buf, size_t size, bool is_first,
+                             enum clog_level level)
+{
+    int rc = cork_stream_consumer_data(consumer, buf, size, is_first);
+    if (flush != NULL && level <= CLOG_LEVEL_ERROR) {
+        int flush_rc = flush(consumer);
+        rc = (rc == 0) ? flush_rc : rc;
+    }
+    return rc;
+}
+
+
 /*-----------------------------------------------------------------------
  * Constructors and destructors
  */
@@ -159,7 +692,7 @@ clog_stream_handler_free(struct clog_handler* vself)
     struct clog_stream_handler* self =
             cork_container_of(vself, struct clog_stream_handler, parent);
     cork_stream_consumer_free(self->consumer);
-    cork_buffer_done(&self->buf);
+    _clog_stream_lock_done(&self->lock);
     if (self->fmt != NULL) {
         clog_formatter_free(self->fmt);
     }
@@ -174,8 +707,8 @@ clog_stream_handler_new_consumer(struct cork_stream_consumer* consumer,
     self->parent.handle = clog_stream_handler_handle;
     self->parent.free = clog_stream_handler_free;
     self->consumer = consumer;
-    self->active_thread = CORK_THREAD_NONE;
-    cork_buffer_init(&self->buf);
+    self->flush = NULL;
+    _clog_stream_lock_init(&self->lock);
     self->first_chunk = true;
     ep_check(self->fmt = clog_formatter_new(fmt));
     return &self->parent;
@@ -193,6 +726,46 @@ clog_stream_handler_new_fp(FILE* fp, bool should_close, const char* fmt)
     return clog_stream_handler_new_consumer(consumer, fmt);
 }
 
+void
+clog_stream_handler_get_stats(struct clog_handler* handler,
+                              struct clog_stream_handler_stats* stats)
+{
+    struct clog_stream_handler* self =
+            cork_container_of(handler, struct clog_stream_handler, parent);
+    *stats = self->lock.stats;
+}
+
+struct clog_handler*
+clog_stream_handler_new_fd(int fd, unsigned int flags, const char* fmt)
+{
+    struct clog_handler* handler;
+    struct clog_stream_handler* self;
+    rpp_check(handler = clog_stream_handler_new_consumer
+              (_clog_fd_consumer_new(fd, flags), fmt));
+    self = cork_container_of(handler, struct clog_stream_handler, parent);
+    self->flush = _clog_fd_consumer_flush;
+    return handler;
+}
+
+int
+clog_stream_handler_flush(struct clog_handler* handler)
+{
+    struct clog_stream_handler* self =
+            cork_container_of(handler, struct clog_stream_handler, parent);
+    bool claimed;
+    int rc = 0;
+
+    if (self->flush == NULL) {
+        return 0;
+    }
+    claimed = _clog_stream_lock_claim(&self->lock);
+    rc = self->flush(self->consumer);
+    if (claimed) {
+        _clog_stream_lock_release(&self->lock);
+    }
+    return rc;
+}
+
 struct clog_handler*
 clog_stderr_handler_new(const char* fmt)
 {
@@ -0,0 +1,94 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+
+
+/*-----------------------------------------------------------------------
+ * Thread identity
+ */
+
+/* The strings live right alongside the info that points at them, in the
+ * thread's own storage, so formatting a thread's identity never has to
+ * render or allocate anything. */
+
+struct clog_thread_cache {
+    bool valid;
+    struct clog_thread_info info;
+    char id[CLOG_FIELD_MAX_SIZE];
+    char name[CLOG_THREAD_NAME_MAX + 1];
+};
+
+cork_tls(struct clog_thread_cache, thread_cache);
+
+static void
+clog_thread_cache_set_name(struct clog_thread_cache* cache, const char* name)
+{
+    size_t size = strlen(name);
+    if (size > CLOG_THREAD_NAME_MAX) {
+        size = CLOG_THREAD_NAME_MAX;
+    }
+    memcpy(cache->name, name, size);
+    cache->name[size] = '\0';
+    cache->info.name = cache->name;
+    cache->info.name_size = size;
+}
+
+static void
+clog_thread_cache_set_default_name(struct clog_thread_cache* cache)
+{
+    struct cork_thread* thread = cork_current_thread_get();
+    const char* name = (thread == NULL) ? NULL : cork_thread_get_name(thread);
+    if (name == NULL || name[0] == '\0') {
+        cache->info.name = cache->id;
+        cache->info.name_size = cache->info.id_size;
+    } else {
+        clog_thread_cache_set_name(cache, name);
+    }
+}
+
+static struct clog_thread_cache*
+clog_thread_cache_get(void)
+{
+    struct clog_thread_cache* cache = thread_cache_get();
+    if (CORK_UNLIKELY(!cache->valid)) {
+        union clog_field_raw raw;
+        raw.u = cork_current_thread_get_id();
+        cache->info.id_size =
+            _clog_field_render_raw(cache->id, CLOG_FIELD_UINT, raw);
+        cache->id[cache->info.id_size] = '\0';
+        cache->info.id = cache->id;
+        clog_thread_cache_set_default_name(cache);
+        cache->valid = true;
+    }
+    return cache;
+}
+
+const struct clog_thread_info*
+clog_current_thread_info(void)
+{
+    return &clog_thread_cache_get()->info;
+}
+
+void
+clog_set_thread_name(const char* name)
+{
+    struct clog_thread_cache* cache = clog_thread_cache_get();
+    if (name == NULL) {
+        clog_thread_cache_set_default_name(cache);
+    } else {
+        clog_thread_cache_set_name(cache, name);
+    }
+}
@@ -0,0 +1,41 @@
+Messages written from the background thread should look the same as ones
+written directly.
+
+  $ CLOG=TRACE CLOG_ASYNC=4 clog-test
+  [CRITICAL] main: This is a critical message
+  [ERROR   ] main: This is a error message
+  [WARNING ] main: This is a warning message
+  [NOTICE  ] main: This is a notice message
+  [INFO    ] main: This is a info message
+  [DEBUG   ] main: This is a debug message
+  [TRACE   ] main: This is a trace message
+  [CRITICAL] libclogger: This is a critical message
+  [ERROR   ] libclogger: This is a error message
+  [WARNING ] libclogger: This is a warning message
+  [NOTICE  ] libclogger: This is a notice message
+  [INFO    ] libclogger: This is a info message
+  [DEBUG   ] libclogger: This is a debug message
+  [TRACE   ] libclogger: This is a trace message
+
+  $ CLOG=WARNING CLOG_ASYNC=1 CLOG_ASYNC_OVERFLOW=block clog-test
+  [CRITICAL] main: This is a critical message
+  [ERROR   ] main: This is a error message
+  [WARNING ] main: This is a warning message
+  [CRITICAL] libclogger: This is a critical message
+  [ERROR   ] libclogger: This is a error message
+  [WARNING ] libclogger: This is a warning message
+
+
+Bad settings
+
+  $ CLOG_ASYNC=lots clog-test
+  Invalid CLOG_ASYNC queue size lots
+  [1]
+
+  $ CLOG_ASYNC=0 clog-test
+  Invalid CLOG_ASYNC queue size 0
+  [1]
+
+  $ CLOG_ASYNC=4 CLOG_ASYNC_OVERFLOW=sometimes clog-test
+  Unknown CLOG_ASYNC_OVERFLOW policy sometimes
+  [1]
@@ -0,0 +1,50 @@
+Binary records should decode to the same text that we'd have written
+directly.
+
+  $ CLOG=TRACE CLOG_BINARY=1 clog-test 2>log.bin
+  $ head -c 8 log.bin
+  clogbin1 (no-eol)
+  $ clog-decode log.bin
+  [CRITICAL] main: This is a critical message
+  [ERROR   ] main: This is a error message
+  [WARNING ] main: This is a warning message
+  [NOTICE  ] main: This is a notice message
+  [INFO    ] main: This is a info message
+  [DEBUG   ] main: This is a debug message
+  [TRACE   ] main: This is a trace message
+  [CRITICAL] libclogger: This is a critical message
+  [ERROR   ] libclogger: This is a error message
+  [WARNING ] libclogger: This is a warning message
+  [NOTICE  ] libclogger: This is a notice message
+  [INFO    ] libclogger: This is a info message
+  [DEBUG   ] libclogger: This is a debug message
+  [TRACE   ] libclogger: This is a trace message
+
+  $ CLOG=WARNING CLOG_BINARY=1 clog-test 2>&1 | clog-decode -f '%c %L %m'
+  main CRITICAL This is a critical message
+  main ERROR    This is a error message
+  main WARNING  This is a warning message
+  libclogger CRITICAL This is a critical message
+  libclogger ERROR    This is a error message
+  libclogger WARNING  This is a warning message
+
+Records keep the time that each message was logged.
+
+  $ clog-decode -f '%t %c' log.bin | head -n 2
+  20\d\d-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z main (re)
+  20\d\d-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z main (re)
+
+
+Bad input
+
+  $ echo "not a log" | clog-decode
+  Not a binary log stream
+  [1]
+
+  $ head -c 20 log.bin | clog-decode
+  Truncated binary log record
+  [1]
+
+  $ clog-decode missing.bin
+  missing.bin: No such file or directory
+  [1]
@@ -99,9 +99,43 @@ Try some custom formats.
   not helpful
   not helpful
 
+Timestamps depend on when the test runs, so we only check their shape.
+
+  $ CLOG=CRITICAL CLOG_FORMAT="%t %t{ms} %t{offset} %c" clog-test
+  \d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z \d{13} \d+\.\d{6} main (re)
+  \d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z \d{13} \d+\.\d{6} libclogger (re)
+
+Unnamed threads use their ID.
+
+  $ CLOG=CRITICAL CLOG_FORMAT="[%T{id}] [%T] %c" clog-test
+  \[\d+\] \[\d+\] main (re)
+  \[\d+\] \[\d+\] libclogger (re)
+
+Each message knows which statement logged it.
+
+  $ CLOG=CRITICAL CLOG_FORMAT="%s{func}:%s{line} %c" clog-test
+  main:30 main
+  main:39 libclogger
+
+  $ CLOG=CRITICAL CLOG_FORMAT="%s %c" clog-test
+  .*clog-test.c:30 main (re)
+  .*clog-test.c:39 libclogger (re)
+
 
 We should get an error message for illegal formats.
 
   $ CLOG_FORMAT=%q clog-test
   Unknown conversion %q
   [1]
+
+  $ CLOG_FORMAT=%t{never} clog-test
+  Unknown timestamp style never
+  [1]
+
+  $ CLOG_FORMAT=%T{pid} clog-test
+  Unknown thread style pid
+  [1]
+
+  $ CLOG_FORMAT=%s{where} clog-test
+  Unknown source style where
+  [1]
@@ -0,0 +1,22 @@
+Each message should be written as a JSON object on its own line.
+
+  $ CLOG=NOTICE CLOG_JSON=1 clog-test
+  {"level":"CRITICAL","channel":"main","message":"This is a critical message"}
+  {"level":"ERROR","channel":"main","message":"This is a error message"}
+  {"level":"WARNING","channel":"main","message":"This is a warning message"}
+  {"level":"NOTICE","channel":"main","message":"This is a notice message"}
+  {"level":"CRITICAL","channel":"libclogger","message":"This is a critical message"}
+  {"level":"ERROR","channel":"libclogger","message":"This is a error message"}
+  {"level":"WARNING","channel":"libclogger","message":"This is a warning message"}
+  {"level":"NOTICE","channel":"libclogger","message":"This is a notice message"}
+
+
+JSON output can't be combined with other output formats.
+
+  $ CLOG_JSON=1 CLOG_BINARY=1 clog-test
+  CLOG_BINARY can't be used with CLOG_JSON
+  [1]
+
+  $ CLOG_JSON=1 CLOG_FILE=log.txt clog-test
+  CLOG_JSON can't be used with CLOG_FILE
+  [1]
@@ -160,3 +160,28 @@ We should get an error message if the log level isn't recognized.
   $ CLOG=UNKNOWN clog-test
   Unknown CLOG level UNKNOWN
   [1]
+
+
+Levels can be overridden for individual channels.
+
+  $ CLOG=warning,main=debug clog-test
+  [CRITICAL] main: This is a critical message
+  [ERROR   ] main: This is a error message
+  [WARNING ] main: This is a warning message
+  [NOTICE  ] main: This is a notice message
+  [INFO    ] main: This is a info message
+  [DEBUG   ] main: This is a debug message
+  [CRITICAL] libclogger: This is a critical message
+  [ERROR   ] libclogger: This is a error message
+  [WARNING ] libclogger: This is a warning message
+
+  $ CLOG=libclogger=none,critical clog-test
+  [CRITICAL] main: This is a critical message
+
+  $ CLOG=main=loud clog-test
+  Unknown CLOG level loud
+  [1]
+
+  $ CLOG==debug clog-test
+  Missing channel name in CLOG level =debug
+  [1]
@@ -0,0 +1,12 @@
+Rotated files can be compressed
+
+  $ CLOG=TRACE CLOG_FILE=gz.txt CLOG_ROTATE=size=200,keep=2,compress clog-test
+  $ ls gz.txt*
+  gz.txt
+  gz.txt.1.gz
+  gz.txt.2.gz
+  $ gunzip -c gz.txt.1.gz
+  [ERROR   ] libclogger: This is a error message
+  [WARNING ] libclogger: This is a warning message
+  [NOTICE  ] libclogger: This is a notice message
+  [INFO    ] libclogger: This is a info message
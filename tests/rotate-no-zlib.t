@@ -0,0 +1,5 @@
+Without zlib, asking for compressed files is an error
+
+  $ CLOG_FILE=gz.txt CLOG_ROTATE=size=200,compress clog-test
+  Can't compress rotated files without zlib
+  [1]
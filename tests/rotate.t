@@ -0,0 +1,73 @@
+Messages can be written to a file instead of stderr, which is added to if it
+already exists.
+
+  $ CLOG=WARNING CLOG_FILE=log.txt clog-test
+  $ CLOG=CRITICAL CLOG_FILE=log.txt clog-test
+  $ cat log.txt
+  [CRITICAL] main: This is a critical message
+  [ERROR   ] main: This is a error message
+  [WARNING ] main: This is a warning message
+  [CRITICAL] libclogger: This is a critical message
+  [ERROR   ] libclogger: This is a error message
+  [WARNING ] libclogger: This is a warning message
+  [CRITICAL] main: This is a critical message
+  [CRITICAL] libclogger: This is a critical message
+
+
+Rotating by size, keeping only the newest files
+
+  $ CLOG=TRACE CLOG_FILE=rotated.txt CLOG_ROTATE=size=200,keep=2 clog-test
+  $ ls rotated.txt*
+  rotated.txt
+  rotated.txt.1
+  rotated.txt.2
+  $ cat rotated.txt.2
+  [INFO    ] main: This is a info message
+  [DEBUG   ] main: This is a debug message
+  [TRACE   ] main: This is a trace message
+  [CRITICAL] libclogger: This is a critical message
+  $ cat rotated.txt.1
+  [ERROR   ] libclogger: This is a error message
+  [WARNING ] libclogger: This is a warning message
+  [NOTICE  ] libclogger: This is a notice message
+  [INFO    ] libclogger: This is a info message
+  $ cat rotated.txt
+  [DEBUG   ] libclogger: This is a debug message
+  [TRACE   ] libclogger: This is a trace message
+
+
+Bad settings
+
+  $ CLOG_FILE=bad.txt CLOG_ROTATE=size=lots clog-test
+  Invalid rotation settings size=lots
+  [1]
+
+  $ CLOG_FILE=bad.txt CLOG_ROTATE=keep=1,colour clog-test
+  Invalid rotation settings keep=1,colour
+  [1]
+
+Values that don't fit are rejected, rather than wrapping around
+
+  $ CLOG_FILE=bad.txt CLOG_ROTATE=size=99999999999999999999 clog-test
+  Invalid rotation settings size=99999999999999999999
+  [1]
+
+  $ CLOG_FILE=bad.txt CLOG_ROTATE=size=99999999999G clog-test
+  Invalid rotation settings size=99999999999G
+  [1]
+
+  $ CLOG_FILE=bad.txt CLOG_ROTATE=age=5000000000 clog-test
+  Invalid rotation settings age=5000000000
+  [1]
+
+  $ CLOG_FILE=bad.txt CLOG_ROTATE=age=100000d clog-test
+  Invalid rotation settings age=100000d
+  [1]
+
+  $ CLOG_FILE=missing/log.txt clog-test
+  missing/log.txt: No such file or directory
+  [1]
+
+  $ CLOG_FILE=bad.txt CLOG_BINARY=1 clog-test
+  CLOG_BINARY can't be used with CLOG_FILE
+  [1]
@@ -0,0 +1,336 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+#include "clogger/stash.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Gate handler
+ */
+
+/* Records the text of each message that it sees, and the name of the thread
+ * that logged the last one.  While the gate is closed, the handler blocks,
+ * which lets us fill up an async handler's queue. */
+
+struct gate_handler {
+    struct clog_handler parent;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool entered;
+    bool open;
+    size_t count;
+    struct cork_buffer received;
+    struct cork_buffer thread;
+};
+
+static void
+gate_handler__handle(struct clog_handler* handler, struct clog_message* message)
+{
+    struct gate_handler* self =
+            cork_container_of(handler, struct gate_handler, parent);
+    pthread_mutex_lock(&self->mutex);
+    self->entered = true;
+    pthread_cond_broadcast(&self->cond);
+    while (!self->open) {
+        pthread_cond_wait(&self->cond, &self->mutex);
+    }
+    if (self->received.size > 0) {
+        cork_buffer_append(&self->received, " ", 1);
+    }
+    clog_message_append_message(message, &self->received);
+    cork_buffer_set_string(&self->thread, clog_message_thread(message)->name);
+    self->count++;
+    pthread_mutex_unlock(&self->mutex);
+}
+
+static void
+gate_handler__free(struct clog_handler* handler)
+{
+    struct gate_handler* self =
+            cork_container_of(handler, struct gate_handler, parent);
+    cork_buffer_done(&self->received);
+    cork_buffer_done(&self->thread);
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->mutex);
+    cork_delete(struct gate_handler, self);
+}
+
+static struct gate_handler*
+gate_handler_new(bool open)
+{
+    struct gate_handler* self = cork_new(struct gate_handler);
+    self->parent.handle = gate_handler__handle;
+    self->parent.free = gate_handler__free;
+    self->parent.next = NULL;
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    self->entered = false;
+    self->open = open;
+    self->count = 0;
+    cork_buffer_init(&self->received);
+    cork_buffer_init(&self->thread);
+    return self;
+}
+
+static void
+gate_handler_wait_until_entered(struct gate_handler* self)
+{
+    pthread_mutex_lock(&self->mutex);
+    while (!self->entered) {
+        pthread_cond_wait(&self->cond, &self->mutex);
+    }
+    pthread_mutex_unlock(&self->mutex);
+}
+
+static void
+gate_handler_open(struct gate_handler* self)
+{
+    pthread_mutex_lock(&self->mutex);
+    self->open = true;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Async handler
+ */
+
+#define CLOG_CHANNEL "test"
+
+#define fail_unless_received(gate, expected) \
+    do { \
+        const char* __actual = (gate)->received.buf; \
+        fail_unless(strcmp(__actual, (expected)) == 0, \
+                    "Unexpected messages\n  Got:      %s\n  Expected: %s", \
+                    __actual, (expected)); \
+    } while (0)
+
+START_TEST(test_async_order)
+{
+    DESCRIBE_TEST;
+    struct gate_handler* gate = gate_handler_new(true);
+    struct clog_async_handler* async =
+            clog_async_handler_new(&gate->parent, 4);
+    struct cork_buffer expected = CORK_BUFFER_INIT();
+    size_t i;
+
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(clog_async_handler_handler(async));
+    for (i = 0; i < 100; i++) {
+        clog_info("%zu", i);
+        cork_buffer_append_printf(&expected, (i == 0) ? "%zu" : " %zu", i);
+    }
+    clog_async_handler_flush(async);
+    fail_unless_received(gate, expected.buf);
+    fail_unless_equal("Dropped messages", "%zu",
+                      (size_t) 0, clog_async_handler_dropped(async));
+
+    fail_if_error(clog_handler_pop_process(clog_async_handler_handler(async)));
+    clog_async_handler_free(async);
+    cork_buffer_done(&expected);
+}
+END_TEST
+
+START_TEST(test_async_fields)
+{
+    DESCRIBE_TEST;
+    struct clog_stash* stash = clog_stash_new();
+    struct clog_async_handler* async =
+            clog_async_handler_new(clog_stashing_handler_new(stash), 16);
+
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(clog_async_handler_handler(async));
+    cloge_warning {
+        clog_add_field(field1, string, "hello");
+        clog_add_field(field2, printf, "%d", 42);
+        clog_add_field(field3, duration, 2500000);
+        clog_set_message("Warning %s", "event");
+    }
+    clog_async_handler_flush(async);
+
+    /* Typed fields are rendered on the consumer thread. */
+    ck_assert(clog_stash_contains_event(stash, "__message", "Warning event",
+                                        "field1", "hello", "field2", "42",
+                                        "field3", "2.5ms", NULL));
+    ck_assert(!clog_stash_contains_event(stash, "field1", "there", NULL));
+
+    fail_if_error(clog_handler_pop_process(clog_async_handler_handler(async)));
+    clog_async_handler_free(async);
+    clog_stash_free(stash);
+}
+END_TEST
+
+START_TEST(test_async_thread_name)
+{
+    DESCRIBE_TEST;
+    struct gate_handler* gate = gate_handler_new(true);
+    struct clog_async_handler* async =
+            clog_async_handler_new(&gate->parent, 4);
+
+    /* Messages are handled on the consumer thread, but still know which
+     * thread logged them. */
+    clog_set_thread_name("producer");
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(clog_async_handler_handler(async));
+    clog_info("Hello");
+    clog_async_handler_flush(async);
+    ck_assert_str_eq((char*) gate->thread.buf, "producer");
+
+    fail_if_error(clog_handler_pop_process(clog_async_handler_handler(async)));
+    clog_async_handler_free(async);
+    clog_set_thread_name(NULL);
+}
+END_TEST
+
+/* Blocks the consumer thread on message 0, and then sends 10 more messages
+ * while the queue only has room for 4 of them. */
+static void
+test_overflow(enum clog_async_overflow overflow, size_t expected_dropped,
+              const char* expected)
+{
+    struct gate_handler* gate = gate_handler_new(false);
+    struct clog_async_handler* async =
+            clog_async_handler_new(&gate->parent, 4);
+    size_t i;
+
+    clog_async_handler_set_overflow(async, overflow);
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(clog_async_handler_handler(async));
+    clog_info("0");
+    gate_handler_wait_until_entered(gate);
+    for (i = 1; i <= 10; i++) {
+        clog_info("%zu", i);
+    }
+    gate_handler_open(gate);
+    clog_async_handler_flush(async);
+
+    fail_unless_received(gate, expected);
+    fail_unless_equal("Dropped messages", "%zu", expected_dropped,
+                      clog_async_handler_dropped(async));
+    fail_if_error(clog_handler_pop_process(clog_async_handler_handler(async)));
+    clog_async_handler_free(async);
+}
+
+START_TEST(test_async_drop_newest)
+{
+    DESCRIBE_TEST;
+    test_overflow(CLOG_ASYNC_DROP_NEWEST, 6, "0 1 2 3 4");
+}
+END_TEST
+
+START_TEST(test_async_drop_oldest)
+{
+    DESCRIBE_TEST;
+    test_overflow(CLOG_ASYNC_DROP_OLDEST, 6, "0 7 8 9 10");
+}
+END_TEST
+
+#define THREAD_COUNT  4
+#define THREAD_MESSAGE_COUNT  10000
+
+static int
+log_from_thread(void* ud)
+{
+    size_t i;
+    for (i = 0; i < THREAD_MESSAGE_COUNT; i++) {
+        cloge_info {
+            clog_add_field(index, printf, "%zu", i);
+            clog_set_message("Thread message");
+        }
+    }
+    return 0;
+}
+
+START_TEST(test_async_threads)
+{
+    DESCRIBE_TEST;
+    struct gate_handler* gate = gate_handler_new(true);
+    struct clog_async_handler* async =
+            clog_async_handler_new(&gate->parent, 8);
+    struct cork_thread* threads[THREAD_COUNT];
+    size_t i;
+
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(clog_async_handler_handler(async));
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", NULL, NULL, log_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+    clog_async_handler_flush(async);
+
+    fail_unless_equal("Handled messages", "%zu",
+                      (size_t) (THREAD_COUNT * THREAD_MESSAGE_COUNT),
+                      gate->count);
+    fail_unless_equal("Dropped messages", "%zu",
+                      (size_t) 0, clog_async_handler_dropped(async));
+    fail_if_error(clog_handler_pop_process(clog_async_handler_handler(async)));
+    clog_async_handler_free(async);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("async");
+
+    TCase  *tc_async = tcase_create("async");
+    tcase_add_test(tc_async, test_async_order);
+    tcase_add_test(tc_async, test_async_fields);
+    tcase_add_test(tc_async, test_async_thread_name);
+    tcase_add_test(tc_async, test_async_drop_newest);
+    tcase_add_test(tc_async, test_async_drop_oldest);
+    tcase_add_test(tc_async, test_async_threads);
+    suite_add_tcase(s, tc_async);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
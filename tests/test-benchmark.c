@@ -7,17 +7,32 @@
  * ----------------------------------------------------------------------
  */
 
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <libcork/ds.h>
 #include <libcork/os.h>
+#include <libcork/threads.h>
 
 #include "clogger/api.h"
 #include "clogger/fields.h"
 #include "clogger/handlers.h"
+#include "clogger/stash.h"
 
 #define CLOG_CHANNEL "benchmark"
 #define DEFAULT_FORMAT "[%L] %c:#*{ %k=%v} %m"
 
+/* Refers to half of the fields in the messages that bench_many_fields
+ * generates, in a different order than they were added. */
+#define MANY_FIELDS_FORMAT                                                     \
+    "[%L] %c: %m #{f23} #{f01} #{f21} #{f03} #{f19} #{f05} "                   \
+    "#!{f17}{%k=%v} #!{f07}{%k=%v} #!{f15}{%k=%v} #!{f09}{%k=%v} "             \
+    "#!{f13}{%k=%v} #!{f11}{%k=%v}"
+
 static size_t
 parse_size(const char* str)
 {
@@ -30,18 +45,167 @@ parse_size(const char* str)
     }
 }
 
-int
-main(int argc, const char** argv)
+static void
+print_elapsed(clock_t start)
 {
-    size_t iteration_count = parse_size(cork_env_get(NULL, "ITERATIONS"));
+    printf("==== %.3f seconds\n",
+           (double) (clock() - start) / (double) CLOCKS_PER_SEC);
+}
+
+static double
+wall_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+/* Returns the number of write system calls this process has made, or 0 if we
+ * can't tell. */
+static unsigned long
+write_syscall_count(void)
+{
+    unsigned long count = 0;
+    char line[128];
+    FILE* fp = fopen("/proc/self/io", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "syscw: ", 7) == 0) {
+            count = strtoul(line + 7, NULL, 10);
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+/*-----------------------------------------------------------------------
+ * Allocation counting
+ */
+
+/* If COUNT_ALLOCATIONS is set, we count how many times anything calls into
+ * libcork's allocator.  Each benchmark resets the counts after its first
+ * message, so that we only see steady-state allocations. */
 
+static bool count_allocations = false;
+static volatile size_t allocation_count = 0;
+static volatile size_t free_count = 0;
+
+static void*
+counting_calloc(const struct cork_alloc* alloc, size_t count, size_t size)
+{
+    cork_size_atomic_add(&allocation_count, 1);
+    return cork_alloc_calloc(alloc->parent, count, size);
+}
+
+static void*
+counting_malloc(const struct cork_alloc* alloc, size_t size)
+{
+    cork_size_atomic_add(&allocation_count, 1);
+    return cork_alloc_malloc(alloc->parent, size);
+}
+
+static void*
+counting_realloc(const struct cork_alloc* alloc, void* ptr, size_t old_size,
+                 size_t new_size)
+{
+    cork_size_atomic_add(&allocation_count, 1);
+    return cork_alloc_realloc(alloc->parent, ptr, old_size, new_size);
+}
+
+static void
+counting_free(const struct cork_alloc* alloc, void* ptr, size_t size)
+{
+    cork_size_atomic_add(&free_count, 1);
+    cork_alloc_free(alloc->parent, ptr, size);
+}
+
+static void
+setup_allocation_counting(void)
+{
+    const char* value = cork_env_get(NULL, "COUNT_ALLOCATIONS");
+    struct cork_alloc* alloc;
+    if (value == NULL || *value == '\0' || strcmp(value, "0") == 0) {
+        return;
+    }
+    count_allocations = true;
+    alloc = cork_alloc_new_alloc(cork_allocator);
+    cork_alloc_set_calloc(alloc, counting_calloc);
+    cork_alloc_set_malloc(alloc, counting_malloc);
+    cork_alloc_set_realloc(alloc, counting_realloc);
+    cork_alloc_set_free(alloc, counting_free);
+    cork_set_allocator(alloc);
+}
+
+static void
+reset_allocation_counts(void)
+{
+    allocation_count = 0;
+    free_count = 0;
+}
+
+static void
+print_allocation_counts(void)
+{
+    if (count_allocations) {
+        printf("==== %zu allocations, %zu frees\n", allocation_count,
+               free_count);
+    }
+}
+
+/*-----------------------------------------------------------------------
+ * Null stream consumer
+ */
+
+/* Lets us measure the cost of formatting messages without also measuring the
+ * cost of writing them somewhere. */
+
+static int
+null_consumer_data(struct cork_stream_consumer* self, const void* buf,
+                   size_t size, bool is_first)
+{
+    return 0;
+}
+
+static int
+null_consumer_eof(struct cork_stream_consumer* self)
+{
+    return 0;
+}
+
+static void
+null_consumer_free(struct cork_stream_consumer* self)
+{
+    cork_delete(struct cork_stream_consumer, self);
+}
+
+static struct cork_stream_consumer*
+null_consumer_new(void)
+{
+    struct cork_stream_consumer* self = cork_new(struct cork_stream_consumer);
+    self->data = null_consumer_data;
+    self->eof = null_consumer_eof;
+    self->free = null_consumer_free;
+    return self;
+}
+
+/*-----------------------------------------------------------------------
+ * Benchmarks
+ */
+
+static void
+bench_null_handler(size_t iteration_count)
+{
     struct clog_handler* handler = clog_null_handler_new();
     clog_handler_push_process(handler);
-    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
 
-    printf("1..1\n");
     printf("==== Generating %zu log messages\n", iteration_count);
+    clock_t start = clock();
     for (size_t i = 0; i < iteration_count; i++) {
+        if (i == 1) {
+            reset_allocation_counts();
+        }
         cloge_debug {
             clog_add_field(field1, string, "value");
             clog_add_field(field2, string, "another value");
@@ -51,7 +215,447 @@ main(int argc, const char** argv)
                              ((i % 2) == 0) ? "" : " not");
         }
     }
+    print_elapsed(start);
+    print_allocation_counts();
+
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+}
+
+static void
+bench_disabled(size_t iteration_count)
+{
+    struct clog_handler* handler = clog_null_handler_new();
+    clog_handler_push_process(handler);
+    clog_set_minimum_level(CLOG_LEVEL_WARNING);
+    clog_set_channel_level("enabled", CLOG_LEVEL_TRACE);
+
+    printf("==== Skipping %zu disabled log messages\n", iteration_count);
+    clock_t start = clock();
+    for (size_t i = 0; i < iteration_count; i++) {
+        cloge_debug {
+            clog_add_field(field1, string, "value");
+            clog_set_message("Interesting things are%s happening",
+                             ((i % 2) == 0) ? "" : " not");
+        }
+    }
+    print_elapsed(start);
+
+    clog_clear_channel_levels();
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+}
+
+static void
+bench_many_fields(size_t iteration_count)
+{
+    struct clog_handler* handler = clog_stream_handler_new_consumer(
+            null_consumer_new(), MANY_FIELDS_FORMAT);
+    clog_handler_push_process(handler);
+
+    printf("==== Formatting %zu log messages with 24 fields\n",
+           iteration_count);
+    clock_t start = clock();
+    for (size_t i = 0; i < iteration_count; i++) {
+        if (i == 1) {
+            reset_allocation_counts();
+        }
+        cloge_debug {
+            clog_add_field(f00, string, "value 00");
+            clog_add_field(f01, string, "value 01");
+            clog_add_field(f02, string, "value 02");
+            clog_add_field(f03, string, "value 03");
+            clog_add_field(f04, string, "value 04");
+            clog_add_field(f05, string, "value 05");
+            clog_add_field(f06, string, "value 06");
+            clog_add_field(f07, string, "value 07");
+            clog_add_field(f08, string, "value 08");
+            clog_add_field(f09, string, "value 09");
+            clog_add_field(f10, string, "value 10");
+            clog_add_field(f11, string, "value 11");
+            clog_add_field(f12, string, "value 12");
+            clog_add_field(f13, string, "value 13");
+            clog_add_field(f14, string, "value 14");
+            clog_add_field(f15, string, "value 15");
+            clog_add_field(f16, string, "value 16");
+            clog_add_field(f17, string, "value 17");
+            clog_add_field(f18, string, "value 18");
+            clog_add_field(f19, string, "value 19");
+            clog_add_field(f20, string, "value 20");
+            clog_add_field(f21, string, "value 21");
+            clog_add_field(f22, string, "value 22");
+            clog_add_field(f23, string, "value 23");
+            clog_set_message("Interesting things are%s happening",
+                             ((i % 2) == 0) ? "" : " not");
+        }
+    }
+    print_elapsed(start);
+    print_allocation_counts();
+
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+}
+
+/* Numeric fields, added either with printf or as typed values, and written
+ * out as binary records so that typed values never have to be rendered. */
+static void
+bench_numeric_fields(size_t iteration_count)
+{
+    struct clog_handler* handler =
+        clog_binary_handler_new_consumer(null_consumer_new());
+    clog_handler_push_process(handler);
+
+    printf("==== Logging %zu binary messages with 3 printf fields\n",
+           iteration_count);
+    clock_t start = clock();
+    for (size_t i = 0; i < iteration_count; i++) {
+        if (i == 1) {
+            reset_allocation_counts();
+        }
+        cloge_debug {
+            clog_add_field(bytes, printf, "%zu", i * 512);
+            clog_add_field(ratio, printf, "%g", i / 3.0);
+            clog_add_field(elapsed, printf, "%zuns", i % 1000000);
+            clog_set_message("Request finished");
+        }
+    }
+    print_elapsed(start);
+    print_allocation_counts();
+
+    printf("==== Logging %zu binary messages with 3 typed fields\n",
+           iteration_count);
+    start = clock();
+    for (size_t i = 0; i < iteration_count; i++) {
+        if (i == 1) {
+            reset_allocation_counts();
+        }
+        cloge_debug {
+            clog_add_field(bytes, uint, i * 512);
+            clog_add_field(ratio, double, i / 3.0);
+            clog_add_field(elapsed, duration, i % 1000000);
+            clog_set_message("Request finished");
+        }
+    }
+    print_elapsed(start);
+    print_allocation_counts();
+
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+}
+
+#define STASH_QUERY_COUNT  100
+
+static void
+bench_stash(size_t iteration_count)
+{
+    struct clog_stash* stash = clog_stash_new();
+    struct clog_handler* handler = clog_stashing_handler_new(stash);
+    clog_handler_push_process(handler);
+
+    printf("==== Stashing %zu log messages\n", iteration_count);
+    clock_t start = clock();
+    for (size_t i = 0; i < iteration_count; i++) {
+        if (i == 1) {
+            reset_allocation_counts();
+        }
+        cloge_info {
+            clog_add_field(field1, string, "value");
+            clog_add_field(index, printf, "%zu", i);
+            clog_set_message("Interesting things are%s happening",
+                             ((i % 2) == 0) ? "" : " not");
+        }
+    }
+    print_elapsed(start);
+    print_allocation_counts();
+
+    printf("==== Searching %zu stashed messages %zu times\n",
+           iteration_count, (size_t) STASH_QUERY_COUNT);
+    start = clock();
+    for (size_t i = 0; i < STASH_QUERY_COUNT; i++) {
+        char index[32];
+        snprintf(index, sizeof(index), "%zu",
+                 (i * 7919) % iteration_count);
+        if (!clog_stash_contains_event(stash, "field1", "value",
+                                       "index", index, NULL)) {
+            printf("# Missing match for %s\n", index);
+        }
+    }
+    if (clog_stash_contains_event(stash, "field1", "value",
+                                  "index", "not there", NULL)) {
+        printf("# Unexpected match\n");
+    }
+    print_elapsed(start);
+
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+    clog_stash_free(stash);
+}
+
+static void
+bench_rate_limited(size_t iteration_count)
+{
+    struct clog_handler* null_handler = clog_null_handler_new();
+    struct clog_handler* handler = clog_rate_limit_handler_new(1, 1);
+    clog_handler_push_process(null_handler);
+    clog_handler_push_process(handler);
+
+    printf("==== Dropping %zu rate-limited log messages\n", iteration_count);
+    clock_t start = clock();
+    for (size_t i = 0; i < iteration_count; i++) {
+        if (i == 1) {
+            reset_allocation_counts();
+        }
+        clog_warning("Interesting things are%s happening",
+                     ((i % 2) == 0) ? "" : " not");
+    }
+    print_elapsed(start);
+    print_allocation_counts();
+
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+    clog_handler_pop_process(null_handler);
+    clog_handler_free(null_handler);
+}
+
+static void
+bench_output(const char* description, struct clog_handler* handler,
+             size_t iteration_count)
+{
+    clog_handler_push_process(handler);
+
+    printf("==== Writing %zu log messages %s\n", iteration_count,
+           description);
+    unsigned long start_syscalls = write_syscall_count();
+    double start = wall_clock();
+    for (size_t i = 0; i < iteration_count; i++) {
+        if (i == 1) {
+            reset_allocation_counts();
+        }
+        cloge_info {
+            clog_add_field(field1, string, "value");
+            clog_add_field(field2, printf, "%zu", i);
+            clog_set_message("Interesting things are%s happening",
+                             ((i % 2) == 0) ? "" : " not");
+        }
+    }
+    printf("==== %.3f seconds (wall clock), %lu write syscalls\n",
+           wall_clock() - start, write_syscall_count() - start_syscalls);
+    print_allocation_counts();
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+}
+
+static void
+bench_fp_output(size_t iteration_count)
+{
+    /* Unbuffered, just like stderr */
+    FILE* fp = fopen("/dev/null", "w");
+    setvbuf(fp, NULL, _IONBF, 0);
+    bench_output("to /dev/null via an unbuffered FILE",
+                 clog_stream_handler_new_fp(fp, true, DEFAULT_FORMAT),
+                 iteration_count);
+}
+
+static void
+bench_fd_output(size_t iteration_count)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    bench_output("to /dev/null via a batched file descriptor",
+                 clog_stream_handler_new_fd(fd, CLOG_STREAM_CLOSE_FD,
+                                            DEFAULT_FORMAT),
+                 iteration_count);
+}
+
+/* The same messages as bench_fd_output, so that the two can be compared */
+static void
+bench_json_output(size_t iteration_count)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    bench_output("to /dev/null as JSON via a batched file descriptor",
+                 clog_json_handler_new_fd(fd, CLOG_STREAM_CLOSE_FD),
+                 iteration_count);
+}
+
+static void
+bench_binary_output(size_t iteration_count)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    bench_output("to /dev/null as binary records",
+                 clog_binary_handler_new_fd(fd, CLOG_STREAM_CLOSE_FD),
+                 iteration_count);
+}
+
+static void
+bench_ring_output(size_t iteration_count)
+{
+    char path[] = "benchmark-ring.XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    bench_output("to a memory-mapped ring file",
+                 clog_mmap_ring_handler_new(path, 4 * 1024 * 1024),
+                 iteration_count);
+    unlink(path);
+}
+
+#define THREAD_COUNT 4
+
+static int
+bench_thread_run(void* vcount)
+{
+    size_t iteration_count = *(size_t*) vcount;
+    for (size_t i = 0; i < iteration_count; i++) {
+        cloge_debug {
+            clog_add_field(field1, string, "value");
+            clog_add_field(field2, printf, "%zu", i);
+            clog_set_message("Interesting things are%s happening",
+                             ((i % 2) == 0) ? "" : " not");
+        }
+    }
+    return 0;
+}
+
+static void
+bench_threads(size_t iteration_count)
+{
+    struct clog_handler* handler = clog_stream_handler_new_consumer(
+            null_consumer_new(), DEFAULT_FORMAT);
+    struct cork_thread* threads[THREAD_COUNT];
+    size_t thread_iteration_count = iteration_count / THREAD_COUNT;
+    clog_handler_push_process(handler);
+
+    printf("==== Formatting %zu log messages from %d threads\n",
+           thread_iteration_count * THREAD_COUNT, THREAD_COUNT);
+    /* This includes each thread's first message, and starting the threads. */
+    reset_allocation_counts();
+    double start = wall_clock();
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        threads[i] = cork_thread_new("bench", &thread_iteration_count, NULL,
+                                     bench_thread_run);
+        cork_thread_start(threads[i]);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        cork_thread_join(threads[i]);
+    }
+    printf("==== %.3f seconds (wall clock)\n", wall_clock() - start);
+    print_allocation_counts();
+
+    clog_handler_pop_process(handler);
+    clog_handler_free(handler);
+}
+
+#if defined(CLOG_COMPILE_MIN_LEVEL)
+/* None of the statements below the compile-time floor should have made it
+ * into the executable.  Each of these statements has a format string that
+ * doesn't appear anywhere else, and a format string is only referenced by the
+ * code that logs it, so we look for the format strings in our own executable.
+ * The INFO statement makes sure that we'd find them if they were there. */
+static void
+log_floor_statements(int i)
+{
+    clog_trace("Floor check: TRACE statement %d", i);
+    clog_debug("Floor check: DEBUG statement %d", i);
+    clog_info("Floor check: INFO statement %d", i);
+}
+
+static bool
+buffer_contains(const struct cork_buffer* buf, const char* needle)
+{
+    size_t needle_size = strlen(needle);
+    const char* curr = buf->buf;
+    const char* end = curr + buf->size;
+    while ((size_t) (end - curr) >= needle_size) {
+        curr = memchr(curr, needle[0], end - curr - needle_size + 1);
+        if (curr == NULL) {
+            return false;
+        }
+        if (memcmp(curr, needle, needle_size) == 0) {
+            return true;
+        }
+        curr++;
+    }
+    return false;
+}
+
+static bool
+executable_has_statement(const struct cork_buffer* exe, enum clog_level level)
+{
+    char needle[64];
+    /* Build the format string at runtime, so that this function doesn't put
+     * a copy of it into the executable. */
+    snprintf(needle, sizeof(needle), "Floor check: %s statement %%d",
+             clog_level_name(level));
+    return buffer_contains(exe, needle);
+}
+
+static bool
+check_compiled_out(void)
+{
+    struct cork_buffer exe = CORK_BUFFER_INIT();
+    char chunk[4096];
+    size_t size;
+    bool result;
+    FILE* fp = fopen("/proc/self/exe", "rb");
+
+    log_floor_statements(0);
+    if (fp == NULL) {
+        printf("==== Cannot read our own executable\n");
+        return false;
+    }
+    while ((size = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        cork_buffer_append(&exe, chunk, size);
+    }
+    fclose(fp);
+
+    bool has_trace = executable_has_statement(&exe, CLOG_LEVEL_TRACE);
+    bool has_debug = executable_has_statement(&exe, CLOG_LEVEL_DEBUG);
+    bool has_info = executable_has_statement(&exe, CLOG_LEVEL_INFO);
+    printf("==== TRACE statement compiled %s\n", has_trace ? "in" : "out");
+    printf("==== DEBUG statement compiled %s\n", has_debug ? "in" : "out");
+    printf("==== INFO statement compiled %s\n", has_info ? "in" : "out");
+    result = !has_trace && !has_debug && has_info;
+    cork_buffer_done(&exe);
+    return result;
+}
+#endif
+
+int
+main(int argc, const char** argv)
+{
+    size_t iteration_count = parse_size(cork_env_get(NULL, "ITERATIONS"));
+    setup_allocation_counting();
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+
+    printf("1..13\n");
+    bench_null_handler(iteration_count);
     printf("ok 1\n");
+    bench_disabled(iteration_count);
+    printf("ok 2\n");
+    bench_many_fields(iteration_count);
+    printf("ok 3\n");
+    bench_threads(iteration_count);
+    printf("ok 4\n");
+    bench_fp_output(iteration_count);
+    printf("ok 5\n");
+    bench_fd_output(iteration_count);
+    printf("ok 6\n");
+    bench_binary_output(iteration_count);
+    printf("ok 7\n");
+    bench_ring_output(iteration_count);
+    printf("ok 8\n");
+    bench_stash(iteration_count);
+    printf("ok 9\n");
+    bench_rate_limited(iteration_count);
+    printf("ok 10\n");
+    bench_numeric_fields(iteration_count);
+    printf("ok 11\n");
+    bench_json_output(iteration_count);
+    printf("ok 12\n");
+#if defined(CLOG_COMPILE_MIN_LEVEL)
+    printf("%s 13\n", check_compiled_out() ? "ok" : "not ok");
+#else
+    printf("ok 13 # skip CLOG_COMPILE_MIN_LEVEL is not set\n");
+#endif
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,280 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "clogger/api.h"
+#include "clogger/error.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define CLOG_CHANNEL "test"
+#define DEFAULT_FORMAT "[%L] %c:#*{ %k=%v} %m"
+
+static struct cork_buffer  *text_buf;
+static struct cork_buffer  *binary_buf;
+static struct clog_handler  *text_handler;
+static struct clog_handler  *binary_handler;
+
+/* Sends every message to a text handler and a binary handler, so that we can
+ * check that decoding the binary records gives us the same text. */
+static void
+setup_handlers(void)
+{
+    text_buf = cork_buffer_new();
+    binary_buf = cork_buffer_new();
+    text_handler = clog_stream_handler_new_consumer
+        (cork_buffer_to_stream_consumer(text_buf), DEFAULT_FORMAT);
+    binary_handler = clog_binary_handler_new_consumer
+        (cork_buffer_to_stream_consumer(binary_buf));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(text_handler);
+    clog_handler_push_process(binary_handler);
+}
+
+static void
+teardown_handlers(void)
+{
+    fail_if_error(clog_handler_pop_process(binary_handler));
+    fail_if_error(clog_handler_pop_process(text_handler));
+    clog_handler_free(binary_handler);
+    clog_handler_free(text_handler);
+    cork_buffer_free(binary_buf);
+    cork_buffer_free(text_buf);
+}
+
+/* Decodes binary_buf, feeding it to the decoder chunk_size bytes at a time. */
+static void
+decode(struct cork_buffer* dest, size_t chunk_size)
+{
+    struct clog_handler* handler = clog_stream_handler_new_consumer
+        (cork_buffer_to_stream_consumer(dest), DEFAULT_FORMAT);
+    struct clog_binary_decoder* decoder = clog_binary_decoder_new(handler);
+    size_t offset;
+
+    for (offset = 0; offset < binary_buf->size; offset += chunk_size) {
+        size_t size = binary_buf->size - offset;
+        if (size > chunk_size) {
+            size = chunk_size;
+        }
+        fail_if_error(clog_binary_decoder_feed
+                      (decoder, (char*) binary_buf->buf + offset, size));
+    }
+    fail_if_error(clog_binary_decoder_finish(decoder));
+    clog_binary_decoder_free(decoder);
+    clog_handler_free(handler);
+}
+
+static void
+fail_unless_decodes(size_t chunk_size)
+{
+    struct cork_buffer decoded = CORK_BUFFER_INIT();
+    decode(&decoded, chunk_size);
+    ck_assert_str_eq(decoded.buf, text_buf->buf);
+    cork_buffer_done(&decoded);
+}
+
+static size_t
+count_records(uint8_t type)
+{
+    const uint8_t* curr =
+        (const uint8_t*) binary_buf->buf + CLOG_BINARY_MAGIC_SIZE;
+    const uint8_t* end = (const uint8_t*) binary_buf->buf + binary_buf->size;
+    size_t count = 0;
+    while (curr < end) {
+        uint32_t size = (uint32_t) curr[0] | ((uint32_t) curr[1] << 8) |
+                        ((uint32_t) curr[2] << 16) | ((uint32_t) curr[3] << 24);
+        if (curr[4] == type) {
+            count++;
+        }
+        curr += 4 + size;
+    }
+    return count;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Binary handler
+ */
+
+static void
+log_repeated(int i)
+{
+    clog_info("Repeated message %d", i);
+}
+
+START_TEST(test_binary_arguments)
+{
+    DESCRIBE_TEST;
+    const char* str = "string argument";
+    char dynamic[32];
+    int i;
+
+    setup_handlers();
+    clog_info("No arguments, 100%% literal");
+    clog_info("Integers: %d %5u %-5x| %ld %llu %zu %jd %td %hhd %c",
+              -1, 2u, 0xabu, -4L, 5ULL, (size_t) 6, (intmax_t) -7,
+              (ptrdiff_t) 8, (char) 9, 'z');
+    clog_info("Floats: %.3f %g %e %Lf", 1.5, 0.25, 1e10, (long double) 2.5);
+    clog_info("Strings: %s [%10s] [%-6.3s] [%.*s] [%*s]",
+              str, "right", "truncated", 4, "precision", -5, "left");
+    clog_info("Pointer: %p", (void*) str);
+    clog_warning("Error: %m");
+    snprintf(dynamic, sizeof(dynamic), "Dynamic %%d %d", 1);
+    clog_info(dynamic, 2);
+    for (i = 0; i < 3; i++) {
+        log_repeated(i);
+    }
+    cloge_debug {
+        clog_add_field(field1, string, "hello");
+        clog_add_field(field2, printf, "%d", 42);
+        clog_set_message("With fields %s", "event");
+    }
+
+    fail_unless_decodes(binary_buf->size);
+    fail_unless_decodes(1);
+    fail_unless_decodes(7);
+
+    /* Each literal format string is only written out once.  "%m" and the
+     * dynamic format string are written as rendered text. */
+    fail_unless_equal("Format records", "%zu", (size_t) 7,
+                      count_records(CLOG_BINARY_FORMAT));
+    fail_unless_equal("Message records", "%zu", (size_t) 11,
+                      count_records(CLOG_BINARY_MESSAGE));
+    teardown_handlers();
+}
+END_TEST
+
+START_TEST(test_binary_typed_fields)
+{
+    DESCRIBE_TEST;
+    struct cork_buffer decoded = CORK_BUFFER_INIT();
+
+    setup_handlers();
+    clog_info("No fields");
+    cloge_info {
+        clog_add_field(count, uint, 1024);
+        clog_add_field(delta, int, -5);
+        clog_add_field(ratio, double, 0.1);
+        clog_add_field(ok, bool, true);
+        clog_add_field(where, ptr, (void*) (uintptr_t) 0x1000);
+        clog_add_field(elapsed, duration, 1500);
+        clog_add_field(name, string, "typed");
+        clog_set_message("With typed fields");
+    }
+
+    /* Messages without typed fields keep using the original record type. */
+    fail_unless_equal("Message records", "%zu", (size_t) 1,
+                      count_records(CLOG_BINARY_MESSAGE));
+    fail_unless_equal("Typed message records", "%zu", (size_t) 1,
+                      count_records(CLOG_BINARY_TYPED_MESSAGE));
+    fail_unless_decodes(binary_buf->size);
+    fail_unless_decodes(3);
+
+    decode(&decoded, binary_buf->size);
+    ck_assert_str_eq(decoded.buf,
+                     "[INFO    ] test: No fields\n"
+                     "[INFO    ] test: count=1024 delta=-5 ratio=0.1 ok=true "
+                     "where=0x1000 elapsed=1.5us name=typed "
+                     "With typed fields\n");
+    cork_buffer_done(&decoded);
+    teardown_handlers();
+}
+END_TEST
+
+START_TEST(test_binary_bad_records)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = clog_null_handler_new();
+    struct clog_binary_decoder* decoder;
+    static const char unknown_type[] = CLOG_BINARY_MAGIC "\x01\x00\x00\x00\x07";
+    static const char unknown_format[] =
+        CLOG_BINARY_MAGIC "\x1b\x00\x00\x00\x02\x05" "\0\0\0\0\0\0\0\0"
+        "\x01\0\0\0" "c" "\0\0\0\0" "\x01\0\0\0\0\0\0\0";
+
+    decoder = clog_binary_decoder_new(handler);
+    fail_unless_error(clog_binary_decoder_feed
+                      (decoder, "not a log", 9), "Expected an error");
+    clog_binary_decoder_free(decoder);
+
+    decoder = clog_binary_decoder_new(handler);
+    fail_unless_error(clog_binary_decoder_feed
+                      (decoder, unknown_type, sizeof(unknown_type) - 1),
+                      "Expected an error");
+    clog_binary_decoder_free(decoder);
+
+    decoder = clog_binary_decoder_new(handler);
+    fail_unless_error(clog_binary_decoder_feed
+                      (decoder, unknown_format, sizeof(unknown_format) - 1),
+                      "Expected an error");
+    clog_binary_decoder_free(decoder);
+
+    /* A partial record is fine until there isn't any more data. */
+    decoder = clog_binary_decoder_new(handler);
+    fail_if_error(clog_binary_decoder_feed
+                  (decoder, unknown_format, sizeof(unknown_format) - 2));
+    fail_unless_error(clog_binary_decoder_finish(decoder),
+                      "Expected an error");
+    clog_binary_decoder_free(decoder);
+
+    clog_handler_free(handler);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("binary");
+
+    TCase  *tc_binary = tcase_create("binary");
+    tcase_add_test(tc_binary, test_binary_arguments);
+    tcase_add_test(tc_binary, test_binary_typed_fields);
+    tcase_add_test(tc_binary, test_binary_bad_records);
+    suite_add_tcase(s, tc_binary);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
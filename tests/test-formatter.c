@@ -8,6 +8,7 @@
  */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -17,6 +18,7 @@
 #include <libcork/core.h>
 #include <libcork/ds.h>
 #include <libcork/helpers/errors.h>
+#include <libcork/threads.h>
 
 #include "clogger/api.h"
 #include "clogger/fields.h"
@@ -53,6 +55,9 @@ START_TEST(test_format_parse_01)
     GOOD("#*{ %% %k %v}");
     GOOD("test 1");
     GOOD("test ##1 %%1");
+    GOOD("%t %t{iso} %t{ms} %t{offset}");
+    GOOD("%T %T{id} %T{name}");
+    GOOD("%s %s{file} %s{line} %s{func}");
     BAD("#{unterminated var");
     BAD("#^");
     BAD("#!");
@@ -64,6 +69,12 @@ START_TEST(test_format_parse_01)
     BAD("#*{unterminated spec");
     BAD("#*{%!}");
     BAD("%!");
+    BAD("%t{unterminated");
+    BAD("%t{unknown}");
+    BAD("%T{unterminated");
+    BAD("%T{unknown}");
+    BAD("%s{unterminated");
+    BAD("%s{unknown}");
 }
 END_TEST
 
@@ -123,6 +134,319 @@ START_TEST(test_format_01)
 END_TEST
 
 
+START_TEST(test_format_02)
+{
+    DESCRIBE_TEST;
+    struct clog_formatter  *fmt;
+    struct cork_buffer  dest = CORK_BUFFER_INIT();
+    /* Literal text that directly follows an annotation spec shouldn't be
+     * treated as part of that spec. */
+    const char  *fmt_str =
+        "##%%#!{var1}{[%v]}## %%"
+        "#*{%k%%}%%end"
+        "#!{var3}{%k}##";
+    const char  *expected =
+        "#%[value1]# %"
+        "var1%var2%%end"
+        "#";
+
+    fail_if_error(fmt = clog_formatter_new(fmt_str));
+    test_message(fmt, &dest, CLOG_LEVEL_INFO, "test", "This is only a test.");
+
+    ck_assert_str_eq((char *) dest.buf, expected);
+    cork_buffer_done(&dest);
+    clog_formatter_free(fmt);
+}
+END_TEST
+
+
+/* The message text should be rendered correctly no matter how many formatters
+ * ask for it, and should still be available to handlers afterwards. */
+static void
+test_repeated_message(const char *fmt, ...)
+{
+    struct clog_formatter  *fmt1;
+    struct clog_formatter  *fmt2;
+    struct cork_buffer  dest1 = CORK_BUFFER_INIT();
+    struct cork_buffer  dest2 = CORK_BUFFER_INIT();
+    struct clog_message  message;
+
+    fail_if_error(fmt1 = clog_formatter_new("%m"));
+    fail_if_error(fmt2 = clog_formatter_new("[%l] %m"));
+    clog_message_init(&message, CLOG_LEVEL_INFO, "test");
+    message.fmt = fmt;
+    va_start(message.args, fmt);
+    clog_formatter_format_message(fmt1, &dest1, &message);
+    clog_formatter_format_message(fmt2, &dest2, &message);
+    ck_assert_str_eq((char *) dest1.buf, "hello 1");
+    ck_assert_str_eq((char *) dest2.buf, "[INFO] hello 1");
+    ck_assert_str_eq(clog_message_message(&message), "hello 1");
+    clog_formatter_format_message(fmt2, &dest2, &message);
+    ck_assert_str_eq((char *) dest2.buf, "[INFO] hello 1");
+    va_end(message.args);
+    clog_message_done(&message);
+
+    cork_buffer_done(&dest1);
+    cork_buffer_done(&dest2);
+    clog_formatter_free(fmt1);
+    clog_formatter_free(fmt2);
+}
+
+START_TEST(test_format_03)
+{
+    DESCRIBE_TEST;
+    test_repeated_message("%s %d", "hello", 1);
+}
+END_TEST
+
+
+START_TEST(test_format_04)
+{
+    DESCRIBE_TEST;
+    static const char  *values[] = {
+        "a", "b", "c", "d", "e", "f", "g", "h", "i", "j",
+        "k", "l", "m", "n", "o", "p", "q"
+    };
+    struct clog_formatter  *fmt;
+    struct cork_buffer  dest = CORK_BUFFER_INIT();
+    struct clog_message  message;
+    struct clog_string_field  fields[20];
+    char  keys[17][8];
+    size_t  i;
+    /* More field references than we can match on the stack, repeated
+     * references to the same field, and a field that appears in the message
+     * more than once.  f17 through f19 aren't in the message. */
+    const char  *fmt_str =
+        "#{f0}#{f1}#{f2}#{f3}#{f4}#{f5}#{f6}#{f7}#{f8}#{f9}"
+        "#{f10}#{f11}#{f12}#{f13}#{f14}#{f15}#{f16}#{f17}#{f18}#{f19} "
+        "#!{f0}{[%v]}#{missing}#!{dup}{<%v>}#{f16}";
+    const char  *expected =
+        "abcdefghijklmnopq "
+        "[a]<3><2><1>q";
+
+    fail_if_error(fmt = clog_formatter_new(fmt_str));
+    clog_message_init(&message, CLOG_LEVEL_INFO, "test");
+    for (i = 0; i < 17; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "f%zu", i);
+        clog_message_add_string_field(&message.fields, &fields[i], keys[i],
+                                      values[i]);
+    }
+    clog_message_add_string_field(&message.fields, &fields[17], "dup", "1");
+    clog_message_add_string_field(&message.fields, &fields[18], "dup", "2");
+    clog_message_add_string_field(&message.fields, &fields[19], "dup", "3");
+    clog_formatter_format_message(fmt, &dest, &message);
+    clog_message_done(&message);
+
+    ck_assert_str_eq((char *) dest.buf, expected);
+    cork_buffer_done(&dest);
+    clog_formatter_free(fmt);
+}
+END_TEST
+
+
+START_TEST(test_format_05)
+{
+    DESCRIBE_TEST;
+    struct clog_formatter  *fmt;
+    struct cork_buffer  dest = CORK_BUFFER_INIT();
+    struct cork_buffer  expected = CORK_BUFFER_INIT();
+    struct clog_message  message;
+    struct clog_string_field  fields[40];
+    struct clog_string_field  extra;
+    char  keys[40][8];
+    size_t  i;
+
+    /* #*{} should output fields in the order they were added, even after
+     * fields have been popped off of the message. */
+    fail_if_error(fmt = clog_formatter_new("#*{%k }"));
+    clog_message_init(&message, CLOG_LEVEL_INFO, "test");
+
+    clog_message_add_string_field(&message.fields, &extra, "extra", "");
+    clog_message_pop_field(&message, &extra.parent);
+    clog_formatter_format_message(fmt, &dest, &message);
+    ck_assert(dest.size == 0);
+
+    for (i = 0; i < 40; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "f%zu", i);
+        clog_message_add_string_field(&message.fields, &fields[i], keys[i],
+                                      "");
+    }
+    clog_message_pop_field(&message, &fields[39].parent);
+    clog_message_pop_field(&message, &fields[38].parent);
+    clog_message_add_string_field(&message.fields, &extra, "extra", "");
+    for (i = 0; i < 38; i++) {
+        cork_buffer_append_printf(&expected, "f%zu ", i);
+    }
+    cork_buffer_append_string(&expected, "extra ");
+
+    clog_formatter_format_message(fmt, &dest, &message);
+    clog_message_done(&message);
+
+    ck_assert_str_eq((char *) dest.buf, (char *) expected.buf);
+    cork_buffer_done(&dest);
+    cork_buffer_done(&expected);
+    clog_formatter_free(fmt);
+}
+END_TEST
+
+START_TEST(test_format_time)
+{
+    DESCRIBE_TEST;
+    struct clog_formatter  *fmt;
+    struct cork_buffer  dest = CORK_BUFFER_INIT();
+    struct clog_message  message;
+
+    fail_if_error(fmt = clog_formatter_new("%t|%t{iso}|%t{ms}|%m"));
+    clog_message_init(&message, CLOG_LEVEL_INFO, "test");
+    message.text = "text";
+    message.text_size = 4;
+
+    /* 2020-02-29T23:59:59.987654321Z */
+    message.timestamp = UINT64_C(1583020799987654321);
+    clog_formatter_format_message(fmt, &dest, &message);
+    ck_assert_str_eq((char *) dest.buf,
+                     "2020-02-29T23:59:59.987Z|2020-02-29T23:59:59.987Z|"
+                     "1583020799987|text");
+
+    /* The same second, which reuses the cached date */
+    message.timestamp = UINT64_C(1583020799000999999);
+    clog_formatter_format_message(fmt, &dest, &message);
+    ck_assert_str_eq((char *) dest.buf,
+                     "2020-02-29T23:59:59.000Z|2020-02-29T23:59:59.000Z|"
+                     "1583020799000|text");
+
+    /* The next second */
+    message.timestamp = UINT64_C(1583020800001000000);
+    clog_formatter_format_message(fmt, &dest, &message);
+    ck_assert_str_eq((char *) dest.buf,
+                     "2020-03-01T00:00:00.001Z|2020-03-01T00:00:00.001Z|"
+                     "1583020800001|text");
+    clog_formatter_free(fmt);
+
+    /* Offsets are relative to when the library was loaded, so we can only
+     * check their shape. */
+    fail_if_error(fmt = clog_formatter_new("%t{offset}"));
+    message.timestamp = clog_now();
+    clog_formatter_format_message(fmt, &dest, &message);
+    fail_unless(dest.size >= 8, "Unexpected offset %s", (char *) dest.buf);
+    ck_assert(((char *) dest.buf)[dest.size - 7] == '.');
+    clog_formatter_free(fmt);
+
+    clog_message_done(&message);
+    cork_buffer_done(&dest);
+}
+END_TEST
+
+static void
+format_thread(struct clog_formatter* fmt, struct cork_buffer* dest)
+{
+    struct clog_message  message;
+    clog_message_init(&message, CLOG_LEVEL_INFO, "test");
+    message.text = "text";
+    message.text_size = 4;
+    clog_formatter_format_message(fmt, dest, &message);
+    clog_message_done(&message);
+}
+
+static int
+format_from_thread(void* vdest)
+{
+    struct clog_formatter  *fmt;
+    fail_if_error(fmt = clog_formatter_new("%T|%m"));
+    format_thread(fmt, vdest);
+    clog_formatter_free(fmt);
+    return 0;
+}
+
+START_TEST(test_format_thread)
+{
+    DESCRIBE_TEST;
+    struct clog_formatter  *fmt;
+    struct cork_buffer  dest = CORK_BUFFER_INIT();
+    struct cork_buffer  expected = CORK_BUFFER_INIT();
+    struct clog_thread_info  other = { "42", 2, "other", 5 };
+    struct clog_message  message;
+    struct cork_thread  *thread;
+    unsigned int  id = cork_current_thread_get_id();
+
+    /* Unnamed threads use their ID as their name. */
+    fail_if_error(fmt = clog_formatter_new("%T|%T{id}|%T{name}|%m"));
+    format_thread(fmt, &dest);
+    cork_buffer_printf(&expected, "%u|%u|%u|text", id, id, id);
+    ck_assert_str_eq((char *) dest.buf, (char *) expected.buf);
+
+    clog_set_thread_name("main thread");
+    format_thread(fmt, &dest);
+    cork_buffer_printf(&expected, "main thread|%u|main thread|text", id);
+    ck_assert_str_eq((char *) dest.buf, (char *) expected.buf);
+
+    /* Long names are truncated. */
+    clog_set_thread_name("0123456789012345678901234567890123456789");
+    format_thread(fmt, &dest);
+    cork_buffer_printf(&expected, "01234567890123456789012345678901|%u|"
+                       "01234567890123456789012345678901|text", id);
+    ck_assert_str_eq((char *) dest.buf, (char *) expected.buf);
+
+    clog_set_thread_name(NULL);
+    format_thread(fmt, &dest);
+    cork_buffer_printf(&expected, "%u|%u|%u|text", id, id, id);
+    ck_assert_str_eq((char *) dest.buf, (char *) expected.buf);
+
+    /* Messages can say that they came from some other thread. */
+    clog_message_init(&message, CLOG_LEVEL_INFO, "test");
+    message.text = "text";
+    message.text_size = 4;
+    message.thread = &other;
+    clog_formatter_format_message(fmt, &dest, &message);
+    ck_assert_str_eq((char *) dest.buf, "other|42|other|text");
+    clog_message_done(&message);
+    clog_formatter_free(fmt);
+
+    /* Threads default to the name of their cork_thread. */
+    fail_if_error(thread = cork_thread_new
+                  ("producer", &dest, NULL, format_from_thread));
+    fail_if_error(cork_thread_start(thread));
+    fail_if_error(cork_thread_join(thread));
+    ck_assert_str_eq((char *) dest.buf, "producer|text");
+
+    cork_buffer_done(&expected);
+    cork_buffer_done(&dest);
+}
+END_TEST
+
+START_TEST(test_format_source)
+{
+    DESCRIBE_TEST;
+    struct clog_formatter  *fmt;
+    struct cork_buffer  dest = CORK_BUFFER_INIT();
+    struct clog_call_site  site = {
+        CLOG_CALL_SITE_ENABLED, CLOG_CALL_SITE_DEFAULT, CLOG_LEVEL_INFO,
+        "test", "src/example.c", 42, "example", "text"
+    };
+    struct clog_message  message;
+
+    fail_if_error(fmt = clog_formatter_new("[%s] [%s{file}] [%s{line}] "
+                                           "[%s{func}] %m"));
+    clog_message_init(&message, CLOG_LEVEL_INFO, "test");
+    message.text = "text";
+    message.text_size = 4;
+
+    /* Messages that weren't logged by a statement don't have a source. */
+    clog_formatter_format_message(fmt, &dest, &message);
+    ck_assert_str_eq((char *) dest.buf, "[] [] [] [] text");
+
+    message.site = &site;
+    clog_formatter_format_message(fmt, &dest, &message);
+    ck_assert_str_eq((char *) dest.buf,
+                     "[src/example.c:42] [src/example.c] [42] [example] text");
+
+    clog_message_done(&message);
+    clog_formatter_free(fmt);
+    cork_buffer_done(&dest);
+}
+END_TEST
+
+
 /*-----------------------------------------------------------------------
  * Testing harness
  */
@@ -135,6 +459,13 @@ test_suite()
     TCase  *tc_format = tcase_create("format");
     tcase_add_test(tc_format, test_format_parse_01);
     tcase_add_test(tc_format, test_format_01);
+    tcase_add_test(tc_format, test_format_02);
+    tcase_add_test(tc_format, test_format_03);
+    tcase_add_test(tc_format, test_format_04);
+    tcase_add_test(tc_format, test_format_05);
+    tcase_add_test(tc_format, test_format_time);
+    tcase_add_test(tc_format, test_format_thread);
+    tcase_add_test(tc_format, test_format_source);
     suite_add_tcase(s, tc_format);
 
     return s;
@@ -0,0 +1,283 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define CLOG_CHANNEL "test"
+
+static struct cork_buffer  *json_buf;
+static struct clog_handler  *json_handler;
+
+static void
+setup_json(void)
+{
+    json_buf = cork_buffer_new();
+    json_handler = clog_json_handler_new_consumer
+        (cork_buffer_to_stream_consumer(json_buf));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(json_handler);
+}
+
+static void
+teardown_json(void)
+{
+    fail_if_error(clog_handler_pop_process(json_handler));
+    clog_handler_free(json_handler);
+    cork_buffer_free(json_buf);
+}
+
+static void
+fail_unless_json(const char* expected)
+{
+    ck_assert_str_eq(json_buf->buf, expected);
+    cork_buffer_clear(json_buf);
+}
+
+/* Logs a message holding str, and checks that it's escaped as expected. */
+static void
+fail_unless_escapes(const char* str, const char* expected)
+{
+    struct cork_buffer  expected_json = CORK_BUFFER_INIT();
+    clog_info("%s", str);
+    cork_buffer_printf
+        (&expected_json,
+         "{\"level\":\"INFO\",\"channel\":\"test\",\"message\":\"%s\"}\n",
+         expected);
+    fail_unless_json(expected_json.buf);
+    cork_buffer_done(&expected_json);
+}
+
+
+/*-----------------------------------------------------------------------
+ * JSON handler
+ */
+
+START_TEST(test_json_messages)
+{
+    DESCRIBE_TEST;
+    setup_json();
+
+    clog_warning("Hello %s", "world");
+    clog_channel_debug("other", "No fields");
+    fail_unless_json
+        ("{\"level\":\"WARNING\",\"channel\":\"test\","
+         "\"message\":\"Hello world\"}\n"
+         "{\"level\":\"DEBUG\",\"channel\":\"other\","
+         "\"message\":\"No fields\"}\n");
+
+    cloge_info {
+        clog_add_field(name, string, "a \"name\"");
+        clog_add_field(count, uint, 1024);
+        clog_add_field(delta, int, -5);
+        clog_add_field(ratio, double, 0.25);
+        clog_add_field(ok, bool, false);
+        clog_add_field(where, ptr, (void*) (uintptr_t) 0xabc);
+        clog_add_field(elapsed, duration, 1500);
+        clog_add_field(bad, double, NAN);
+        clog_set_message("With fields");
+    }
+    fail_unless_json
+        ("{\"level\":\"INFO\",\"channel\":\"test\","
+         "\"message\":\"With fields\",\"fields\":{"
+         "\"name\":\"a \\\"name\\\"\",\"count\":1024,\"delta\":-5,"
+         "\"ratio\":0.25,\"ok\":false,\"where\":\"0xabc\","
+         "\"elapsed\":1500,\"bad\":null}}\n");
+
+    teardown_json();
+}
+END_TEST
+
+START_TEST(test_json_escaping)
+{
+    DESCRIBE_TEST;
+    char long_clean[101];
+    char long_dirty[101];
+    char expected[200];
+    size_t i;
+
+    setup_json();
+    fail_unless_escapes("", "");
+    fail_unless_escapes("plain", "plain");
+    fail_unless_escapes("quote \" backslash \\", "quote \\\" backslash \\\\");
+    fail_unless_escapes("\b\f\n\r\t", "\\b\\f\\n\\r\\t");
+    fail_unless_escapes("\x01\x1f\x7f", "\\u0001\\u001f\x7f");
+    fail_unless_escapes("caf\xc3\xa9", "caf\xc3\xa9");
+
+    /* Long enough to be checked in blocks, with an escape at every possible
+     * position in (and after) a block. */
+    memset(long_clean, 'x', sizeof(long_clean) - 1);
+    long_clean[sizeof(long_clean) - 1] = '\0';
+    fail_unless_escapes(long_clean, long_clean);
+    for (i = 0; i < sizeof(long_dirty) - 1; i++) {
+        memcpy(long_dirty, long_clean, sizeof(long_clean));
+        long_dirty[i] = (i % 2 == 0) ? '"' : '\n';
+        snprintf(expected, sizeof(expected), "%.*s\\%c%s", (int) i,
+                 long_clean, (i % 2 == 0) ? '"' : 'n', long_clean + i + 1);
+        fail_unless_escapes(long_dirty, expected);
+    }
+
+    /* Bytes that are only "dirty" if compared as signed values */
+    fail_unless_escapes
+        ("\xc2\x80\xc2\x9f\xc2\xa0\xc3\xbf and some more text to fill a block",
+         "\xc2\x80\xc2\x9f\xc2\xa0\xc3\xbf and some more text to fill a block");
+
+    /* Valid UTF-8 of every length, at the end of a block and after it */
+    fail_unless_escapes
+        ("\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80 and some more text to fill "
+         "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80",
+         "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80 and some more text to fill "
+         "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+
+    teardown_json();
+}
+END_TEST
+
+#define REPLACEMENT  "\xef\xbf\xbd"
+
+START_TEST(test_json_invalid_utf8)
+{
+    DESCRIBE_TEST;
+    setup_json();
+    /* Stray continuation bytes, and bytes that never appear in UTF-8 */
+    fail_unless_escapes("a\x80\xbf\xc0\xc1\xf5\xff" "b",
+                        "a" REPLACEMENT REPLACEMENT REPLACEMENT REPLACEMENT
+                        REPLACEMENT REPLACEMENT "b");
+    /* A truncated sequence is replaced as a whole */
+    fail_unless_escapes("a\xe2\x82" "b", "a" REPLACEMENT "b");
+    fail_unless_escapes("a\xf0\x9f\x98", "a" REPLACEMENT);
+    /* Overlong encodings, surrogates, and values above U+10FFFF */
+    fail_unless_escapes("\xe0\x80\x80", REPLACEMENT REPLACEMENT REPLACEMENT);
+    fail_unless_escapes("\xed\xa0\x80", REPLACEMENT REPLACEMENT REPLACEMENT);
+    fail_unless_escapes("\xf4\x90\x80\x80",
+                        REPLACEMENT REPLACEMENT REPLACEMENT REPLACEMENT);
+    /* An invalid byte after a valid sequence */
+    fail_unless_escapes("\xc3\xa9\xa9", "\xc3\xa9" REPLACEMENT);
+    teardown_json();
+}
+END_TEST
+
+/* A consumer that logs a message of its own the first time it's given data,
+ * which makes its way back to the same JSON handler. */
+struct logging_consumer {
+    struct cork_stream_consumer  parent;
+    struct cork_buffer  buf;
+    bool  logged;
+};
+
+static int
+logging_consumer_data(struct cork_stream_consumer* consumer,
+                      const void* buf, size_t size, bool is_first)
+{
+    struct logging_consumer  *self =
+        cork_container_of(consumer, struct logging_consumer, parent);
+    if (!self->logged) {
+        self->logged = true;
+        clog_channel_info("consumer", "Writing %zu bytes", size);
+    }
+    cork_buffer_append(&self->buf, buf, size);
+    return 0;
+}
+
+static int
+logging_consumer_eof(struct cork_stream_consumer* consumer)
+{
+    return 0;
+}
+
+static void
+logging_consumer_free(struct cork_stream_consumer* consumer)
+{
+}
+
+START_TEST(test_json_reentrant)
+{
+    DESCRIBE_TEST;
+    struct logging_consumer  consumer;
+    struct clog_handler  *handler;
+
+    consumer.parent.data = logging_consumer_data;
+    consumer.parent.eof = logging_consumer_eof;
+    consumer.parent.free = logging_consumer_free;
+    cork_buffer_init(&consumer.buf);
+    consumer.logged = false;
+    handler = clog_json_handler_new_consumer(&consumer.parent);
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+
+    clog_info("Hello");
+    ck_assert_str_eq
+        (consumer.buf.buf,
+         "{\"level\":\"INFO\",\"channel\":\"consumer\","
+         "\"message\":\"Writing 52 bytes\"}\n"
+         "{\"level\":\"INFO\",\"channel\":\"test\","
+         "\"message\":\"Hello\"}\n");
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    cork_buffer_done(&consumer.buf);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("json");
+
+    TCase  *tc_json = tcase_create("json");
+    tcase_add_test(tc_json, test_json_messages);
+    tcase_add_test(tc_json, test_json_escaping);
+    tcase_add_test(tc_json, test_json_invalid_utf8);
+    tcase_add_test(tc_json, test_json_reentrant);
+    suite_add_tcase(s, tc_json);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
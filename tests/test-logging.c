@@ -7,15 +7,21 @@
  * ----------------------------------------------------------------------
  */
 
+#include <float.h>
+#include <locale.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <wchar.h>
 
 #include <check.h>
 
 #include <libcork/core.h>
 #include <libcork/ds.h>
 #include <libcork/helpers/errors.h>
+#include <libcork/threads.h>
 
 #include "clogger/api.h"
 #include "clogger/fields.h"
@@ -339,6 +345,545 @@ START_TEST(test_no_handlers)
 END_TEST
 
 
+/*-----------------------------------------------------------------------
+ * Channel levels
+ */
+
+static void
+log_to_channel(const char* channel)
+{
+    clog_channel_info(channel, "Info message");
+    clog_channel_debug(channel, "Debug message");
+}
+
+START_TEST(test_channel_levels_01)
+{
+    DESCRIBE_TEST;
+    char dynamic_channel[] = "dynamic";
+    clog_set_minimum_level(CLOG_LEVEL_INFO);
+    create_log_handler(process);
+
+    /* log_to_channel's channel isn't a compile-time constant, so its call
+     * site descriptors stay dynamic, and their levels are looked up each time
+     * they run. */
+    clog_set_channel_level("net", CLOG_LEVEL_DEBUG);
+    clog_set_channel_level("db", CLOG_LEVEL_WARNING);
+    log_to_channel("net");
+    log_to_channel("db");
+    log_to_channel(dynamic_channel);
+    log_to_channel("net");
+    log_to_channel("db");
+    log_to_channel(dynamic_channel);
+
+    /* Changing a level takes effect right away. */
+    clog_set_channel_level("db", CLOG_LEVEL_DEBUG);
+    clog_set_channel_level("dynamic", CLOG_LEVEL_NONE);
+    log_to_channel("db");
+    log_to_channel(dynamic_channel);
+
+    /* Levels go by the channel's name, not where it's stored. */
+    strcpy(dynamic_channel, "db");
+    log_to_channel(dynamic_channel);
+    clog_clear_channel_levels();
+    clog_set_minimum_level(CLOG_LEVEL_WARNING);
+    log_to_channel("net");
+
+    ck_assert_str_eq(log_buf->buf,
+                     "[INFO    ] net: Info message\n"
+                     "[DEBUG   ] net: Debug message\n"
+                     "[INFO    ] dynamic: Info message\n"
+                     "[INFO    ] net: Info message\n"
+                     "[DEBUG   ] net: Debug message\n"
+                     "[INFO    ] dynamic: Info message\n"
+                     "[INFO    ] db: Info message\n"
+                     "[DEBUG   ] db: Debug message\n"
+                     "[INFO    ] db: Info message\n"
+                     "[DEBUG   ] db: Debug message\n");
+    destroy_log_handler(process);
+}
+END_TEST
+
+static unsigned int  net_debug_line;
+
+static void
+log_net_debug(void)
+{
+    net_debug_line = __LINE__; clog_channel_debug("net", "Debug message");
+}
+
+START_TEST(test_channel_levels_02)
+{
+    DESCRIBE_TEST;
+    struct clog_call_site* site;
+
+    /* Statements with a constant level and channel have their descriptors
+     * resolved as soon as the levels change. */
+    log_net_debug();
+    fail_if((site = clog_call_site_find(__FILE__, net_debug_line)) == NULL,
+            "Cannot find call site");
+    fail_if_error(clog_set_levels("warning,net=debug,db=none"));
+    fail_unless_equal("Enabled", "%d", CLOG_CALL_SITE_ENABLED, site->enabled);
+    fail_unless_equal("Default level", "%d", CLOG_LEVEL_WARNING,
+                      clog_channel_level("other"));
+    fail_unless_equal("net level", "%d", CLOG_LEVEL_DEBUG,
+                      clog_channel_level("net"));
+    fail_unless_equal("db level", "%d", CLOG_LEVEL_NONE,
+                      clog_channel_level("db"));
+
+    fail_if_error(clog_set_levels("NET=trace"));
+    fail_unless_equal("NET level", "%d", CLOG_LEVEL_TRACE,
+                      clog_channel_level("NET"));
+    fail_unless_equal("net level", "%d", CLOG_LEVEL_DEBUG,
+                      clog_channel_level("net"));
+
+    fail_unless_error(clog_set_levels("loud"), "Expected an error");
+    fail_unless_error(clog_set_levels("net=loud"), "Expected an error");
+    fail_unless_error(clog_set_levels("=debug"), "Expected an error");
+    fail_unless_error(clog_set_levels("warning,"), "Expected an error");
+    clog_clear_channel_levels();
+    fail_unless_equal("Enabled", "%d", CLOG_CALL_SITE_DISABLED, site->enabled);
+}
+END_TEST
+
+START_TEST(test_channel_levels_03)
+{
+    DESCRIBE_TEST;
+    char channel[64];
+    const char* long_channel =
+        "a.channel.name.that.is.much.longer.than.a.few.dozen.bytes";
+    size_t i;
+    clog_set_minimum_level(CLOG_LEVEL_WARNING);
+    create_log_handler(process);
+
+    /* Give enough channels their own levels that the table has to grow a few
+     * times, and make sure that none of them get lost along the way. */
+    for (i = 0; i < 100; i++) {
+        snprintf(channel, sizeof(channel), "channel%zu", i);
+        clog_set_channel_level(channel, (i % 2 == 0) ?
+                               CLOG_LEVEL_DEBUG : CLOG_LEVEL_ERROR);
+    }
+    for (i = 0; i < 100; i++) {
+        snprintf(channel, sizeof(channel), "channel%zu", i);
+        fail_unless_equal(channel, "%d",
+                          (i % 2 == 0) ? CLOG_LEVEL_DEBUG : CLOG_LEVEL_ERROR,
+                          clog_channel_level(channel));
+    }
+
+    /* Long channel names work just like short ones. */
+    clog_set_channel_level(long_channel, CLOG_LEVEL_DEBUG);
+    log_to_channel(long_channel);
+    log_to_channel("channel1");
+    clog_clear_channel_levels();
+    log_to_channel(long_channel);
+    fail_unless_equal("channel0", "%d", CLOG_LEVEL_WARNING,
+                      clog_channel_level("channel0"));
+
+    ck_assert_str_eq(log_buf->buf,
+                     "[INFO    ] a.channel.name.that.is.much.longer.than.a.few."
+                     "dozen.bytes: Info message\n"
+                     "[DEBUG   ] a.channel.name.that.is.much.longer.than.a.few."
+                     "dozen.bytes: Debug message\n");
+    destroy_log_handler(process);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Call sites
+ */
+
+static unsigned int  trace_line;
+static unsigned int  dynamic_trace_line;
+static unsigned int  source_line;
+
+static void
+log_trace(void)
+{
+    trace_line = __LINE__; clog_channel_trace("sites", "Trace %d", 1);
+}
+
+static void
+log_dynamic_trace(const char* channel)
+{
+    dynamic_trace_line = __LINE__; clog_channel_trace(channel, "Trace");
+}
+
+static void
+log_source(void)
+{
+    source_line = __LINE__; clog_channel_info("sites", "Source");
+}
+
+static void
+log_counted(void)
+{
+    clog_channel_trace("sites", "Counted %d", 1);
+    clog_channel_debug("sites", "Counted %d", 2);
+    clog_channel_info("sites", "Counted %d", 3);
+}
+
+/* Only counts the statements in log_counted, so that adding statements
+ * elsewhere in this file doesn't change the count. */
+static void
+count_call_sites(void* user_data, struct clog_call_site* site)
+{
+    size_t* count = user_data;
+    if (strcmp(site->file, __FILE__) == 0 &&
+        strcmp(site->function, "log_counted") == 0) {
+        (*count)++;
+    }
+}
+
+START_TEST(test_call_sites_01)
+{
+    DESCRIBE_TEST;
+    struct clog_call_site* site;
+    size_t count = 0;
+    clog_set_minimum_level(CLOG_LEVEL_INFO);
+    create_log_handler(process);
+
+    log_trace();
+    fail_if((site = clog_call_site_find(__FILE__, trace_line)) == NULL,
+            "Cannot find call site");
+    fail_unless_equal("Level", "%d", CLOG_LEVEL_TRACE, site->level);
+    ck_assert_str_eq(site->channel, "sites");
+    ck_assert_str_eq(site->format, "Trace %d");
+    fail_unless_equal("Enabled", "%d", CLOG_CALL_SITE_DISABLED,
+                      site->enabled);
+
+    /* Turn on just this one statement... */
+    clog_call_site_set_override(site, CLOG_CALL_SITE_FORCE_ON);
+    log_trace();
+    /* ...which stays on when the levels change... */
+    clog_set_channel_level("sites", CLOG_LEVEL_NONE);
+    log_trace();
+    /* ...until we turn it off again. */
+    clog_call_site_set_override(site, CLOG_CALL_SITE_FORCE_OFF);
+    clog_set_channel_level("sites", CLOG_LEVEL_TRACE);
+    log_trace();
+    clog_call_site_set_override(site, CLOG_CALL_SITE_DEFAULT);
+    log_trace();
+    clog_clear_channel_levels();
+    log_trace();
+
+    ck_assert_str_eq(log_buf->buf,
+                     "[TRACE   ] sites: Trace 1\n"
+                     "[TRACE   ] sites: Trace 1\n"
+                     "[TRACE   ] sites: Trace 1\n");
+
+    /* Every statement has its own call site, whether or not it's enabled. */
+    log_counted();
+    clog_call_sites_visit(&count, count_call_sites);
+    fail_unless_equal("Call sites", "%zu", (size_t) 3, count);
+    destroy_log_handler(process);
+}
+END_TEST
+
+START_TEST(test_call_sites_02)
+{
+    DESCRIBE_TEST;
+    struct clog_call_site* site;
+    clog_set_minimum_level(CLOG_LEVEL_INFO);
+    create_log_handler(process);
+
+    /* This call site's channel isn't known at compile time, so it has to be
+     * checked each time it runs.  Overrides still work, though. */
+    log_dynamic_trace("net");
+    fail_if((site = clog_call_site_find(__FILE__, dynamic_trace_line)) ==
+            NULL, "Cannot find call site");
+    fail_unless(site->channel == NULL, "Channel should be unknown");
+    fail_unless_equal("Enabled", "%d", CLOG_CALL_SITE_DYNAMIC,
+                      site->enabled);
+    clog_set_channel_level("net", CLOG_LEVEL_TRACE);
+    log_dynamic_trace("net");
+    log_dynamic_trace("db");
+    clog_call_site_set_override(site, CLOG_CALL_SITE_FORCE_ON);
+    log_dynamic_trace("db");
+    clog_call_site_set_override(site, CLOG_CALL_SITE_DEFAULT);
+    log_dynamic_trace("db");
+    clog_clear_channel_levels();
+
+    ck_assert_str_eq(log_buf->buf,
+                     "[TRACE   ] net: Trace\n"
+                     "[TRACE   ] db: Trace\n");
+    destroy_log_handler(process);
+}
+END_TEST
+
+START_TEST(test_call_sites_03)
+{
+    DESCRIBE_TEST;
+    struct cork_buffer expected = CORK_BUFFER_INIT();
+    clog_set_minimum_level(CLOG_LEVEL_INFO);
+    log_buf = cork_buffer_new();
+    log_consumer = cork_buffer_to_stream_consumer(log_buf);
+    handler = clog_stream_handler_new_consumer
+        (log_consumer, "%s|%s{file}|%s{line}|%s{func}|%m");
+    clog_handler_push_process(handler);
+
+    /* Each message knows which statement logged it. */
+    log_source();
+    cork_buffer_printf(&expected, "%s:%u|%s|%u|log_source|Source\n",
+                       __FILE__, source_line, __FILE__, source_line);
+    ck_assert_str_eq(log_buf->buf, expected.buf);
+
+    cork_buffer_done(&expected);
+    destroy_log_handler(process);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Per-thread arena
+ */
+
+static const char*
+arena_printf(const char* fmt, ...)
+{
+    const char* result;
+    va_list args;
+    va_start(args, fmt);
+    result = clog_arena_vprintf(NULL, fmt, args);
+    va_end(args);
+    return result;
+}
+
+START_TEST(test_arena_01)
+{
+    DESCRIBE_TEST;
+    struct clog_arena_mark outer = clog_arena_get_mark();
+    const char* str1 = arena_printf("%s %d", "hello", 1);
+    struct clog_arena_mark inner = clog_arena_get_mark();
+    const char* str2;
+    const char* str3;
+    size_t size;
+    void* ptr;
+
+    /* Resetting an inner mark frees its allocations, but nothing before. */
+    str2 = arena_printf("%s %d", "hello", 2);
+    ck_assert_str_eq(str1, "hello 1");
+    ck_assert_str_eq(str2, "hello 2");
+    clog_arena_reset(inner);
+    str3 = arena_printf("%s %d", "hello", 3);
+    ck_assert_ptr_eq(str2, str3);
+    ck_assert_str_eq(str1, "hello 1");
+    ck_assert_str_eq(str3, "hello 3");
+
+    /* Allocations bigger than a chunk */
+    ptr = clog_arena_alloc(1);
+    str2 = arena_printf("%010000d", 4);
+    size = strlen(str2);
+    fail_unless_equal("String length", "%zu", (size_t) 10000, size);
+    ck_assert_str_eq(str2 + 9990, "0000000004");
+    ck_assert_str_eq(str3, "hello 3");
+
+    /* Aligned allocations */
+    ptr = clog_arena_alloc(sizeof(void*));
+    fail_unless((uintptr_t) ptr % sizeof(void*) == 0,
+                "Arena allocation isn't aligned");
+
+    clog_arena_reset(outer);
+    str3 = arena_printf("%s %d", "hello", 5);
+    ck_assert_ptr_eq(str1, str3);
+}
+END_TEST
+
+static const char*
+arena_printf_size(size_t* size, const char* fmt, ...)
+{
+    const char* result;
+    va_list args;
+    va_start(args, fmt);
+    result = clog_arena_vprintf(size, fmt, args);
+    va_end(args);
+    return result;
+}
+
+START_TEST(test_arena_bad_format)
+{
+    DESCRIBE_TEST;
+    static const wchar_t  smiley[] = { 0x263a, 0 };
+    size_t size = 100;
+    const char* str;
+
+    /* A wide string that can't be converted in the C locale makes vsnprintf
+     * fail, which leaves us with an empty string. */
+    setlocale(LC_CTYPE, "C");
+    str = arena_printf_size(&size, "Smile %ls", smiley);
+    ck_assert_str_eq(str, "");
+    fail_unless_equal("String length", "%zu", (size_t) 0, size);
+
+    /* The arena still works afterwards. */
+    str = arena_printf_size(&size, "%s %d", "hello", 1);
+    ck_assert_str_eq(str, "hello 1");
+    fail_unless_equal("String length", "%zu", (size_t) 7, size);
+}
+END_TEST
+
+static int
+log_printf_fields(void* ud)
+{
+    size_t i;
+    for (i = 0; i < 100; i++) {
+        clog_event_channel(CLOG_LEVEL_INFO, "test") {
+            clog_add_field(field1, printf, "%zu", i);
+            clog_set_message("Info %s", clog_field_value(field1));
+        }
+    }
+    return 0;
+}
+
+START_TEST(test_arena_threads)
+{
+    DESCRIBE_TEST;
+    struct clog_arena_mark before = clog_arena_get_mark();
+    struct clog_arena_mark after;
+    struct cork_thread* thread;
+    size_t i;
+
+    /* Each thread's arena is freed when the thread finishes; the debug
+     * allocator will complain if it's freed incorrectly. */
+    for (i = 0; i < 4; i++) {
+        fail_if_error(thread = cork_thread_new
+                      ("logger", NULL, NULL, log_printf_fields));
+        fail_if_error(cork_thread_start(thread));
+        fail_if_error(cork_thread_join(thread));
+    }
+
+    /* Logging on this thread shouldn't leave anything in the arena. */
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    log_printf_fields(NULL);
+    after = clog_arena_get_mark();
+    ck_assert(before.chunk == after.chunk);
+    ck_assert(before.used == after.used);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Typed fields
+ */
+
+static void
+fail_unless_field_renders(const char* expected,
+                          struct clog_message_fields* fields,
+                          struct clog_message_field* field)
+{
+    ck_assert_str_eq(clog_message_field_value(field), expected);
+    /* The rendered value is cached. */
+    ck_assert(clog_message_field_value(field) == field->value);
+    clog_message_fields_pop(fields, field);
+}
+
+#define fail_unless_renders(expected, type, value)                             \
+    do {                                                                       \
+        clog_##type##_field_type __field;                                      \
+        fail_unless_field_renders(                                             \
+            (expected), &fields,                                               \
+            clog_message_add_##type##_field(&fields, &__field, "f", (value))); \
+    } while (0)
+
+START_TEST(test_typed_fields)
+{
+    DESCRIBE_TEST;
+    struct clog_arena_mark before = clog_arena_get_mark();
+    struct clog_arena_mark after;
+    struct clog_message_fields fields;
+
+    clog_message_fields_init(&fields);
+    fail_unless_renders("0", int, 0);
+    fail_unless_renders("-7", int, -7);
+    fail_unless_renders("1234567890", int, 1234567890);
+    fail_unless_renders("9223372036854775807", int, INT64_MAX);
+    fail_unless_renders("-9223372036854775808", int, INT64_MIN);
+    fail_unless_renders("5", uint, 5);
+    fail_unless_renders("18446744073709551615", uint, UINT64_MAX);
+
+    fail_unless_renders("0", double, 0.0);
+    fail_unless_renders("1.5", double, 1.5);
+    fail_unless_renders("0.1", double, 0.1);
+    fail_unless_renders("0.30000000000000004", double, 0.1 + 0.2);
+    fail_unless_renders("-2.5e-10", double, -2.5e-10);
+    fail_unless_renders("1e+100", double, 1e100);
+    fail_unless_renders("-0", double, -0.0);
+    fail_unless_renders("100", double, 100.0);
+    fail_unless_renders("0.0001", double, 0.0001);
+    fail_unless_renders("1e-05", double, 0.00001);
+    fail_unless_renders("123456789012345", double, 123456789012345.0);
+    fail_unless_renders("1e+15", double, 1e15);
+    fail_unless_renders("5e-324", double, 5e-324);
+    fail_unless_renders("1.7976931348623157e+308", double, DBL_MAX);
+    fail_unless_renders("inf", double, INFINITY);
+    fail_unless_renders("nan", double, NAN);
+
+    fail_unless_renders("true", bool, true);
+    fail_unless_renders("false", bool, false);
+    fail_unless_renders("0x0", ptr, NULL);
+    fail_unless_renders("0xdeadbeef", ptr, (void*) (uintptr_t) 0xdeadbeef);
+
+    fail_unless_renders("0ns", duration, 0);
+    fail_unless_renders("250ns", duration, 250);
+    fail_unless_renders("1us", duration, 1000);
+    fail_unless_renders("1.5ms", duration, 1500000);
+    fail_unless_renders("2.000001s", duration, 2000001000);
+    fail_unless_renders("-3s", duration, -3000000000);
+    fail_unless_renders("61s", duration, 61000000000);
+
+    /* Rendered values live in the arena. */
+    after = clog_arena_get_mark();
+    ck_assert(before.chunk != after.chunk || before.used != after.used);
+    clog_arena_reset(before);
+}
+END_TEST
+
+START_TEST(test_typed_fields_locale)
+{
+    DESCRIBE_TEST;
+    static const char  *locales[] = {
+        "de_DE.UTF-8", "fr_FR.UTF-8", "ru_RU.UTF-8", NULL
+    };
+    const char  **locale;
+    struct clog_message_fields fields;
+
+    /* Doubles render the same no matter what the decimal separator of the
+     * current locale is.  Skip the check if none of these are installed. */
+    for (locale = locales; *locale != NULL; locale++) {
+        if (setlocale(LC_NUMERIC, *locale) != NULL) {
+            break;
+        }
+    }
+    if (*locale == NULL) {
+        return;
+    }
+
+    clog_message_fields_init(&fields);
+    fail_unless_renders("1.5", double, 1.5);
+    fail_unless_renders("-2.5e-10", double, -2.5e-10);
+    clog_message_fields_done(&fields);
+    setlocale(LC_NUMERIC, "C");
+}
+END_TEST
+
+START_TEST(test_typed_fields_unrendered)
+{
+    DESCRIBE_TEST;
+    struct clog_message_fields fields;
+    struct clog_uint_field field1;
+    struct clog_string_field field2;
+
+    clog_message_fields_init(&fields);
+    clog_message_add_uint_field(&fields, &field1, "field1", 42);
+    clog_message_add_string_field(&fields, &field2, "field2", "hello");
+    ck_assert(field1.parent.type == CLOG_FIELD_UINT);
+    ck_assert(field1.parent.raw.u == 42);
+    ck_assert(field1.parent.value == NULL);
+    ck_assert(field2.parent.type == CLOG_FIELD_STRING);
+    ck_assert_str_eq(clog_message_field_value(&field2.parent), "hello");
+    clog_message_fields_done(&fields);
+}
+END_TEST
+
+
 /*-----------------------------------------------------------------------
  * Testing harness
  */
@@ -368,6 +913,30 @@ test_suite()
     tcase_add_test(tc_thread, test_no_handlers);
     suite_add_tcase(s, tc_thread);
 
+    TCase  *tc_levels = tcase_create("levels");
+    tcase_add_test(tc_levels, test_channel_levels_01);
+    tcase_add_test(tc_levels, test_channel_levels_02);
+    tcase_add_test(tc_levels, test_channel_levels_03);
+    suite_add_tcase(s, tc_levels);
+
+    TCase  *tc_call_sites = tcase_create("call-sites");
+    tcase_add_test(tc_call_sites, test_call_sites_01);
+    tcase_add_test(tc_call_sites, test_call_sites_02);
+    tcase_add_test(tc_call_sites, test_call_sites_03);
+    suite_add_tcase(s, tc_call_sites);
+
+    TCase  *tc_arena = tcase_create("arena");
+    tcase_add_test(tc_arena, test_arena_01);
+    tcase_add_test(tc_arena, test_arena_bad_format);
+    tcase_add_test(tc_arena, test_arena_threads);
+    suite_add_tcase(s, tc_arena);
+
+    TCase  *tc_fields = tcase_create("fields");
+    tcase_add_test(tc_fields, test_typed_fields);
+    tcase_add_test(tc_fields, test_typed_fields_locale);
+    tcase_add_test(tc_fields, test_typed_fields_unrendered);
+    suite_add_tcase(s, tc_fields);
+
     return s;
 }
 
@@ -0,0 +1,277 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/handlers.h"
+#include "clogger/stash.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define CLOG_CHANNEL "test"
+
+static struct clog_stash* stash;
+static struct clog_handler* stash_handler;
+
+/* The rate-limiting handler passes everything that it lets through (and its
+ * summaries) to a stash. */
+static struct clog_handler*
+push_rate_limit(unsigned int per_second, unsigned int burst)
+{
+    struct clog_handler* handler;
+    stash = clog_stash_new();
+    stash_handler = clog_stashing_handler_new(stash);
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(stash_handler);
+    handler = clog_rate_limit_handler_new(per_second, burst);
+    clog_handler_push_process(handler);
+    return handler;
+}
+
+static void
+pop_rate_limit(struct clog_handler* handler)
+{
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    fail_if_error(clog_handler_pop_process(stash_handler));
+    clog_handler_free(stash_handler);
+    clog_stash_free(stash);
+}
+
+static void
+fail_unless_count(size_t expected, const char* key, const char* value)
+{
+    fail_unless_equal("Event count", "%zu", expected,
+                      clog_stash_count_events(stash, key, value, NULL));
+}
+
+
+/*-----------------------------------------------------------------------
+ * Rate-limiting handler
+ */
+
+START_TEST(test_rate_limit_call_sites)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = push_rate_limit(1, 3);
+    int i;
+
+    /* Each call site gets its own burst. */
+    for (i = 0; i < 10; i++) {
+        clog_info("First %d", i);
+        clog_info("Second %d", i);
+        clog_channel_info("other", "First %d", i);
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) 9,
+                      clog_stash_event_count(stash));
+    fail_unless_count(2, "__message", "First 2");
+    fail_unless_count(0, "__message", "First 3");
+    fail_unless_count(1, "__message", "Second 2");
+    fail_unless_count(0, "__message", "Second 3");
+    fail_unless_equal("Suppressed", "%zu", (size_t) 21,
+                      clog_rate_limit_handler_suppressed(handler));
+
+    /* The summary has a warning for each call site... */
+    clog_rate_limit_handler_report(handler);
+    fail_unless_count(3, "suppressed", "7");
+    ck_assert(clog_stash_contains_event
+              (stash, "suppressed", "7", "format", "Second %d", NULL));
+    ck_assert(clog_stash_contains_event
+              (stash, "suppressed", "7", "format", "First %d",
+               "__message", "Rate limit suppressed 7 messages", NULL));
+
+    /* ...and only counts the messages dropped since the last one. */
+    clog_rate_limit_handler_report(handler);
+    fail_unless_count(3, "suppressed", "7");
+    clog_info("First %d", 100);
+    clog_rate_limit_handler_report(handler);
+    fail_unless_count(1, "suppressed", "1");
+
+    pop_rate_limit(handler);
+}
+END_TEST
+
+START_TEST(test_rate_limit_channels)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = push_rate_limit(1, 2);
+    char fmt[] = "Message %d";
+    int i;
+
+    /* Formats that aren't literals share a limit with their channel. */
+    for (i = 0; i < 5; i++) {
+        clog_channel_info("a", fmt, i);
+        clog_channel_info("b", fmt, i);
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) 4,
+                      clog_stash_event_count(stash));
+    fail_unless_count(2, "__message", "Message 0");
+    fail_unless_count(2, "__message", "Message 1");
+    fail_unless_count(0, "__message", "Message 2");
+
+    clog_rate_limit_handler_report(handler);
+    fail_unless_count(2, "suppressed", "3");
+    ck_assert(!clog_stash_contains_event(stash, "format", "Message 4", NULL));
+
+    pop_rate_limit(handler);
+}
+END_TEST
+
+#define RUNTIME_CHANNEL_COUNT 300
+
+START_TEST(test_rate_limit_runtime_channels)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = push_rate_limit(1, 2);
+    const char* channels[RUNTIME_CHANNEL_COUNT];
+    size_t i;
+
+    /* A channel name that's built at runtime lives at a different address
+     * each time, but it's still the same channel, and shares one limit.  It
+     * doesn't fill up the table, either. */
+    for (i = 0; i < RUNTIME_CHANNEL_COUNT; i++) {
+        channels[i] = cork_strdup("runtime");
+        clog_channel_info(channels[i], "Runtime %zu", i);
+    }
+    for (i = 0; i < 3; i++) {
+        clog_channel_info("other", "Other %zu", i);
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) 4,
+                      clog_stash_event_count(stash));
+    fail_unless_count(1, "__message", "Runtime 1");
+    fail_unless_count(0, "__message", "Runtime 2");
+    fail_unless_count(1, "__message", "Other 1");
+    fail_unless_count(0, "__message", "Other 2");
+
+    for (i = 0; i < RUNTIME_CHANNEL_COUNT; i++) {
+        cork_strfree(channels[i]);
+    }
+    pop_rate_limit(handler);
+}
+END_TEST
+
+START_TEST(test_rate_limit_summary_interval)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = push_rate_limit(1, 1);
+
+    /* With no interval, each message checks for anything to report. */
+    clog_rate_limit_handler_set_summary_interval(handler, 0);
+    clog_info("Flood");
+    clog_info("Flood");
+    clog_info("Flood");
+    fail_unless_count(1, "__message", "Flood");
+    fail_unless_count(2, "__message", "Rate limit suppressed 1 message");
+    ck_assert(clog_stash_contains_sequence
+              (stash,
+               "__message", "Flood", NULL,
+               "suppressed", "1", "format", "Flood", NULL,
+               "suppressed", "1", "format", "Flood", NULL,
+               NULL));
+
+    pop_rate_limit(handler);
+}
+END_TEST
+
+#define THREAD_COUNT 4
+#define THREAD_MESSAGE_COUNT 1000
+#define THREAD_BURST 100
+
+static int
+log_from_thread(void* unused)
+{
+    size_t i;
+    for (i = 0; i < THREAD_MESSAGE_COUNT; i++) {
+        clog_info("From a thread");
+    }
+    return 0;
+}
+
+START_TEST(test_rate_limit_threads)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = push_rate_limit(1, THREAD_BURST);
+    struct cork_thread* threads[THREAD_COUNT];
+    size_t passed;
+    size_t i;
+
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", NULL, NULL, log_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+
+    /* Every message is either passed along or counted, and the burst isn't
+     * exceeded (by much, if the test happens to be slow). */
+    passed = clog_stash_event_count(stash);
+    fail_unless_equal("Message count", "%zu",
+                      (size_t) THREAD_COUNT * THREAD_MESSAGE_COUNT,
+                      passed + clog_rate_limit_handler_suppressed(handler));
+    fail_if(passed < THREAD_BURST, "Too few messages: %zu", passed);
+    fail_if(passed > THREAD_BURST + 5, "Too many messages: %zu", passed);
+
+    pop_rate_limit(handler);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("ratelimit");
+
+    TCase  *tc_ratelimit = tcase_create("ratelimit");
+    tcase_add_test(tc_ratelimit, test_rate_limit_call_sites);
+    tcase_add_test(tc_ratelimit, test_rate_limit_channels);
+    tcase_add_test(tc_ratelimit, test_rate_limit_runtime_channels);
+    tcase_add_test(tc_ratelimit, test_rate_limit_summary_interval);
+    tcase_add_test(tc_ratelimit, test_rate_limit_threads);
+    suite_add_tcase(s, tc_ratelimit);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,396 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define CLOG_CHANNEL "test"
+#define DEFAULT_FORMAT "[%L] %c:#*{ %k=%v} %m"
+
+static char ring_path[] = "test-ring.XXXXXX";
+
+static void
+create_ring_path(void)
+{
+    int fd;
+    strcpy(ring_path, "test-ring.XXXXXX");
+    fail_if((fd = mkstemp(ring_path)) == -1, "Cannot create ring file");
+    close(fd);
+}
+
+static struct clog_handler*
+push_ring(size_t size)
+{
+    struct clog_handler* handler;
+    fail_if_error(handler = clog_mmap_ring_handler_new(ring_path, size));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    return handler;
+}
+
+static void
+pop_ring(struct clog_handler* handler)
+{
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+}
+
+static void
+read_ring(struct cork_buffer* dest, const char* fmt)
+{
+    struct clog_handler* handler = clog_stream_handler_new_consumer
+        (cork_buffer_to_stream_consumer(dest), fmt);
+    fail_if_error(clog_mmap_ring_read(ring_path, handler));
+    clog_handler_free(handler);
+}
+
+static void
+fail_unless_ring(const char* fmt, const char* expected)
+{
+    struct cork_buffer actual = CORK_BUFFER_INIT();
+    read_ring(&actual, fmt);
+    ck_assert_str_eq((actual.buf == NULL) ? "" : actual.buf, expected);
+    cork_buffer_done(&actual);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Ring handler
+ */
+
+START_TEST(test_ring_01)
+{
+    DESCRIBE_TEST;
+    struct cork_buffer text = CORK_BUFFER_INIT();
+    struct clog_handler* text_handler = clog_stream_handler_new_consumer
+        (cork_buffer_to_stream_consumer(&text), DEFAULT_FORMAT);
+    struct clog_handler* handler;
+
+    create_ring_path();
+    clog_handler_push_process(text_handler);
+    handler = push_ring(65536);
+    clog_info("Hello %s", "world");
+    cloge_warning {
+        clog_add_field(field1, string, "hello");
+        clog_add_field(field2, printf, "%d", 42);
+        clog_set_message("With fields");
+    }
+    clog_channel_debug("other", "Last message");
+    pop_ring(handler);
+    fail_if_error(clog_handler_pop_process(text_handler));
+    clog_handler_free(text_handler);
+
+    fail_unless_ring(DEFAULT_FORMAT, text.buf);
+    cork_buffer_done(&text);
+    unlink(ring_path);
+}
+END_TEST
+
+START_TEST(test_ring_wrap)
+{
+    DESCRIBE_TEST;
+    struct cork_buffer actual = CORK_BUFFER_INIT();
+    struct cork_buffer expected = CORK_BUFFER_INIT();
+    struct clog_handler* handler;
+    int first;
+    int i;
+
+    create_ring_path();
+    handler = push_ring(4096);
+    for (i = 0; i < 1000; i++) {
+        clog_info("Message %d", i);
+    }
+    pop_ring(handler);
+
+    /* Only the newest messages fit, but they should all be there. */
+    read_ring(&actual, "%m");
+    fail_unless(sscanf(actual.buf, "Message %d", &first) == 1,
+                "Unexpected ring contents:\n%s", (char*) actual.buf);
+    fail_unless(first > 900, "Too many messages in ring: %d", 1000 - first);
+    for (i = first; i < 1000; i++) {
+        cork_buffer_append_printf(&expected, "Message %d\n", i);
+    }
+    ck_assert_str_eq(actual.buf, expected.buf);
+
+    cork_buffer_done(&actual);
+    cork_buffer_done(&expected);
+    unlink(ring_path);
+}
+END_TEST
+
+START_TEST(test_ring_reopen)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler;
+
+    create_ring_path();
+    handler = push_ring(4096);
+    clog_info("First");
+    pop_ring(handler);
+
+    /* A ring of the same size keeps its existing messages... */
+    handler = push_ring(4096);
+    clog_info("Second");
+    pop_ring(handler);
+    fail_unless_ring("%m", "First\nSecond\n");
+
+    /* ...but a different size starts over. */
+    handler = push_ring(8192);
+    clog_info("Third");
+    pop_ring(handler);
+    fail_unless_ring("%m", "Third\n");
+    unlink(ring_path);
+}
+END_TEST
+
+START_TEST(test_ring_crash)
+{
+    DESCRIBE_TEST;
+    pid_t pid;
+    int status;
+
+    create_ring_path();
+    pid = fork();
+    fail_if(pid == -1, "Cannot fork");
+    if (pid == 0) {
+        push_ring(4096);
+        clog_info("Before the crash");
+        clog_error("Crashing now");
+        signal(SIGABRT, SIG_DFL);
+        abort();
+    }
+
+    fail_if(waitpid(pid, &status, 0) != pid, "Cannot wait for child");
+    fail_unless(WIFSIGNALED(status), "Child didn't crash");
+    fail_unless_ring("%m", "Before the crash\nCrashing now\n");
+    unlink(ring_path);
+}
+END_TEST
+
+/* Ring files start with a 64-byte header, and each record starts with an
+ * 8-byte slot holding ~pos, followed by its 32-bit length and type byte. */
+#define RING_HEADER_SIZE  64
+#define RING_SLOT_SIZE  8
+
+/* Replaces the type of the record containing needle with a bogus one, while
+ * leaving its slot intact. */
+static void
+corrupt_ring_record(const char* needle)
+{
+    struct cork_buffer file = CORK_BUFFER_INIT();
+    size_t needle_size = strlen(needle);
+    char chunk[4096];
+    FILE* fp;
+    size_t size;
+    size_t pos;
+
+    fail_if((fp = fopen(ring_path, "r+b")) == NULL, "Cannot open ring");
+    while ((size = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        cork_buffer_append(&file, chunk, size);
+    }
+
+    for (pos = 0; RING_HEADER_SIZE + pos + RING_SLOT_SIZE + 5 <= file.size;
+         pos += RING_SLOT_SIZE) {
+        char* slot = (char*) file.buf + RING_HEADER_SIZE + pos;
+        uint64_t tag;
+        uint32_t record_size;
+        size_t i;
+        memcpy(&tag, slot, sizeof(tag));
+        memcpy(&record_size, slot + RING_SLOT_SIZE, sizeof(record_size));
+        if (tag != ~(uint64_t) pos || record_size < needle_size) {
+            continue;
+        }
+        for (i = 0; i + needle_size <= record_size; i++) {
+            if (memcmp(slot + RING_SLOT_SIZE + 4 + i, needle,
+                       needle_size) == 0) {
+                fseek(fp, RING_HEADER_SIZE + pos + RING_SLOT_SIZE + 4,
+                      SEEK_SET);
+                fputc(0xff, fp);
+                fclose(fp);
+                cork_buffer_done(&file);
+                return;
+            }
+        }
+    }
+    fail("Cannot find record containing %s", needle);
+}
+
+START_TEST(test_ring_torn_record)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler;
+
+    create_ring_path();
+    handler = push_ring(4096);
+    clog_info("First");
+    clog_info("Second");
+    clog_info("Third");
+    pop_ring(handler);
+
+    /* A record that won't decode is skipped, like any other torn record. */
+    corrupt_ring_record("Second");
+    fail_unless_ring("%m", "First\nThird\n");
+    unlink(ring_path);
+}
+END_TEST
+
+#define THREAD_COUNT 4
+#define THREAD_MESSAGE_COUNT 1000
+
+static int
+log_from_thread(void* vid)
+{
+    size_t id = (uintptr_t) vid;
+    size_t i;
+    for (i = 0; i < THREAD_MESSAGE_COUNT; i++) {
+        clog_info("%zu %zu", id, i);
+    }
+    return 0;
+}
+
+START_TEST(test_ring_threads)
+{
+    DESCRIBE_TEST;
+    struct cork_buffer actual = CORK_BUFFER_INIT();
+    struct cork_thread* threads[THREAD_COUNT];
+    size_t next[THREAD_COUNT];
+    struct clog_handler* handler;
+    const char* curr;
+    size_t id;
+    size_t index;
+    size_t i;
+
+    create_ring_path();
+    handler = push_ring(1024 * 1024);
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", (void*) (uintptr_t) i, NULL,
+                       log_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+    pop_ring(handler);
+
+    /* Each thread's messages should all be there, in order. */
+    read_ring(&actual, "%m");
+    memset(next, 0, sizeof(next));
+    for (curr = actual.buf; *curr != '\0'; curr = strchr(curr, '\n') + 1) {
+        fail_unless(sscanf(curr, "%zu %zu", &id, &index) == 2,
+                    "Unexpected message %s", curr);
+        fail_unless(id < THREAD_COUNT, "Unexpected thread %zu", id);
+        fail_unless_equal("Message index", "%zu", next[id], index);
+        next[id]++;
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_unless_equal("Message count", "%zu",
+                          (size_t) THREAD_MESSAGE_COUNT, next[i]);
+    }
+
+    cork_buffer_done(&actual);
+    unlink(ring_path);
+}
+END_TEST
+
+START_TEST(test_ring_bad_files)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = clog_null_handler_new();
+    struct stat info;
+    FILE* fp;
+
+    create_ring_path();
+    fail_unless_error(clog_mmap_ring_handler_new(ring_path, 1000),
+                      "Expected an error");
+    fail_unless_error(clog_mmap_ring_read(ring_path, handler),
+                      "Expected an error");
+    fp = fopen(ring_path, "w");
+    fprintf(fp, "This isn't a ring file, but it's long enough to have a "
+                "header, if it were one.\n");
+    fclose(fp);
+    fail_unless_error(clog_mmap_ring_read(ring_path, handler),
+                      "Expected an error");
+
+    /* A file that isn't a ring is left alone, rather than overwritten. */
+    fail_unless_error(clog_mmap_ring_handler_new(ring_path, 4096),
+                      "Expected an error");
+    fail_if(stat(ring_path, &info) == -1, "Cannot stat ring file");
+    fail_unless_equal("File size", "%zu", (size_t) 79, (size_t) info.st_size);
+    unlink(ring_path);
+    fail_unless_error(clog_mmap_ring_read(ring_path, handler),
+                      "Expected an error");
+    clog_handler_free(handler);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("ring");
+
+    TCase  *tc_ring = tcase_create("ring");
+    tcase_add_test(tc_ring, test_ring_01);
+    tcase_add_test(tc_ring, test_ring_wrap);
+    tcase_add_test(tc_ring, test_ring_reopen);
+    tcase_add_test(tc_ring, test_ring_crash);
+    tcase_add_test(tc_ring, test_ring_torn_record);
+    tcase_add_test(tc_ring, test_ring_threads);
+    tcase_add_test(tc_ring, test_ring_bad_files);
+    suite_add_tcase(s, tc_ring);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,382 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#if defined(CLOG_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/handlers.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define CLOG_CHANNEL "test"
+
+static char dir[] = "test-rotate.XXXXXX";
+static struct cork_buffer path = CORK_BUFFER_INIT();
+
+static struct clog_handler*
+create_handler(void)
+{
+    struct clog_handler* handler;
+    strcpy(dir, "test-rotate.XXXXXX");
+    fail_if(mkdtemp(dir) == NULL, "Cannot create directory");
+    cork_buffer_printf(&path, "%s/log.txt", dir);
+    fail_if_error(handler = clog_rotating_file_handler_new(path.buf, "%m"));
+    return handler;
+}
+
+static void
+remove_files(void)
+{
+    struct cork_buffer rotated = CORK_BUFFER_INIT();
+    unsigned int i;
+    unlink(path.buf);
+    for (i = 1; i <= 1000; i++) {
+        cork_buffer_printf(&rotated, "%s.%u", (char*) path.buf, i);
+        unlink(rotated.buf);
+        cork_buffer_append_string(&rotated, ".gz");
+        unlink(rotated.buf);
+    }
+    rmdir(dir);
+    cork_buffer_done(&rotated);
+    cork_buffer_done(&path);
+}
+
+/* Appends the contents of a (possibly compressed) file to dest.  Returns
+ * false if the file doesn't exist. */
+#if defined(CLOG_HAVE_ZLIB)
+static bool
+read_file(struct cork_buffer* dest, const char* filename, size_t* size)
+{
+    char buf[4096];
+    int bytes_read;
+    gzFile gz = gzopen(filename, "rb");
+    if (gz == NULL) {
+        return false;
+    }
+    *size = 0;
+    while ((bytes_read = gzread(gz, buf, sizeof(buf))) > 0) {
+        cork_buffer_append(dest, buf, bytes_read);
+        *size += bytes_read;
+    }
+    gzclose(gz);
+    return true;
+}
+#else
+static bool
+read_file(struct cork_buffer* dest, const char* filename, size_t* size)
+{
+    char buf[4096];
+    size_t bytes_read;
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    *size = 0;
+    while ((bytes_read = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        cork_buffer_append(dest, buf, bytes_read);
+        *size += bytes_read;
+    }
+    fclose(fp);
+    return true;
+}
+#endif
+
+/* Reads every rotated file, oldest first, and then the current file.  Fails
+ * if any file is bigger than max_size. */
+static void
+read_all(struct cork_buffer* dest, const char* suffix, size_t max_size)
+{
+    struct cork_buffer rotated = CORK_BUFFER_INIT();
+    size_t size;
+    unsigned int i = 1;
+
+    cork_buffer_set_string(dest, "");
+    do {
+        cork_buffer_printf(&rotated, "%s.%u%s", (char*) path.buf, i++, suffix);
+    } while (access(rotated.buf, F_OK) == 0);
+    for (i -= 2; i > 0; i--) {
+        cork_buffer_printf(&rotated, "%s.%u%s", (char*) path.buf, i, suffix);
+        fail_unless(read_file(dest, rotated.buf, &size),
+                    "Cannot read %s", (char*) rotated.buf);
+        fail_if(size > max_size, "%s is too big: %zu bytes",
+                (char*) rotated.buf, size);
+    }
+    fail_unless(read_file(dest, path.buf, &size),
+                "Cannot read %s", (char*) path.buf);
+    cork_buffer_done(&rotated);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Rotating file handler
+ */
+
+START_TEST(test_rotate_size)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = create_handler();
+    struct cork_buffer actual = CORK_BUFFER_INIT();
+    struct cork_buffer expected = CORK_BUFFER_INIT();
+    struct cork_buffer oldest = CORK_BUFFER_INIT();
+    int i;
+
+    /* Each message is 11 bytes, so 4 fit in each file. */
+    clog_rotating_file_handler_set_max_size(handler, 50);
+    clog_rotating_file_handler_set_keep(handler, 3);
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    for (i = 0; i < 20; i++) {
+        clog_info("Message %02d", i);
+    }
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+
+    cork_buffer_printf(&oldest, "%s.4", (char*) path.buf);
+    fail_unless(access(oldest.buf, F_OK) != 0, "Too many rotated files");
+    read_all(&actual, "", 50);
+    for (i = 4; i < 20; i++) {
+        cork_buffer_append_printf(&expected, "Message %02d\n", i);
+    }
+    ck_assert_str_eq(actual.buf, expected.buf);
+
+    cork_buffer_done(&actual);
+    cork_buffer_done(&expected);
+    cork_buffer_done(&oldest);
+    remove_files();
+}
+END_TEST
+
+START_TEST(test_rotate_age)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = create_handler();
+    struct cork_buffer actual = CORK_BUFFER_INIT();
+    size_t size;
+
+    fail_if_error(clog_rotating_file_handler_configure(handler, "age=1"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    clog_info("First");
+    clog_info("Second");
+    sleep(1);
+    clog_info("Third");
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+
+    read_all(&actual, "", SIZE_MAX);
+    ck_assert_str_eq(actual.buf, "First\nSecond\nThird\n");
+    cork_buffer_set_string(&actual, "");
+    fail_unless(read_file(&actual, path.buf, &size),
+                "Cannot read %s", (char*) path.buf);
+    ck_assert_str_eq(actual.buf, "Third\n");
+
+    cork_buffer_done(&actual);
+    remove_files();
+}
+END_TEST
+
+#if defined(CLOG_HAVE_ZLIB)
+START_TEST(test_rotate_compress)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = create_handler();
+    struct cork_buffer actual = CORK_BUFFER_INIT();
+    struct cork_buffer expected = CORK_BUFFER_INIT();
+    int i;
+
+    fail_if_error(clog_rotating_file_handler_configure
+                  (handler, "size=50,keep=100,compress"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    for (i = 0; i < 20; i++) {
+        clog_info("Message %02d", i);
+        cork_buffer_append_printf(&expected, "Message %02d\n", i);
+    }
+    fail_if_error(clog_rotating_file_handler_rotate(handler));
+    clog_info("After rotating");
+    cork_buffer_append_printf(&expected, "After rotating\n");
+    fail_if_error(clog_rotating_file_handler_flush(handler));
+
+    read_all(&actual, ".gz", 50);
+    ck_assert_str_eq(actual.buf, expected.buf);
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    cork_buffer_done(&actual);
+    cork_buffer_done(&expected);
+    remove_files();
+}
+END_TEST
+#else
+START_TEST(test_rotate_compress)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = create_handler();
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "compress"), "Expected an error");
+    clog_handler_free(handler);
+    remove_files();
+}
+END_TEST
+#endif
+
+START_TEST(test_rotate_bad_settings)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = create_handler();
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "size=lots"), "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "size=10X"), "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "keep=-1"), "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "keep"), "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "often"), "Expected an error");
+    /* Too big for their settings */
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "size=99999999999999999999"),
+                      "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "size=99999999999G"), "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "age=5000000000"), "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "age=100000d"), "Expected an error");
+    fail_unless_error(clog_rotating_file_handler_configure
+                      (handler, "keep=5000000000"), "Expected an error");
+    fail_if_error(clog_rotating_file_handler_configure
+                  (handler, "size=10k,age=2h,,keep=0"));
+    clog_handler_free(handler);
+    remove_files();
+
+    fail_unless_error(clog_rotating_file_handler_new
+                      ("missing/log.txt", "%m"), "Expected an error");
+}
+END_TEST
+
+#define THREAD_COUNT 4
+#define THREAD_MESSAGE_COUNT 1000
+
+static int
+log_from_thread(void* vid)
+{
+    size_t id = (uintptr_t) vid;
+    size_t i;
+    for (i = 0; i < THREAD_MESSAGE_COUNT; i++) {
+        clog_info("%zu %zu", id, i);
+    }
+    return 0;
+}
+
+START_TEST(test_rotate_threads)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = create_handler();
+    struct cork_buffer actual = CORK_BUFFER_INIT();
+    struct cork_thread* threads[THREAD_COUNT];
+    size_t next[THREAD_COUNT];
+    const char* curr;
+    size_t id;
+    size_t index;
+    size_t i;
+
+    clog_rotating_file_handler_set_max_size(handler, 1000);
+    clog_rotating_file_handler_set_keep(handler, 1000);
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", (void*) (uintptr_t) i, NULL,
+                       log_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+
+    /* No message should be split between files, or lost. */
+    read_all(&actual, "", 1000);
+    memset(next, 0, sizeof(next));
+    for (curr = actual.buf; *curr != '\0'; curr = strchr(curr, '\n') + 1) {
+        fail_unless(sscanf(curr, "%zu %zu", &id, &index) == 2,
+                    "Unexpected message %s", curr);
+        fail_unless(id < THREAD_COUNT, "Unexpected thread %zu", id);
+        fail_unless_equal("Message index", "%zu", next[id], index);
+        next[id]++;
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_unless_equal("Message count", "%zu",
+                          (size_t) THREAD_MESSAGE_COUNT, next[i]);
+    }
+
+    cork_buffer_done(&actual);
+    remove_files();
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("rotate");
+
+    TCase  *tc_rotate = tcase_create("rotate");
+    tcase_add_test(tc_rotate, test_rotate_size);
+    tcase_add_test(tc_rotate, test_rotate_age);
+    tcase_add_test(tc_rotate, test_rotate_compress);
+    tcase_add_test(tc_rotate, test_rotate_bad_settings);
+    tcase_add_test(tc_rotate, test_rotate_threads);
+    suite_add_tcase(s, tc_rotate);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
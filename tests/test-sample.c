@@ -0,0 +1,317 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/fields.h"
+#include "clogger/handlers.h"
+#include "clogger/stash.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+#define CLOG_CHANNEL "test"
+
+static struct clog_stash* stash;
+static struct clog_handler* stash_handler;
+
+/* The sampling handler passes everything that it keeps to a stash. */
+static void
+push_sampling(struct clog_handler* handler)
+{
+    stash = clog_stash_new();
+    stash_handler = clog_stashing_handler_new(stash);
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(stash_handler);
+    clog_handler_push_process(handler);
+}
+
+static void
+pop_sampling(struct clog_handler* handler)
+{
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    fail_if_error(clog_handler_pop_process(stash_handler));
+    clog_handler_free(stash_handler);
+    clog_stash_free(stash);
+}
+
+static void
+fail_unless_count(size_t expected, const char* key, const char* value)
+{
+    fail_unless_equal("Event count", "%zu", expected,
+                      clog_stash_count_events(stash, key, value, NULL));
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sampling handler
+ */
+
+START_TEST(test_sample_every)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = clog_sampling_handler_new_every(4);
+    int i;
+
+    push_sampling(handler);
+    for (i = 0; i < 100; i++) {
+        clog_debug("Message %d", i);
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) 25,
+                      clog_stash_event_count(stash));
+    fail_unless_count(25, "sample_rate", "4");
+    fail_unless_count(1, "__message", "Message 0");
+    fail_unless_count(0, "__message", "Message 1");
+    fail_unless_count(1, "__message", "Message 96");
+    pop_sampling(handler);
+}
+END_TEST
+
+START_TEST(test_sample_random)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = clog_sampling_handler_new_random(0.25);
+    size_t kept;
+    int i;
+
+    push_sampling(handler);
+    for (i = 0; i < 10000; i++) {
+        clog_debug("Message %d", i);
+    }
+    kept = clog_stash_event_count(stash);
+    fail_if(kept < 2000 || kept > 3000, "Unexpected sample size %zu", kept);
+    fail_unless_count(kept, "sample_rate", "4");
+    pop_sampling(handler);
+
+    handler = clog_sampling_handler_new_random(1.0);
+    push_sampling(handler);
+    for (i = 0; i < 100; i++) {
+        clog_debug("Message %d", i);
+    }
+    fail_unless_count(100, "sample_rate", "1");
+    pop_sampling(handler);
+
+    handler = clog_sampling_handler_new_random(0.0);
+    push_sampling(handler);
+    for (i = 0; i < 100; i++) {
+        clog_debug("Message %d", i);
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) 0,
+                      clog_stash_event_count(stash));
+    pop_sampling(handler);
+}
+END_TEST
+
+START_TEST(test_sample_field)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler =
+        clog_sampling_handler_new_field("request_id", 4);
+    char request_id[32];
+    size_t kept_requests = 0;
+    size_t count;
+    int i;
+    int j;
+
+    push_sampling(handler);
+    for (i = 0; i < 100; i++) {
+        for (j = 0; j < 10; j++) {
+            cloge_debug {
+                clog_add_field(request_id, printf, "%d", i);
+                clog_set_message("Step %d", j);
+            }
+        }
+    }
+
+    /* Each request is either kept or dropped as a whole. */
+    for (i = 0; i < 100; i++) {
+        snprintf(request_id, sizeof(request_id), "%d", i);
+        count = clog_stash_count_events(stash, "request_id", request_id,
+                                        "sample_rate", "4", NULL);
+        fail_unless(count == 0 || count == 10,
+                    "Request %d was only partially kept", i);
+        if (count == 10) {
+            kept_requests++;
+        }
+    }
+    fail_if(kept_requests < 10 || kept_requests > 45,
+            "Unexpected sample size %zu", kept_requests);
+    pop_sampling(handler);
+}
+END_TEST
+
+START_TEST(test_sample_level)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = clog_sampling_handler_new_every(1000);
+    int i;
+
+    /* Only debug messages are sampled. */
+    clog_sampling_handler_set_level(handler, CLOG_LEVEL_DEBUG);
+    push_sampling(handler);
+    for (i = 0; i < 10; i++) {
+        clog_debug("Debug %d", i);
+        clog_info("Info %d", i);
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) 11,
+                      clog_stash_event_count(stash));
+    fail_unless_count(1, "sample_rate", "1000");
+    ck_assert(clog_stash_contains_event(stash, "__message", "Info 9", NULL));
+    ck_assert(!clog_stash_contains_event
+              (stash, "__message", "Info 9", "sample_rate", "1000", NULL));
+    pop_sampling(handler);
+}
+END_TEST
+
+#define THREAD_COUNT 4
+#define THREAD_MESSAGE_COUNT 1000
+
+static int
+log_from_thread(void* unused)
+{
+    size_t i;
+    for (i = 0; i < THREAD_MESSAGE_COUNT; i++) {
+        clog_debug("From a thread");
+    }
+    return 0;
+}
+
+START_TEST(test_sample_threads)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = clog_sampling_handler_new_every(10);
+    struct cork_thread* threads[THREAD_COUNT];
+    size_t i;
+
+    push_sampling(handler);
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", NULL, NULL, log_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+    fail_unless_equal("Event count", "%zu",
+                      (size_t) THREAD_COUNT * THREAD_MESSAGE_COUNT / 10,
+                      clog_stash_event_count(stash));
+    pop_sampling(handler);
+}
+END_TEST
+
+#define SHORT_THREAD_MESSAGE_COUNT 5
+
+static int
+log_a_few_from_thread(void* unused)
+{
+    size_t i;
+    for (i = 0; i < SHORT_THREAD_MESSAGE_COUNT; i++) {
+        clog_debug("From a thread");
+    }
+    return 0;
+}
+
+START_TEST(test_sample_threads_count_separately)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler = clog_sampling_handler_new_every(10);
+    struct cork_thread* threads[THREAD_COUNT];
+    size_t i;
+
+    /* Each thread keeps its own first message. */
+    push_sampling(handler);
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", NULL, NULL, log_a_few_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) THREAD_COUNT,
+                      clog_stash_event_count(stash));
+    pop_sampling(handler);
+}
+END_TEST
+
+START_TEST(test_sample_every_chained)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* every_2 = clog_sampling_handler_new_every(2);
+    struct clog_handler* every_3 = clog_sampling_handler_new_every(3);
+    int i;
+
+    /* Each handler keeps its own count.  The first keeps messages 0, 2, 4,
+     * and so on; the second keeps one in 3 of those. */
+    push_sampling(every_3);
+    clog_handler_push_process(every_2);
+    for (i = 0; i < 12; i++) {
+        clog_debug("Message %d", i);
+    }
+    fail_unless_equal("Event count", "%zu", (size_t) 2,
+                      clog_stash_event_count(stash));
+    fail_unless_count(1, "__message", "Message 0");
+    fail_unless_count(1, "__message", "Message 6");
+    fail_if_error(clog_handler_pop_process(every_2));
+    clog_handler_free(every_2);
+    pop_sampling(every_3);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("sample");
+
+    TCase  *tc_sample = tcase_create("sample");
+    tcase_add_test(tc_sample, test_sample_every);
+    tcase_add_test(tc_sample, test_sample_random);
+    tcase_add_test(tc_sample, test_sample_field);
+    tcase_add_test(tc_sample, test_sample_level);
+    tcase_add_test(tc_sample, test_sample_threads);
+    tcase_add_test(tc_sample, test_sample_threads_count_separately);
+    tcase_add_test(tc_sample, test_sample_every_chained);
+    suite_add_tcase(s, tc_sample);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -7,12 +7,16 @@
  * ----------------------------------------------------------------------
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <check.h>
 
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
 #include "clogger/api.h"
 #include "clogger/fields.h"
 #include "clogger/stash.h"
@@ -156,6 +160,255 @@ START_TEST(test_two_stashes)
 }
 END_TEST
 
+START_TEST(test_stash_queries)
+{
+    DESCRIBE_TEST;
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    struct clog_stash* stash = clog_stash_new();
+    struct clog_handler* handler = clog_stashing_handler_new(stash);
+    size_t index = 100;
+    clog_handler_push_process(handler);
+
+    ck_assert(!clog_stash_find_first_event(stash, &index, NULL));
+    fail_unless_equal("Event count", "%zu", (size_t) 0,
+                      clog_stash_count_events(stash, NULL));
+
+    cloge_info {
+        clog_add_field(user, string, "alice");
+        clog_set_message("login");
+    }
+    cloge_info {
+        clog_add_field(user, string, "bob");
+        clog_set_message("login");
+    }
+    cloge_info {
+        clog_add_field(user, string, "alice");
+        clog_set_message("logout");
+    }
+    cloge_info {
+        clog_add_field(user, string, "bob");
+        clog_set_message("logout");
+    }
+    cloge_info {
+        clog_add_field(user, string, "alice");
+        clog_set_message("login");
+    }
+
+    fail_unless_equal("Event count", "%zu", (size_t) 5,
+                      clog_stash_event_count(stash));
+    fail_unless_equal("Event count", "%zu", (size_t) 5,
+                      clog_stash_count_events(stash, NULL));
+    fail_unless_equal("Event count", "%zu", (size_t) 3,
+                      clog_stash_count_events(stash, "user", "alice", NULL));
+    fail_unless_equal("Event count", "%zu", (size_t) 2,
+                      clog_stash_count_events(stash, "user", "alice",
+                                              "__message", "login", NULL));
+    fail_unless_equal("Event count", "%zu", (size_t) 0,
+                      clog_stash_count_events(stash, "user", "carol", NULL));
+    fail_unless_equal("Event count", "%zu", (size_t) 0,
+                      clog_stash_count_events(stash, "user", NULL));
+
+    ck_assert(clog_stash_find_first_event(stash, &index, "user", "bob", NULL));
+    fail_unless_equal("Event index", "%zu", (size_t) 1, index);
+    ck_assert(clog_stash_find_last_event(stash, &index, "user", "bob", NULL));
+    fail_unless_equal("Event index", "%zu", (size_t) 3, index);
+    ck_assert(clog_stash_find_last_event(stash, &index, NULL));
+    fail_unless_equal("Event index", "%zu", (size_t) 4, index);
+    ck_assert(!clog_stash_find_last_event(stash, &index,
+                                          "user", "bob", "__message", "oops",
+                                          NULL));
+    fail_unless_equal("Event index", "%zu", (size_t) 4, index);
+
+    ck_assert_str_eq(clog_stash_event_get(stash, 2, "__message"), "logout");
+    ck_assert_str_eq(clog_stash_event_get(stash, 2, "user"), "alice");
+    ck_assert(clog_stash_event_get(stash, 2, "missing") == NULL);
+    ck_assert(clog_stash_event_get(stash, 5, "user") == NULL);
+
+    ck_assert(clog_stash_contains_sequence
+              (stash,
+               "user", "alice", "__message", "login", NULL,
+               "user", "bob", "__message", "logout", NULL,
+               "user", "alice", "__message", "login", NULL,
+               NULL));
+    ck_assert(clog_stash_contains_sequence
+              (stash,
+               "__message", "logout", NULL,
+               "user", "alice", NULL,
+               NULL));
+    ck_assert(!clog_stash_contains_sequence
+              (stash,
+               "user", "bob", "__message", "logout", NULL,
+               "user", "bob", NULL,
+               NULL));
+    ck_assert(!clog_stash_contains_sequence
+              (stash,
+               "__message", "login", NULL,
+               "__message", "login", NULL,
+               "__message", "login", NULL,
+               "__message", "login", NULL,
+               NULL));
+    ck_assert(clog_stash_contains_sequence(stash, NULL));
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    clog_stash_free(stash);
+}
+END_TEST
+
+START_TEST(test_stash_many_events)
+{
+    DESCRIBE_TEST;
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    struct clog_stash* stash = clog_stash_new();
+    struct clog_handler* handler = clog_stashing_handler_new(stash);
+    clog_handler_push_process(handler);
+    char big[100000];
+    char index[32];
+
+    /* Enough events to need several chunks, and one that's bigger than a
+     * chunk. */
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    for (int i = 0; i < 5000; i++) {
+        cloge_info {
+            clog_add_field(index, printf, "%d", i);
+            clog_add_field(parity, string, (i % 2 == 0) ? "even" : "odd");
+            clog_set_message("Event %d", i);
+        }
+        if (i == 2500) {
+            clog_info("%s", big);
+        }
+    }
+
+    ck_assert(clog_stash_contains_event(stash, "__message", big, NULL));
+    for (int i = 0; i < 5000; i += 499) {
+        snprintf(index, sizeof(index), "%d", i);
+        ck_assert(clog_stash_contains_event(stash, "index", index,
+                                            "parity",
+                                            (i % 2 == 0) ? "even" : "odd",
+                                            NULL));
+        ck_assert(!clog_stash_contains_event(stash, "index", index,
+                                             "parity",
+                                             (i % 2 == 0) ? "odd" : "even",
+                                             NULL));
+    }
+
+    /* Keys that no event has ever had can't match. */
+    ck_assert(!clog_stash_contains_event(stash, "unknown", "1", NULL));
+    ck_assert(!clog_stash_contains_event(stash, "index", NULL));
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    clog_stash_free(stash);
+}
+END_TEST
+
+#define THREAD_COUNT 4
+#define THREAD_MESSAGE_COUNT 1000
+
+static volatile size_t producers_done;
+
+static int
+log_from_thread(void* vid)
+{
+    size_t id = (uintptr_t) vid;
+    size_t i;
+    for (i = 0; i < THREAD_MESSAGE_COUNT; i++) {
+        cloge_info {
+            clog_add_field(thread, printf, "%zu", id);
+            clog_add_field(index, printf, "%zu", i);
+            clog_set_message("Message");
+        }
+    }
+    return 0;
+}
+
+/* Queries while the producers are running should see each thread's messages
+ * in order, with none missing. */
+static int
+query_while_logging(void* vstash)
+{
+    struct clog_stash* stash = vstash;
+    size_t seen[THREAD_COUNT];
+    char thread[32];
+    char index[32];
+    size_t i;
+
+    memset(seen, 0, sizeof(seen));
+    while (cork_size_atomic_add(&producers_done, 0) == 0) {
+        for (i = 0; i < THREAD_COUNT; i++) {
+            size_t count;
+            snprintf(thread, sizeof(thread), "%zu", i);
+            count = clog_stash_count_events(stash, "thread", thread, NULL);
+            fail_if(count < seen[i], "Thread %zu lost messages", i);
+            if (count > 0) {
+                snprintf(index, sizeof(index), "%zu", count - 1);
+                fail_unless(clog_stash_contains_event
+                            (stash, "thread", thread, "index", index, NULL),
+                            "Thread %zu is missing message %s", i, index);
+            }
+            seen[i] = count;
+        }
+    }
+    return 0;
+}
+
+START_TEST(test_stash_threads)
+{
+    DESCRIBE_TEST;
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    struct clog_stash* stash = clog_stash_new();
+    struct clog_handler* handler = clog_stashing_handler_new(stash);
+    struct cork_thread* threads[THREAD_COUNT];
+    struct cork_thread* querier;
+    char thread[32];
+    size_t i;
+
+    clog_handler_push_process(handler);
+    producers_done = 0;
+    fail_if_error(querier = cork_thread_new
+                  ("querier", stash, NULL, query_while_logging));
+    fail_if_error(cork_thread_start(querier));
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", (void*) (uintptr_t) i, NULL,
+                       log_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+    cork_size_atomic_add(&producers_done, 1);
+    fail_if_error(cork_thread_join(querier));
+
+    fail_unless_equal("Event count", "%zu",
+                      (size_t) THREAD_COUNT * THREAD_MESSAGE_COUNT,
+                      clog_stash_event_count(stash));
+    for (i = 0; i < THREAD_COUNT; i++) {
+        snprintf(thread, sizeof(thread), "%zu", i);
+        fail_unless_equal("Event count", "%zu",
+                          (size_t) THREAD_MESSAGE_COUNT,
+                          clog_stash_count_events
+                          (stash, "thread", thread, NULL));
+        ck_assert(clog_stash_contains_sequence
+                  (stash,
+                   "thread", thread, "index", "0", NULL,
+                   "thread", thread, "index", "1", NULL,
+                   "thread", thread, "index", "999", NULL,
+                   NULL));
+        ck_assert(!clog_stash_contains_sequence
+                  (stash,
+                   "thread", thread, "index", "1", NULL,
+                   "thread", thread, "index", "0", NULL,
+                   NULL));
+    }
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    clog_stash_free(stash);
+}
+END_TEST
+
 
 /*-----------------------------------------------------------------------
  * Testing harness
@@ -169,6 +422,9 @@ test_suite()
     TCase  *tc_stash = tcase_create("stash");
     tcase_add_test(tc_stash, test_stash);
     tcase_add_test(tc_stash, test_two_stashes);
+    tcase_add_test(tc_stash, test_stash_queries);
+    tcase_add_test(tc_stash, test_stash_many_events);
+    tcase_add_test(tc_stash, test_stash_threads);
     suite_add_tcase(s, tc_stash);
 
     return s;
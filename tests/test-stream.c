@@ -0,0 +1,392 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2020, clogger authors.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <check.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/threads.h>
+
+#include "clogger/api.h"
+#include "clogger/handlers.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Slow consumer
+ */
+
+#define CLOG_CHANNEL "test"
+
+/* Appends everything to a buffer, but takes a while to do it, like a stream
+ * that's writing to a full pipe. */
+
+struct slow_consumer {
+    struct cork_stream_consumer parent;
+    struct cork_buffer buf;
+    unsigned int delay_usec;
+    /* If set, the next write will log a message of its own. */
+    bool log_nested;
+};
+
+static int
+slow_consumer__data(struct cork_stream_consumer* consumer, const void* buf,
+                    size_t size, bool is_first)
+{
+    struct slow_consumer* self =
+            cork_container_of(consumer, struct slow_consumer, parent);
+    usleep(self->delay_usec);
+    if (self->log_nested) {
+        self->log_nested = false;
+        clog_info("Nested");
+    }
+    cork_buffer_append(&self->buf, buf, size);
+    return 0;
+}
+
+static int
+slow_consumer__eof(struct cork_stream_consumer* consumer)
+{
+    return 0;
+}
+
+static void
+slow_consumer__free(struct cork_stream_consumer* consumer)
+{
+    struct slow_consumer* self =
+            cork_container_of(consumer, struct slow_consumer, parent);
+    cork_buffer_done(&self->buf);
+    cork_delete(struct slow_consumer, self);
+}
+
+static struct slow_consumer*
+slow_consumer_new(unsigned int delay_usec)
+{
+    struct slow_consumer* self = cork_new(struct slow_consumer);
+    self->parent.data = slow_consumer__data;
+    self->parent.eof = slow_consumer__eof;
+    self->parent.free = slow_consumer__free;
+    cork_buffer_init(&self->buf);
+    self->delay_usec = delay_usec;
+    self->log_nested = false;
+    return self;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Contention
+ */
+
+#define THREAD_COUNT  4
+#define THREAD_MESSAGE_COUNT  50
+
+static int
+log_from_thread(void* ud)
+{
+    size_t i;
+    for (i = 0; i < THREAD_MESSAGE_COUNT; i++) {
+        clog_info("Message %zu", i);
+    }
+    return 0;
+}
+
+START_TEST(test_stream_contention)
+{
+    DESCRIBE_TEST;
+    struct slow_consumer* consumer = slow_consumer_new(1000);
+    struct clog_handler* handler;
+    struct clog_stream_handler_stats stats;
+    struct cork_thread* threads[THREAD_COUNT];
+    const char* curr;
+    size_t line_count = 0;
+    size_t i;
+
+    fail_if_error(handler = clog_stream_handler_new_consumer
+                  (&consumer->parent, "%c: %m"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(threads[i] = cork_thread_new
+                      ("producer", NULL, NULL, log_from_thread));
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+    }
+
+    /* Every line should have been written in one piece. */
+    cork_buffer_append(&consumer->buf, "", 1);
+    for (curr = consumer->buf.buf; *curr != '\0'; line_count++) {
+        const char* eol = strchr(curr, '\n');
+        fail_if(eol == NULL, "Missing newline");
+        fail_unless(strncmp(curr, "test: Message ", 14) == 0,
+                    "Garbled line %.*s", (int) (eol - curr), curr);
+        curr = eol + 1;
+    }
+    fail_unless_equal("Line count", "%zu",
+                      (size_t) (THREAD_COUNT * THREAD_MESSAGE_COUNT),
+                      line_count);
+
+    clog_stream_handler_get_stats(handler, &stats);
+    fail_unless_equal("Acquisitions", "%zu",
+                      (size_t) (THREAD_COUNT * THREAD_MESSAGE_COUNT),
+                      stats.acquisitions);
+    /* The consumer is slow enough that waiting threads should give up on
+     * spinning. */
+    fail_unless(stats.parks > 0, "Expected some threads to park");
+    fail_unless(stats.spins >= stats.parks,
+                "More parks (%zu) than spins (%zu)", stats.parks, stats.spins);
+    fail_unless(stats.max_wait_usec > 0, "Expected a non-zero wait");
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+}
+END_TEST
+
+START_TEST(test_stream_uncontended)
+{
+    DESCRIBE_TEST;
+    struct slow_consumer* consumer = slow_consumer_new(0);
+    struct clog_handler* handler;
+    struct clog_stream_handler_stats stats;
+
+    fail_if_error(handler = clog_stream_handler_new_consumer
+                  (&consumer->parent, "%c: %m"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    log_from_thread(NULL);
+
+    clog_stream_handler_get_stats(handler, &stats);
+    fail_unless_equal("Acquisitions", "%zu",
+                      (size_t) THREAD_MESSAGE_COUNT, stats.acquisitions);
+    fail_unless_equal("Spins", "%zu", (size_t) 0, stats.spins);
+    fail_unless_equal("Parks", "%zu", (size_t) 0, stats.parks);
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+}
+END_TEST
+
+START_TEST(test_stream_nested)
+{
+    DESCRIBE_TEST;
+    struct slow_consumer* consumer = slow_consumer_new(0);
+    struct clog_handler* handler;
+
+    fail_if_error(handler = clog_stream_handler_new_consumer
+                  (&consumer->parent, "%c: %m"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    consumer->log_nested = true;
+    clog_info("Outer");
+    clog_info("After");
+
+    cork_buffer_append(&consumer->buf, "", 1);
+    ck_assert_str_eq(consumer->buf.buf,
+                     "test: Nested\ntest: Outer\ntest: After\n");
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * File descriptors
+ */
+
+static void
+open_pipe(int fds[2])
+{
+    fail_unless(pipe(fds) == 0, "Cannot open pipe");
+    fail_unless(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+                "Cannot make pipe non-blocking");
+}
+
+/* Reads everything that's currently available from the pipe. */
+static void
+fail_unless_pipe_contains(int fd, const char* expected)
+{
+    char buf[4096];
+    ssize_t size = read(fd, buf, sizeof(buf) - 1);
+    if (size < 0) {
+        fail_unless(errno == EAGAIN, "Cannot read from pipe");
+        size = 0;
+    }
+    buf[size] = '\0';
+    ck_assert_str_eq(buf, expected);
+}
+
+START_TEST(test_stream_fd_batched)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler;
+    int fds[2];
+
+    open_pipe(fds);
+    fail_if_error(handler = clog_stream_handler_new_fd
+                  (fds[1], CLOG_STREAM_CLOSE_FD, "[%L] %m"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+
+    /* Less serious messages wait in the batch... */
+    clog_info("Info message");
+    clog_warning("Warning message");
+    fail_unless_pipe_contains(fds[0], "");
+
+    /* ...until something bad happens. */
+    clog_error("Error message");
+    fail_unless_pipe_contains(fds[0],
+                              "[INFO    ] Info message\n"
+                              "[WARNING ] Warning message\n"
+                              "[ERROR   ] Error message\n");
+
+    /* Or until we ask for them. */
+    clog_debug("Debug message");
+    fail_unless_pipe_contains(fds[0], "");
+    fail_if_error(clog_stream_handler_flush(handler));
+    fail_unless_pipe_contains(fds[0], "[DEBUG   ] Debug message\n");
+
+    /* Freeing the handler flushes whatever's left, and closes the pipe. */
+    clog_notice("Notice message");
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    fail_unless_pipe_contains(fds[0], "[NOTICE  ] Notice message\n");
+    fail_unless(read(fds[0], fds, 1) == 0, "Pipe should be closed");
+    close(fds[0]);
+}
+END_TEST
+
+START_TEST(test_stream_fd_idle)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler;
+    int fds[2];
+
+    open_pipe(fds);
+    fail_if_error(handler = clog_stream_handler_new_fd
+                  (fds[1], CLOG_STREAM_CLOSE_FD, "[%L] %m"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+
+    /* A batch shouldn't wait forever just because nothing else gets
+     * logged after it. */
+    clog_info("Last message");
+    fail_unless_pipe_contains(fds[0], "");
+    usleep(300000);
+    fail_unless_pipe_contains(fds[0], "[INFO    ] Last message\n");
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    close(fds[0]);
+}
+END_TEST
+
+START_TEST(test_stream_fd_unbatched)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler;
+    int fds[2];
+
+    open_pipe(fds);
+    fail_if_error(handler = clog_stream_handler_new_fd
+                  (fds[1], CLOG_STREAM_UNBATCHED, "[%L] %m"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+
+    clog_info("Info message");
+    fail_unless_pipe_contains(fds[0], "[INFO    ] Info message\n");
+
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+START_TEST(test_stream_fd_large)
+{
+    DESCRIBE_TEST;
+    struct clog_handler* handler;
+    FILE* fp = tmpfile();
+    struct stat info;
+    size_t i;
+
+    /* Write a lot more than one batch's worth of messages, so that some of
+     * them have to be sent along with a full chunk. */
+    fail_if(fp == NULL, "Cannot open temporary file");
+    fail_if_error(handler = clog_stream_handler_new_fd
+                  (dup(fileno(fp)), CLOG_STREAM_CLOSE_FD, "%m"));
+    clog_set_minimum_level(CLOG_LEVEL_DEBUG);
+    clog_handler_push_process(handler);
+    for (i = 0; i < 1000; i++) {
+        clog_info("%0500zu", i);
+    }
+    fail_if_error(clog_handler_pop_process(handler));
+    clog_handler_free(handler);
+
+    fail_unless(fstat(fileno(fp), &info) == 0, "Cannot stat temporary file");
+    fail_unless_equal("Bytes written", "%zu", (size_t) 501000,
+                      (size_t) info.st_size);
+    fclose(fp);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("stream");
+
+    TCase  *tc_stream = tcase_create("stream");
+    tcase_add_test(tc_stream, test_stream_uncontended);
+    tcase_add_test(tc_stream, test_stream_contention);
+    tcase_add_test(tc_stream, test_stream_nested);
+    suite_add_tcase(s, tc_stream);
+
+    TCase  *tc_fd = tcase_create("fd");
+    tcase_add_test(tc_fd, test_stream_fd_batched);
+    tcase_add_test(tc_fd, test_stream_fd_idle);
+    tcase_add_test(tc_fd, test_stream_fd_unbatched);
+    tcase_add_test(tc_fd, test_stream_fd_large);
+    suite_add_tcase(s, tc_fd);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    /* Use TAP for our stderr output instead of libcheck's default. */
+    srunner_set_tap(runner, "-");
+    srunner_run_all(runner, CK_SILENT);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}